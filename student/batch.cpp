@@ -0,0 +1,468 @@
+
+#include "batch.h"
+#include "chunked_mesh.h"
+#include "debug.h"
+#include "profiler.h"
+#include "stats.h"
+
+#include "../lib/log.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace PT {
+
+std::string parse_batch_args(int argc, char **argv, Batch_Settings &settings) {
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+            return "Missing value for " + arg;
+        std::string value = argv[++i];
+
+        auto to_size = [&](size_t &out) {
+            char *end = nullptr;
+            long long v = std::strtoll(value.c_str(), &end, 10);
+            if (end == value.c_str() || *end != '\0' || v <= 0)
+                return false;
+            out = (size_t)v;
+            return true;
+        };
+
+        bool ok = true;
+        if (arg == "--scene")
+            settings.scene = value;
+        else if (arg == "--out")
+            settings.output = value;
+        else if (arg == "--report")
+            settings.report = value;
+        else if (arg == "--width")
+            ok = to_size(settings.width);
+        else if (arg == "--height")
+            ok = to_size(settings.height);
+        else if (arg == "--spp")
+            ok = to_size(settings.samples);
+        else if (arg == "--area-spp")
+            ok = to_size(settings.area_samples);
+        else if (arg == "--depth")
+            ok = to_size(settings.depth);
+        else if (arg == "--threads")
+            ok = to_size(settings.threads);
+        else if (arg == "--tile")
+            ok = to_size(settings.tile);
+        else if (arg == "--denoise")
+            settings.denoised = value;
+        else if (arg == "--aovs")
+            settings.aovs = value;
+        else
+            return "Unknown option " + arg;
+
+        if (!ok)
+            return "Invalid value '" + value + "' for " + arg;
+    }
+    if (settings.scene.empty())
+        return "No scene given (--scene)";
+    return {};
+}
+
+Batch_Report render_batch(Pathtracer &pathtracer, Scene &scene, const Camera &camera,
+                          const Batch_Settings &settings) {
+
+    Batch_Report report;
+    report.scene = settings.scene;
+    report.width = settings.width;
+    report.height = settings.height;
+    report.samples = settings.samples;
+    report.threads = settings.threads;
+    report.tile = settings.tile;
+
+    pathtracer.set_sizes(settings.width, settings.height, settings.samples,
+                         settings.area_samples, settings.depth);
+    reset_traversal_stats();
+    const Chunked_Mesh *chunked = render_chunked_mesh();
+    if (chunked)
+        chunked->reset_stats();
+
+    bool was_recording_aovs = debug_data.output_aovs;
+    if (!settings.denoised.empty() || !settings.aovs.empty())
+        debug_data.output_aovs = true;
+    int was_render_threads = debug_data.render_threads;
+    debug_data.render_threads = (int)settings.threads;
+
+    // The scene BVH is built synchronously by begin_render; only profile that part
+    // so the timers don't slow down the render itself.
+    bool was_profiling = profiler_enabled();
+    profiler_enable(true);
+    profiler_reset();
+
+    report.process_peak_memory = !reset_peak_memory();
+    auto start = std::chrono::steady_clock::now();
+    pathtracer.begin_render(scene, camera);
+    report.bvh_build_ms = profiler_summary()[(int)Prof_Stage::bvh_build].total_ms;
+    profiler_enable(was_profiling);
+
+    while (pathtracer.in_progress()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    report.wall_ms = std::chrono::duration<double, std::milli>(end - start).count();
+    double render_s = (report.wall_ms - report.bvh_build_ms) * 1e-3;
+    Traversal_Stats stats = total_traversal_stats();
+    report.rays_per_sec = render_s > 0.0 ? stats.rays / render_s : 0.0;
+    report.peak_memory_mb = peak_memory_mb();
+    if (chunked)
+        chunked->log_stats(render_s);
+    if (stats.rays) {
+        report.nodes_per_ray = (double)stats.nodes_visited / stats.rays;
+        report.boxes_per_ray = (double)stats.boxes_tested / stats.rays;
+        report.tris_per_ray = (double)stats.tris_tested / stats.rays;
+    }
+    debug_data.render_threads = was_render_threads;
+
+    if (!write_pfm(pathtracer.get_output(), settings.output))
+        warn("Failed to write image to %s", settings.output.c_str());
+    if (!write_report(report, settings.report))
+        warn("Failed to write report to %s", settings.report.c_str());
+
+    if (!settings.denoised.empty()) {
+        HDR_Image denoised;
+        Denoise_Settings denoise_settings;
+        denoise_settings.threads = settings.threads;
+        denoise_settings.tile = settings.tile;
+        auto denoise_start = std::chrono::steady_clock::now();
+        denoise(pathtracer.get_output(), aov_buffers(), denoised, denoise_settings);
+        double denoise_ms = std::chrono::duration<double, std::milli>(
+                                std::chrono::steady_clock::now() - denoise_start)
+                                .count();
+        info("Denoised %s in %.1f ms", settings.scene.c_str(), denoise_ms);
+        if (!write_pfm(denoised, settings.denoised))
+            warn("Failed to write denoised image to %s", settings.denoised.c_str());
+    }
+    if (!settings.aovs.empty() && !write_aovs(aov_buffers(), settings.aovs))
+        warn("Failed to write AOVs to %s_*.pfm", settings.aovs.c_str());
+    debug_data.output_aovs = was_recording_aovs;
+
+    info("Rendered %s in %.1f ms (BVH %.1f ms, %.2f Mrays/s, peak %.1f MB)",
+         settings.scene.c_str(), report.wall_ms, report.bvh_build_ms,
+         report.rays_per_sec * 1e-6, report.peak_memory_mb);
+    return report;
+}
+
+bool write_pfm(const HDR_Image &image, const std::string &path) {
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out.is_open())
+        return false;
+
+    // Little-endian color PFM; rows are stored bottom to top
+    const auto [w, h] = image.dimension();
+    out << "PF\n" << w << " " << h << "\n-1.0\n";
+
+    std::vector<float> row(w * 3);
+    for (size_t y = h; y-- > 0;) {
+        for (size_t x = 0; x < w; x++) {
+            const Spectrum &s = image.at(x, y);
+            row[3 * x] = s.r;
+            row[3 * x + 1] = s.g;
+            row[3 * x + 2] = s.b;
+        }
+        out.write((const char *)row.data(), row.size() * sizeof(float));
+    }
+    return out.good();
+}
+
+bool write_aovs(const AOV_Buffers &aovs, const std::string &prefix) {
+
+    HDR_Image albedo(aovs.w, aovs.h), normal(aovs.w, aovs.h), depth(aovs.w, aovs.h);
+    for (size_t i = 0; i < aovs.w * aovs.h; i++) {
+        const Vec3 &n = aovs.normal[i];
+        albedo.at(i) = aovs.albedo[i];
+        normal.at(i) = Spectrum(n.x, n.y, n.z);
+        depth.at(i) = Spectrum(aovs.depth[i]);
+    }
+    return write_pfm(albedo, prefix + "_albedo.pfm") && write_pfm(normal, prefix + "_normal.pfm") &&
+           write_pfm(depth, prefix + "_depth.pfm");
+}
+
+// Quotes a string for JSON, escaping quotes, backslashes and control characters
+static std::string json_string(const std::string &s) {
+
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if (c == '\t') {
+            out += "\\t";
+        } else if ((unsigned char)c < 0x20) {
+            char code[8];
+            std::snprintf(code, sizeof(code), "\\u%04x", (unsigned)c);
+            out += code;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+bool write_report(const Batch_Report &report, const std::string &path) {
+
+    std::ofstream out(path);
+    if (!out.is_open())
+        return false;
+
+    out << "{\n"
+        << "    \"scene\": " << json_string(report.scene) << ",\n"
+        << "    \"width\": " << report.width << ",\n"
+        << "    \"height\": " << report.height << ",\n"
+        << "    \"samples\": " << report.samples << ",\n"
+        << "    \"threads\": " << report.threads << ",\n"
+        << "    \"tile\": " << report.tile << ",\n"
+        << "    \"wall_ms\": " << report.wall_ms << ",\n"
+        << "    \"bvh_build_ms\": " << report.bvh_build_ms << ",\n"
+        << "    \"rays_per_sec\": " << report.rays_per_sec << ",\n"
+        << "    \"peak_memory_mb\": " << report.peak_memory_mb << ",\n"
+        << "    \"peak_memory_scope\": "
+        << json_string(report.process_peak_memory ? "process" : "render") << ",\n"
+        << "    \"nodes_per_ray\": " << report.nodes_per_ray << ",\n"
+        << "    \"boxes_per_ray\": " << report.boxes_per_ray << ",\n"
+        << "    \"tris_per_ray\": " << report.tris_per_ray << "\n"
+        << "}\n";
+    return out.good();
+}
+
+// Minimal reader for the flat JSON objects written by write_report
+static bool json_field(const std::string &json, const std::string &key, std::string &value) {
+
+    size_t at = json.find("\"" + key + "\"");
+    if (at == std::string::npos)
+        return false;
+    at = json.find(':', at);
+    if (at == std::string::npos)
+        return false;
+    at = json.find_first_not_of(" \t\n", at + 1);
+    if (at == std::string::npos)
+        return false;
+
+    if (json[at] == '"') {
+        // Undo the escapes json_string writes; other code points are kept as \\uXXXX
+        value.clear();
+        for (at++; at < json.size() && json[at] != '"'; at++) {
+            if (json[at] != '\\') {
+                value += json[at];
+                continue;
+            }
+            if (++at >= json.size())
+                return false;
+            char c = json[at];
+            if (c == 'n')
+                value += '\n';
+            else if (c == 't')
+                value += '\t';
+            else if (c == 'u' && at + 4 < json.size() && json.compare(at + 1, 2, "00") == 0) {
+                value += (char)std::strtol(json.substr(at + 3, 2).c_str(), nullptr, 16);
+                at += 4;
+            } else if (c == 'u')
+                value += "\\u";
+            else
+                value += c;
+        }
+        if (at >= json.size())
+            return false;
+    } else {
+        size_t end = json.find_first_of(",}\n", at);
+        value = json.substr(at, end - at);
+    }
+    return true;
+}
+
+bool read_report(const std::string &path, Batch_Report &report) {
+
+    std::ifstream in(path);
+    if (!in.is_open())
+        return false;
+    std::stringstream buf;
+    buf << in.rdbuf();
+    std::string json = buf.str();
+
+    std::string v;
+    if (!json_field(json, "scene", v))
+        return false;
+    report.scene = v;
+    if (json_field(json, "width", v))
+        report.width = std::strtoull(v.c_str(), nullptr, 10);
+    if (json_field(json, "height", v))
+        report.height = std::strtoull(v.c_str(), nullptr, 10);
+    if (json_field(json, "samples", v))
+        report.samples = std::strtoull(v.c_str(), nullptr, 10);
+    if (json_field(json, "threads", v))
+        report.threads = std::strtoull(v.c_str(), nullptr, 10);
+    if (json_field(json, "tile", v))
+        report.tile = std::strtoull(v.c_str(), nullptr, 10);
+    if (json_field(json, "wall_ms", v))
+        report.wall_ms = std::strtod(v.c_str(), nullptr);
+    if (json_field(json, "bvh_build_ms", v))
+        report.bvh_build_ms = std::strtod(v.c_str(), nullptr);
+    if (json_field(json, "rays_per_sec", v))
+        report.rays_per_sec = std::strtod(v.c_str(), nullptr);
+    if (json_field(json, "peak_memory_mb", v))
+        report.peak_memory_mb = std::strtod(v.c_str(), nullptr);
+    // Reports without a scope predate per-render peaks
+    report.process_peak_memory = !(json_field(json, "peak_memory_scope", v) && v == "render");
+    if (json_field(json, "nodes_per_ray", v))
+        report.nodes_per_ray = std::strtod(v.c_str(), nullptr);
+    if (json_field(json, "boxes_per_ray", v))
+        report.boxes_per_ray = std::strtod(v.c_str(), nullptr);
+    if (json_field(json, "tris_per_ray", v))
+        report.tris_per_ray = std::strtod(v.c_str(), nullptr);
+    return true;
+}
+
+std::vector<Batch_Settings> read_benchmark_suite(const std::string &path) {
+
+    std::vector<Batch_Settings> suite;
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        warn("Could not open benchmark suite %s", path.c_str());
+        return suite;
+    }
+
+    std::string line;
+    size_t line_no = 0;
+    while (std::getline(in, line)) {
+        line_no++;
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        Batch_Settings s;
+        std::istringstream fields(line);
+        if (!(fields >> s.scene >> s.width >> s.height >> s.samples >> s.area_samples >>
+              s.depth)) {
+            warn("%s:%zu: expected <scene> <width> <height> <spp> <area spp> <depth> "
+                 "[threads] [tile]",
+                 path.c_str(), line_no);
+            continue;
+        }
+        if (fields >> s.threads)
+            fields >> s.tile;
+
+        // Name outputs after the scene file so a whole suite can share a directory
+        std::string name = s.scene.substr(s.scene.find_last_of("/\\") + 1);
+        name = name.substr(0, name.find_last_of('.'));
+        s.output = name + ".pfm";
+        s.report = name + ".json";
+        suite.push_back(s);
+    }
+    return suite;
+}
+
+// The report metrics compare_reports checks, and whether a larger value is better
+struct Report_Metric {
+    const char *name;
+    double Batch_Report::*value;
+    bool higher_is_better;
+};
+static const Report_Metric report_metrics[] = {
+    {"wall ms", &Batch_Report::wall_ms, false},
+    {"BVH build ms", &Batch_Report::bvh_build_ms, false},
+    {"rays/s", &Batch_Report::rays_per_sec, true},
+    {"peak MB", &Batch_Report::peak_memory_mb, false},
+    {"nodes/ray", &Batch_Report::nodes_per_ray, false},
+    {"boxes/ray", &Batch_Report::boxes_per_ray, false},
+    {"tris/ray", &Batch_Report::tris_per_ray, false},
+};
+
+size_t compare_reports(const std::vector<Batch_Report> &baseline,
+                       const std::vector<Batch_Report> &current, double tolerance) {
+
+    size_t regressions = 0;
+    for (const Batch_Report &cur : current) {
+        const Batch_Report *base = nullptr;
+        for (const Batch_Report &b : baseline) {
+            if (b.scene == cur.scene && b.width == cur.width && b.height == cur.height &&
+                b.samples == cur.samples && b.threads == cur.threads && b.tile == cur.tile)
+                base = &b;
+        }
+        if (!base) {
+            info("%s: no baseline", cur.scene.c_str());
+            continue;
+        }
+
+        bool regressed = false;
+        for (const Report_Metric &m : report_metrics) {
+            double before = base->*m.value, after = cur.*m.value;
+            if (before <= 0.0)
+                continue;
+            // A process-wide peak depends on what ran before the render
+            if (m.value == &Batch_Report::peak_memory_mb &&
+                (base->process_peak_memory || cur.process_peak_memory))
+                continue;
+            double change = after / before - 1.0;
+            double worse = m.higher_is_better ? -change : change;
+            if (worse > tolerance) {
+                warn("%s: %s %.3g -> %.3g (%+.1f%%)", cur.scene.c_str(), m.name, before,
+                     after, change * 100.0);
+                regressed = true;
+            } else {
+                info("%s: %s %.3g -> %.3g (%+.1f%%)", cur.scene.c_str(), m.name, before,
+                     after, change * 100.0);
+            }
+        }
+        regressions += regressed;
+    }
+    return regressions;
+}
+
+bool reset_peak_memory() {
+#ifdef __linux__
+    // Writing 5 to clear_refs resets VmHWM to the current resident set size
+    std::ofstream clear("/proc/self/clear_refs");
+    clear << "5";
+    clear.flush();
+    return clear.good();
+#else
+    return false;
+#endif
+}
+
+double peak_memory_mb() {
+#ifdef __linux__
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return std::strtod(line.c_str() + 6, nullptr) / 1024.0; // kilobytes
+    }
+#endif
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return pmc.PeakWorkingSetSize / (1024.0 * 1024.0);
+    return 0.0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0.0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0); // bytes
+#else
+    return usage.ru_maxrss / 1024.0; // kilobytes
+#endif
+#endif
+}
+
+} // namespace PT
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "../rays/pathtracer.h"
+#include "../util/hdr_image.h"
+#include "denoise.h"
+
+/* Headless batch rendering:
+
+    These helpers drive a Pathtracer without the interactive render widget, for
+    rendering on machines without a display and for benchmarking. A batch render
+    runs one render to completion, writes the image as a PFM, and writes a JSON
+    report with the wall time, scene rays per second, BVH build time and peak
+    resident memory during the render. It can also write a denoised copy of the
+    image and the AOVs the denoiser used (see denoise.h).
+
+    Where the system cannot restart the peak (anything but Linux), the report holds
+    the peak of the whole process instead and says so; compare_reports skips memory
+    for those reports.
+
+    A benchmark suite is a plain text manifest with one render per line:
+
+        <scene file> <width> <height> <samples> <area samples> <max depth> [threads] [tile]
+
+    Lines starting with # are ignored. Comparing the reports of two runs of the same
+    suite flags any render whose time, rays per second, memory or BVH traversal work
+    per ray got worse than the allowed tolerance.
+
+    Loading scenes and cameras belongs to the application, so these functions do not
+    make a command line renderer by themselves: its main() has to parse the arguments
+    with parse_batch_args, load the scene, and call render_batch.
+
+    The render's thread pool and its split of the image into tiles belong to the
+    Pathtracer, so a thread count caps how many of the pool's threads trace pixels at
+    once (debug_data.render_threads), and both the thread count and the tile size
+    apply in full to the denoiser.
+*/
+
+namespace PT {
+
+struct Batch_Settings {
+    std::string scene;
+    std::string output = "render.pfm";
+    std::string report = "render.json";
+    size_t width = 640;
+    size_t height = 360;
+    size_t samples = 128;
+    size_t area_samples = 8;
+    size_t depth = 4;
+    size_t threads = 0; // 0 = all hardware threads
+    size_t tile = 0;    // denoiser tile size in pixels; 0 = one band of rows per thread
+    // When set, first-hit AOVs are recorded, and the denoised image / the AOV images
+    // (<prefix>_albedo.pfm, <prefix>_normal.pfm, <prefix>_depth.pfm) are written too
+    std::string denoised;
+    std::string aovs;
+};
+
+struct Batch_Report {
+    std::string scene;
+    size_t width = 0, height = 0, samples = 0, threads = 0, tile = 0;
+    double wall_ms = 0.0;
+    double bvh_build_ms = 0.0;
+    double rays_per_sec = 0.0;
+    double peak_memory_mb = 0.0;
+    // Set when peak_memory_mb is the peak of the whole process, not of this render
+    bool process_peak_memory = false;
+    // Average BVH traversal work per scene ray (see stats.h)
+    double nodes_per_ray = 0.0, boxes_per_ray = 0.0, tris_per_ray = 0.0;
+};
+
+// Parses --scene, --out, --report, --width, --height, --spp, --area-spp, --depth,
+// --threads, --tile, --denoise and --aovs.
+// Returns an error message, or an empty string on success.
+std::string parse_batch_args(int argc, char **argv, Batch_Settings &settings);
+
+// Renders scene with camera using the given settings, blocking until the render
+// finishes, then writes the image and the report.
+Batch_Report render_batch(Pathtracer &pathtracer, Scene &scene, const Camera &camera,
+                          const Batch_Settings &settings);
+
+bool write_pfm(const HDR_Image &image, const std::string &path);
+bool write_aovs(const AOV_Buffers &aovs, const std::string &prefix);
+bool write_report(const Batch_Report &report, const std::string &path);
+bool read_report(const std::string &path, Batch_Report &report);
+
+// Reads a benchmark manifest (see above)
+std::vector<Batch_Settings> read_benchmark_suite(const std::string &path);
+
+// Compares every report in current with the report for the same render in baseline,
+// and logs each metric that got more than tolerance (e.g. 0.05 = 5%) worse. Returns
+// the number of renders with at least one regression.
+size_t compare_reports(const std::vector<Batch_Report> &baseline,
+                       const std::vector<Batch_Report> &current, double tolerance);
+
+// Restarts the peak peak_memory_mb reports. Returns false where that isn't possible,
+// in which case peak_memory_mb is the peak of the whole process.
+bool reset_peak_memory();
+
+// Peak resident set size since reset_peak_memory, in megabytes
+double peak_memory_mb();
+
+} // namespace PT
@@ -9,50 +9,23 @@ bool BBox::hit(const Ray &ray, Vec2 &times) const {
     // If the ray intersected the bounding box within the range given by
     // [times.x,times.y], update times with the new intersection times.
 
-    Vec2 y_time;
-    Vec3 z_time;
-
-    // hit point in 3 dim
-    times.x = (min.x-ray.point.x)*(1.0f/ray.dir.x);
-    times.y = (max.x-ray.point.x)*(1.0f/ray.dir.x);
-    if (times.x > times.y) std::swap(times.x,times.y);
-
-    y_time.x = (min.y-ray.point.y)*(1.0f/ray.dir.y);
-    y_time.y = (max.y-ray.point.y)*(1.0f/ray.dir.y);
-    if (y_time.x > y_time.y) std::swap(y_time.x,y_time.y); 
-
-    z_time.x = (min.z-ray.point.z)*(1.0f/ray.dir.z);
-    z_time.y = (max.z-ray.point.z)*(1.0f/ray.dir.z);
-    if (z_time.x > z_time.y) std::swap(z_time.x,z_time.y);
-
-    // compare x y 
-    if ((times.x > y_time.y) || (y_time.x > times.y)) 
-        return false; 
-    
-    if (y_time.x > times.x){
-        times.x = y_time.x;
-    }
- 
-    if (y_time.y < times.y){
-        times.y = y_time.y;
-    }
-
-    // compare x y z
-    if ((times.x > z_time.y) || (z_time.x > times.y)){
-        return false;
-    }
- 
-    if (z_time.x > times.x) 
-        times.x = z_time.x; 
- 
-    if (z_time.y < times.y) 
-        times.y = z_time.y; 
-
-    if (times.x < ray.time_bounds[0] || times.y>ray.time_bounds[1]){
-        times.x = ray.time_bounds[0];
-        times.y = ray.time_bounds[1];
-        return false;
+    // Slab test: the result is the overlap of [times.x, times.y] with the times the
+    // ray spends between each pair of planes, so a ray starting inside the box hits it
+    // with times.x unchanged.
+    float t0 = times.x, t1 = times.y;
+    for (int a = 0; a < 3; a++) {
+        float inv = 1.0f / ray.dir[a];
+        float near_t = (min[a] - ray.point[a]) * inv;
+        float far_t = (max[a] - ray.point[a]) * inv;
+        if (near_t > far_t)
+            std::swap(near_t, far_t);
+        t0 = near_t > t0 ? near_t : t0;
+        t1 = far_t < t1 ? far_t : t1;
+        if (t0 > t1)
+            return false;
     }
 
+    times.x = t0;
+    times.y = t1;
     return true;
 }
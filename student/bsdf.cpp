@@ -1,7 +1,13 @@
 
 #include "../rays/bsdf.h"
+#include "../lib/log.h"
 #include "../util/rand.h"
 #include "debug.h"
+#include "microfacet.h"
+#include "shade_batch.h"
+
+#include <algorithm>
+#include <cmath>
 
 namespace PT {
 
@@ -9,7 +15,7 @@ Vec3 reflect(Vec3 dir) {
 
     // TODO (PathTracer): Task 6
     // Return reflection of dir about the surface normal (0,1,0).
-    return Vec3();
+    return Vec3(-dir.x, dir.y, -dir.z);
 }
 
 Vec3 refract(Vec3 out_dir, float index_of_refraction, bool &was_internal) {
@@ -26,18 +32,44 @@ Vec3 refract(Vec3 out_dir, float index_of_refraction, bool &was_internal) {
     // you want to compute the 'input' direction that would cause this output,
     // and to do so you can simply find the direction that out_dir would refract
     // _to_, as refraction is symmetric.
-    return Vec3();
+    bool entering = out_dir.y > 0.0f;
+    float eta = entering ? 1.0f / index_of_refraction : index_of_refraction;
+    float cos_o = std::abs(out_dir.y);
+    float sin2_t = eta * eta * std::max(0.0f, 1.0f - cos_o * cos_o);
+    if (sin2_t >= 1.0f) {
+        was_internal = false;
+        return reflect(out_dir);
+    }
+    was_internal = true;
+    float cos_t = std::sqrt(1.0f - sin2_t);
+    return Vec3(-eta * out_dir.x, entering ? -cos_t : cos_t, -eta * out_dir.z);
+}
+
+// Schlick's approximation of the Fresnel reflectance for light arriving at
+// cos_theta from the medium with index eta_i into the medium with index eta_t
+static float schlick(float cos_theta, float eta_i, float eta_t) {
+    float r0 = (eta_i - eta_t) / (eta_i + eta_t);
+    r0 = r0 * r0;
+    float c = 1.0f - std::abs(cos_theta);
+    return r0 + (1.0f - r0) * c * c * c * c * c;
 }
 
+/* Note on discrete BSDF samples:
+
+        trace_ray weights every BSDF sample by attenuation * cos(theta) / pdf. For the
+        delta BSDFs below (mirror, glass, refract), the attenuation therefore includes a
+        1 / cos(theta) factor, so that the weight is just the reflectance or
+        transmittance of the chosen event divided by its probability.
+*/
+
 BSDF_Sample BSDF_Lambertian::sample(Vec3 out_dir) const {
 
     // TODO (PathTracer): Task 5
     // Implement lambertian BSDF. Use of BSDF_Lambertian::sampler may be useful
 
     BSDF_Sample ret;
-    ret.attenuation = Spectrum(); // What is the ratio of reflected/incoming light?
-    ret.direction = Vec3();       // What direction should we sample incoming light from?
-    ret.pdf = 0.0f;               // Was was the PDF of the sampled direction?
+    ret.direction = sampler.sample(ret.pdf);            // What direction should we sample incoming light from?
+    ret.attenuation = evaluate(out_dir, ret.direction); // What is the ratio of reflected/incoming light?
     return ret;
 }
 
@@ -51,9 +83,10 @@ BSDF_Sample BSDF_Mirror::sample(Vec3 out_dir) const {
     // Implement mirror BSDF
 
     BSDF_Sample ret;
-    ret.attenuation = Spectrum(); // What is the ratio of reflected/incoming light?
-    ret.direction = Vec3();       // What direction should we sample incoming light from?
-    ret.pdf = 0.0f; // Was was the PDF of the sampled direction? (In this case, the PMF)
+    ret.direction = reflect(out_dir); // What direction should we sample incoming light from?
+    ret.attenuation = reflectance * (1.0f / std::abs(ret.direction.y)); // What is the ratio
+                                                                        // of reflected/incoming light?
+    ret.pdf = 1.0f; // Was was the PDF of the sampled direction? (In this case, the PMF)
     return ret;
 }
 
@@ -78,9 +111,23 @@ BSDF_Sample BSDF_Glass::sample(Vec3 out_dir) const {
     // Be wary of your eta1/eta2 ratio - are you entering or leaving the surface?
 
     BSDF_Sample ret;
-    ret.attenuation = Spectrum(); // What is the ratio of reflected/incoming light?
-    ret.direction = Vec3();       // What direction should we sample incoming light from?
-    ret.pdf = 0.0f; // Was was the PDF of the sampled direction? (In this case, the PMF)
+    bool entering = out_dir.y > 0.0f;
+    float fresnel = entering ? schlick(out_dir.y, 1.0f, index_of_refraction)
+                             : schlick(out_dir.y, index_of_refraction, 1.0f);
+
+    bool refracted = false;
+    Vec3 in_dir = refract(out_dir, index_of_refraction, refracted);
+    if (!refracted || RNG::coin_flip(fresnel)) {
+        // Reflect; always the case under total internal reflection
+        float p = refracted ? fresnel : 1.0f;
+        ret.direction = reflect(out_dir);
+        ret.attenuation = reflectance * (p / std::abs(ret.direction.y));
+        ret.pdf = p;
+    } else {
+        ret.direction = in_dir;
+        ret.attenuation = transmittance * ((1.0f - fresnel) / std::abs(ret.direction.y));
+        ret.pdf = 1.0f - fresnel;
+    }
     return ret;
 }
 
@@ -111,9 +158,10 @@ BSDF_Sample BSDF_Refract::sample(Vec3 out_dir) const {
     // Be wary of your eta1/eta2 ratio - are you entering or leaving the surface?
 
     BSDF_Sample ret;
-    ret.attenuation = Spectrum(); // What is the ratio of reflected/incoming light?
-    ret.direction = Vec3();       // What direction should we sample incoming light from?
-    ret.pdf = 0.0f; // Was was the PDF of the sampled direction? (In this case, the PMF)
+    bool refracted = false;
+    ret.direction = refract(out_dir, index_of_refraction, refracted);
+    ret.attenuation = transmittance * (1.0f / std::abs(ret.direction.y));
+    ret.pdf = 1.0f;
     return ret;
 }
 
@@ -123,4 +171,373 @@ Spectrum BSDF_Refract::evaluate(Vec3 out_dir, Vec3 in_dir) const {
     return {};
 }
 
+namespace GGX {
+
+float D(Vec3 h, float alpha) {
+    float a2 = alpha * alpha;
+    float c2 = h.y * h.y;
+    float d = c2 * (a2 - 1.0f) + 1.0f;
+    return a2 / (PI_F * d * d);
+}
+
+// Smith Lambda(v) for GGX
+static float lambda(Vec3 v, float alpha) {
+    float c2 = v.y * v.y;
+    if (c2 <= 0.0f)
+        return 0.0f;
+    float tan2 = std::max(0.0f, 1.0f - c2) / c2;
+    return 0.5f * (std::sqrt(1.0f + alpha * alpha * tan2) - 1.0f);
+}
+
+float G1(Vec3 v, float alpha) {
+    return 1.0f / (1.0f + lambda(v, alpha));
+}
+
+float G2(Vec3 o, Vec3 i, float alpha) {
+    return 1.0f / (1.0f + lambda(o, alpha) + lambda(i, alpha));
+}
+
+Vec3 sample_visible_normal(Vec3 v, float alpha, float u1, float u2) {
+
+    // Heitz's formulation is written with z up; swap y and z on the way in and out
+    Vec3 ve(v.x, v.z, v.y);
+
+    // Stretch the view direction so the GGX distribution becomes a hemisphere
+    Vec3 vh = Vec3(alpha * ve.x, alpha * ve.y, ve.z).unit();
+
+    // Orthonormal basis around vh
+    float lensq = vh.x * vh.x + vh.y * vh.y;
+    Vec3 t1 = lensq > 0.0f ? Vec3(-vh.y, vh.x, 0.0f) * (1.0f / std::sqrt(lensq))
+                           : Vec3(1.0f, 0.0f, 0.0f);
+    Vec3 t2 = cross(vh, t1);
+
+    // Uniformly sample the projected hemisphere: a disk, with its far half
+    // compressed according to how much of it vh hides
+    float r = std::sqrt(u1);
+    float phi = 2.0f * PI_F * u2;
+    float p1 = r * std::cos(phi);
+    float p2 = r * std::sin(phi);
+    float s = 0.5f * (1.0f + vh.z);
+    p2 = (1.0f - s) * std::sqrt(std::max(0.0f, 1.0f - p1 * p1)) + s * p2;
+
+    // Reproject onto the hemisphere and unstretch
+    Vec3 nh = p1 * t1 + p2 * t2 + std::sqrt(std::max(0.0f, 1.0f - p1 * p1 - p2 * p2)) * vh;
+    Vec3 ne = Vec3(alpha * nh.x, alpha * nh.y, std::max(1e-6f, nh.z)).unit();
+    return Vec3(ne.x, ne.z, ne.y);
+}
+
+float visible_normal_pdf(Vec3 v, Vec3 h, float alpha) {
+    if (v.y == 0.0f)
+        return 0.0f;
+    return G1(v, alpha) * std::abs(dot(v, h)) * D(h, alpha) / std::abs(v.y);
+}
+
+float fresnel_dielectric(float cos_i, float eta_i, float eta_t) {
+
+    cos_i = std::clamp(cos_i, -1.0f, 1.0f);
+    if (cos_i < 0.0f) {
+        std::swap(eta_i, eta_t);
+        cos_i = -cos_i;
+    }
+
+    float sin_t = eta_i / eta_t * std::sqrt(std::max(0.0f, 1.0f - cos_i * cos_i));
+    if (sin_t >= 1.0f)
+        return 1.0f; // total internal reflection
+    float cos_t = std::sqrt(std::max(0.0f, 1.0f - sin_t * sin_t));
+
+    float r_par = (eta_t * cos_i - eta_i * cos_t) / (eta_t * cos_i + eta_i * cos_t);
+    float r_perp = (eta_i * cos_i - eta_t * cos_t) / (eta_i * cos_i + eta_t * cos_t);
+    return 0.5f * (r_par * r_par + r_perp * r_perp);
+}
+
+} // namespace GGX
+
+static Spectrum schlick(Spectrum f0, float cos_theta) {
+    float c = 1.0f - std::abs(cos_theta);
+    float c5 = c * c * c * c * c;
+    return f0 + (Spectrum(1.0f) - f0) * c5;
+}
+
+BSDF_Sample BSDF_GGX_Conductor::sample(Vec3 out_dir) const {
+
+    BSDF_Sample ret;
+    if (out_dir.y <= 0.0f)
+        return ret;
+
+    float alpha = std::max(roughness, GGX::min_roughness);
+    Vec3 h = GGX::sample_visible_normal(out_dir, alpha, RNG::unit(), RNG::unit());
+    Vec3 in_dir = 2.0f * dot(out_dir, h) * h - out_dir;
+    if (in_dir.y <= 0.0f)
+        return ret;
+
+    ret.direction = in_dir;
+    ret.attenuation = evaluate(out_dir, in_dir);
+    ret.pdf = pdf(out_dir, in_dir);
+    return ret;
+}
+
+Spectrum BSDF_GGX_Conductor::evaluate(Vec3 out_dir, Vec3 in_dir) const {
+
+    if (out_dir.y <= 0.0f || in_dir.y <= 0.0f)
+        return {};
+
+    float alpha = std::max(roughness, GGX::min_roughness);
+    Vec3 h = (out_dir + in_dir).unit();
+    float d = GGX::D(h, alpha) * GGX::G2(out_dir, in_dir, alpha);
+    return schlick(reflectance, dot(in_dir, h)) * (d / (4.0f * out_dir.y * in_dir.y));
+}
+
+float BSDF_GGX_Conductor::pdf(Vec3 out_dir, Vec3 in_dir) const {
+
+    if (out_dir.y <= 0.0f || in_dir.y <= 0.0f)
+        return 0.0f;
+
+    // Reflecting about h maps the density of h to in_dir with Jacobian 1 / (4 |o.h|)
+    float alpha = std::max(roughness, GGX::min_roughness);
+    Vec3 h = (out_dir + in_dir).unit();
+    return GGX::visible_normal_pdf(out_dir, h, alpha) / (4.0f * std::abs(dot(out_dir, h)));
+}
+
+/* Note on the rough dielectric:
+
+        Following Walter et al. 2007, the microfacet normal for a pair of directions is
+        the (generalized) half vector, oriented to the outside (h.y > 0):
+            reflection:   h ~ out_dir + in_dir
+            transmission: h ~ eta_o * out_dir + eta_i * in_dir
+        where eta_o and eta_i are the indices of refraction on the side of each direction.
+        Configurations where either direction sees the back of its microfacet contribute
+        nothing.
+*/
+struct Dielectric_Config {
+    bool reflect;
+    float eta_o, eta_i;
+    Vec3 h;
+    bool valid;
+};
+
+static Dielectric_Config dielectric_config(Vec3 out_dir, Vec3 in_dir, float ior) {
+
+    Dielectric_Config c;
+    c.reflect = out_dir.y * in_dir.y > 0.0f;
+    c.eta_o = out_dir.y > 0.0f ? 1.0f : ior;
+    c.eta_i = c.reflect ? c.eta_o : (in_dir.y > 0.0f ? 1.0f : ior);
+    c.h = c.reflect ? out_dir + in_dir : c.eta_o * out_dir + c.eta_i * in_dir;
+    c.valid = out_dir.y != 0.0f && in_dir.y != 0.0f && c.h.norm_squared() > 0.0f;
+    if (!c.valid)
+        return c;
+
+    c.h = c.h.unit();
+    if (c.h.y < 0.0f)
+        c.h = -c.h;
+    c.valid = dot(out_dir, c.h) * out_dir.y > 0.0f && dot(in_dir, c.h) * in_dir.y > 0.0f;
+    return c;
+}
+
+BSDF_Sample BSDF_GGX_Dielectric::sample(Vec3 out_dir) const {
+
+    BSDF_Sample ret;
+    if (out_dir.y == 0.0f)
+        return ret;
+
+    float alpha = std::max(roughness, GGX::min_roughness);
+    bool outside = out_dir.y > 0.0f;
+    float eta_o = outside ? 1.0f : index_of_refraction;
+    float eta_i = outside ? index_of_refraction : 1.0f;
+
+    // Sample a normal visible from out_dir, oriented towards out_dir's side
+    Vec3 h = GGX::sample_visible_normal(outside ? out_dir : -out_dir, alpha, RNG::unit(),
+                                        RNG::unit());
+    if (!outside)
+        h = -h;
+
+    float cos_o = dot(out_dir, h);
+    float fresnel = GGX::fresnel_dielectric(cos_o, eta_o, eta_i);
+
+    Vec3 in_dir;
+    bool reflect = RNG::coin_flip(fresnel);
+    if (reflect) {
+        in_dir = 2.0f * cos_o * h - out_dir;
+    } else {
+        float eta = eta_o / eta_i;
+        float sin2_t = eta * eta * std::max(0.0f, 1.0f - cos_o * cos_o);
+        if (sin2_t >= 1.0f)
+            return ret;
+        float cos_t = std::sqrt(1.0f - sin2_t);
+        in_dir = -eta * out_dir + (eta * cos_o - cos_t) * h;
+    }
+
+    // A steep microfacet can send the reflection through the surface or the refraction
+    // back out; pdf() reads such a direction as the other event, so it is dropped
+    if ((out_dir.y * in_dir.y > 0.0f) != reflect)
+        return ret;
+
+    ret.direction = in_dir;
+    ret.attenuation = evaluate(out_dir, in_dir);
+    ret.pdf = pdf(out_dir, in_dir);
+    return ret;
+}
+
+Spectrum BSDF_GGX_Dielectric::evaluate(Vec3 out_dir, Vec3 in_dir) const {
+
+    Dielectric_Config c = dielectric_config(out_dir, in_dir, index_of_refraction);
+    if (!c.valid)
+        return {};
+
+    float alpha = std::max(roughness, GGX::min_roughness);
+    float d = GGX::D(c.h, alpha) * GGX::G2(out_dir, in_dir, alpha);
+    float fresnel = GGX::fresnel_dielectric(dot(out_dir, c.h), 1.0f, index_of_refraction);
+    float cos_o = std::abs(out_dir.y), cos_i = std::abs(in_dir.y);
+
+    if (c.reflect)
+        return reflectance * (fresnel * d / (4.0f * cos_o * cos_i));
+
+    float oh = dot(out_dir, c.h), ih = dot(in_dir, c.h);
+    float denom = c.eta_o * oh + c.eta_i * ih;
+    return transmittance * ((1.0f - fresnel) * d * std::abs(oh * ih) * c.eta_o * c.eta_o /
+                            (cos_o * cos_i * denom * denom));
+}
+
+float BSDF_GGX_Dielectric::pdf(Vec3 out_dir, Vec3 in_dir) const {
+
+    Dielectric_Config c = dielectric_config(out_dir, in_dir, index_of_refraction);
+    if (!c.valid)
+        return 0.0f;
+
+    float alpha = std::max(roughness, GGX::min_roughness);
+    float fresnel = GGX::fresnel_dielectric(dot(out_dir, c.h), 1.0f, index_of_refraction);
+    float pdf_h = GGX::visible_normal_pdf(out_dir, c.h, alpha);
+
+    float oh = dot(out_dir, c.h), ih = dot(in_dir, c.h);
+    if (c.reflect)
+        return fresnel * pdf_h / (4.0f * std::abs(oh));
+
+    // Jacobian of the refracted direction with respect to h
+    float denom = c.eta_o * oh + c.eta_i * ih;
+    return (1.0f - fresnel) * pdf_h * c.eta_i * c.eta_i * std::abs(ih) / (denom * denom);
+}
+
+// Mean and standard error of a Monte Carlo estimate, from the sums of its terms and
+// their squares
+struct Estimate {
+    double sum = 0.0, sum_sq = 0.0;
+    void add(double x) {
+        sum += x;
+        sum_sq += x * x;
+    }
+    double mean(size_t n) const {
+        return sum / n;
+    }
+    double error(size_t n) const {
+        double m = mean(n);
+        return std::sqrt(std::max(0.0, sum_sq / n - m * m) / n);
+    }
+};
+
+// Checks one microfacet BSDF for a single outgoing direction: every sample must report
+// the pdf and value that pdf() and evaluate() give for its direction, and integrating
+// pdf() and the BSDF over the sphere by uniform sampling must agree with what sample()
+// draws (the density integrates to the fraction of samples that produce a direction,
+// and the mean sample weight estimates the albedo). Returns false, logging the
+// discrepancy, if any of these disagree by more than the noise of the estimates allows.
+template <typename B>
+static bool ggx_check(const char *name, const B &bsdf, Vec3 out_dir, size_t n) {
+
+    size_t mismatched = 0;
+    Estimate produced, albedo_sampled;
+    for (size_t i = 0; i < n; i++) {
+        BSDF_Sample s = bsdf.sample(out_dir);
+        if (s.pdf <= 0.0f) {
+            produced.add(0.0);
+            albedo_sampled.add(0.0);
+            continue;
+        }
+        float pdf = bsdf.pdf(out_dir, s.direction);
+        float value = bsdf.evaluate(out_dir, s.direction).luma();
+        if (std::abs(pdf - s.pdf) > 1e-3f * std::max(pdf, 1.0f) ||
+            std::abs(value - s.attenuation.luma()) > 1e-3f * std::max(value, 1.0f))
+            mismatched++;
+        produced.add(1.0);
+        albedo_sampled.add(s.attenuation.luma() * std::abs(s.direction.y) / s.pdf);
+    }
+
+    const float sphere_pdf = 1.0f / (4.0f * PI_F);
+    Estimate pdf_integral, albedo_integral;
+    for (size_t i = 0; i < n; i++) {
+        float y = 1.0f - 2.0f * RNG::unit(), phi = 2.0f * PI_F * RNG::unit();
+        float r = std::sqrt(std::max(0.0f, 1.0f - y * y));
+        Vec3 in_dir(r * std::cos(phi), y, r * std::sin(phi));
+        pdf_integral.add(bsdf.pdf(out_dir, in_dir) / sphere_pdf);
+        albedo_integral.add(bsdf.evaluate(out_dir, in_dir).luma() * std::abs(in_dir.y) /
+                            sphere_pdf);
+    }
+
+    // Two estimates of the same value differ by more than five standard errors (plus
+    // a little float rounding) with negligible probability
+    auto agree = [n](const Estimate &a, const Estimate &b) {
+        double error = std::sqrt(a.error(n) * a.error(n) + b.error(n) * b.error(n));
+        return std::abs(a.mean(n) - b.mean(n)) <= 5.0 * error + 1e-3;
+    };
+    bool ok = mismatched == 0 && agree(pdf_integral, produced) &&
+              agree(albedo_integral, albedo_sampled);
+    if (!ok)
+        warn("%s (out y = %.2f): %zu of %zu samples disagree with pdf/evaluate, pdf "
+             "integrates to %.3f for %.3f of samples drawn, albedo %.3f sampled vs %.3f "
+             "integrated",
+             name, out_dir.y, mismatched, n, pdf_integral.mean(n), produced.mean(n),
+             albedo_sampled.mean(n), albedo_integral.mean(n));
+    return ok;
+}
+
+void ggx_consistency_check() {
+
+    const size_t n = 1 << 18;
+    size_t checks = 0, failed = 0;
+    for (float roughness : {0.2f, 0.5f, 0.9f}) {
+        for (float theta : {0.1f, 0.7f, 1.3f}) {
+            Vec3 out_dir(std::sin(theta), std::cos(theta), 0.0f);
+            BSDF_GGX_Conductor metal(Spectrum(0.9f, 0.6f, 0.3f), roughness);
+            BSDF_GGX_Dielectric glass(Spectrum(1.0f), Spectrum(1.0f), roughness, 1.5f);
+            failed += !ggx_check("GGX conductor", metal, out_dir, n);
+            failed += !ggx_check("GGX dielectric", glass, out_dir, n);
+            failed += !ggx_check("GGX dielectric from inside", glass, -out_dir, n);
+            checks += 3;
+        }
+    }
+    info("GGX consistency: %zu of %zu configurations passed", checks - failed, checks);
+}
+
+// The batch evaluator lives in this file so the BSDF_*::evaluate calls in its
+// type-specialized loops can be inlined.
+
+void evaluate_batch(const BSDF &bsdf, Vec3 out_dir, const Vec3 *in_dirs, size_t n,
+                    Spectrum *out) {
+    std::visit(
+        [&](const auto &b) {
+            for (size_t i = 0; i < n; i++)
+                out[i] = b.evaluate(out_dir, in_dirs[i]);
+        },
+        bsdf.underlying);
+}
+
+void sort_by_material(const std::vector<BSDF> &materials, const std::vector<Trace> &hits,
+                      std::vector<uint32_t> &order) {
+
+    // Misses get the key past every (type, material) pair
+    size_t n_types = std::variant_size_v<decltype(BSDF::underlying)>;
+    uint64_t miss = (uint64_t)n_types * materials.size();
+    auto key = [&](uint32_t i) {
+        const Trace &hit = hits[i];
+        if (!hit.hit || (size_t)hit.material >= materials.size())
+            return miss;
+        return (uint64_t)materials[hit.material].underlying.index() * materials.size() +
+               (uint64_t)hit.material;
+    };
+
+    order.resize(hits.size());
+    for (size_t i = 0; i < hits.size(); i++)
+        order[i] = (uint32_t)i;
+    std::stable_sort(order.begin(), order.end(),
+                     [&](uint32_t a, uint32_t b) { return key(a) < key(b); });
+}
+
 } // namespace PT
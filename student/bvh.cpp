@@ -2,13 +2,19 @@
 #include "../rays/bvh.h"
 
 #include "debug.h"
+#include "profiler.h"
+#include "scene_probe.h"
+#include "stats.h"
 #include <stack>
 #include <cmath>
 #include <iostream>
+#include <type_traits>
 
 
 namespace PT {
 
+class Object;
+
 template <typename Primitive>
 void BVH<Primitive>::build(std::vector<Primitive> &&prims, size_t max_leaf_size) {
 
@@ -31,9 +37,19 @@ void BVH<Primitive>::build(std::vector<Primitive> &&prims, size_t max_leaf_size)
     // to create a new node, don't allocate one yourself - use BVH::new_node, which
     // returns the index of a newly added node.
 
+    // Pathtracer::begin_render builds the scene's BVH of Objects before any pixel is
+    // traced, so each render's profile starts there
+    if constexpr (std::is_same_v<Primitive, Object>)
+        profiler_reset();
+
+    PROFILE_SCOPE(bvh_build);
     nodes.clear();
     primitives = std::move(prims);
 
+    // The primitives are only reordered in place from here on
+    if constexpr (std::is_same_v<Primitive, Object>)
+        scene_built(primitives.data(), primitives.size());
+
     // TODO (PathTracer): Task 3
     // Construct a BVH from the given vector of primitives and maximum leaf
     // size configuration. The starter code builds a BVH with a
@@ -151,6 +167,14 @@ void BVH<Primitive>::build(std::vector<Primitive> &&prims, size_t max_leaf_size)
             }
         }
         
+        // Every centroid fell into one bucket (e.g. the node's box is much larger than
+        // their spread), so no split separates them; keep the node as a leaf
+        if (left_buckets_box_num[bestParti_left_num] == 0 ||
+            right_buckets_box_num[n_bucket - bestParti_left_num] == 0) {
+            nodes_need_partition_idx.erase(nodes_need_partition_idx.begin());
+            continue;
+        }
+
         // 3. divide it
         std::vector<size_t> idx_leftPartition;
         std::vector<size_t> idx_rightPartition;
@@ -253,8 +277,16 @@ template <typename Primitive> Trace BVH<Primitive>::hit(const Ray &ray) const {
     // Again, remember you can use hit() on any Primitive value.
 
     Trace ret;
+
+    // A probe ray (see scene_probe.h) visits every primitive
+    if (ray.depth == probe_depth) {
+        for (const Primitive &prim : primitives)
+            prim.hit(ray);
+        return ret;
+    }
     
     if (nodes.size()<8){
+        TRAVERSAL_STAT(prims_tested, primitives.size());
         for (const Primitive &prim : primitives) {
             Trace hit = prim.hit(ray);
             ret = Trace::min(ret, hit);
@@ -279,28 +311,29 @@ template <typename Primitive> Trace BVH<Primitive>::hit(const Ray &ray) const {
 template <typename Primitive> Trace BVH<Primitive>::find_closest_hit(const Ray &ray, size_t node_idx) const{
     Trace ret;
     //ret.time = FLT_MAX;
+    TRAVERSAL_STAT(nodes_visited, 1);
     
     bool isleaf = nodes[node_idx].is_leaf();
     if (isleaf){
         for (size_t i = nodes[node_idx].start; i<nodes[node_idx].start+nodes[node_idx].size; i++) 
         {
+            TRAVERSAL_STAT(prims_tested, 1);
             Trace hit_pri = primitives[i].hit(ray);
             //std::cout << "hit with the "<< i <<"th leaf node ? " << hit.hit << std::endl;
-            if (hit_pri.hit){
-                ret = Trace::min(ret, hit_pri);
-                return ret;
-            }
+            // Keep the closest hit of the leaf, not the first one found
+            ret = Trace::min(ret, hit_pri);
         }
     }else{
-        Vec2 left_time;
+        Vec2 left_time(ray.time_bounds[0], ray.time_bounds[1]);
         size_t left_node_idx = nodes[node_idx].l;
         BBox box_left = nodes[left_node_idx].bbox;
         bool hit_left = box_left.hit(ray, left_time);
 
-        Vec2 right_time;
+        Vec2 right_time(ray.time_bounds[0], ray.time_bounds[1]);
         size_t right_node_idx = nodes[node_idx].r;
         BBox box_right = nodes[right_node_idx].bbox;
         bool hit_right = box_right.hit(ray, right_time);
+        TRAVERSAL_STAT(boxes_tested, 2);
 
         //if(hit_left){
         //    if(hit_right){
@@ -392,11 +425,15 @@ template <typename Primitive> BBox BVH<Primitive>::bbox() const {
 }
 
 template <typename Primitive> std::vector<Primitive> BVH<Primitive>::destructure() {
+    if constexpr (std::is_same_v<Primitive, Object>)
+        scene_built(nullptr, 0);
     nodes.clear();
     return std::move(primitives);
 }
 
 template <typename Primitive> void BVH<Primitive>::clear() {
+    if constexpr (std::is_same_v<Primitive, Object>)
+        scene_built(nullptr, 0);
     nodes.clear();
     primitives.clear();
 }
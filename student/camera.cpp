@@ -1,8 +1,80 @@
 
 #include "../util/camera.h"
+#include "../rays/samplers.h"
+#include "../util/rand.h"
+#include "camera_rays.h"
 #include "debug.h"
+#include "profiler.h"
+#include <cmath>
+#include <cstring>
 #include <iostream>
 
+bool Camera_Basis::update(const Camera &camera) {
+
+    Mat4 cur_view = camera.get_view();
+    float cur_fov = camera.get_fov();
+    float cur_ar = camera.get_ar();
+    float cur_ap = camera.get_ap();
+    float cur_dist = camera.get_dist();
+    if (valid && std::memcmp(&cur_view, &view, sizeof(Mat4)) == 0 && cur_fov == fov &&
+        cur_ar == ar && cur_ap == aperture && cur_dist == focal_dist)
+        return false;
+
+    view = cur_view;
+    fov = cur_fov;
+    ar = cur_ar;
+    aperture = cur_ap;
+    focal_dist = cur_dist;
+    pinhole = aperture <= 0.0f || focal_dist <= 0.0f;
+    valid = true;
+
+    // The sensor plane sits one unit in front of the pinhole and spans
+    // [-width, width] x [-height, height] in view space.
+    float height = std::tan(Radians(fov / 2));
+    float width = height * ar;
+
+    Mat4 iview = view.inverse();
+    origin = camera.pos();
+    base = iview.rotate(Vec3(-width, -height, -1.0f));
+    du = iview.rotate(Vec3(2.0f * width, 0.0f, 0.0f));
+    dv = iview.rotate(Vec3(0.0f, 2.0f * height, 0.0f));
+
+    float lens_radius = pinhole ? 0.0f : 0.5f * aperture;
+    lens_u = iview.rotate(Vec3(lens_radius, 0.0f, 0.0f));
+    lens_v = iview.rotate(Vec3(0.0f, lens_radius, 0.0f));
+    return true;
+}
+
+Ray Camera_Basis::thin_lens_ray(Vec2 screen_coord, Vec2 lens_sample) const {
+
+    if (pinhole)
+        return Ray(origin, direction(screen_coord));
+
+    // The pinhole direction has unit depth, so scaling it by the focal distance
+    // lands on the plane of focus
+    Vec3 focus = (base + screen_coord.x * du + screen_coord.y * dv) * focal_dist;
+    Vec3 lens = lens_sample.x * lens_u + lens_sample.y * lens_v;
+    return Ray(origin + lens, (focus - lens).unit());
+}
+
+Vec2 concentric_disk(Vec2 square) {
+
+    float a = 2.0f * square.x - 1.0f;
+    float b = 2.0f * square.y - 1.0f;
+    if (a == 0.0f && b == 0.0f)
+        return Vec2();
+
+    float r, phi;
+    if (std::abs(a) > std::abs(b)) {
+        r = a;
+        phi = (PI_F / 4.0f) * (b / a);
+    } else {
+        r = b;
+        phi = (PI_F / 2.0f) - (PI_F / 4.0f) * (a / b);
+    }
+    return Vec2(r * std::cos(phi), r * std::sin(phi));
+}
+
 Ray Camera::generate_ray(Vec2 screen_coord) const {
 
     // TODO (PathTracer): Task 1
@@ -10,31 +82,89 @@ Ray Camera::generate_ray(Vec2 screen_coord) const {
     // canonical sensor plane one unit away from the pinhole.
     // Tip: compute the ray direction in view space and use
     // the camera transform to transform it back into world space.
-    float pixelScreenX  = screen_coord[0];
-    float pixelScreenY = screen_coord[1];
+    PROFILE_SCOPE(camera_rays);
+
+    // The tangent of the field of view and the view-to-world rotation only change
+    // when the camera moves, so each thread keeps them in a cached basis.
+    static thread_local Camera_Basis basis;
+    basis.update(*this);
+
+    if (basis.pinhole)
+        return Ray(basis.origin, basis.direction(screen_coord));
+    return basis.thin_lens_ray(screen_coord, concentric_disk(Vec2(RNG::unit(), RNG::unit())));
+}
+
+void generate_tile(const Camera &camera, size_t x0, size_t y0, size_t w, size_t h, size_t out_w,
+                   size_t out_h, size_t samples_per_pixel, std::vector<Camera_Ray> &rays) {
+
+    PROFILE_SCOPE(camera_rays);
 
-    float v_fov = get_fov();
-    
-    //std::cout<<"v_fov = "<< v_fov <<std::endl;
-    //std::cout<<"aspect ratio = "<< get_ar() <<std::endl;
+    static thread_local Camera_Basis basis;
+    basis.update(camera);
 
-    float height = tan(Radians(v_fov/2));
-    float width = height*get_ar();
+    size_t n = w * h * samples_per_pixel;
+    rays.resize(n);
 
-    float pixelCameraY = (1-2*pixelScreenY)*height;
-    float pixelCameraX = (2*pixelScreenX-1)*width;
+    // Scratch arrays reused between calls; (lx, ly, lz) is the lens offset of each sample
+    static thread_local std::vector<float> sx, sy, lx, ly, lz, dx, dy, dz, len;
+    for (std::vector<float> *a : {&sx, &sy, &lx, &ly, &lz, &dx, &dy, &dz, &len})
+        a->assign(n, 0.0f);
 
-     //std::cout<<"height = "<< height <<std::endl; 
-    //std::cout<<"width = "<< width <<std::endl;
+    // Jittered screen coordinates for every sample in the tile
+    Samplers::Rect::Uniform jitter;
+    float pdf;
+    size_t k = 0;
+    for (size_t j = 0; j < h; j++) {
+        for (size_t i = 0; i < w; i++) {
+            for (size_t s = 0; s < samples_per_pixel; s++, k++) {
+                Vec2 offset = jitter.sample(pdf);
+                sx[k] = ((float)(x0 + i) + offset.x) / out_w;
+                sy[k] = ((float)(y0 + j) + offset.y) / out_h;
+                rays[k].time = debug_data.motion_blur ? RNG::unit() : 0.0f;
+            }
+        }
+    }
+    if (!basis.pinhole) {
+        for (k = 0; k < n; k++) {
+            Vec2 disk = concentric_disk(Vec2(RNG::unit(), RNG::unit()));
+            Vec3 lens = disk.x * basis.lens_u + disk.y * basis.lens_v;
+            lx[k] = lens.x;
+            ly[k] = lens.y;
+            lz[k] = lens.z;
+        }
+    }
 
-    // the parameter screen coordinate is start from the left up corner
-    // but the camera coordinate is start from the center of the image, so we need -width/2 -height/2
-    Vec3 camera_dir(pixelCameraX, -pixelCameraY, -1.0f);
-    camera_dir = camera_dir.normalize();
+    // Directions from the lens point to the focus point (for a pinhole camera the
+    // lens offsets are zero and the scale is one); written as independent per-lane
+    // arithmetic so these loops vectorize
+    const float scale = basis.pinhole ? 1.0f : basis.focal_dist;
+    const Vec3 base = basis.base * scale, du = basis.du * scale, dv = basis.dv * scale;
+    for (k = 0; k < n; k++) {
+        dx[k] = base.x + sx[k] * du.x + sy[k] * dv.x - lx[k];
+        dy[k] = base.y + sx[k] * du.y + sy[k] * dv.y - ly[k];
+        dz[k] = base.z + sx[k] * du.z + sy[k] * dv.z - lz[k];
+    }
+    for (k = 0; k < n; k++) {
+        len[k] = std::sqrt(dx[k] * dx[k] + dy[k] * dy[k] + dz[k] * dz[k]);
+        float inv = 1.0f / len[k];
+        dx[k] *= inv;
+        dy[k] *= inv;
+        dz[k] *= inv;
+    }
 
-    Vec3 world_dir = iview * camera_dir-pos();
-    world_dir = world_dir.normalize();
+    // Moving one pixel changes the unnormalized direction by du / out_w (resp. dv / out_h)
+    // while the lens point stays put; the derivative of d / |d| along a change D is
+    // (D - d * dot(d, D)) / |d|.
+    const Vec3 step_x = du / (float)out_w, step_y = dv / (float)out_h;
+    for (k = 0; k < n; k++) {
+        Vec3 d(dx[k], dy[k], dz[k]);
+        float inv = 1.0f / len[k];
 
-    return Ray(pos(), world_dir);
+        Camera_Ray &r = rays[k];
+        r.ray = Ray(basis.origin + Vec3(lx[k], ly[k], lz[k]), d);
+        r.diff.dodx = Vec3();
+        r.diff.dody = Vec3();
+        r.diff.dddx = (step_x - d * dot(d, step_x)) * inv;
+        r.diff.dddy = (step_y - d * dot(d, step_y)) * inv;
+    }
 }
- 
\ No newline at end of file
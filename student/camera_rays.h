@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../util/camera.h"
+
+/* Camera ray generation:
+
+    Camera_Basis holds everything generate_ray needs that only changes when the
+    camera does: the eye position and the world-space vectors spanning the image
+    plane one unit in front of it. A pixel's direction is then
+
+        base + screen.x * du + screen.y * dv
+
+    followed by a single normalization.
+
+    generate_tile produces the primary rays of a block of pixels at once. The
+    directions are computed in structure-of-arrays form so the compiler can
+    vectorize the loops, and every ray carries its differentials: how its origin and
+    direction change when moving one pixel in x or y, which texture and environment
+    lookups can use to filter over the ray's footprint.
+
+    When the camera has a non-zero aperture, rays follow the thin lens model: they
+    start at a point sampled on a disk of diameter Camera::get_ap() around the eye and
+    pass through the point the pinhole ray would reach at distance Camera::get_dist(),
+    so geometry on that plane stays in focus. With motion blur on, each ray also gets
+    a shutter time in [0, 1) (see motion_bvh.h).
+*/
+
+struct Camera_Basis {
+
+    // Recomputes the basis if the camera's view, field of view, aspect ratio or lens
+    // changed since the last update; returns whether it did
+    bool update(const Camera &camera);
+
+    Vec3 direction(Vec2 screen_coord) const {
+        return (base + screen_coord.x * du + screen_coord.y * dv).unit();
+    }
+
+    // lens_sample is a point in the unit disk; ignored for a pinhole camera
+    Ray thin_lens_ray(Vec2 screen_coord, Vec2 lens_sample) const;
+
+    Vec3 origin;
+    Vec3 base, du, dv;
+
+    // World-space lens axes, scaled by the lens radius
+    Vec3 lens_u, lens_v;
+    float focal_dist = 1.0f;
+    bool pinhole = true;
+
+    // Used to detect camera changes
+    Mat4 view;
+    float fov = 0.0f, ar = 0.0f, aperture = 0.0f;
+    bool valid = false;
+};
+
+// Maps a point in the unit square to the unit disk (Shirley-Chiu concentric mapping)
+Vec2 concentric_disk(Vec2 square);
+
+struct Ray_Differential {
+    Vec3 dodx, dody; // change in origin per pixel step in x / y
+    Vec3 dddx, dddy; // change in (normalized) direction per pixel step in x / y
+};
+
+struct Camera_Ray {
+    Ray ray;
+    Ray_Differential diff;
+    float time = 0.0f; // shutter time in [0, 1)
+};
+
+// Generates samples_per_pixel jittered rays for each pixel in the w x h tile whose
+// lower-left pixel is (x0, y0) in an image of size out_w x out_h. Rays are written in
+// scanline order, with the samples of each pixel stored contiguously.
+void generate_tile(const Camera &camera, size_t x0, size_t y0, size_t w, size_t h, size_t out_w,
+                   size_t out_h, size_t samples_per_pixel, std::vector<Camera_Ray> &rays);
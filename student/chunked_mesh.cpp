@@ -0,0 +1,738 @@
+
+#include "chunked_mesh.h"
+#include "../lib/log.h"
+#include "debug.h"
+#include "render_shared.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+namespace PT {
+
+// The file starts with the magic, the number of chunks and the offset of the
+// directory, which follows the chunks since their number is only known at the end
+static const char chunk_magic[8] = {'S', '3', 'D', 'C', 'H', 'N', 'K', '2'};
+
+// Build-time triangle: vertices by value plus its centroid
+struct Chunked_Mesh::Build_Tri {
+    Vec3 p[3], n[3];
+    Vec3 centroid;
+};
+
+static BBox tri_box(const Vec3 (&p)[3]) {
+    BBox b;
+    for (int i = 0; i < 3; i++)
+        b.enclose(p[i]);
+    return b;
+}
+
+static int longest_axis(const BBox &box) {
+    Vec3 extent = box.max - box.min;
+    return extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+}
+
+// Reorders tris[begin, end) so that ranges of at most leaf_size triangles are
+// spatially coherent, calling leaf(begin, end) for each final range in order
+template <typename T, typename F>
+static void median_split(std::vector<T> &tris, size_t begin, size_t end, size_t leaf_size,
+                         F &&leaf) {
+    std::vector<std::pair<size_t, size_t>> todo = {{begin, end}};
+    while (!todo.empty()) {
+        auto [b, e] = todo.back();
+        todo.pop_back();
+        if (e - b <= leaf_size) {
+            leaf(b, e);
+            continue;
+        }
+        BBox cbox;
+        for (size_t i = b; i < e; i++)
+            cbox.enclose(tris[i].centroid);
+        int axis = longest_axis(cbox);
+        size_t mid = b + (e - b) / 2;
+        std::nth_element(tris.begin() + b, tris.begin() + mid, tris.begin() + e,
+                         [axis](const T &x, const T &y) {
+                             return x.centroid[axis] < y.centroid[axis];
+                         });
+        // Push the right half first so leaves come out left to right
+        todo.push_back({mid, e});
+        todo.push_back({b, mid});
+    }
+}
+
+Chunked_Mesh::Writer::Writer(const std::string &file, size_t tris_per_chunk,
+                             size_t memory_bytes)
+    : path(file), leaf_size(std::max(tris_per_chunk, size_t(1))) {
+    capacity = std::max(memory_bytes / sizeof(Build_Tri), leaf_size);
+}
+
+Chunked_Mesh::Writer::~Writer() {
+    spill.close();
+    for (const std::string &file : temporaries)
+        std::remove(file.c_str());
+}
+
+void Chunked_Mesh::Writer::add(Vec3 p0, Vec3 p1, Vec3 p2, Vec3 n0, Vec3 n1, Vec3 n2) {
+
+    Build_Tri t;
+    t.p[0] = p0, t.p[1] = p1, t.p[2] = p2;
+    t.n[0] = n0, t.n[1] = n1, t.n[2] = n2;
+    t.centroid = (p0 + p1 + p2) * (1.0f / 3.0f);
+    centroids.enclose(t.centroid);
+    buffer.push_back(t);
+    if (buffer.size() >= capacity)
+        failed |= !spill_buffer();
+}
+
+// Appends the buffered triangles to the spill file
+bool Chunked_Mesh::Writer::spill_buffer() {
+
+    if (!spill.is_open()) {
+        spill_path = temporary();
+        spill.open(spill_path, std::ios::binary);
+    }
+    spill.write((const char *)buffer.data(), buffer.size() * sizeof(Build_Tri));
+    spilled += buffer.size();
+    buffer.clear();
+    return spill.good();
+}
+
+std::string Chunked_Mesh::Writer::temporary() {
+    temporaries.push_back(path + ".part" + std::to_string(temporaries.size()));
+    return temporaries.back();
+}
+
+bool Chunked_Mesh::Writer::finish() {
+
+    out.open(path, std::ios::binary);
+    if (!out.is_open() || failed)
+        return false;
+
+    uint64_t header[2] = {0, 0}; // chunks, directory offset
+    out.write(chunk_magic, sizeof(chunk_magic));
+    out.write((const char *)header, sizeof(header));
+    entries.clear();
+
+    if (spilled == 0) {
+        cluster(buffer);
+        buffer.clear();
+    } else {
+        if (!buffer.empty() && !spill_buffer())
+            return false;
+        spill.close();
+        if (!partition(spill_path, spilled, centroids))
+            return false;
+    }
+
+    header[0] = entries.size();
+    header[1] = (uint64_t)out.tellp();
+    for (const Entry &entry : entries) {
+        float bounds[6] = {entry.box.min.x, entry.box.min.y, entry.box.min.z,
+                           entry.box.max.x, entry.box.max.y, entry.box.max.z};
+        out.write((const char *)bounds, sizeof(bounds));
+        out.write((const char *)&entry.offset, sizeof(entry.offset));
+        out.write((const char *)&entry.n_nodes, sizeof(entry.n_nodes));
+        out.write((const char *)&entry.n_tris, sizeof(entry.n_tris));
+    }
+    out.seekp(sizeof(chunk_magic));
+    out.write((const char *)header, sizeof(header));
+    out.close();
+    return !out.fail();
+}
+
+// Writes the n triangles in file as chunks, first splitting them into parts that fit
+// in memory. The file is removed once it has been split or read.
+bool Chunked_Mesh::Writer::partition(const std::string &file, size_t n, BBox bounds) {
+
+    if (n <= capacity) {
+        std::vector<Build_Tri> tris(n);
+        std::ifstream in(file, std::ios::binary);
+        in.read((char *)tris.data(), n * sizeof(Build_Tri));
+        bool ok = in.good();
+        in.close();
+        std::remove(file.c_str());
+        if (!ok)
+            return false;
+        cluster(tris);
+        return out.good();
+    }
+
+    // Split at the middle of the longest axis of the centroid bounds. If every
+    // centroid lands on one side (they all coincide), split by order instead.
+    int axis = longest_axis(bounds);
+    float middle = bounds.center()[axis];
+    std::string left = temporary(), right = temporary();
+    size_t n_left = 0;
+    BBox box_left, box_right;
+    for (int by_order = 0; by_order < 2; by_order++) {
+        std::ifstream in(file, std::ios::binary);
+        std::ofstream l(left, std::ios::binary), r(right, std::ios::binary);
+        std::vector<Build_Tri> block(std::min(n, size_t(4096)));
+        n_left = 0;
+        box_left = box_right = BBox();
+        for (size_t i = 0; i < n; i += block.size()) {
+            size_t count = std::min(block.size(), n - i);
+            in.read((char *)block.data(), count * sizeof(Build_Tri));
+            if (!in.good())
+                return false;
+            for (size_t k = 0; k < count; k++) {
+                const Build_Tri &t = block[k];
+                bool to_left = by_order ? i + k < n / 2 : t.centroid[axis] < middle;
+                (to_left ? l : r).write((const char *)&t, sizeof(Build_Tri));
+                (to_left ? box_left : box_right).enclose(t.centroid);
+                n_left += to_left;
+            }
+        }
+        if (!l.good() || !r.good())
+            return false;
+        if (n_left > 0 && n_left < n)
+            break;
+    }
+    std::remove(file.c_str());
+    return partition(left, n_left, box_left) && partition(right, n - n_left, box_right);
+}
+
+// Clusters tris into chunks and writes each of them
+void Chunked_Mesh::Writer::cluster(std::vector<Build_Tri> &tris) {
+    median_split(tris, 0, tris.size(), leaf_size,
+                 [&](size_t b, size_t e) { write_chunk(tris, b, e); });
+}
+
+// Writes tris[begin, end) as one chunk, with a local BVH of up to four triangles per leaf
+void Chunked_Mesh::Writer::write_chunk(std::vector<Build_Tri> &tris, size_t begin, size_t end) {
+
+    std::vector<Node> nodes;
+    std::vector<Tri> local;
+    local.reserve(end - begin);
+
+    struct Pending {
+        size_t begin, end, node;
+    };
+    nodes.push_back({});
+    std::vector<Pending> todo = {{begin, end, 0}};
+    while (!todo.empty()) {
+        Pending p = todo.back();
+        todo.pop_back();
+
+        BBox nb;
+        for (size_t i = p.begin; i < p.end; i++)
+            nb.enclose(tri_box(tris[i].p));
+        Node &node = nodes[p.node];
+        for (int a = 0; a < 3; a++) {
+            node.min[a] = nb.min[a];
+            node.max[a] = nb.max[a];
+        }
+        node.l = node.r = 0;
+
+        if (p.end - p.begin <= 4) {
+            node.start = (uint32_t)local.size();
+            node.count = (uint32_t)(p.end - p.begin);
+            for (size_t i = p.begin; i < p.end; i++) {
+                Tri t;
+                std::copy(tris[i].p, tris[i].p + 3, t.p);
+                std::copy(tris[i].n, tris[i].n + 3, t.n);
+                local.push_back(t);
+            }
+            continue;
+        }
+
+        BBox cbox;
+        for (size_t i = p.begin; i < p.end; i++)
+            cbox.enclose(tris[i].centroid);
+        int axis = longest_axis(cbox);
+        size_t mid = p.begin + (p.end - p.begin) / 2;
+        std::nth_element(tris.begin() + p.begin, tris.begin() + mid, tris.begin() + p.end,
+                         [axis](const Build_Tri &x, const Build_Tri &y) {
+                             return x.centroid[axis] < y.centroid[axis];
+                         });
+
+        uint32_t l = (uint32_t)nodes.size();
+        nodes.push_back({});
+        nodes.push_back({});
+        nodes[p.node].l = l;
+        nodes[p.node].r = l + 1;
+        nodes[p.node].start = nodes[p.node].count = 0;
+        todo.push_back({mid, p.end, l + 1});
+        todo.push_back({p.begin, mid, l});
+    }
+
+    Entry entry;
+    entry.box = BBox(Vec3(nodes[0].min[0], nodes[0].min[1], nodes[0].min[2]),
+                     Vec3(nodes[0].max[0], nodes[0].max[1], nodes[0].max[2]));
+    entry.offset = (uint64_t)out.tellp();
+    entry.n_nodes = (uint32_t)nodes.size();
+    entry.n_tris = (uint32_t)local.size();
+    out.write((const char *)nodes.data(), nodes.size() * sizeof(Node));
+    out.write((const char *)local.data(), local.size() * sizeof(Tri));
+    entries.push_back(entry);
+}
+
+bool Chunked_Mesh::write(const GL::Mesh &mesh, const std::string &path, size_t tris_per_chunk) {
+
+    const auto &verts = mesh.verts();
+    const auto &idxs = mesh.indices();
+
+    // The mesh is in memory already, so the writer need not spill it
+    Writer writer(path, tris_per_chunk, (idxs.size() / 3 + 1) * sizeof(Build_Tri));
+    for (size_t t = 0; t + 2 < idxs.size(); t += 3) {
+        const auto &a = verts[idxs[t]], &b = verts[idxs[t + 1]], &c = verts[idxs[t + 2]];
+        writer.add(a.pos, b.pos, c.pos, a.norm, b.norm, c.norm);
+    }
+    return writer.finish();
+}
+
+bool Chunked_Mesh::open(const std::string &file, size_t budget_bytes) {
+
+    std::ifstream in(file, std::ios::binary);
+    if (!in.is_open())
+        return false;
+
+    char magic[sizeof(chunk_magic)];
+    uint64_t header[2]; // chunks, directory offset
+    in.read(magic, sizeof(magic));
+    in.read((char *)header, sizeof(header));
+    if (!in.good() || std::memcmp(magic, chunk_magic, sizeof(magic)) != 0)
+        return false;
+    uint64_t n_chunks = header[0];
+    in.seekg((std::streamoff)header[1]);
+
+    std::vector<Entry> entries(n_chunks);
+    BBox bounds;
+    for (Entry &entry : entries) {
+        float b[6];
+        in.read((char *)b, sizeof(b));
+        in.read((char *)&entry.offset, sizeof(entry.offset));
+        in.read((char *)&entry.n_nodes, sizeof(entry.n_nodes));
+        in.read((char *)&entry.n_tris, sizeof(entry.n_tris));
+        entry.box = BBox(Vec3(b[0], b[1], b[2]), Vec3(b[3], b[4], b[5]));
+        bounds.enclose(entry.box);
+    }
+    if (!in.good())
+        return false;
+
+    // Top-level BVH over the chunk bounds, split at the median chunk center
+    std::vector<Top_Node> nodes;
+    std::vector<uint32_t> order(entries.size());
+    for (uint32_t c = 0; c < order.size(); c++)
+        order[c] = c;
+    struct Pending {
+        size_t begin, end, node;
+    };
+    std::vector<Pending> todo;
+    if (!entries.empty()) {
+        nodes.push_back({});
+        todo.push_back({0, order.size(), 0});
+    }
+    while (!todo.empty()) {
+        Pending p = todo.back();
+        todo.pop_back();
+
+        BBox nb, cbox;
+        for (size_t i = p.begin; i < p.end; i++) {
+            nb.enclose(entries[order[i]].box);
+            cbox.enclose(entries[order[i]].box.center());
+        }
+        nodes[p.node].box = nb;
+        if (p.end - p.begin == 1) {
+            nodes[p.node].chunk = order[p.begin];
+            continue;
+        }
+
+        Vec3 extent = cbox.max - cbox.min;
+        int axis =
+            extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+        size_t mid = p.begin + (p.end - p.begin) / 2;
+        std::nth_element(order.begin() + p.begin, order.begin() + mid, order.begin() + p.end,
+                         [&](uint32_t x, uint32_t y) {
+                             return entries[x].box.center()[axis] < entries[y].box.center()[axis];
+                         });
+
+        uint32_t l = (uint32_t)nodes.size();
+        nodes.push_back({});
+        nodes.push_back({});
+        nodes[p.node].l = l;
+        nodes[p.node].r = l + 1;
+        todo.push_back({mid, p.end, l + 1});
+        todo.push_back({p.begin, mid, l});
+    }
+
+    std::lock_guard<std::mutex> lock(cache_lock);
+    path = file;
+    box = bounds;
+    budget = budget_bytes;
+    directory = std::move(entries);
+    top = std::move(nodes);
+    slots.assign(directory.size(), Slot());
+    lru.clear();
+    resident = 0;
+    return true;
+}
+
+std::shared_ptr<const Chunked_Mesh::Chunk> Chunked_Mesh::load(uint32_t index) const {
+
+    auto start = std::chrono::steady_clock::now();
+    const Entry &entry = directory[index];
+
+    auto chunk = std::make_shared<Chunk>();
+    chunk->nodes.resize(entry.n_nodes);
+    chunk->tris.resize(entry.n_tris);
+    chunk->bytes = entry.n_nodes * sizeof(Node) + entry.n_tris * sizeof(Tri);
+
+    std::ifstream in(path, std::ios::binary);
+    in.seekg((std::streamoff)entry.offset);
+    in.read((char *)chunk->nodes.data(), entry.n_nodes * sizeof(Node));
+    in.read((char *)chunk->tris.data(), entry.n_tris * sizeof(Tri));
+    bool ok = in.good() && valid_chunk(*chunk);
+
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+    load_us.fetch_add((uint64_t)us, std::memory_order_relaxed);
+    if (!ok) {
+        // Only the first failure is logged; stats() counts the rest
+        if (n_failed.fetch_add(1, std::memory_order_relaxed) == 0)
+            warn("Failed to read chunk %u of %s", index, path.c_str());
+        return nullptr;
+    }
+    n_loads.fetch_add(1, std::memory_order_relaxed);
+    n_bytes.fetch_add(chunk->bytes, std::memory_order_relaxed);
+    return chunk;
+}
+
+std::shared_ptr<const Chunked_Mesh::Chunk> Chunked_Mesh::acquire(uint32_t index) const {
+
+    {
+        std::lock_guard<std::mutex> lock(cache_lock);
+        Slot &slot = slots[index];
+        if (slot.chunk) {
+            lru.splice(lru.begin(), lru, slot.lru);
+            n_hits.fetch_add(1, std::memory_order_relaxed);
+            return slot.chunk;
+        }
+    }
+
+    // Read without holding the lock, so other threads keep tracing resident chunks
+    std::shared_ptr<const Chunk> chunk = load(index);
+
+    std::lock_guard<std::mutex> lock(cache_lock);
+    Slot &slot = slots[index];
+    if (slot.chunk) // another thread loaded it meanwhile
+        return slot.chunk;
+
+    // A chunk that failed to load is left out of the cache, so it is read again later
+    if (!chunk) {
+        static const std::shared_ptr<const Chunk> missing = std::make_shared<Chunk>();
+        return missing;
+    }
+
+    slot.chunk = chunk;
+    lru.push_front(index);
+    slot.lru = lru.begin();
+    resident += chunk->bytes;
+
+    // Evict least recently used chunks; rays still tracing them keep them alive
+    // until they finish
+    while (resident > budget && lru.size() > 1) {
+        uint32_t victim = lru.back();
+        lru.pop_back();
+        resident -= slots[victim].chunk->bytes;
+        slots[victim].chunk.reset();
+        n_evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    return chunk;
+}
+
+// Checks that a chunk read from disk is a tree hit_chunk can traverse: children come
+// after their parent (so there are no cycles), leaves stay within the triangles, and
+// no leaf is deeper than max_chunk_depth
+bool Chunked_Mesh::valid_chunk(const Chunk &chunk) {
+
+    std::vector<uint32_t> depth(chunk.nodes.size(), 0);
+    for (uint32_t i = 0; i < chunk.nodes.size(); i++) {
+        const Node &node = chunk.nodes[i];
+        if (node.l || node.r) {
+            if (node.l <= i || node.r <= i || node.l >= chunk.nodes.size() ||
+                node.r >= chunk.nodes.size() || depth[i] >= max_chunk_depth)
+                return false;
+            depth[node.l] = depth[node.r] = depth[i] + 1;
+        } else if ((uint64_t)node.start + node.count > chunk.tris.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Trace Chunked_Mesh::hit_chunk(const Chunk &chunk, const Ray &ray) {
+
+    Trace ret;
+    if (chunk.nodes.empty())
+        return ret;
+
+    // Depth-first, the stack holds at most one pending sibling per level
+    uint32_t stack[max_chunk_depth + 1];
+    size_t top = 0;
+    stack[top++] = 0;
+    while (top) {
+        const Node &node = chunk.nodes[stack[--top]];
+        TRAVERSAL_STAT(nodes_visited, 1);
+        TRAVERSAL_STAT(boxes_tested, 1);
+
+        BBox nb(Vec3(node.min[0], node.min[1], node.min[2]),
+                Vec3(node.max[0], node.max[1], node.max[2]));
+        Vec2 times(ray.time_bounds[0], ray.time_bounds[1]);
+        if (!nb.hit(ray, times) || (ret.hit && times.x > ret.time))
+            continue;
+
+        if (node.l || node.r) {
+            assert(top + 2 <= max_chunk_depth + 1);
+            stack[top++] = node.r;
+            stack[top++] = node.l;
+            continue;
+        }
+
+        // Moller-Trumbore, with the normal facing the ray as in Triangle::hit
+        for (uint32_t i = node.start; i < node.start + node.count; i++) {
+            TRAVERSAL_STAT(tris_tested, 1);
+            const Tri &t = chunk.tris[i];
+            Vec3 e1 = t.p[1] - t.p[0], e2 = t.p[2] - t.p[0];
+            Vec3 pv = cross(ray.dir, e2);
+            float det = dot(e1, pv);
+            if (det == 0.0f)
+                continue;
+            float inv = 1.0f / det;
+            Vec3 s = ray.point - t.p[0];
+            float u = dot(s, pv) * inv;
+            if (u < 0.0f || u > 1.0f)
+                continue;
+            Vec3 qv = cross(s, e1);
+            float v = dot(ray.dir, qv) * inv;
+            if (v < 0.0f || u + v > 1.0f)
+                continue;
+            float d = dot(e2, qv) * inv;
+            if (d <= ray.time_bounds[0] || d >= ray.time_bounds[1] || (ret.hit && d >= ret.time))
+                continue;
+
+            ret.hit = true;
+            ret.time = d;
+            ret.origin = ray.point;
+            ret.position = (1.0f - u - v) * t.p[0] + u * t.p[1] + v * t.p[2];
+            ret.normal = (1.0f - u - v) * t.n[0] + u * t.n[1] + v * t.n[2];
+            // Interpolated normals are shorter than unit length; fall back to the face
+            // normal where they cancel out
+            if (ret.normal.norm_squared() > 0.0f)
+                ret.normal = ret.normal.unit();
+            else
+                ret.normal = cross(e1, e2).unit();
+            if (dot(ret.normal, ray.dir) > 0.0f)
+                ret.normal = -ret.normal;
+        }
+    }
+    return ret;
+}
+
+template <typename F>
+void Chunked_Mesh::visit_chunks(const Ray &ray, const float *limit, F &&f) const {
+
+    // Whether the ray enters a top-level node's box, and when
+    auto enter = [&](uint32_t n, float &t) {
+        Vec2 times(ray.time_bounds[0], ray.time_bounds[1]);
+        if (!top[n].box.hit(ray, times))
+            return false;
+        t = times.x;
+        return true;
+    };
+
+    // Nodes whose boxes the ray enters, with their entry times
+    static thread_local std::vector<std::pair<uint32_t, float>> stack;
+    stack.clear();
+    float t_root;
+    if (!top.empty() && enter(0, t_root))
+        stack.push_back({0, t_root});
+
+    while (!stack.empty()) {
+        auto [n, t] = stack.back();
+        stack.pop_back();
+        if (limit && t > *limit)
+            continue;
+
+        const Top_Node &node = top[n];
+        if (!node.l && !node.r) {
+            f(node.chunk, t);
+            continue;
+        }
+
+        // Push the farther child first so the nearer one is visited first
+        float tl, tr;
+        bool hit_l = enter(node.l, tl), hit_r = enter(node.r, tr);
+        if (hit_l && hit_r) {
+            bool l_first = tl <= tr;
+            stack.push_back(l_first ? std::make_pair(node.r, tr) : std::make_pair(node.l, tl));
+            stack.push_back(l_first ? std::make_pair(node.l, tl) : std::make_pair(node.r, tr));
+        } else if (hit_l) {
+            stack.push_back({node.l, tl});
+        } else if (hit_r) {
+            stack.push_back({node.r, tr});
+        }
+    }
+}
+
+Trace Chunked_Mesh::hit(const Ray &ray) const {
+
+    n_rays.fetch_add(1, std::memory_order_relaxed);
+
+    Trace ret;
+    float limit = std::numeric_limits<float>::infinity();
+    visit_chunks(ray, &limit, [&](uint32_t c, float) {
+        n_visits.fetch_add(1, std::memory_order_relaxed);
+        std::shared_ptr<const Chunk> chunk = acquire(c);
+        ret = Trace::min(ret, hit_chunk(*chunk, ray));
+        if (ret.hit)
+            limit = ret.time;
+    });
+    return ret;
+}
+
+void Chunked_Mesh::hit_queued(const std::vector<Ray> &rays, std::vector<Trace> &out) const {
+
+    out.assign(rays.size(), Trace());
+    n_rays.fetch_add(rays.size(), std::memory_order_relaxed);
+
+    // Queue every ray on each chunk it enters, along with its entry time
+    std::vector<std::vector<std::pair<float, uint32_t>>> queues(directory.size());
+    for (uint32_t r = 0; r < rays.size(); r++) {
+        visit_chunks(rays[r], nullptr,
+                     [&](uint32_t c, float t) { queues[c].push_back({t, r}); });
+    }
+    // Process chunks that are already resident first, so they are used before the
+    // loads of the others can evict them; then nearest queues first overall, which
+    // lets later chunks skip rays that already found a closer hit
+    std::vector<uint32_t> order;
+    std::vector<char> cached(directory.size(), 0);
+    std::vector<float> nearest(directory.size(), std::numeric_limits<float>::infinity());
+    {
+        std::lock_guard<std::mutex> lock(cache_lock);
+        for (uint32_t c = 0; c < directory.size(); c++)
+            cached[c] = slots[c].chunk != nullptr;
+    }
+    for (uint32_t c = 0; c < directory.size(); c++) {
+        if (queues[c].empty())
+            continue;
+        order.push_back(c);
+        for (auto &q : queues[c])
+            nearest[c] = std::min(nearest[c], q.first);
+    }
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        if (cached[a] != cached[b])
+            return cached[a] > cached[b];
+        return nearest[a] < nearest[b];
+    });
+
+    for (uint32_t c : order) {
+        std::shared_ptr<const Chunk> chunk;
+        for (auto [t, r] : queues[c]) {
+            if (out[r].hit && t > out[r].time)
+                continue;
+            if (!chunk)
+                chunk = acquire(c);
+            n_visits.fetch_add(1, std::memory_order_relaxed);
+            out[r] = Trace::min(out[r], hit_chunk(*chunk, rays[r]));
+        }
+    }
+}
+
+size_t Chunked_Mesh::resident_bytes() const {
+    std::lock_guard<std::mutex> lock(cache_lock);
+    return resident;
+}
+
+Chunk_Stats Chunked_Mesh::stats() const {
+    Chunk_Stats s;
+    s.rays = n_rays.load();
+    s.chunk_visits = n_visits.load();
+    s.cache_hits = n_hits.load();
+    s.loads = n_loads.load();
+    s.failed_loads = n_failed.load();
+    s.evictions = n_evictions.load();
+    s.bytes_read = n_bytes.load();
+    s.load_ms = load_us.load() * 1e-3;
+    return s;
+}
+
+void Chunked_Mesh::reset_stats() const {
+    n_rays = n_visits = n_hits = n_loads = n_failed = n_evictions = n_bytes = load_us = 0;
+}
+
+void Chunked_Mesh::log_stats(double seconds) const {
+    Chunk_Stats s = stats();
+    double lookups = (double)(s.cache_hits + s.loads);
+    info("Out-of-core: %.2f Mrays/s, %llu chunk loads (%.1f MB, %.1f ms, %llu failed), "
+         "%llu evictions, %.1f%% cache hits, %.1f / %.1f MB resident",
+         seconds > 0.0 ? s.rays / seconds * 1e-6 : 0.0, (unsigned long long)s.loads,
+         s.bytes_read / (1024.0 * 1024.0), s.load_ms, (unsigned long long)s.failed_loads,
+         (unsigned long long)s.evictions,
+         lookups > 0.0 ? 100.0 * s.cache_hits / lookups : 0.0,
+         resident_bytes() / (1024.0 * 1024.0), budget / (1024.0 * 1024.0));
+}
+
+struct Render_Chunked {
+    std::string path;
+    size_t budget_mb = 0;
+    Chunked_Mesh mesh;
+    bool opened = false;
+};
+static Render_Shared<Render_Chunked> render_chunked;
+
+const Chunked_Mesh *render_chunked_mesh() {
+
+    if (!debug_data.chunked_mesh[0])
+        return nullptr;
+    size_t budget_mb = (size_t)std::max(debug_data.chunked_budget_mb, 1);
+
+    static thread_local Render_Shared<Render_Chunked>::Handle handle;
+    const Render_Chunked *current = render_chunked.get(
+        handle,
+        [&](const Render_Chunked &r) {
+            return r.path == debug_data.chunked_mesh && r.budget_mb == budget_mb;
+        },
+        [&]() {
+            auto r = std::make_shared<Render_Chunked>();
+            r->path = debug_data.chunked_mesh;
+            r->budget_mb = budget_mb;
+            r->opened = r->mesh.open(r->path, budget_mb << 20);
+            if (r->opened)
+                info("Opened out-of-core mesh %s: %zu chunks", r->path.c_str(),
+                     r->mesh.chunks());
+            else
+                warn("Failed to open out-of-core mesh %s", r->path.c_str());
+            return r;
+        });
+    return current->opened ? &current->mesh : nullptr;
+}
+
+void render_chunked_mesh_reset() {
+    render_chunked.reset();
+}
+
+bool hit_chunked(const Chunked_Mesh *mesh, const Ray &ray, Trace &hit, size_t n_materials) {
+
+    if (!mesh || n_materials == 0)
+        return false;
+
+    // Only look for hits in front of the scene's
+    Ray bounded = ray;
+    if (hit.hit)
+        bounded.time_bounds[1] = std::min(bounded.time_bounds[1], hit.time);
+    Trace own = mesh->hit(bounded);
+    if (!own.hit)
+        return false;
+    hit = own;
+    hit.material = std::clamp(debug_data.chunked_material, 0, (int)n_materials - 1);
+    return true;
+}
+
+} // namespace PT
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <atomic>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../platform/gl.h"
+#include "../rays/trace.h"
+
+/* Out-of-core meshes:
+
+    A Chunked_Mesh keeps only a small directory in memory: the bounding box and file
+    offset of every chunk. The triangles themselves live in a file written by
+    Chunked_Mesh::Writer, which clusters them with median splits into chunks of
+    spatially close triangles, and stores each chunk together with its own BVH. A
+    chunk is therefore ready to trace as soon as it is read, and its triangles carry
+    their vertices by value, so nothing points into memory that may be evicted.
+
+    The writer takes triangles one at a time and keeps a bounded number of them in
+    memory. Once more arrive, they are spilled to temporary files next to the output,
+    which finish() splits at the middle of their centroid bounds until each part fits
+    in memory and can be clustered into chunks there. Chunked_Mesh::write is the same
+    for a mesh that is already in memory.
+
+    Chunks are paged in on demand and kept in an LRU cache bounded by the memory
+    budget given to open(), which also builds a small top-level BVH over the chunk
+    bounds. Tracing single rays walks it front to back, which may load a chunk per
+    ray; hit_queued instead sorts a batch of rays into per-chunk queues and processes
+    one chunk at a time, so each chunk is loaded at most once per batch no matter how
+    many rays need it. A chunk that fails to load is not cached; its rays miss it and
+    the next ray to reach it tries again.
+
+    The pathtracer renders the file named by debug_data.chunked_mesh along with the
+    scene (see render_chunked_mesh); caustic photons do not land on it. stats()
+    reports rays traced, chunk loads, evictions and bytes read, so throughput under
+    memory pressure can be measured, and log_stats is called after each batch render
+    (see batch.h) and from the debug UI.
+*/
+
+namespace PT {
+
+struct Chunk_Stats {
+    uint64_t rays = 0;
+    uint64_t chunk_visits = 0; // ray - chunk tests that reached the chunk's triangles
+    uint64_t cache_hits = 0;
+    uint64_t loads = 0;
+    uint64_t failed_loads = 0;
+    uint64_t evictions = 0;
+    uint64_t bytes_read = 0;
+    double load_ms = 0.0;
+};
+
+class Chunked_Mesh {
+    // A triangle being written, and where a written chunk is in the file
+    struct Build_Tri;
+    struct Entry {
+        BBox box;
+        uint64_t offset = 0;
+        uint32_t n_nodes = 0, n_tris = 0;
+    };
+
+public:
+    // Writes the chunk file for triangles added one at a time (see above), keeping at
+    // most about memory_bytes of them in memory
+    class Writer {
+    public:
+        Writer(const std::string &path, size_t tris_per_chunk = 1 << 16,
+               size_t memory_bytes = size_t(256) << 20);
+        ~Writer();
+
+        void add(Vec3 p0, Vec3 p1, Vec3 p2, Vec3 n0, Vec3 n1, Vec3 n2);
+
+        // Clusters everything added into chunks of at most tris_per_chunk triangles
+        // and writes them. Returns false if a file could not be written.
+        bool finish();
+
+    private:
+        bool spill_buffer();
+        bool partition(const std::string &file, size_t n, BBox centroids);
+        void cluster(std::vector<Build_Tri> &tris);
+        void write_chunk(std::vector<Build_Tri> &tris, size_t begin, size_t end);
+        std::string temporary();
+
+        std::string path;
+        size_t leaf_size, capacity;
+        std::vector<Build_Tri> buffer;
+        std::ofstream spill;
+        std::string spill_path;
+        size_t spilled = 0;
+        BBox centroids;
+        bool failed = false;
+        std::vector<std::string> temporaries;
+        std::ofstream out;
+        std::vector<Entry> entries;
+    };
+
+    // Clusters the mesh into chunks of at most tris_per_chunk triangles and writes it
+    // to path. Returns false if the file could not be written.
+    static bool write(const GL::Mesh &mesh, const std::string &path,
+                      size_t tris_per_chunk = 1 << 16);
+
+    // Reads the chunk directory of a file written by write; chunks are loaded later,
+    // keeping at most budget_bytes of them resident
+    bool open(const std::string &path, size_t budget_bytes);
+
+    BBox bbox() const {
+        return box;
+    }
+    Trace hit(const Ray &ray) const;
+
+    // out[i] = hit(rays[i]), traced chunk by chunk
+    void hit_queued(const std::vector<Ray> &rays, std::vector<Trace> &out) const;
+
+    size_t chunks() const {
+        return directory.size();
+    }
+    size_t resident_bytes() const;
+
+    Chunk_Stats stats() const;
+    void reset_stats() const;
+    // Logs stats() along with the ray throughput over the given wall time
+    void log_stats(double seconds) const;
+
+private:
+    struct Node {
+        float min[3], max[3];
+        uint32_t start, count; // triangles of a leaf
+        uint32_t l, r;         // children; 0 for leaves
+    };
+    // Deepest chunk BVH hit_chunk can traverse. write() splits at the median, so even
+    // 2^32 triangles stay far below it; load() rejects chunks that exceed it.
+    static constexpr uint32_t max_chunk_depth = 48;
+    struct Tri {
+        Vec3 p[3];
+        Vec3 n[3];
+    };
+    struct Chunk {
+        std::vector<Node> nodes;
+        std::vector<Tri> tris;
+        size_t bytes = 0;
+    };
+    struct Slot {
+        std::shared_ptr<const Chunk> chunk;
+        std::list<uint32_t>::iterator lru;
+    };
+    // Top-level BVH node; leaves (l = r = 0) hold a single chunk
+    struct Top_Node {
+        BBox box;
+        uint32_t l = 0, r = 0, chunk = 0;
+    };
+
+    std::shared_ptr<const Chunk> acquire(uint32_t index) const;
+    std::shared_ptr<const Chunk> load(uint32_t index) const;
+    static bool valid_chunk(const Chunk &chunk);
+    static Trace hit_chunk(const Chunk &chunk, const Ray &ray);
+
+    // Calls f(chunk, entry time) for every chunk the ray enters before *limit, nearer
+    // children of the top-level BVH first
+    template <typename F> void visit_chunks(const Ray &ray, const float *limit, F &&f) const;
+
+    std::string path;
+    BBox box;
+    size_t budget = 0;
+    std::vector<Entry> directory;
+    std::vector<Top_Node> top;
+
+    mutable std::mutex cache_lock;
+    mutable std::vector<Slot> slots;
+    mutable std::list<uint32_t> lru; // most recently used first
+    mutable size_t resident = 0;
+
+    mutable std::atomic<uint64_t> n_rays{0}, n_visits{0}, n_hits{0}, n_loads{0}, n_failed{0},
+        n_evictions{0}, n_bytes{0}, load_us{0};
+};
+
+// The out-of-core mesh named by debug_data.chunked_mesh, opened with a cache of
+// debug_data.chunked_budget_mb; null if none is set or it could not be opened. The
+// result stays valid until the calling thread's next call.
+const Chunked_Mesh *render_chunked_mesh();
+
+// Reopens the file on the next render_chunked_mesh, e.g. after it was rewritten
+void render_chunked_mesh_reset();
+
+// Replaces hit, the scene's hit of ray, with mesh's if that is nearer, and returns
+// whether it did. The mesh's hits get the material debug_data.chunked_material,
+// limited to the n_materials the scene has.
+bool hit_chunked(const Chunked_Mesh *mesh, const Ray &ray, Trace &hit, size_t n_materials);
+
+} // namespace PT
@@ -2,12 +2,216 @@
 #include "debug.h"
 #include <imgui/imgui.h>
 
+#include "../geometry/halfedge.h"
 #include "../lib/log.h"
 #include "../lib/spectrum.h"
+#include "chunked_mesh.h"
+#include "edit_log.h"
+#include "guiding.h"
+#include "microfacet.h"
+#include "photon_map.h"
+#include "profiler.h"
+#include "progressive.h"
+#include "radiance_cache.h"
+#include "remesh.h"
+#include "simplify.h"
+#include "spectrum4.h"
+#include "stats.h"
+#include "subdivision.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <vector>
 
 // Actual storage for the debug data
 Debug_Data debug_data;
 
+// Times the light-accumulation kernel of trace_ray (acc += radiance * bsdf * weight)
+// with scalar Spectrum and packed Spectrum4 arithmetic.
+static void benchmark_spectrum_kernels() {
+
+    const size_t n = 1 << 20, reps = 16;
+    std::vector<Spectrum> radiance(n), bsdf(n);
+    std::vector<float> weight(n);
+    for (size_t i = 0; i < n; i++) {
+        radiance[i] = Spectrum((i % 7) * 0.1f, (i % 11) * 0.1f, (i % 13) * 0.1f);
+        bsdf[i] = Spectrum((i % 5) * 0.2f, (i % 3) * 0.3f, 0.5f);
+        weight[i] = 1.0f / (1 + i % 17);
+    }
+
+    auto time = [&](auto &&kernel) {
+        auto start = std::chrono::steady_clock::now();
+        float check = kernel();
+        auto end = std::chrono::steady_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(end - start).count();
+        return std::make_pair(ms, check);
+    };
+
+    auto [scalar_ms, scalar_sum] = time([&]() {
+        Spectrum acc;
+        for (size_t r = 0; r < reps; r++)
+            for (size_t i = 0; i < n; i++)
+                acc += weight[i] * radiance[i] * bsdf[i];
+        return acc.luma();
+    });
+    auto [packed_ms, packed_sum] = time([&]() {
+        Spectrum4 acc;
+        for (size_t r = 0; r < reps; r++)
+            for (size_t i = 0; i < n; i++)
+                acc.fma(radiance[i], bsdf[i], weight[i]);
+        return acc.luma();
+    });
+
+    double mops = n * reps * 1e-6;
+    info("Spectrum: %.1f ms (%.1f M/s), Spectrum4: %.1f ms (%.1f M/s), speedup %.2fx (%f / %f)",
+         scalar_ms, mops / (scalar_ms * 1e-3), packed_ms, mops / (packed_ms * 1e-3),
+         scalar_ms / packed_ms, scalar_sum, packed_sum);
+}
+
+// An n x n grid of quads wrapped around a torus, each quad optionally split in two
+static void torus_mesh(unsigned int n, bool triangles, std::vector<Vec3> &verts,
+                       std::vector<std::vector<unsigned int>> &polygons) {
+    for (unsigned int i = 0; i < n; i++) {
+        for (unsigned int j = 0; j < n; j++) {
+            float u = 2.0f * PI_F * i / n, v = 2.0f * PI_F * j / n;
+            float r = 1.0f + 0.3f * std::cos(v);
+            verts.push_back(Vec3(r * std::cos(u), 0.3f * std::sin(v), r * std::sin(u)));
+            unsigned int a = i * n + j, b = ((i + 1) % n) * n + j,
+                         c = ((i + 1) % n) * n + (j + 1) % n, d = i * n + (j + 1) % n;
+            if (triangles) {
+                polygons.push_back({a, b, c});
+                polygons.push_back({a, c, d});
+            } else {
+                polygons.push_back({a, b, c, d});
+            }
+        }
+    }
+}
+
+// Subdivides a 256 x 256 quad torus by 1, 2 and 3 levels, on one thread and then on
+// debug_data.mesh_threads threads, then Loop subdivides a 2M triangle torus once
+static void benchmark_subdivision() {
+
+    std::vector<Vec3> verts;
+    std::vector<std::vector<unsigned int>> polygons;
+    torus_mesh(256, false, verts, polygons);
+    subdivision_benchmark(polygons, verts, Subdivision_Scheme::catmull_clark, 1);
+    subdivision_benchmark(polygons, verts, Subdivision_Scheme::catmull_clark,
+                          debug_data.mesh_threads);
+
+    verts.clear();
+    polygons.clear();
+    torus_mesh(1024, true, verts, polygons);
+    std::vector<unsigned int> triangles;
+    std::vector<Vec3> refined;
+    Subdivision_Timing timing;
+    auto start = std::chrono::steady_clock::now();
+    loop_subdivide(polygons, verts, triangles, refined, debug_data.mesh_threads, &timing);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                    .count();
+    info("Loop subdivision: %zu -> %zu triangles in %.1f ms (%.1f M output triangles/s; "
+         "tables %.1f ms, edges %.1f ms, vertices %.1f ms, triangles %.1f ms)",
+         polygons.size(), triangles.size() / 3, ms, triangles.size() / 3 / (ms * 1e3),
+         timing.topology_ms, timing.edge_ms, timing.vertex_ms, timing.connect_ms);
+}
+
+// Simplifies a 10M triangle torus to 1%
+static void benchmark_simplification() {
+
+    std::vector<Vec3> verts;
+    std::vector<std::vector<unsigned int>> polygons;
+    torus_mesh(2236, true, verts, polygons);
+    simplify_benchmark(polygons, verts, debug_data.mesh_threads);
+}
+
+// Builds the progressive mesh of a 2M triangle torus down to 1%, extracts several
+// levels of detail and streams it back from a file
+static void benchmark_progressive_mesh() {
+
+    std::vector<Vec3> verts;
+    std::vector<std::vector<unsigned int>> polygons;
+    torus_mesh(1000, true, verts, polygons);
+    progressive_benchmark(polygons, verts, debug_data.mesh_threads);
+}
+
+// Remeshes a 2M triangle torus
+static void benchmark_remeshing() {
+
+    std::vector<Vec3> verts;
+    std::vector<std::vector<unsigned int>> polygons;
+    torus_mesh(1000, true, verts, polygons);
+    remesh_benchmark(polygons, verts, debug_data.mesh_threads);
+}
+
+// Records 100k local operations on a 2M triangle torus, then undoes and redoes them
+static void benchmark_edit_log() {
+
+    std::vector<Vec3> verts;
+    std::vector<std::vector<unsigned int>> polygons;
+    torus_mesh(1000, true, verts, polygons);
+    edit_log_benchmark(polygons, verts);
+}
+
+// Runs the editor's local operations on a 2k triangle torus under a Halfedge_Edit_Log,
+// then checks that undoing and redoing every step gives back the same meshes
+static void check_halfedge_edit_log() {
+
+    std::vector<Vec3> verts;
+    std::vector<std::vector<unsigned int>> polygons;
+    torus_mesh(32, true, verts, polygons);
+    halfedge_edit_log_check(polygons, verts);
+}
+
+// Triangulates a 2M quad torus in the mode selected by "MeshEdit: ear-clipping
+// triangulation"; toggle it and run again to compare fanning with ear clipping
+static void benchmark_triangulation() {
+
+    std::vector<Vec3> verts;
+    std::vector<std::vector<unsigned int>> polygons;
+    torus_mesh(1415, false, verts, polygons);
+    Halfedge_Mesh mesh;
+    std::string err = mesh.from_poly(polygons, verts);
+    if (!err.empty()) {
+        warn("Triangulation benchmark: %s", err.c_str());
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    mesh.triangulate();
+    double ms =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+            .count();
+    info("Triangulation (%s): %zu quads in %.1f ms (%.1f M faces/s)",
+         debug_data.ear_clip_triangulation ? "ear clipping" : "fan", polygons.size(), ms,
+         polygons.size() / (ms * 1e3));
+}
+
+// Streams a 2M triangle torus into an out-of-core mesh file, keeping at most 16 MB of
+// it in memory, and renders it along with the scene
+static void write_chunked_torus(const char *path) {
+
+    std::vector<Vec3> verts;
+    std::vector<std::vector<unsigned int>> polygons;
+    torus_mesh(1000, true, verts, polygons);
+
+    auto start = std::chrono::steady_clock::now();
+    PT::Chunked_Mesh::Writer writer(path, 1 << 14, size_t(16) << 20);
+    for (const std::vector<unsigned int> &tri : polygons) {
+        Vec3 a = verts[tri[0]], b = verts[tri[1]], c = verts[tri[2]];
+        Vec3 n = cross(b - a, c - a).unit();
+        writer.add(a, b, c, n, n, n);
+    }
+    if (!writer.finish()) {
+        warn("Failed to write out-of-core mesh %s", path);
+        return;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                    .count();
+    info("Wrote %zu triangles to %s in %.1f ms", polygons.size(), path, ms);
+    std::strncpy(debug_data.chunked_mesh, path, sizeof(debug_data.chunked_mesh) - 1);
+    PT::render_chunked_mesh_reset();
+}
+
 /* Debugging Tips:
 
     Based on your Debug_Data fields in debug.h, you can add ImGui calls
@@ -42,6 +246,178 @@ void student_debug_ui() {
     // Debug option example
     Checkbox("Pathtracer: use normal colors", &debug_data.normal_colors);
 
+    // BVH traversal statistics
+    Checkbox("Pathtracer: BVH heatmap", &debug_data.bvh_heatmap);
+    if (debug_data.bvh_heatmap) {
+        Combo("Heatmap Metric", &debug_data.heatmap_metric,
+              "Nodes Visited\0Boxes Tested\0Triangles Tested\0");
+        DragFloat("Heatmap Max", &debug_data.heatmap_max, 1.0f, 1.0f, 10000.0f);
+    }
+    {
+        PT::Traversal_Stats stats = PT::total_traversal_stats();
+        double rays = stats.rays ? (double)stats.rays : 1.0;
+        Text("BVH queries: %llu", (unsigned long long)stats.rays);
+        Text("Nodes/ray: %.2f  Boxes/ray: %.2f  Tris/ray: %.2f", stats.nodes_visited / rays,
+             stats.boxes_tested / rays, stats.tris_tested / rays);
+        if (Button("Reset BVH Stats")) {
+            PT::reset_traversal_stats();
+        }
+    }
+
+    // Path guiding
+    Checkbox("Pathtracer: path guiding", &debug_data.path_guiding);
+    if (debug_data.path_guiding) {
+        SliderFloat("Guided Fraction", &debug_data.guide_fraction, 0.0f, 0.99f);
+        DragInt("Guide Budget (MB)", &debug_data.guide_budget_mb, 1.0f, 1, 4096);
+        if (Button("Reset Guide")) {
+            PT::guide_reset();
+        }
+    }
+
+    // Radiance cache
+    Checkbox("Pathtracer: radiance cache", &debug_data.radiance_cache);
+    if (debug_data.radiance_cache) {
+        DragInt("Cache Budget (MB)", &debug_data.cache_budget_mb, 1.0f, 1, 4096);
+        DragFloat("Cache Resolution", &debug_data.cache_resolution, 1.0f, 8.0f, 4096.0f);
+        DragInt("Cache Min Samples", &debug_data.cache_min_samples, 1.0f, 1, 1024);
+        if (Button("Reset Cache")) {
+            PT::radiance_cache_reset();
+        }
+    }
+
+    // Integrator selection
+    Combo("Pathtracer: integrator", &debug_data.integrator,
+          "Path Tracing\0Path Tracing + Caustic Photons\0");
+    if (debug_data.integrator == 1) {
+        DragInt("Photons", &debug_data.photon_count, 1000.0f, 1000, 100000000);
+        DragFloat("Photon Radius", &debug_data.photon_radius, 0.0001f, 0.0001f, 0.1f, "%.4f");
+        if (Button("Rebuild Photon Map")) {
+            PT::photon_map_reset();
+        }
+    }
+
+    Checkbox("Pathtracer: output AOVs for denoising", &debug_data.output_aovs);
+    DragInt("Pathtracer: threads (0 = all)", &debug_data.render_threads, 1.0f, 0, 256);
+
+    Checkbox("Pathtracer: sphere packets", &debug_data.sphere_packets);
+    Checkbox("Pathtracer: motion blur", &debug_data.motion_blur);
+    if (debug_data.motion_blur) {
+        DragInt("Moving Object", &debug_data.motion_object, 1.0f, 0, 1 << 20);
+        DragFloat3("Motion Offset", debug_data.motion_offset, 0.01f);
+    }
+
+    // Out-of-core mesh; the path only takes effect on Open, not while it is typed
+    {
+        static char chunked_path[sizeof(debug_data.chunked_mesh)] = "torus.chunks";
+        static auto stats_since = std::chrono::steady_clock::now();
+        InputText("Out-of-Core Mesh", chunked_path, sizeof(chunked_path));
+        if (Button("Open")) {
+            std::strncpy(debug_data.chunked_mesh, chunked_path,
+                         sizeof(debug_data.chunked_mesh) - 1);
+            PT::render_chunked_mesh_reset();
+        }
+        SameLine();
+        if (Button("Close")) {
+            debug_data.chunked_mesh[0] = '\0';
+        }
+        SameLine();
+        if (Button("Write Torus")) {
+            write_chunked_torus(chunked_path);
+        }
+        if (debug_data.chunked_mesh[0]) {
+            DragInt("Chunk Budget (MB)", &debug_data.chunked_budget_mb, 1.0f, 1, 65536);
+            DragInt("Mesh Material", &debug_data.chunked_material, 1.0f, 0, 1024);
+            if (const PT::Chunked_Mesh *mesh = PT::render_chunked_mesh()) {
+                if (Button("Log Out-of-Core Stats")) {
+                    mesh->log_stats(std::chrono::duration<double>(
+                                        std::chrono::steady_clock::now() - stats_since)
+                                        .count());
+                }
+                SameLine();
+                if (Button("Reset Out-of-Core Stats")) {
+                    mesh->reset_stats();
+                    stats_since = std::chrono::steady_clock::now();
+                }
+            }
+        }
+    }
+
+    // Render profiling
+    static bool profile = false;
+    if (Checkbox("Pathtracer: profile render stages", &profile)) {
+        PT::profiler_enable(profile);
+    }
+    if (profile) {
+        std::vector<PT::Prof_Row> rows = PT::profiler_summary();
+        Columns(4);
+        Text("Stage");
+        NextColumn();
+        Text("Calls");
+        NextColumn();
+        Text("Total (ms)");
+        NextColumn();
+        Text("Mean (us)");
+        NextColumn();
+        Separator();
+        for (const PT::Prof_Row &row : rows) {
+            Text("%s", PT::Prof_Stage_Names[(int)row.stage]);
+            NextColumn();
+            Text("%llu", (unsigned long long)row.calls);
+            NextColumn();
+            Text("%.2f", row.total_ms);
+            NextColumn();
+            Text("%.3f", row.mean_us);
+            NextColumn();
+        }
+        Columns(1);
+
+        static char trace_path[256] = "render_profile.json";
+        InputText("Trace File", trace_path, sizeof(trace_path));
+        if (Button("Write Chrome Trace")) {
+            if (PT::profiler_write_trace(trace_path))
+                info("Wrote render profile to %s", trace_path);
+            else
+                warn("Failed to write render profile to %s", trace_path);
+        }
+        SameLine();
+        if (Button("Reset Profile")) {
+            PT::profiler_reset();
+        }
+    }
+    if (Button("Benchmark Spectrum Kernels")) {
+        benchmark_spectrum_kernels();
+    }
+    if (Button("Check GGX Sampling")) {
+        PT::ggx_consistency_check();
+    }
+
+    // Mesh processing
+    DragInt("MeshEdit: threads (0 = all)", &debug_data.mesh_threads, 1.0f, 0, 256);
+    Checkbox("MeshEdit: log timings", &debug_data.mesh_timing);
+    Checkbox("MeshEdit: batched parallel simplification", &debug_data.batched_simplify);
+    Checkbox("MeshEdit: ear-clipping triangulation", &debug_data.ear_clip_triangulation);
+    if (Button("Benchmark Subdivision")) {
+        benchmark_subdivision();
+    }
+    if (Button("Benchmark Simplification")) {
+        benchmark_simplification();
+    }
+    if (Button("Benchmark Progressive Mesh")) {
+        benchmark_progressive_mesh();
+    }
+    if (Button("Benchmark Remeshing")) {
+        benchmark_remeshing();
+    }
+    if (Button("Benchmark Edit Log")) {
+        benchmark_edit_log();
+    }
+    if (Button("Check Halfedge Edit Log")) {
+        check_halfedge_edit_log();
+    }
+    if (Button("Benchmark Triangulation")) {
+        benchmark_triangulation();
+    }
+
     // ImGui examples
     if (Button("Press Me")) {
         info("Debug button pressed!");
@@ -45,6 +45,70 @@
 struct Debug_Data {
     // Setting it here makes it default to false.
     bool normal_colors = true;
+
+    // Replace the pathtracer output with a per-pixel heatmap of BVH traversal work.
+    // heatmap_metric selects the counter: 0 = nodes visited, 1 = boxes tested,
+    // 2 = triangles tested. Counts at or above heatmap_max are drawn fully red.
+    bool bvh_heatmap = false;
+    int heatmap_metric = 0;
+    float heatmap_max = 200.0f;
+
+    // Learn where indirect light comes from while rendering and guide diffuse bounces
+    // towards it (see guiding.h). guide_fraction is the probability of sampling the
+    // learned distribution instead of the BSDF, at most 0.99 so that the BSDF still
+    // reaches directions the field has not learned; guide_budget_mb bounds its memory.
+    bool path_guiding = false;
+    float guide_fraction = 0.5f;
+    int guide_budget_mb = 64;
+
+    // End paths in a radiance cache after their first diffuse bounce (see
+    // radiance_cache.h). cache_resolution is the number of cells along the scene's
+    // bounding box diagonal; entries are used after cache_min_samples updates.
+    bool radiance_cache = false;
+    int cache_budget_mb = 32;
+    float cache_resolution = 256.0f;
+    int cache_min_samples = 16;
+
+    // Integrator: 0 = path tracing, 1 = path tracing plus a caustic photon map (see
+    // photon_map.h) of photon_count photons, gathered within photon_radius times the
+    // scene's bounding box diagonal
+    int integrator = 0;
+    int photon_count = 1000000;
+    float photon_radius = 0.005f;
+
+    // Record first-hit albedo, normal and depth for the denoiser (see denoise.h)
+    bool output_aovs = false;
+
+    // Out-of-core mesh file (see chunked_mesh.h) rendered along with the scene, using
+    // the scene's material chunked_material; at most chunked_budget_mb of its chunks
+    // are kept in memory. Empty to render the scene alone.
+    char chunked_mesh[256] = "";
+    int chunked_budget_mb = 256;
+    int chunked_material = 0;
+
+    // Motion blur: scene object motion_object moves by motion_offset (in world space)
+    // while the shutter is open, and each camera ray sees it at a random time in the
+    // shutter interval (see motion_bvh.h)
+    bool motion_blur = false;
+    int motion_object = 0;
+    float motion_offset[3] = {0.0f, 0.5f, 0.0f};
+
+    // Trace the scene's spheres four at a time, in a BVH of sphere packets (see
+    // sphere_packet.h)
+    bool sphere_packets = false;
+
+    // Most threads that trace pixels at once (0 = every thread of the render's pool)
+    int render_threads = 0;
+
+    // Threads used by the parallel mesh passes (0 = all hardware threads), and whether
+    // subdivision and simplification log the time spent in each of their passes
+    int mesh_threads = 0;
+    bool mesh_timing = false;
+    // Simplify in parallel rounds of independent collapses instead of by heap order
+    bool batched_simplify = false;
+    // Triangulate faces by clipping their best-shaped ears instead of fanning them
+    // out of one corner
+    bool ear_clip_triangulation = false;
 };
 
 // This tells other code about a global variable of type Debug_Data, allowing
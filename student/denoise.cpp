@@ -0,0 +1,177 @@
+
+#include "denoise.h"
+#include "spectrum4.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+namespace PT {
+
+void AOV_Buffers::resize(size_t w_, size_t h_) {
+    w = w_;
+    h = h_;
+    albedo.assign(w * h, Spectrum(1.0f));
+    normal.assign(w * h, Vec3());
+    depth.assign(w * h, 0.0f);
+}
+
+static AOV_Buffers buffers;
+static std::mutex buffers_lock;
+
+// The dimensions the buffers have, published once they are resized; 0 before that
+static std::atomic<uint64_t> buffers_size{0};
+
+AOV_Buffers &aov_buffers() {
+    return buffers;
+}
+
+void aov_prepare(size_t w, size_t h) {
+    uint64_t size = ((uint64_t)w << 32) | (uint64_t)h;
+    if (buffers_size.load(std::memory_order_acquire) == size)
+        return;
+    std::lock_guard<std::mutex> lock(buffers_lock);
+    if (buffers.w != w || buffers.h != h)
+        buffers.resize(w, h);
+    buffers_size.store(size, std::memory_order_release);
+}
+
+Spectrum bsdf_albedo(const BSDF &bsdf) {
+    return std::visit(
+        [](const auto &b) -> Spectrum {
+            using T = std::decay_t<decltype(b)>;
+            if constexpr (std::is_same_v<T, BSDF_Lambertian>)
+                return b.albedo;
+            else if constexpr (std::is_same_v<T, BSDF_Mirror>)
+                return b.reflectance;
+            else if constexpr (std::is_same_v<T, BSDF_Glass>)
+                return (b.reflectance + b.transmittance) * 0.5f;
+            else if constexpr (std::is_same_v<T, BSDF_Refract>)
+                return b.transmittance;
+            else
+                return Spectrum(1.0f);
+        },
+        bsdf.underlying);
+}
+
+// Runs f(x0, x1, y0, y1) over the tile x tile blocks of a w x h image, which the threads
+// take in turn; tile = 0 instead gives each thread one band of whole rows
+template <typename F>
+static void parallel_tiles(size_t w, size_t h, size_t tile, size_t threads, F &&f) {
+
+    if (!threads)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    size_t tile_w = tile ? tile : w, tile_h = tile ? tile : (h + threads - 1) / threads;
+    tile_w = std::max(tile_w, size_t(1));
+    tile_h = std::max(tile_h, size_t(1));
+    size_t cols = (w + tile_w - 1) / tile_w, tiles = cols * ((h + tile_h - 1) / tile_h);
+    threads = std::min(threads, std::max(tiles, size_t(1)));
+
+    std::atomic<size_t> next{0};
+    auto work = [&]() {
+        for (size_t t; (t = next.fetch_add(1, std::memory_order_relaxed)) < tiles;) {
+            size_t x0 = (t % cols) * tile_w, y0 = (t / cols) * tile_h;
+            f(x0, std::min(w, x0 + tile_w), y0, std::min(h, y0 + tile_h));
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; t++)
+        workers.emplace_back(work);
+    work();
+    for (std::thread &worker : workers)
+        worker.join();
+}
+
+void denoise(const HDR_Image &color, const AOV_Buffers &aovs, HDR_Image &out,
+             const Denoise_Settings &settings) {
+
+    const auto [w, h] = color.dimension();
+    out.resize(w, h);
+    if (aovs.w != w || aovs.h != h || !w || !h) {
+        for (size_t i = 0; i < w * h; i++)
+            out.at(i) = color.at(i);
+        return;
+    }
+
+    // Demodulate: filter illumination instead of the final color, so the albedo
+    // AOV alone carries texture detail
+    const float eps = 1e-3f;
+    std::vector<Spectrum4> a(w * h), b(w * h);
+    std::vector<float> luma(w * h);
+    for (size_t i = 0; i < w * h; i++) {
+        const Spectrum &c = color.at(i), &al = aovs.albedo[i];
+        a[i] = Spectrum(c.r / std::max(al.r, eps), c.g / std::max(al.g, eps),
+                        c.b / std::max(al.b, eps));
+    }
+
+    static const float kernel[5] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f,
+                                    1.0f / 16.0f};
+
+    for (int pass = 0; pass < settings.passes; pass++) {
+
+        int step = 1 << pass;
+        float sigma_color = settings.sigma_color / (float)(1 << pass);
+        for (size_t i = 0; i < w * h; i++)
+            luma[i] = a[i].luma();
+
+        parallel_tiles(w, h, settings.tile, settings.threads,
+                       [&](size_t x0, size_t x1, size_t y0, size_t y1) {
+            for (size_t y = y0; y < y1; y++) {
+                for (size_t x = x0; x < x1; x++) {
+
+                    size_t p = y * w + x;
+                    const Vec3 &np = aovs.normal[p];
+                    const Spectrum &ap = aovs.albedo[p];
+                    float zp = aovs.depth[p], lp = luma[p];
+                    float color_scale = 1.0f / (sigma_color * std::max(lp, eps));
+                    float depth_scale = 1.0f / (settings.sigma_depth * step * std::max(zp, eps));
+
+                    Spectrum4 sum;
+                    float weights = 0.0f;
+                    for (int j = -2; j <= 2; j++) {
+                        long long qy = (long long)y + j * step;
+                        if (qy < 0 || qy >= (long long)h)
+                            continue;
+                        for (int i = -2; i <= 2; i++) {
+                            long long qx = (long long)x + i * step;
+                            if (qx < 0 || qx >= (long long)w)
+                                continue;
+                            size_t q = (size_t)qy * w + (size_t)qx;
+
+                            float dl = (luma[q] - lp) * color_scale;
+                            float dz = (aovs.depth[q] - zp) * depth_scale;
+                            const Spectrum &aq = aovs.albedo[q];
+                            float dr = aq.r - ap.r, dg = aq.g - ap.g, db = aq.b - ap.b;
+                            float d2a = (dr * dr + dg * dg + db * db) /
+                                        (settings.sigma_albedo * settings.sigma_albedo);
+                            float wn = 1.0f;
+                            if (zp > 0.0f && aovs.depth[q] > 0.0f)
+                                wn = std::pow(std::max(dot(np, aovs.normal[q]), 0.0f),
+                                              settings.normal_power);
+
+                            float wgt = kernel[i + 2] * kernel[j + 2] * wn *
+                                        std::exp(-dl * dl - std::abs(dz) - d2a);
+                            sum += a[q] * wgt;
+                            weights += wgt;
+                        }
+                    }
+                    b[p] = weights > 0.0f ? sum * (1.0f / weights) : a[p];
+                }
+            }
+        });
+        std::swap(a, b);
+    }
+
+    // Remodulate
+    for (size_t i = 0; i < w * h; i++) {
+        Spectrum c = a[i].spectrum();
+        const Spectrum &al = aovs.albedo[i];
+        out.at(i) = Spectrum(c.r * std::max(al.r, eps), c.g * std::max(al.g, eps),
+                             c.b * std::max(al.b, eps));
+    }
+}
+
+} // namespace PT
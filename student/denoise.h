@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../lib/spectrum.h"
+#include "../rays/bsdf.h"
+#include "../util/hdr_image.h"
+
+/* Denoising:
+
+    When debug_data.output_aovs is set, trace_pixel also records what each camera ray
+    hit first: the albedo of its material, its normal and its distance (AOVs,
+    "arbitrary output variables"). These are nearly noise-free after a few samples,
+    and tell the denoiser where the edges of the image are.
+
+    denoise is an edge-avoiding a-trous wavelet filter (Dammertz et al. 2010), i.e. a
+    cross-bilateral filter whose 5x5 footprint doubles on every pass. Radiance is
+    first divided by the albedo so texture detail is not blurred, filtered with
+    weights from the color, normal, depth and albedo differences between pixels, then
+    multiplied back. Each pass is split into tiles (or bands of rows) that the threads
+    take in turn, and pixels are accumulated with packed Spectrum4 arithmetic.
+*/
+
+namespace PT {
+
+// First-hit features of each pixel, in the same layout as the output image
+struct AOV_Buffers {
+    size_t w = 0, h = 0;
+    std::vector<Spectrum> albedo;
+    std::vector<Vec3> normal;
+    std::vector<float> depth; // distance to the first hit; 0 where rays escaped
+
+    void resize(size_t w, size_t h);
+};
+
+// The buffers trace_pixel writes to. aov_prepare resizes them to match the output
+// image, and may be called concurrently; only the first call of a render with new
+// dimensions locks, the others just compare them.
+AOV_Buffers &aov_buffers();
+void aov_prepare(size_t w, size_t h);
+
+// The color of a material under white light, used as its albedo AOV
+Spectrum bsdf_albedo(const BSDF &bsdf);
+
+struct Denoise_Settings {
+    int passes = 5;            // filter radius is 2^(passes + 1) pixels
+    float sigma_color = 1.0f;  // relative luminance difference, halved every pass
+    float normal_power = 64.0f;
+    float sigma_depth = 0.05f; // relative depth difference, per pixel of filter step
+    float sigma_albedo = 0.1f;
+    size_t threads = 0;        // 0 = one per hardware thread
+    size_t tile = 0;           // square tile size in pixels; 0 = one band of rows per thread
+};
+
+// Filters color using the given AOVs, which must have the same dimensions
+void denoise(const HDR_Image &color, const AOV_Buffers &aovs, HDR_Image &out,
+             const Denoise_Settings &settings = {});
+
+} // namespace PT
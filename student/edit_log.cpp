@@ -0,0 +1,966 @@
+#include "edit_log.h"
+#include "../lib/log.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <type_traits>
+
+namespace {
+
+using Index = Edit_Log::Index;
+using Clock = std::chrono::steady_clock;
+
+// Keeps the first state saved for each element, sorted by element
+template<typename S> void keep_first(std::vector<Index> &ids, std::vector<S> &states) {
+    std::vector<size_t> order(ids.size());
+    std::iota(order.begin(), order.end(), size_t(0));
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t a, size_t b) { return ids[a] < ids[b]; });
+    std::vector<Index> kept_ids;
+    std::vector<S> kept_states;
+    for (size_t i : order) {
+        if (!kept_ids.empty() && kept_ids.back() == ids[i])
+            continue;
+        kept_ids.push_back(ids[i]);
+        kept_states.push_back(states[i]);
+    }
+    ids = std::move(kept_ids);
+    states = std::move(kept_states);
+}
+
+template<typename T> size_t vector_bytes(const std::vector<T> &v) {
+    return v.capacity() * sizeof(T);
+}
+
+} // namespace
+
+Edit_Log::Edit_Log(Flat_Halfedge_Mesh &mesh) : mesh(mesh) {
+}
+
+Edit_Log::~Edit_Log() {
+    if (open)
+        mesh.log = nullptr;
+}
+
+void Edit_Log::begin() {
+
+    if (open)
+        return;
+    current = Step{};
+    capacities(current.capacity_before);
+    for (int k = 0; k < 3; k++)
+        current.free_low[k] = (Index)free_list(k).size();
+    mesh.log = this;
+    open = true;
+}
+
+void Edit_Log::commit() {
+
+    if (!open)
+        return;
+    mesh.log = nullptr;
+    open = false;
+
+    Step &s = current;
+    capacities(s.capacity_after);
+    keep_first(s.halfedges, s.halfedge_before);
+    keep_first(s.vertices, s.vertex_before);
+    keep_first(s.faces, s.face_before);
+
+    // New states of the saved elements, then of the appended slots
+    auto halfedge_state = [&](Index h) {
+        return Halfedge_State{mesh.next[h], mesh.vertex[h], mesh.face[h]};
+    };
+    for (Index h : s.halfedges)
+        s.halfedge_after.push_back(halfedge_state(h));
+    for (Index h = 2 * s.capacity_before[1]; h < 2 * s.capacity_after[1]; h++)
+        s.halfedge_after.push_back(halfedge_state(h));
+    for (Index v : s.vertices)
+        s.vertex_after.push_back(Vertex_State{mesh.vertex_halfedge[v], mesh.pos[v]});
+    for (Index v = s.capacity_before[0]; v < s.capacity_after[0]; v++)
+        s.vertex_after.push_back(Vertex_State{mesh.vertex_halfedge[v], mesh.pos[v]});
+    for (Index f : s.faces)
+        s.face_after.push_back(Face_State{mesh.face_halfedge[f], mesh.boundary[f]});
+    for (Index f = s.capacity_before[2]; f < s.capacity_after[2]; f++)
+        s.face_after.push_back(Face_State{mesh.face_halfedge[f], mesh.boundary[f]});
+
+    // Pops were saved last first
+    bool changed = !s.halfedge_after.empty() || !s.vertex_after.empty() || !s.face_after.empty();
+    for (int k = 0; k < 3; k++) {
+        std::reverse(s.free_before[k].begin(), s.free_before[k].end());
+        s.free_after[k].assign(free_list(k).begin() + s.free_low[k], free_list(k).end());
+        changed = changed || s.free_before[k] != s.free_after[k];
+    }
+    if (!changed)
+        return;
+
+    auto shrink = [](auto &...v) { (v.shrink_to_fit(), ...); };
+    shrink(s.halfedges, s.vertices, s.faces, s.halfedge_before, s.vertex_before, s.face_before,
+           s.halfedge_after, s.vertex_after, s.face_after);
+    steps.resize(done);
+    steps.push_back(std::move(s));
+    done++;
+}
+
+void Edit_Log::abort() {
+
+    if (!open)
+        return;
+    mesh.log = nullptr;
+    open = false;
+    keep_first(current.halfedges, current.halfedge_before);
+    keep_first(current.vertices, current.vertex_before);
+    keep_first(current.faces, current.face_before);
+    for (int k = 0; k < 3; k++)
+        std::reverse(current.free_before[k].begin(), current.free_before[k].end());
+    apply(current, false);
+}
+
+void Edit_Log::set_pos(Index v, Vec3 p) {
+    bool was_open = open;
+    begin();
+    save_vertex(v);
+    mesh.pos[v] = p;
+    if (!was_open)
+        commit();
+}
+
+bool Edit_Log::undo() {
+
+    commit();
+    if (!done)
+        return false;
+    const Step &s = steps[done - 1];
+
+    // The mesh must be as the step left it, at least in size
+    Index now[3];
+    capacities(now);
+    bool same = std::equal(now, now + 3, s.capacity_after);
+    for (int k = 0; k < 3; k++)
+        same = same && free_list(k).size() == s.free_low[k] + s.free_after[k].size();
+    if (!same) {
+        warn("Edit log: the mesh was changed outside the log; clearing its history");
+        clear();
+        return false;
+    }
+
+    apply(s, false);
+    done--;
+    return true;
+}
+
+bool Edit_Log::redo() {
+
+    commit();
+    if (done == steps.size())
+        return false;
+    const Step &s = steps[done];
+
+    Index now[3];
+    capacities(now);
+    bool same = std::equal(now, now + 3, s.capacity_before);
+    for (int k = 0; k < 3; k++)
+        same = same && free_list(k).size() == s.free_low[k] + s.free_before[k].size();
+    if (!same) {
+        warn("Edit log: the mesh was changed outside the log; clearing its history");
+        clear();
+        return false;
+    }
+
+    apply(s, true);
+    done++;
+    return true;
+}
+
+size_t Edit_Log::bytes() const {
+    size_t n = 0;
+    for (const Step &s : steps)
+        n += s.bytes();
+    return n;
+}
+
+void Edit_Log::clear() {
+    steps.clear();
+    done = 0;
+}
+
+size_t Edit_Log::Step::bytes() const {
+    size_t n = sizeof(Step) + vector_bytes(halfedges) + vector_bytes(vertices) +
+               vector_bytes(faces) + vector_bytes(halfedge_before) +
+               vector_bytes(halfedge_after) + vector_bytes(vertex_before) +
+               vector_bytes(vertex_after) + vector_bytes(face_before) + vector_bytes(face_after);
+    for (int k = 0; k < 3; k++)
+        n += vector_bytes(free_before[k]) + vector_bytes(free_after[k]);
+    return n;
+}
+
+void Edit_Log::save_halfedge(Index h) {
+    // Slots appended by the transaction have no old state to keep
+    if (h >= 2 * current.capacity_before[1])
+        return;
+    current.halfedges.push_back(h);
+    current.halfedge_before.push_back(
+        Halfedge_State{mesh.next[h], mesh.vertex[h], mesh.face[h]});
+}
+
+void Edit_Log::save_vertex(Index v) {
+    if (v >= current.capacity_before[0])
+        return;
+    current.vertices.push_back(v);
+    current.vertex_before.push_back(Vertex_State{mesh.vertex_halfedge[v], mesh.pos[v]});
+}
+
+void Edit_Log::save_face(Index f) {
+    if (f >= current.capacity_before[2])
+        return;
+    current.faces.push_back(f);
+    current.face_before.push_back(Face_State{mesh.face_halfedge[f], mesh.boundary[f]});
+}
+
+void Edit_Log::popped(const std::vector<Index> &list, Index i) {
+    for (int k = 0; k < 3; k++) {
+        if (&list != &free_list(k) || list.size() >= current.free_low[k])
+            continue;
+        current.free_low[k] = (Index)list.size();
+        current.free_before[k].push_back(i);
+    }
+}
+
+std::vector<Index> &Edit_Log::free_list(int k) {
+    return k == 0 ? mesh.free_vertices : k == 1 ? mesh.free_edges : mesh.free_faces;
+}
+
+void Edit_Log::capacities(Index out[3]) const {
+    out[0] = mesh.vertex_capacity();
+    out[1] = mesh.edge_capacity();
+    out[2] = mesh.face_capacity();
+}
+
+void Edit_Log::resize(const Index capacity[3]) {
+    mesh.vertex_halfedge.resize(capacity[0], Flat_Halfedge_Mesh::null);
+    mesh.pos.resize(capacity[0]);
+    mesh.next.resize(2 * (size_t)capacity[1], Flat_Halfedge_Mesh::null);
+    mesh.vertex.resize(2 * (size_t)capacity[1], Flat_Halfedge_Mesh::null);
+    mesh.face.resize(2 * (size_t)capacity[1], Flat_Halfedge_Mesh::null);
+    mesh.face_halfedge.resize(capacity[2], Flat_Halfedge_Mesh::null);
+    mesh.boundary.resize(capacity[2], 0);
+}
+
+void Edit_Log::apply(const Step &s, bool forward) {
+
+    auto set_halfedge = [&](Index h, const Halfedge_State &st) {
+        mesh.next[h] = st.next;
+        mesh.vertex[h] = st.vertex;
+        mesh.face[h] = st.face;
+    };
+    auto set_vertex = [&](Index v, const Vertex_State &st) {
+        mesh.vertex_halfedge[v] = st.halfedge;
+        mesh.pos[v] = st.pos;
+    };
+    auto set_face = [&](Index f, const Face_State &st) {
+        mesh.face_halfedge[f] = st.halfedge;
+        mesh.boundary[f] = st.boundary;
+    };
+
+    if (forward) {
+        resize(s.capacity_after);
+        size_t nh = s.halfedges.size(), nv = s.vertices.size(), nf = s.faces.size();
+        for (size_t i = 0; i < s.halfedge_after.size(); i++)
+            set_halfedge(i < nh ? s.halfedges[i] : 2 * s.capacity_before[1] + Index(i - nh),
+                         s.halfedge_after[i]);
+        for (size_t i = 0; i < s.vertex_after.size(); i++)
+            set_vertex(i < nv ? s.vertices[i] : s.capacity_before[0] + Index(i - nv),
+                       s.vertex_after[i]);
+        for (size_t i = 0; i < s.face_after.size(); i++)
+            set_face(i < nf ? s.faces[i] : s.capacity_before[2] + Index(i - nf),
+                     s.face_after[i]);
+    } else {
+        for (size_t i = 0; i < s.halfedges.size(); i++)
+            set_halfedge(s.halfedges[i], s.halfedge_before[i]);
+        for (size_t i = 0; i < s.vertices.size(); i++)
+            set_vertex(s.vertices[i], s.vertex_before[i]);
+        for (size_t i = 0; i < s.faces.size(); i++)
+            set_face(s.faces[i], s.face_before[i]);
+        resize(s.capacity_before);
+    }
+
+    for (int k = 0; k < 3; k++) {
+        const std::vector<Index> &tail = forward ? s.free_after[k] : s.free_before[k];
+        free_list(k).resize(s.free_low[k]);
+        free_list(k).insert(free_list(k).end(), tail.begin(), tail.end());
+    }
+}
+
+void edit_log_benchmark(const std::vector<std::vector<Index>> &triangles,
+                        const std::vector<Vec3> &verts) {
+
+    Flat_Halfedge_Mesh mesh;
+    std::string err = mesh.from_poly(triangles, verts);
+    if (!err.empty()) {
+        warn("Edit log benchmark: %s", err.c_str());
+        return;
+    }
+
+    // What snapshot undo would pay for every step
+    Clock::time_point start = Clock::now();
+    Flat_Halfedge_Mesh original = mesh;
+    double copy_ms = ms_since(start);
+    size_t copy_bytes = original.halfedge_capacity() * 3 * sizeof(Index) +
+                        original.vertex_capacity() * (sizeof(Index) + sizeof(Vec3)) +
+                        original.face_capacity() * (sizeof(Index) + 1);
+    double copy_mb = copy_bytes / (1024.0 * 1024.0);
+
+    // Batches of 100 operations on random edges, one transaction each
+    Edit_Log log(mesh);
+    std::mt19937 rng(1);
+    const size_t transactions = 1000, batch = 100;
+    size_t applied = 0;
+    start = Clock::now();
+    for (size_t t = 0; t < transactions; t++) {
+        log.begin();
+        for (size_t i = 0; i < batch; i++) {
+            Index e = rng() % mesh.edge_capacity();
+            if (!mesh.edge_alive(e))
+                continue;
+            std::optional<Index> done;
+            switch (rng() % 3) {
+            case 0: done = mesh.flip_edge(e); break;
+            case 1: done = mesh.split_edge(e); break;
+            default: done = mesh.collapse_edge(e); break;
+            }
+            applied += done.has_value();
+        }
+        log.commit();
+    }
+    double edit_ms = ms_since(start);
+    size_t steps = log.undo_steps();
+    double step_kb = log.bytes() / 1024.0 / std::max(steps, size_t(1));
+    Flat_Halfedge_Mesh edited = mesh;
+
+    auto same = [](const Flat_Halfedge_Mesh &a, const Flat_Halfedge_Mesh &b) {
+        return a.next == b.next && a.vertex == b.vertex && a.face == b.face &&
+               a.vertex_halfedge == b.vertex_halfedge && a.pos == b.pos &&
+               a.face_halfedge == b.face_halfedge && a.boundary == b.boundary &&
+               a.n_vertices() == b.n_vertices() && a.n_edges() == b.n_edges() &&
+               a.n_faces() == b.n_faces();
+    };
+    start = Clock::now();
+    while (log.undo())
+        ;
+    double undo_ms = ms_since(start);
+    bool ok = same(mesh, original);
+    start = Clock::now();
+    while (log.redo())
+        ;
+    double redo_ms = ms_since(start);
+    ok = ok && same(mesh, edited) && mesh.validate().empty();
+
+    info("Edit log: %zu operations in %zu transactions on %zu triangles in %.0f ms; "
+         "%.1f KB per step against %.1f MB and %.1f ms per mesh copy",
+         applied, steps, triangles.size(), edit_ms, step_kb, copy_mb, copy_ms);
+    info("Edit log: undid every step in %.1f ms and redid them in %.1f ms%s", undo_ms, redo_ms,
+         ok ? "" : " (MISMATCH)");
+}
+
+namespace {
+
+// The Halfedge_Edit_Logs with a transaction open, for the local operations to find
+std::vector<Halfedge_Edit_Log *> recording_logs;
+
+void stop_recording(Halfedge_Edit_Log *log) {
+    recording_logs.erase(std::remove(recording_logs.begin(), recording_logs.end(), log),
+                         recording_logs.end());
+}
+
+} // namespace
+
+template <typename Ref> Halfedge_Edit_Log::Index Halfedge_Edit_Log::Slots<Ref>::slot(Ref r) {
+    auto [it, added] = of.try_emplace(&*r, (Index)refs.size());
+    if (added) {
+        refs.push_back(r);
+        addresses.push_back(&*r);
+    }
+    return it->second;
+}
+
+template <typename Ref> void Halfedge_Edit_Log::Slots<Ref>::bind(Index s, Ref r) {
+    refs[s] = r;
+    addresses[s] = &*r;
+    of[&*r] = s;
+}
+
+template <typename Ref> void Halfedge_Edit_Log::Slots<Ref>::unbind(Index s) {
+    of.erase(addresses[s]);
+    addresses[s] = nullptr;
+}
+
+template <typename Ref> void Halfedge_Edit_Log::Slots<Ref>::clear() {
+    refs.clear();
+    addresses.clear();
+    of.clear();
+}
+
+template <typename Ref> size_t Halfedge_Edit_Log::Slots<Ref>::bytes() const {
+    // A hash node holds the pair, the next pointer and the cached hash
+    size_t node = sizeof(std::pair<const void *const, Index>) + 2 * sizeof(void *);
+    return vector_bytes(refs) + vector_bytes(addresses) + of.size() * node +
+           of.bucket_count() * sizeof(void *);
+}
+
+template <typename State> size_t Halfedge_Edit_Log::Changes<State>::bytes() const {
+    return vector_bytes(slots) + vector_bytes(before) + vector_bytes(after) +
+           vector_bytes(exists);
+}
+
+size_t Halfedge_Edit_Log::Step::bytes() const {
+    return sizeof(Step) + halfedges.bytes() + vertices.bytes() + edges.bytes() + faces.bytes();
+}
+
+Halfedge_Edit_Log::Halfedge_Edit_Log(Halfedge_Mesh &mesh) : mesh(mesh) {
+}
+
+Halfedge_Edit_Log::~Halfedge_Edit_Log() {
+    if (open)
+        stop_recording(this);
+}
+
+Halfedge_Edit_Log *Halfedge_Edit_Log::recording(const Halfedge_Mesh &mesh,
+                                                 const Mesh_Access &access) {
+    for (Halfedge_Edit_Log *log : recording_logs) {
+        if (&log->mesh == &mesh) {
+            log->access = access;
+            return log;
+        }
+    }
+    return nullptr;
+}
+
+void Halfedge_Edit_Log::begin() {
+
+    if (open)
+        return;
+    current = Step{};
+    recording_logs.push_back(this);
+    open = true;
+}
+
+void Halfedge_Edit_Log::commit() {
+
+    if (!open)
+        return;
+    stop_recording(this);
+    open = false;
+    bool changed = finish(current);
+    flush();
+    if (!changed) {
+        current = Step{};
+        return;
+    }
+    steps.resize(done);
+    steps.push_back(std::move(current));
+    current = Step{};
+    done++;
+}
+
+void Halfedge_Edit_Log::abort() {
+
+    if (!open)
+        return;
+    stop_recording(this);
+    open = false;
+    finish(current);
+    apply(current, false);
+    current = Step{};
+}
+
+void Halfedge_Edit_Log::set_pos(VertexRef v, Vec3 p) {
+    bool was_open = open;
+    begin();
+    save(v);
+    v->pos = p;
+    if (!was_open)
+        commit();
+}
+
+bool Halfedge_Edit_Log::undo() {
+
+    commit();
+    if (!done)
+        return false;
+    const Step &s = steps[done - 1];
+    if (!applicable(s, false)) {
+        warn("Edit log: the mesh was changed outside the log; clearing its history");
+        clear();
+        return false;
+    }
+    apply(s, false);
+    done--;
+    return true;
+}
+
+bool Halfedge_Edit_Log::redo() {
+
+    commit();
+    if (done == steps.size())
+        return false;
+    const Step &s = steps[done];
+    if (!applicable(s, true)) {
+        warn("Edit log: the mesh was changed outside the log; clearing its history");
+        clear();
+        return false;
+    }
+    apply(s, true);
+    done++;
+    return true;
+}
+
+size_t Halfedge_Edit_Log::bytes() const {
+    size_t n = halfedge_slots.bytes() + vertex_slots.bytes() + edge_slots.bytes() +
+               face_slots.bytes();
+    for (const Step &s : steps)
+        n += s.bytes();
+    return n;
+}
+
+void Halfedge_Edit_Log::clear() {
+    if (open)
+        stop_recording(this);
+    open = false;
+    current = Step{};
+    steps.clear();
+    done = 0;
+    pending.clear();
+    halfedge_slots.clear();
+    vertex_slots.clear();
+    edge_slots.clear();
+    face_slots.clear();
+}
+
+void Halfedge_Edit_Log::save_face(FaceRef f) {
+
+    if (!open)
+        return;
+    save(f);
+    HalfedgeRef h = f->halfedge();
+    do {
+        save(h);
+        save(h->twin());
+        save(h->vertex());
+        save(h->edge());
+        h = h->next();
+    } while (h != f->halfedge());
+}
+
+void Halfedge_Edit_Log::save_around(EdgeRef e) {
+
+    if (!open)
+        return;
+    // Every face around either end, walking the halfedges leaving it
+    for (HalfedgeRef start : {e->halfedge(), e->halfedge()->twin()}) {
+        HalfedgeRef h = start;
+        do {
+            save_face(h->face());
+            h = h->twin()->next();
+        } while (h != start);
+    }
+}
+
+// The first state saved for an element is the one from before the transaction;
+// elements created in it are reported before anything saves them
+template <typename Ref> void Halfedge_Edit_Log::save(Ref r) {
+    auto &c = changes(current, r);
+    Index s = slots(r).slot(r);
+    auto before = state(r);
+    c.slots.push_back(s);
+    c.before.push_back(before);
+    c.exists.push_back(1);
+}
+
+template <typename Ref> void Halfedge_Edit_Log::add_created(Ref r) {
+
+    if (!open)
+        return;
+    // Erased elements keep their addresses until they are freed, and the log unbinds
+    // those it is told about. A slot still bound to this address is stale: the mesh
+    // freed an element that was erased without the log, so it is dropped.
+    auto &table = slots(r);
+    auto old = table.of.find(&*r);
+    if (old != table.of.end())
+        table.unbind(old->second);
+    auto &c = changes(current, r);
+    c.slots.push_back(table.slot(r));
+    c.before.emplace_back();
+    c.exists.push_back(0);
+}
+
+template <typename Ref> void Halfedge_Edit_Log::add_erased(Ref r) {
+
+    // An element reported twice is erased once
+    if (!open || pending.count(&*r))
+        return;
+    // Once the erasure is flushed, the address may be reused by an element created later
+    save(r);
+    slots(r).unbind(slots(r).slot(r));
+    pending.insert(&*r);
+}
+
+template void Halfedge_Edit_Log::add_created(HalfedgeRef);
+template void Halfedge_Edit_Log::add_created(VertexRef);
+template void Halfedge_Edit_Log::add_created(EdgeRef);
+template void Halfedge_Edit_Log::add_created(FaceRef);
+template void Halfedge_Edit_Log::add_erased(HalfedgeRef);
+template void Halfedge_Edit_Log::add_erased(VertexRef);
+template void Halfedge_Edit_Log::add_erased(EdgeRef);
+template void Halfedge_Edit_Log::add_erased(FaceRef);
+
+Halfedge_Edit_Log::Halfedge_State Halfedge_Edit_Log::state(HalfedgeRef h) {
+    return Halfedge_State{halfedge_slots.slot(h->twin()), halfedge_slots.slot(h->next()),
+                          vertex_slots.slot(h->vertex()), edge_slots.slot(h->edge()),
+                          face_slots.slot(h->face())};
+}
+
+Halfedge_Edit_Log::Vertex_State Halfedge_Edit_Log::state(VertexRef v) {
+    return Vertex_State{halfedge_slots.slot(v->halfedge()), v->pos};
+}
+
+Halfedge_Edit_Log::Edge_State Halfedge_Edit_Log::state(EdgeRef e) {
+    return Edge_State{halfedge_slots.slot(e->halfedge())};
+}
+
+Halfedge_Edit_Log::Face_State Halfedge_Edit_Log::state(FaceRef f) {
+    return Face_State{halfedge_slots.slot(f->halfedge()), f->is_boundary()};
+}
+
+void Halfedge_Edit_Log::set(HalfedgeRef h, const Halfedge_State &s) {
+    h->twin() = halfedge_slots.refs[s.twin];
+    h->next() = halfedge_slots.refs[s.next];
+    h->vertex() = vertex_slots.refs[s.vertex];
+    h->edge() = edge_slots.refs[s.edge];
+    h->face() = face_slots.refs[s.face];
+}
+
+void Halfedge_Edit_Log::set(VertexRef v, const Vertex_State &s) {
+    v->halfedge() = halfedge_slots.refs[s.halfedge];
+    v->pos = s.pos;
+}
+
+void Halfedge_Edit_Log::set(EdgeRef e, const Edge_State &s) {
+    e->halfedge() = halfedge_slots.refs[s.halfedge];
+}
+
+void Halfedge_Edit_Log::set(FaceRef f, const Face_State &s) {
+    f->halfedge() = halfedge_slots.refs[s.halfedge];
+}
+
+Halfedge_Edit_Log::Slots<Halfedge_Edit_Log::HalfedgeRef> &
+Halfedge_Edit_Log::slots(HalfedgeRef) {
+    return halfedge_slots;
+}
+
+Halfedge_Edit_Log::Slots<Halfedge_Edit_Log::VertexRef> &Halfedge_Edit_Log::slots(VertexRef) {
+    return vertex_slots;
+}
+
+Halfedge_Edit_Log::Slots<Halfedge_Edit_Log::EdgeRef> &Halfedge_Edit_Log::slots(EdgeRef) {
+    return edge_slots;
+}
+
+Halfedge_Edit_Log::Slots<Halfedge_Edit_Log::FaceRef> &Halfedge_Edit_Log::slots(FaceRef) {
+    return face_slots;
+}
+
+Halfedge_Edit_Log::Changes<Halfedge_Edit_Log::Halfedge_State> &
+Halfedge_Edit_Log::changes(Step &s, HalfedgeRef) {
+    return s.halfedges;
+}
+
+Halfedge_Edit_Log::Changes<Halfedge_Edit_Log::Vertex_State> &
+Halfedge_Edit_Log::changes(Step &s, VertexRef) {
+    return s.vertices;
+}
+
+Halfedge_Edit_Log::Changes<Halfedge_Edit_Log::Edge_State> &
+Halfedge_Edit_Log::changes(Step &s, EdgeRef) {
+    return s.edges;
+}
+
+Halfedge_Edit_Log::Changes<Halfedge_Edit_Log::Face_State> &
+Halfedge_Edit_Log::changes(Step &s, FaceRef) {
+    return s.faces;
+}
+
+bool Halfedge_Edit_Log::finish(Step &s) {
+
+    bool changed = false;
+    auto finish_changes = [&](auto &c, auto &table) {
+        std::vector<size_t> order(c.slots.size());
+        std::iota(order.begin(), order.end(), size_t(0));
+        std::stable_sort(order.begin(), order.end(),
+                         [&](size_t a, size_t b) { return c.slots[a] < c.slots[b]; });
+
+        std::decay_t<decltype(c)> kept;
+        for (size_t n = 0; n < order.size(); n++) {
+            size_t i = order[n];
+            if (n > 0 && c.slots[order[n - 1]] == c.slots[i])
+                continue;
+            Index slot = c.slots[i];
+            uint8_t exists = c.exists[i];
+            std::decay_t<decltype(c.before[i])> after{};
+            if (table.bound(slot)) {
+                auto ref = table.refs[slot];
+                after = state(ref);
+                exists |= 2;
+            }
+            // Created and erased again, or left as it was
+            if (exists == 0 || (exists == 3 && after == c.before[i]))
+                continue;
+            kept.slots.push_back(slot);
+            kept.before.push_back(c.before[i]);
+            kept.after.push_back(after);
+            kept.exists.push_back(exists);
+        }
+        kept.slots.shrink_to_fit();
+        kept.before.shrink_to_fit();
+        kept.after.shrink_to_fit();
+        kept.exists.shrink_to_fit();
+        changed = changed || !kept.slots.empty();
+        c = std::move(kept);
+    };
+    finish_changes(s.halfedges, halfedge_slots);
+    finish_changes(s.vertices, vertex_slots);
+    finish_changes(s.edges, edge_slots);
+    finish_changes(s.faces, face_slots);
+    return changed;
+}
+
+bool Halfedge_Edit_Log::applicable(const Step &s, bool forward) const {
+
+    uint8_t from = forward ? 1 : 2, to = forward ? 2 : 1;
+
+    // What the step erases must be there and what it brings back must not, and erasing
+    // or bringing back elements takes the mesh's access from an operation
+    bool ok = true;
+    auto present = [&](const auto &c, const auto &table) {
+        for (size_t i = 0; i < c.slots.size(); i++) {
+            ok = ok && table.bound(c.slots[i]) == bool(c.exists[i] & from);
+            ok = ok && (c.exists[i] == 3 || access.do_erase);
+        }
+    };
+    present(s.halfedges, halfedge_slots);
+    present(s.vertices, vertex_slots);
+    present(s.edges, edge_slots);
+    present(s.faces, face_slots);
+    if (!ok)
+        return false;
+
+    // And the elements its states refer to must be there once it is applied
+    auto there = [&](const auto &c, const auto &table, Index slot) {
+        auto it = std::lower_bound(c.slots.begin(), c.slots.end(), slot);
+        if (it != c.slots.end() && *it == slot)
+            return bool(c.exists[it - c.slots.begin()] & to);
+        return slot < table.addresses.size() && table.bound(slot);
+    };
+    auto there_halfedge = [&](Index h) { return there(s.halfedges, halfedge_slots, h); };
+    for (size_t i = 0; i < s.halfedges.slots.size(); i++) {
+        if (!(s.halfedges.exists[i] & to))
+            continue;
+        const Halfedge_State &h = forward ? s.halfedges.after[i] : s.halfedges.before[i];
+        ok = ok && there_halfedge(h.twin) && there_halfedge(h.next) &&
+             there(s.vertices, vertex_slots, h.vertex) && there(s.edges, edge_slots, h.edge) &&
+             there(s.faces, face_slots, h.face);
+    }
+    for (size_t i = 0; i < s.vertices.slots.size(); i++)
+        if (s.vertices.exists[i] & to)
+            ok = ok && there_halfedge(forward ? s.vertices.after[i].halfedge
+                                              : s.vertices.before[i].halfedge);
+    for (size_t i = 0; i < s.edges.slots.size(); i++)
+        if (s.edges.exists[i] & to)
+            ok = ok && there_halfedge(forward ? s.edges.after[i].halfedge
+                                              : s.edges.before[i].halfedge);
+    for (size_t i = 0; i < s.faces.slots.size(); i++)
+        if (s.faces.exists[i] & to)
+            ok = ok && there_halfedge(forward ? s.faces.after[i].halfedge
+                                              : s.faces.before[i].halfedge);
+    return ok;
+}
+
+void Halfedge_Edit_Log::apply(const Step &s, bool forward) {
+
+    uint8_t from = forward ? 1 : 2, to = forward ? 2 : 1;
+    auto target = [&](const auto &c, size_t i) -> const auto & {
+        return forward ? c.after[i] : c.before[i];
+    };
+
+    // Erase what only exists on this side of the step
+    auto erase = [&](const auto &c, auto &table, auto erase_ref) {
+        for (size_t i = 0; i < c.slots.size(); i++) {
+            if (!(c.exists[i] & from) || (c.exists[i] & to))
+                continue;
+            auto ref = table.refs[c.slots[i]];
+            table.unbind(c.slots[i]);
+            erase_ref(mesh, ref);
+        }
+    };
+    erase(s.halfedges, halfedge_slots, access.erase_halfedge);
+    erase(s.vertices, vertex_slots, access.erase_vertex);
+    erase(s.edges, edge_slots, access.erase_edge);
+    erase(s.faces, face_slots, access.erase_face);
+
+    // Allocate what only exists on the other side
+    auto create = [&](const auto &c, auto &table, auto allocate) {
+        for (size_t i = 0; i < c.slots.size(); i++)
+            if (!(c.exists[i] & from) && (c.exists[i] & to))
+                table.bind(c.slots[i], allocate(i));
+    };
+    create(s.halfedges, halfedge_slots, [&](size_t) { return access.new_halfedge(mesh); });
+    create(s.vertices, vertex_slots, [&](size_t) { return access.new_vertex(mesh); });
+    create(s.edges, edge_slots, [&](size_t) { return access.new_edge(mesh); });
+    create(s.faces, face_slots,
+           [&](size_t i) { return access.new_face(mesh, target(s.faces, i).boundary); });
+
+    // Then link everything as it was on the other side
+    auto link = [&](const auto &c, auto &table) {
+        for (size_t i = 0; i < c.slots.size(); i++)
+            if (c.exists[i] & to)
+                set(table.refs[c.slots[i]], target(c, i));
+    };
+    link(s.halfedges, halfedge_slots);
+    link(s.vertices, vertex_slots);
+    link(s.edges, edge_slots);
+    link(s.faces, face_slots);
+    flush();
+}
+
+void Halfedge_Edit_Log::flush() {
+    if (access.do_erase)
+        access.do_erase(mesh);
+    pending.clear();
+}
+
+void halfedge_edit_log_check(const std::vector<std::vector<Halfedge_Mesh::Index>> &polygons,
+                             const std::vector<Vec3> &verts) {
+
+    Halfedge_Mesh mesh;
+    std::string err = mesh.from_poly(polygons, verts);
+    if (!err.empty()) {
+        warn("Halfedge edit log check: %s", err.c_str());
+        return;
+    }
+
+    // The faces as loops of position bits (a bevel may leave NaNs), each turned to its
+    // smallest rotation and sorted, so meshes compare equal whatever the order and ids
+    // of their elements
+    auto faces = [](Halfedge_Mesh &m) {
+        std::vector<std::vector<uint32_t>> out;
+        for (auto f = m.faces_begin(); f != m.faces_end(); f++) {
+            std::vector<uint32_t> loop;
+            auto h = f->halfedge();
+            do {
+                Vec3 p = h->vertex()->pos;
+                for (float x : {p.x, p.y, p.z}) {
+                    uint32_t bits;
+                    std::memcpy(&bits, &x, sizeof(bits));
+                    loop.push_back(bits);
+                }
+                h = h->next();
+            } while (h != f->halfedge());
+            std::vector<uint32_t> best = loop;
+            for (size_t r = 3; r < loop.size(); r += 3) {
+                std::rotate(loop.begin(), loop.begin() + 3, loop.end());
+                best = std::min(best, loop);
+            }
+            best.push_back(f->is_boundary());
+            out.push_back(std::move(best));
+        }
+        std::sort(out.begin(), out.end());
+        return out;
+    };
+    auto original = faces(mesh);
+
+    // What snapshot undo would pay for every step
+    Clock::time_point start = Clock::now();
+    Halfedge_Mesh copy;
+    mesh.copy_to(copy);
+    double copy_ms = ms_since(start);
+    size_t node = 2 * sizeof(void *);
+    size_t copy_bytes = mesh.n_halfedges() * (sizeof(Halfedge_Mesh::Halfedge) + node) +
+                        mesh.n_vertices() * (sizeof(Halfedge_Mesh::Vertex) + node) +
+                        mesh.n_edges() * (sizeof(Halfedge_Mesh::Edge) + node) +
+                        (mesh.n_faces() + mesh.n_boundaries()) *
+                            (sizeof(Halfedge_Mesh::Face) + node);
+
+    // Transactions of a few operations on random elements, validating the mesh after
+    // each like the editor does, and aborting the transaction if one breaks it
+    Halfedge_Edit_Log log(mesh);
+    std::mt19937 rng(1);
+    const size_t transactions = 200, batch = 5;
+    size_t applied = 0, aborted = 0;
+    for (size_t t = 0; t < transactions; t++) {
+        log.begin();
+        size_t done_in_batch = 0;
+        for (size_t i = 0; i < batch && log.recording(); i++) {
+            // The lists still hold the elements erased earlier in the transaction
+            Halfedge_Mesh::EdgeRef e;
+            Halfedge_Mesh::FaceRef f;
+            do
+                e = std::next(mesh.edges_begin(), rng() % mesh.n_edges());
+            while (!log.alive(e));
+            do
+                f = std::next(mesh.faces_begin(), rng() % mesh.n_faces());
+            while (!log.alive(f));
+            bool done = false;
+            switch (rng() % 5) {
+            case 0: done = mesh.flip_edge(e).has_value(); break;
+            case 1: done = mesh.split_edge(e).has_value(); break;
+            case 2: done = mesh.collapse_edge(e).has_value(); break;
+            case 3: done = mesh.erase_edge(e).has_value(); break;
+            default:
+                if (auto bevel = mesh.bevel_face(f); bevel && !(*bevel)->is_boundary()) {
+                    std::vector<Vec3> start_positions;
+                    auto h = (*bevel)->halfedge();
+                    do {
+                        start_positions.push_back(h->vertex()->pos);
+                        h = h->next();
+                    } while (h != (*bevel)->halfedge());
+                    mesh.bevel_face_positions(start_positions, *bevel, 0.1f, 0.05f);
+                    done = true;
+                }
+                break;
+            }
+            done_in_batch += done;
+            if (mesh.validate()) {
+                log.abort();
+                mesh.validate();
+                aborted++;
+            }
+        }
+        if (log.recording())
+            applied += done_in_batch;
+        log.commit();
+    }
+    size_t steps = log.undo_steps();
+    double step_kb = log.bytes() / 1024.0 / std::max(steps, size_t(1));
+    auto edited = faces(mesh);
+
+    start = Clock::now();
+    while (log.undo())
+        ;
+    double undo_ms = ms_since(start);
+    bool ok = !mesh.validate() && faces(mesh) == original;
+    start = Clock::now();
+    while (log.redo())
+        ;
+    double redo_ms = ms_since(start);
+    ok = ok && !mesh.validate() && faces(mesh) == edited;
+
+    info("Halfedge edit log: %zu operations in %zu transactions (%zu aborted) on %zu faces; "
+         "%.1f KB per step against %.1f MB and %.1f ms per mesh copy",
+         applied, steps, aborted, polygons.size(), step_kb, copy_bytes / (1024.0 * 1024.0),
+         copy_ms);
+    info("Halfedge edit log: undid every step in %.1f ms and redid them in %.1f ms%s", undo_ms,
+         redo_ms, ok ? "" : " (MISMATCH)");
+}
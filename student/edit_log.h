@@ -0,0 +1,341 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "../geometry/halfedge.h"
+#include "../lib/mathlib.h"
+#include "flat_halfedge.h"
+
+/* Edit logs:
+
+    Undoing an edit by keeping a copy of the whole mesh costs time and memory in
+    proportion to the mesh, however little the edit changed. An Edit_Log keeps the
+    change instead: between begin() and commit(), every local operation on its
+    Flat_Halfedge_Mesh (and every set_pos) reports the elements it is about to
+    write, and the log saves their attributes as they were:
+
+        halfedge h  next[h], vertex[h], face[h]
+        vertex v    vertex_halfedge[v], pos[v]
+        face f      face_halfedge[f], boundary[f]
+
+    commit() then reads the same elements again, along with every slot appended
+    to the arrays, and stores one step with both states. Free lists change only at
+    their ends, so a step keeps them from the lowest size they reached onward.
+    undo() writes the old states back and shrinks the arrays to their old sizes,
+    and redo() grows them and writes the new states, both in time and memory
+    proportional to the elements the step changed.
+
+    Any number of operations may go into one transaction, which becomes one step.
+    Committing a step drops the steps undone before it. Recording is not thread
+    safe: operations run on several threads (with deferred free lists) or
+    compact() must not happen inside a transaction, and once either has happened
+    between transactions the history no longer matches the mesh, which undo() and
+    redo() notice by the array sizes and answer by clearing it.
+
+    The editor's Halfedge_Mesh keeps its elements in lists and refers to them by
+    iterator, so a Halfedge_Edit_Log first gives every element it sees a slot
+    number, and saves the same attributes in terms of slots:
+
+        halfedge    twin, next, vertex, edge, face
+        vertex      halfedge, pos
+        edge        halfedge
+        face        halfedge, boundary
+
+    The local operations in meshedit.cpp (erase_edge, collapse_edge, flip_edge,
+    split_edge and bevel_face) report to the transaction open on their mesh: before
+    writing anything they save every element of the faces around the edge or face
+    they work on, and they report each element they create or erase. Undoing a step
+    erases the elements it created and allocates new ones in place of those it
+    erased, rebinding their slots, so elements brought back get new ids. A beveled
+    face's positions are part of its step as long as bevel_face_positions runs
+    before commit().
+
+    The log creates and erases elements with the mesh's own new_* and erase, which
+    only Halfedge_Mesh's members can call; the operations hand them to the log as a
+    Mesh_Access when they look up the transaction. Erasing only marks an element
+    until the mesh's do_erase(), so the elements erased in a transaction stay in the
+    mesh's lists until commit() (or abort()) frees them; until then alive() tells
+    them apart. undo() and redo() free the elements they erase before returning.
+
+    Changing the mesh by any other means invalidates the slots: call clear()
+    afterwards, which also drops an open transaction without undoing it. undo()
+    and redo() check that the elements a step erases, brings back and refers to
+    are present or absent as it expects, and clear the history if not.
+*/
+
+class Edit_Log {
+public:
+    using Index = Flat_Halfedge_Mesh::Index;
+
+    explicit Edit_Log(Flat_Halfedge_Mesh &mesh);
+    ~Edit_Log();
+    Edit_Log(const Edit_Log &) = delete;
+    Edit_Log &operator=(const Edit_Log &) = delete;
+
+    // Starts recording the mesh's local operations
+    void begin();
+    // Stores what changed since begin() as one step; a transaction that changed
+    // nothing stores none
+    void commit();
+    // Reverts everything since begin() and stores nothing
+    void abort();
+    bool recording() const {
+        return open;
+    }
+
+    // Moves a vertex, as one step of its own outside a transaction
+    void set_pos(Index v, Vec3 p);
+
+    // Reverts the last step, or repeats the last one undone; return false if there
+    // is none, or if the mesh was changed outside the log since
+    bool undo();
+    bool redo();
+
+    size_t undo_steps() const {
+        return done;
+    }
+    size_t redo_steps() const {
+        return steps.size() - done;
+    }
+    // Bytes held by the recorded steps
+    size_t bytes() const;
+    void clear();
+
+private:
+    friend class Flat_Halfedge_Mesh;
+
+    struct Halfedge_State {
+        Index next, vertex, face;
+    };
+    struct Vertex_State {
+        Index halfedge;
+        Vec3 pos;
+    };
+    struct Face_State {
+        Index halfedge;
+        uint8_t boundary;
+    };
+
+    // The elements one step changed and their states before and after it. The
+    // after arrays also cover the slots the step appended, [capacity_before,
+    // capacity_after) of each kind, following the listed elements.
+    struct Step {
+        std::vector<Index> halfedges, vertices, faces;
+        std::vector<Halfedge_State> halfedge_before, halfedge_after;
+        std::vector<Vertex_State> vertex_before, vertex_after;
+        std::vector<Face_State> face_before, face_after;
+
+        // Vertex, edge and face capacities
+        Index capacity_before[3] = {}, capacity_after[3] = {};
+        // Each free list (vertices, edges, faces) is the same below free_low
+        // before and after the step; above it, it holds free_before or free_after
+        Index free_low[3] = {};
+        std::vector<Index> free_before[3], free_after[3];
+
+        size_t bytes() const;
+    };
+
+    // Called by the mesh while a transaction is open
+    void save_halfedge(Index h);
+    void save_vertex(Index v);
+    void save_face(Index f);
+    void popped(const std::vector<Index> &list, Index i);
+
+    std::vector<Index> &free_list(int k); // vertices, edges, faces
+    void capacities(Index out[3]) const;
+    void resize(const Index capacity[3]);
+    void apply(const Step &step, bool forward);
+
+    Flat_Halfedge_Mesh &mesh;
+    std::vector<Step> steps;
+    size_t done = 0;
+    Step current;
+    bool open = false;
+};
+
+// Runs batches of random flips, splits and collapses on the given triangle mesh
+// as transactions, undoes and redoes all of them, checks the mesh comes back
+// exactly, and logs the timings and the memory per step against a mesh copy
+void edit_log_benchmark(const std::vector<std::vector<Flat_Halfedge_Mesh::Index>> &triangles,
+                        const std::vector<Vec3> &verts);
+
+class Halfedge_Edit_Log {
+public:
+    using Index = uint32_t;
+    using VertexRef = Halfedge_Mesh::VertexRef;
+    using EdgeRef = Halfedge_Mesh::EdgeRef;
+    using FaceRef = Halfedge_Mesh::FaceRef;
+    using HalfedgeRef = Halfedge_Mesh::HalfedgeRef;
+
+    explicit Halfedge_Edit_Log(Halfedge_Mesh &mesh);
+    ~Halfedge_Edit_Log();
+    Halfedge_Edit_Log(const Halfedge_Edit_Log &) = delete;
+    Halfedge_Edit_Log &operator=(const Halfedge_Edit_Log &) = delete;
+
+    // As for Edit_Log
+    void begin();
+    void commit();
+    void abort();
+    bool recording() const {
+        return open;
+    }
+    void set_pos(VertexRef v, Vec3 p);
+    bool undo();
+    bool redo();
+    size_t undo_steps() const {
+        return done;
+    }
+    size_t redo_steps() const {
+        return steps.size() - done;
+    }
+    // Bytes held by the recorded steps and the slot tables
+    size_t bytes() const;
+    void clear();
+
+    // The mesh's element allocation and erasure, for a log to undo and redo with
+    struct Mesh_Access {
+        HalfedgeRef (*new_halfedge)(Halfedge_Mesh &);
+        VertexRef (*new_vertex)(Halfedge_Mesh &);
+        EdgeRef (*new_edge)(Halfedge_Mesh &);
+        FaceRef (*new_face)(Halfedge_Mesh &, bool boundary);
+        void (*erase_halfedge)(Halfedge_Mesh &, HalfedgeRef);
+        void (*erase_vertex)(Halfedge_Mesh &, VertexRef);
+        void (*erase_edge)(Halfedge_Mesh &, EdgeRef);
+        void (*erase_face)(Halfedge_Mesh &, FaceRef);
+        void (*do_erase)(Halfedge_Mesh &);
+    };
+
+    // The transaction open on mesh, if any, for the local operations to report to
+    static Halfedge_Edit_Log *recording(const Halfedge_Mesh &mesh, const Mesh_Access &access);
+
+    // False for an element erased in the open transaction, which the mesh still lists
+    template <typename Ref> bool alive(Ref r) const {
+        return !pending.count(&*r);
+    }
+
+    // Save every element of the faces around both ends of e, or of face f
+    void save_around(EdgeRef e);
+    void save_face(FaceRef f);
+    // Report elements just created, or about to be erased
+    template <typename... Refs> void created(Refs... refs) {
+        (add_created(refs), ...);
+    }
+    template <typename... Refs> void erased(Refs... refs) {
+        (add_erased(refs), ...);
+    }
+
+private:
+    struct Halfedge_State {
+        Index twin, next, vertex, edge, face;
+        bool operator==(const Halfedge_State &o) const {
+            return twin == o.twin && next == o.next && vertex == o.vertex && edge == o.edge &&
+                   face == o.face;
+        }
+    };
+    struct Vertex_State {
+        Index halfedge;
+        Vec3 pos;
+        bool operator==(const Vertex_State &o) const {
+            return halfedge == o.halfedge && pos == o.pos;
+        }
+    };
+    struct Edge_State {
+        Index halfedge;
+        bool operator==(const Edge_State &o) const {
+            return halfedge == o.halfedge;
+        }
+    };
+    struct Face_State {
+        Index halfedge;
+        bool boundary;
+        bool operator==(const Face_State &o) const {
+            return halfedge == o.halfedge && boundary == o.boundary;
+        }
+    };
+
+    // The slots of one kind of element: the element each slot stands for, if it
+    // exists, and the slot of each element seen so far, by address
+    template <typename Ref> struct Slots {
+        std::vector<Ref> refs;
+        std::vector<const void *> addresses; // null while the slot has no element
+        std::unordered_map<const void *, Index> of;
+
+        Index slot(Ref r);
+        void bind(Index s, Ref r);
+        void unbind(Index s);
+        bool bound(Index s) const {
+            return addresses[s] != nullptr;
+        }
+        void clear();
+        size_t bytes() const;
+    };
+
+    // The elements of one kind a step changed, their states before and after it, and
+    // whether each existed before (bit 0) and after (bit 1)
+    template <typename State> struct Changes {
+        std::vector<Index> slots;
+        std::vector<State> before, after;
+        std::vector<uint8_t> exists;
+        size_t bytes() const;
+    };
+    struct Step {
+        Changes<Halfedge_State> halfedges;
+        Changes<Vertex_State> vertices;
+        Changes<Edge_State> edges;
+        Changes<Face_State> faces;
+        size_t bytes() const;
+    };
+
+    template <typename Ref> void save(Ref r);
+    template <typename Ref> void add_created(Ref r);
+    template <typename Ref> void add_erased(Ref r);
+
+    Halfedge_State state(HalfedgeRef h);
+    Vertex_State state(VertexRef v);
+    Edge_State state(EdgeRef e);
+    Face_State state(FaceRef f);
+    void set(HalfedgeRef h, const Halfedge_State &s);
+    void set(VertexRef v, const Vertex_State &s);
+    void set(EdgeRef e, const Edge_State &s);
+    void set(FaceRef f, const Face_State &s);
+
+    Slots<HalfedgeRef> &slots(HalfedgeRef);
+    Slots<VertexRef> &slots(VertexRef);
+    Slots<EdgeRef> &slots(EdgeRef);
+    Slots<FaceRef> &slots(FaceRef);
+    Changes<Halfedge_State> &changes(Step &s, HalfedgeRef);
+    Changes<Vertex_State> &changes(Step &s, VertexRef);
+    Changes<Edge_State> &changes(Step &s, EdgeRef);
+    Changes<Face_State> &changes(Step &s, FaceRef);
+
+    // Reads the new states of the saved elements and drops those left as they were;
+    // returns whether anything changed
+    bool finish(Step &s);
+    bool applicable(const Step &s, bool forward) const;
+    void apply(const Step &s, bool forward);
+    // Frees the elements erased so far
+    void flush();
+
+    Halfedge_Mesh &mesh;
+    Slots<HalfedgeRef> halfedge_slots;
+    Slots<VertexRef> vertex_slots;
+    Slots<EdgeRef> edge_slots;
+    Slots<FaceRef> face_slots;
+    std::vector<Step> steps;
+    size_t done = 0;
+    Step current;
+    bool open = false;
+    Mesh_Access access = {};
+    // Addresses of the elements erased and not yet freed
+    std::unordered_set<const void *> pending;
+};
+
+// Runs transactions of random flips, splits, collapses, edge erasures and face bevels
+// through the Halfedge_Mesh local operations, undoes and redoes all of them, checks
+// the mesh comes back to the same faces, and logs the memory per step against a copy
+void halfedge_edit_log_check(const std::vector<std::vector<Halfedge_Mesh::Index>> &polygons,
+                             const std::vector<Vec3> &verts);
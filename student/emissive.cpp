@@ -0,0 +1,261 @@
+
+#include "emissive.h"
+#include "../util/rand.h"
+#include "render_shared.h"
+#include "scene_probe.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace PT {
+
+void Emissive_Lights::clear() {
+    triangles.clear();
+    spheres.clear();
+    table.clear();
+    emissive.clear();
+    power = 0.0f;
+}
+
+Spectrum material_emission(const std::vector<BSDF> &materials, int material) {
+    if (material < 0 || (size_t)material >= materials.size())
+        return {};
+    const BSDF_Diffuse *diffuse = std::get_if<BSDF_Diffuse>(&materials[material].underlying);
+    return diffuse ? diffuse->radiance : Spectrum();
+}
+
+void Emissive_Lights::build(const std::vector<BSDF> &list) {
+
+    clear();
+    revision = scene_revision();
+    materials = materials_key(list);
+
+    // Only the geometry of objects with emissive materials is read
+    Object_Shape shape;
+    for (size_t i = 0; i < scene_objects(); i++) {
+        if (!probe_material(i, shape))
+            continue;
+        Spectrum radiance = material_emission(list, shape.material);
+        if (radiance.luma() <= 0.0f || !probe_geometry(i, shape))
+            continue;
+        if (shape.sphere) {
+            add_sphere(shape.center, shape.radius, radiance, shape.material);
+            continue;
+        }
+        const std::vector<Vec3> &v = shape.triangles;
+        for (size_t t = 0; t + 2 < v.size(); t += 3)
+            add_triangle(v[t], v[t + 1], v[t + 2], radiance, shape.material);
+    }
+    build_table();
+}
+
+void Emissive_Lights::add_triangle(Vec3 v0, Vec3 v1, Vec3 v2, Spectrum radiance, int material) {
+
+    Emissive_Triangle t;
+    t.v0 = v0;
+    t.e1 = v1 - v0;
+    t.e2 = v2 - v0;
+    Vec3 n = cross(t.e1, t.e2);
+    t.area = 0.5f * n.norm();
+    if (t.area <= 0.0f || radiance.luma() <= 0.0f)
+        return;
+    t.normal = n.unit();
+    t.radiance = radiance;
+    triangles.push_back(t);
+    add_material(material, radiance);
+}
+
+void Emissive_Lights::add_sphere(Vec3 center, float radius, Spectrum radiance, int material) {
+    if (radius <= 0.0f || radiance.luma() <= 0.0f)
+        return;
+    spheres.push_back({center, radius, radiance, material});
+    add_material(material, radiance);
+}
+
+void Emissive_Lights::add_material(int material, Spectrum radiance) {
+    for (const Emissive_Material &m : emissive)
+        if (m.material == material)
+            return;
+    emissive.push_back({material, radiance.luma()});
+}
+
+void Emissive_Lights::build_table() {
+
+    // Vose's alias method: split the scaled weights into those below and above the
+    // mean, and pair each small entry with a large one that covers the rest of its slot
+    size_t n = triangles.size() + spheres.size();
+    std::vector<float> weight;
+    weight.reserve(n);
+    for (const Emissive_Triangle &t : triangles)
+        weight.push_back(t.area * t.radiance.luma());
+    for (const Emissive_Sphere &s : spheres)
+        weight.push_back(4.0f * PI_F * s.radius * s.radius * s.radiance.luma());
+
+    table.assign(n, {1.0f, 0, 0.0f});
+    power = 0.0f;
+    for (float w : weight)
+        power += w;
+    if (!n || power <= 0.0f)
+        return;
+
+    std::vector<float> scaled(n);
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < n; i++) {
+        table[i].pmf = weight[i] / power;
+        scaled[i] = table[i].pmf * n;
+        (scaled[i] < 1.0f ? small : large).push_back((uint32_t)i);
+    }
+    while (!small.empty() && !large.empty()) {
+        uint32_t s = small.back(), l = large.back();
+        small.pop_back();
+        table[s].prob = scaled[s];
+        table[s].alias = l;
+        scaled[l] -= 1.0f - scaled[s];
+        if (scaled[l] < 1.0f) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Whatever remains is 1 up to rounding
+    for (uint32_t i : small)
+        table[i].prob = 1.0f;
+    for (uint32_t i : large)
+        table[i].prob = 1.0f;
+}
+
+bool Emissive_Lights::samples_material(int material) const {
+    for (const Emissive_Material &m : emissive)
+        if (m.material == material)
+            return power > 0.0f;
+    return false;
+}
+
+float Emissive_Lights::pdf(Vec3 from, Vec3 point, Vec3 normal, int material) const {
+
+    if (power <= 0.0f)
+        return 0.0f;
+    const Emissive_Material *m = nullptr;
+    for (const Emissive_Material &e : emissive)
+        if (e.material == material)
+            m = &e;
+    if (!m)
+        return 0.0f;
+
+    // A point on one of the material's spheres
+    size_t base = triangles.size();
+    for (size_t i = 0; i < spheres.size(); i++) {
+        const Emissive_Sphere &s = spheres[i];
+        if (s.material == material &&
+            std::abs((point - s.center).norm() - s.radius) <= 1e-3f * s.radius)
+            return sphere_pdf(s, table[base + i].pmf, from);
+    }
+
+    // Otherwise a triangle: its pmf is its area times the material's luminance over
+    // the total power, so the area density is the same on all of the material's triangles
+    Vec3 to = point - from;
+    float dist2 = to.norm_squared();
+    float cos_light = std::abs(dot(normal.unit(), to)) / std::sqrt(dist2);
+    if (!(cos_light > 0.0f))
+        return 0.0f;
+    return m->luma / power * dist2 / cos_light;
+}
+
+Light_Sample Emissive_Lights::sample(Vec3 from) const {
+
+    Light_Sample ret;
+    ret.pdf = 0.0f;
+    ret.distance = 0.0f;
+    if (table.empty())
+        return ret;
+
+    size_t n = table.size();
+    float u = RNG::unit() * n;
+    size_t slot = std::min((size_t)u, n - 1);
+    size_t i = (u - slot) < table[slot].prob ? slot : table[slot].alias;
+    if (i >= triangles.size())
+        return sample_sphere(spheres[i - triangles.size()], table[i].pmf, from);
+    const Emissive_Triangle &t = triangles[i];
+
+    // Uniform point on the triangle
+    float s = std::sqrt(RNG::unit());
+    float b1 = 1.0f - s, b2 = RNG::unit() * s;
+    Vec3 point = t.v0 + b1 * t.e1 + b2 * t.e2;
+
+    Vec3 to = point - from;
+    float dist2 = to.norm_squared();
+    if (dist2 <= 0.0f)
+        return ret;
+    ret.distance = std::sqrt(dist2);
+    ret.direction = to * (1.0f / ret.distance);
+
+    float cos_light = std::abs(dot(t.normal, ret.direction));
+    if (cos_light <= 0.0f)
+        return ret;
+
+    ret.radiance = t.radiance;
+    ret.pdf = table[i].pmf / t.area * dist2 / cos_light;
+    return ret;
+}
+
+Light_Sample Emissive_Lights::sample_sphere(const Emissive_Sphere &s, float pmf,
+                                            Vec3 from) const {
+
+    Light_Sample ret;
+    ret.pdf = 0.0f;
+    ret.distance = 0.0f;
+
+    Vec3 to_center = s.center - from;
+    float dist2 = to_center.norm_squared();
+    float r2 = s.radius * s.radius;
+    if (dist2 <= r2)
+        return ret; // inside the emitter; it can't be seen as a light from here
+
+    // Uniform direction in the cone subtended by the sphere
+    float dist = std::sqrt(dist2);
+    Vec3 w = to_center * (1.0f / dist);
+    float cos_max = std::sqrt(std::max(0.0f, 1.0f - r2 / dist2));
+    float cos_t = 1.0f - RNG::unit() * (1.0f - cos_max);
+    float sin_t = std::sqrt(std::max(0.0f, 1.0f - cos_t * cos_t));
+    float phi = 2.0f * PI_F * RNG::unit();
+
+    Vec3 u = std::abs(w.x) > 0.9f ? Vec3(0.0f, 1.0f, 0.0f) : Vec3(1.0f, 0.0f, 0.0f);
+    u = cross(u, w).unit();
+    Vec3 v = cross(w, u);
+    ret.direction = (u * std::cos(phi) + v * std::sin(phi)) * sin_t + w * cos_t;
+
+    // Distance to the near side of the sphere along the sampled direction
+    float b = dot(to_center, ret.direction);
+    float disc = std::max(0.0f, b * b - (dist2 - r2));
+    ret.distance = b - std::sqrt(disc);
+
+    ret.radiance = s.radiance;
+    ret.pdf = sphere_pdf(s, pmf, from);
+    return ret;
+}
+
+float Emissive_Lights::sphere_pdf(const Emissive_Sphere &s, float pmf, Vec3 from) const {
+    float dist2 = (s.center - from).norm_squared();
+    float r2 = s.radius * s.radius;
+    if (dist2 <= r2)
+        return 0.0f;
+    float cos_max = std::sqrt(std::max(0.0f, 1.0f - r2 / dist2));
+    return pmf / (2.0f * PI_F * std::max(1.0f - cos_max, 1e-7f));
+}
+
+static Render_Shared<Emissive_Lights> lights;
+
+const Emissive_Lights *emissive_lights(const std::vector<BSDF> &materials) {
+
+    static thread_local Render_Shared<Emissive_Lights>::Handle handle;
+    uint64_t revision = scene_revision(), key = materials_key(materials);
+    return lights.get(
+        handle,
+        [&](const Emissive_Lights &l) { return l.revision == revision && l.materials == key; },
+        [&]() {
+            auto built = std::make_shared<Emissive_Lights>();
+            built->build(materials);
+            return built;
+        });
+}
+
+} // namespace PT
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../lib/spectrum.h"
+#include "../rays/bsdf.h"
+#include "../rays/light.h"
+
+/* Emissive geometry as lights:
+
+    Surfaces with a BSDF_Diffuse material emit light, but the pathtracer only finds
+    them when a path happens to hit one. Emissive_Lights collects every emissive
+    triangle and sphere of the scene in world space so trace_ray can sample them like
+    the other area lights. They are read from the scene's objects (see scene_probe.h)
+    by the first pixel of a render, and again whenever the scene or its materials
+    change.
+
+    A triangle is chosen with probability proportional to its power (area times the
+    luminance of its radiance) using an alias table, so each pick is O(1) whatever
+    the number of triangles, and a point is chosen uniformly on it. The area density
+    is converted to solid angle at the shaded point:
+
+        pdf(dir) = P(triangle) / area * distance^2 / |cos(theta_light)|
+
+    Emissive spheres are sampled by solid angle instead: seen from outside, a sphere
+    covers a cone of directions, which is sampled uniformly, so no sample is wasted
+    on its far side and the density does not blow up at its silhouette:
+
+        pdf(dir) = P(sphere) / (2 pi (1 - cos(theta_max))),  sin(theta_max) = r / distance
+
+    Triangles radiate from both sides, like BSDF_Diffuse. A path can now reach the
+    same emission either way, through a light sample or through a BSDF bounce that
+    hits the emitter, so trace_ray weights both with the power heuristic (multiple
+    importance sampling); pdf() gives the light side's density for a bounce's hit.
+*/
+
+namespace PT {
+
+class Emissive_Lights {
+public:
+    void clear();
+
+    // Reads the emitters from the scene's objects and builds the alias table
+    void build(const std::vector<BSDF> &materials);
+
+    void add_triangle(Vec3 v0, Vec3 v1, Vec3 v2, Spectrum radiance, int material);
+    void add_sphere(Vec3 center, float radius, Spectrum radiance, int material);
+
+    // Builds the alias table; call after adding all emitters
+    void build_table();
+
+    bool empty() const {
+        return triangles.empty() && spheres.empty();
+    }
+    bool is_discrete() const {
+        return false;
+    }
+
+    // Samples a point on the emitters as seen from the point from
+    Light_Sample sample(Vec3 from) const;
+
+    // Density (per solid angle at from) with which sample(from) picks point, which
+    // lies on an emitter with this material and the given normal
+    float pdf(Vec3 from, Vec3 point, Vec3 normal, int material) const;
+
+    // Whether surfaces with this material are sampled as lights
+    bool samples_material(int material) const;
+
+    float total_power() const {
+        return power;
+    }
+
+    // The scene revision and materials the emitters were read from
+    uint64_t revision = 0;
+    uint64_t materials = 0;
+
+private:
+    struct Emissive_Triangle {
+        Vec3 v0, e1, e2; // vertex and edges
+        Vec3 normal;     // unit
+        float area;
+        Spectrum radiance;
+    };
+    struct Emissive_Sphere {
+        Vec3 center;
+        float radius;
+        Spectrum radiance;
+        int material;
+    };
+    // Alias table entries index triangles first, then spheres
+    struct Alias {
+        float prob;     // probability of keeping this entry
+        uint32_t alias; // entry used otherwise
+        float pmf;      // probability of choosing this emitter
+    };
+    // The materials of the emitters, with the luminance of their radiance
+    struct Emissive_Material {
+        int material;
+        float luma;
+    };
+
+    Light_Sample sample_sphere(const Emissive_Sphere &s, float pmf, Vec3 from) const;
+    float sphere_pdf(const Emissive_Sphere &s, float pmf, Vec3 from) const;
+    void add_material(int material, Spectrum radiance);
+
+    std::vector<Emissive_Triangle> triangles;
+    std::vector<Emissive_Sphere> spheres;
+    std::vector<Alias> table;
+    std::vector<Emissive_Material> emissive;
+    float power = 0.0f;
+};
+
+// The radiance emitted by surfaces with this material, zero if they don't emit
+Spectrum material_emission(const std::vector<BSDF> &materials, int material);
+
+// The emitters of the scene being rendered, rebuilt when the scene or the materials
+// change; valid until the calling thread's next call
+const Emissive_Lights *emissive_lights(const std::vector<BSDF> &materials);
+
+} // namespace PT
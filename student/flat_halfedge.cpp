@@ -0,0 +1,755 @@
+
+#include "flat_halfedge.h"
+#include "edit_log.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+Flat_Halfedge_Mesh::Flat_Halfedge_Mesh(const Halfedge_Mesh &mesh) {
+
+    std::unordered_map<const Halfedge_Mesh::Vertex *, Index> vertex_index;
+    std::vector<Vec3> verts;
+    vertex_index.reserve(mesh.n_vertices());
+    verts.reserve(mesh.n_vertices());
+    for (auto v = mesh.vertices_begin(); v != mesh.vertices_end(); v++) {
+        vertex_index[&*v] = (Index)verts.size();
+        verts.push_back(v->pos);
+    }
+
+    std::vector<std::vector<Index>> polygons;
+    polygons.reserve(mesh.n_faces());
+    for (auto f = mesh.faces_begin(); f != mesh.faces_end(); f++) {
+        if (f->is_boundary())
+            continue;
+        std::vector<Index> poly;
+        auto h = f->halfedge();
+        do {
+            poly.push_back(vertex_index[&*h->vertex()]);
+            h = h->next();
+        } while (h != f->halfedge());
+        polygons.push_back(std::move(poly));
+    }
+
+    from_poly(polygons, verts);
+}
+
+void Flat_Halfedge_Mesh::clear() {
+    next.clear();
+    vertex.clear();
+    face.clear();
+    vertex_halfedge.clear();
+    pos.clear();
+    face_halfedge.clear();
+    boundary.clear();
+    free_vertices.clear();
+    free_edges.clear();
+    free_faces.clear();
+}
+
+std::string Flat_Halfedge_Mesh::from_poly(const std::vector<std::vector<Index>> &polygons,
+                                          const std::vector<Vec3> &verts) {
+
+    clear();
+    auto fail = [this](std::string message) {
+        clear();
+        return message;
+    };
+    for (Vec3 p : verts)
+        new_vertex(p);
+
+    // Flatten the polygons into sides running from side_from to side_to
+    size_t n_sides = 0;
+    for (const auto &poly : polygons)
+        n_sides += poly.size();
+    std::vector<Index> side_from, side_to;
+    side_from.reserve(n_sides);
+    side_to.reserve(n_sides);
+    for (size_t p = 0; p < polygons.size(); p++) {
+        const auto &poly = polygons[p];
+        size_t n = poly.size();
+        if (n < 3)
+            return fail("Polygon " + std::to_string(p) + " has fewer than three vertices.");
+        for (size_t i = 0; i < n; i++) {
+            Index a = poly[i], b = poly[(i + 1) % n];
+            if (a >= verts.size() || b >= verts.size())
+                return fail("Polygon " + std::to_string(p) + " references a missing vertex.");
+            if (a == b)
+                return fail("Polygon " + std::to_string(p) + " repeats a vertex.");
+            side_from.push_back(a);
+            side_to.push_back(b);
+        }
+    }
+
+    // Bucket the sides by the vertex they leave (a counting sort), so the twin of a
+    // side from a to b is found by scanning the few sides leaving b
+    Index nv = vertex_capacity();
+    std::vector<Index> bucket_start(nv + 1, 0), bucket(n_sides);
+    for (Index a : side_from)
+        bucket_start[a + 1]++;
+    for (Index v = 0; v < nv; v++)
+        bucket_start[v + 1] += bucket_start[v];
+    {
+        std::vector<Index> cursor(bucket_start.begin(), bucket_start.end() - 1);
+        for (size_t s = 0; s < n_sides; s++)
+            bucket[cursor[side_from[s]]++] = (Index)s;
+    }
+    auto sides_between = [&](Index a, Index b, Index &found) {
+        unsigned int count = 0;
+        for (Index k = bucket_start[a]; k < bucket_start[a + 1]; k++) {
+            if (side_to[bucket[k]] == b) {
+                found = bucket[k];
+                count++;
+            }
+        }
+        return count;
+    };
+
+    // Pair each side with its twin; both share a new edge, in order of first use
+    std::vector<Index> side_halfedge(n_sides, null);
+    next.reserve(n_sides + n_sides / 4);
+    vertex.reserve(n_sides + n_sides / 4);
+    face.reserve(n_sides + n_sides / 4);
+    for (size_t s = 0; s < n_sides; s++) {
+        if (side_halfedge[s] != null)
+            continue;
+        Index a = side_from[s], b = side_to[s], same = null, opposite = null;
+        if (sides_between(a, b, same) > 1 || sides_between(b, a, opposite) > 1)
+            return fail("Edge (" + std::to_string(a) + ", " + std::to_string(b) +
+                        ") is used twice in the same direction; the mesh is "
+                        "non-manifold or inconsistently oriented.");
+        Index e = new_edge();
+        side_halfedge[s] = 2 * e;
+        if (opposite != null)
+            side_halfedge[opposite] = 2 * e + 1;
+    }
+
+    size_t side = 0;
+    for (size_t p = 0; p < polygons.size(); p++) {
+        Index f = new_face(false);
+        Index first = side_halfedge[side], last = null;
+        for (size_t i = 0; i < polygons[p].size(); i++, side++) {
+            Index h = side_halfedge[side];
+            vertex[h] = side_from[side];
+            face[h] = f;
+            vertex_halfedge[side_from[side]] = h;
+            if (last != null)
+                next[last] = h;
+            last = h;
+        }
+        next[last] = first;
+        face_halfedge[f] = first;
+    }
+
+    for (Index v = 0; v < vertex_capacity(); v++)
+        if (vertex_halfedge[v] == null)
+            return fail("Vertex " + std::to_string(v) + " is not used by any polygon.");
+
+    // Halfedges that no polygon claimed lie on the boundary: h = twin(t) runs against
+    // t, so it starts where t ends. Each boundary vertex must start exactly one.
+    std::vector<Index> boundary_out(vertex_capacity(), null);
+    for (Index h = 0; h < halfedge_capacity(); h++) {
+        if (vertex[h] != null)
+            continue;
+        Index v = vertex[next[twin(h)]];
+        if (boundary_out[v] != null)
+            return fail("Vertex " + std::to_string(v) + " is non-manifold.");
+        vertex[h] = v;
+        boundary_out[v] = h;
+    }
+    for (Index h = 0; h < halfedge_capacity(); h++)
+        if (face[h] == null)
+            next[h] = boundary_out[vertex[twin(h)]];
+
+    for (Index h = 0; h < halfedge_capacity(); h++) {
+        if (face[h] != null)
+            continue;
+        Index f = new_face(true);
+        face_halfedge[f] = h;
+        Index g = h;
+        do {
+            face[g] = f;
+            g = next[g];
+        } while (g != h);
+    }
+
+    // A vertex whose faces form more than one fan is non-manifold: walking its ring
+    // only reaches one of them
+    std::vector<Index> outgoing(vertex_capacity(), 0);
+    for (Index h = 0; h < halfedge_capacity(); h++)
+        outgoing[vertex[h]]++;
+    for (Index v = 0; v < vertex_capacity(); v++)
+        if (vertex_degree(v) != outgoing[v])
+            return fail("Vertex " + std::to_string(v) + " is non-manifold.");
+
+    return {};
+}
+
+void Flat_Halfedge_Mesh::to_poly(std::vector<std::vector<Index>> &polygons,
+                                 std::vector<Vec3> &verts) const {
+
+    std::vector<Index> remap(vertex_capacity(), null);
+    verts.clear();
+    verts.reserve(n_vertices());
+    for (Index v = 0; v < vertex_capacity(); v++) {
+        if (!vertex_alive(v))
+            continue;
+        remap[v] = (Index)verts.size();
+        verts.push_back(pos[v]);
+    }
+
+    polygons.clear();
+    polygons.reserve(n_faces());
+    for (Index f = 0; f < face_capacity(); f++) {
+        if (!face_alive(f) || boundary[f])
+            continue;
+        std::vector<Index> poly;
+        for_each_halfedge(f, [&](Index h) { poly.push_back(remap[vertex[h]]); });
+        polygons.push_back(std::move(poly));
+    }
+}
+
+std::string Flat_Halfedge_Mesh::to_halfedge_mesh(Halfedge_Mesh &mesh) const {
+    std::vector<std::vector<Index>> polygons;
+    std::vector<Vec3> verts;
+    to_poly(polygons, verts);
+    return mesh.from_poly(polygons, verts);
+}
+
+Flat_Halfedge_Mesh::Index Flat_Halfedge_Mesh::prev(Index h) const {
+    Index p = h;
+    while (next[p] != h)
+        p = next[p];
+    return p;
+}
+
+unsigned int Flat_Halfedge_Mesh::vertex_degree(Index v) const {
+    unsigned int d = 0;
+    for_each_outgoing(v, [&](Index) { d++; });
+    return d;
+}
+
+unsigned int Flat_Halfedge_Mesh::face_degree(Index f) const {
+    unsigned int d = 0;
+    for_each_halfedge(f, [&](Index) { d++; });
+    return d;
+}
+
+bool Flat_Halfedge_Mesh::vertex_on_boundary(Index v) const {
+    bool on = false;
+    for_each_outgoing(v, [&](Index h) { on = on || boundary[face[h]]; });
+    return on;
+}
+
+bool Flat_Halfedge_Mesh::edge_on_boundary(Index e) const {
+    return boundary[face[2 * e]] || boundary[face[2 * e + 1]];
+}
+
+Vec3 Flat_Halfedge_Mesh::vertex_neighborhood_center(Index v) const {
+    Vec3 c;
+    unsigned int d = 0;
+    for_each_outgoing(v, [&](Index h) {
+        c += pos[vertex[twin(h)]];
+        d++;
+    });
+    return c / (float)d;
+}
+
+Vec3 Flat_Halfedge_Mesh::edge_center(Index e) const {
+    return 0.5f * (pos[vertex[2 * e]] + pos[vertex[2 * e + 1]]);
+}
+
+float Flat_Halfedge_Mesh::edge_length(Index e) const {
+    return (pos[vertex[2 * e]] - pos[vertex[2 * e + 1]]).norm();
+}
+
+Vec3 Flat_Halfedge_Mesh::face_center(Index f) const {
+    Vec3 c;
+    unsigned int d = 0;
+    for_each_halfedge(f, [&](Index h) {
+        c += pos[vertex[h]];
+        d++;
+    });
+    return c / (float)d;
+}
+
+Vec3 Flat_Halfedge_Mesh::face_normal(Index f) const {
+    Vec3 n;
+    for_each_halfedge(f, [&](Index h) { n += cross(pos[vertex[h]], pos[vertex[next[h]]]); });
+    return n.unit();
+}
+
+void Flat_Halfedge_Mesh::log_halfedges(std::initializer_list<Index> hs) {
+    for (Index h : hs)
+        log->save_halfedge(h);
+}
+
+void Flat_Halfedge_Mesh::log_vertices(std::initializer_list<Index> vs) {
+    for (Index v : vs)
+        log->save_vertex(v);
+}
+
+void Flat_Halfedge_Mesh::log_faces(std::initializer_list<Index> fs) {
+    for (Index f : fs)
+        log->save_face(f);
+}
+
+Flat_Halfedge_Mesh::Index Flat_Halfedge_Mesh::pop_free(std::vector<Index> &list) {
+    Index i = list.back();
+    list.pop_back();
+    if (log)
+        log->popped(list, i);
+    return i;
+}
+
+Flat_Halfedge_Mesh::Index Flat_Halfedge_Mesh::new_vertex(Vec3 p) {
+    Index v;
+    if (!free_vertices.empty()) {
+        v = pop_free(free_vertices);
+        record_vertices({v});
+        pos[v] = p;
+    } else {
+        v = (Index)vertex_halfedge.size();
+        vertex_halfedge.push_back(null);
+        pos.push_back(p);
+    }
+    return v;
+}
+
+Flat_Halfedge_Mesh::Index Flat_Halfedge_Mesh::new_edge() {
+    if (!free_edges.empty())
+        return pop_free(free_edges);
+    Index e = (Index)(next.size() / 2);
+    next.insert(next.end(), 2, null);
+    vertex.insert(vertex.end(), 2, null);
+    face.insert(face.end(), 2, null);
+    return e;
+}
+
+Flat_Halfedge_Mesh::Index Flat_Halfedge_Mesh::new_face(bool is_boundary) {
+    Index f;
+    if (!free_faces.empty()) {
+        f = pop_free(free_faces);
+        record_faces({f});
+        boundary[f] = is_boundary;
+    } else {
+        f = (Index)face_halfedge.size();
+        face_halfedge.push_back(null);
+        boundary.push_back(is_boundary);
+    }
+    return f;
+}
+
+void Flat_Halfedge_Mesh::erase_vertex_slot(Index v) {
+    record_vertices({v});
+    vertex_halfedge[v] = null;
+    if (!deferred_free)
+        free_vertices.push_back(v);
+}
+
+void Flat_Halfedge_Mesh::erase_edge_slot(Index e) {
+    record_halfedges({2 * e, 2 * e + 1});
+    for (Index h = 2 * e; h < 2 * e + 2; h++)
+        next[h] = vertex[h] = face[h] = null;
+    if (!deferred_free)
+        free_edges.push_back(e);
+}
+
+void Flat_Halfedge_Mesh::erase_face_slot(Index f) {
+    record_faces({f});
+    face_halfedge[f] = null;
+    if (!deferred_free)
+        free_faces.push_back(f);
+}
+
+void Flat_Halfedge_Mesh::connect(Index ha, Index hb, Index e, Index g) {
+
+    Index f = face[ha];
+    Index pa = prev(ha), pb = prev(hb);
+    Index n0 = 2 * e, n1 = 2 * e + 1; // n0 runs from hb's start to ha's, n1 back
+    record_halfedges({n0, n1, pa, pb});
+    record_faces({f, g});
+
+    vertex[n0] = vertex[hb];
+    vertex[n1] = vertex[ha];
+    next[pb] = n0;
+    next[n0] = ha;
+    next[pa] = n1;
+    next[n1] = hb;
+    face[n0] = f;
+    face_halfedge[f] = ha;
+
+    boundary[g] = boundary[f];
+    face_halfedge[g] = hb;
+    Index h = hb;
+    do {
+        record_halfedges({h});
+        face[h] = g;
+        h = next[h];
+    } while (h != hb);
+}
+
+void Flat_Halfedge_Mesh::remove_digon(Index h) {
+
+    // The face is x, y with twins tx, ty. x and ty run the same way, so x takes ty's
+    // place in its face and y's edge goes away.
+    Index x = h, y = next[h];
+    Index tx = twin(x), ty = twin(y);
+    Index f = face[x], c = vertex[y];
+
+    Index p = prev(ty);
+    record_halfedges({p, x});
+    record_faces({face[ty]});
+    record_vertices({vertex[ty], c});
+    next[p] = x;
+    next[x] = next[ty];
+    face[x] = face[ty];
+    if (face_halfedge[face[ty]] == ty)
+        face_halfedge[face[ty]] = x;
+    if (vertex_halfedge[vertex[ty]] == ty)
+        vertex_halfedge[vertex[ty]] = x;
+    if (vertex_halfedge[c] == y)
+        vertex_halfedge[c] = tx;
+
+    erase_face_slot(f);
+    erase_edge_slot(edge(y));
+}
+
+std::optional<Flat_Halfedge_Mesh::Index> Flat_Halfedge_Mesh::erase_edge(Index e) {
+
+    if (e >= edge_capacity() || !edge_alive(e))
+        return std::nullopt;
+
+    Index h0 = 2 * e, h1 = 2 * e + 1;
+    Index v0 = vertex[h0], v1 = vertex[h1];
+    Index f0 = face[h0], f1 = face[h1];
+    if (f0 == f1 || boundary[f0] || boundary[f1])
+        return std::nullopt;
+    // An endpoint left with a single edge would dangle
+    if (vertex_degree(v0) <= 2 || vertex_degree(v1) <= 2)
+        return std::nullopt;
+
+    Index pa = prev(h0), pb = prev(h1);
+    Index a = next[h0], b = next[h1];
+    record_halfedges({pa, pb});
+    record_vertices({v0, v1});
+    record_faces({f0});
+    for (Index h = b; h != h1; h = next[h]) {
+        record_halfedges({h});
+        face[h] = f0;
+    }
+    next[pa] = b;
+    next[pb] = a;
+    if (vertex_halfedge[v0] == h0)
+        vertex_halfedge[v0] = b;
+    if (vertex_halfedge[v1] == h1)
+        vertex_halfedge[v1] = a;
+    face_halfedge[f0] = a;
+
+    erase_face_slot(f1);
+    erase_edge_slot(e);
+    return f0;
+}
+
+std::optional<Flat_Halfedge_Mesh::Index> Flat_Halfedge_Mesh::collapse_edge(Index e) {
+
+    if (e >= edge_capacity() || !edge_alive(e))
+        return std::nullopt;
+
+    Index h0 = 2 * e, h1 = 2 * e + 1;
+    Index v0 = vertex[h0], v1 = vertex[h1];
+    Index f0 = face[h0], f1 = face[h1];
+    if (f0 == f1)
+        return std::nullopt;
+
+    // Triangles on either side shrink to two-sided faces and are removed
+    bool d0 = face_degree(f0) == 3, d1 = face_degree(f1) == 3;
+    if ((d0 && boundary[f0]) || (d1 && boundary[f1]))
+        return std::nullopt;
+    Index c = d0 ? vertex[prev(h0)] : null;
+    Index d = d1 ? vertex[prev(h1)] : null;
+    if (c != null && c == d)
+        return std::nullopt; // both triangles also share the edges to c
+
+    // Link condition: the only vertices adjacent to both endpoints may be the
+    // opposite corners of those triangles, or the collapse pinches the surface. The
+    // rings are walked against each other rather than copied, so the check allocates
+    // nothing (the degrees are small) and stays safe to run on several threads.
+    bool pinch = false;
+    for_each_outgoing(v1, [&](Index h) {
+        Index w = vertex[twin(h)];
+        if (pinch || w == c || w == d)
+            return;
+        for_each_outgoing(v0, [&](Index g) { pinch = pinch || vertex[twin(g)] == w; });
+    });
+    if (pinch)
+        return std::nullopt;
+    if (!edge_on_boundary(e) && vertex_on_boundary(v0) && vertex_on_boundary(v1))
+        return std::nullopt;
+    // The opposite corners lose an edge; don't leave them with fewer than three
+    for (Index w : {c, d})
+        if (w != null && vertex_degree(w) <= (vertex_on_boundary(w) ? 2u : 3u))
+            return std::nullopt;
+
+    Vec3 mid = edge_center(e);
+    Index pa = prev(h0), pb = prev(h1);
+    Index a = next[h0], b = next[h1];
+
+    record_halfedges({pa, pb});
+    record_vertices({v0});
+    record_faces({f0, f1});
+    for_each_outgoing(v1, [&](Index h) {
+        record_halfedges({h});
+        vertex[h] = v0;
+    });
+    next[pa] = a;
+    next[pb] = b;
+    if (face_halfedge[f0] == h0)
+        face_halfedge[f0] = a;
+    if (face_halfedge[f1] == h1)
+        face_halfedge[f1] = b;
+    vertex_halfedge[v0] = a;
+    pos[v0] = mid;
+
+    erase_vertex_slot(v1);
+    erase_edge_slot(e);
+    if (d0)
+        remove_digon(a);
+    if (d1)
+        remove_digon(b);
+    return v0;
+}
+
+std::optional<Flat_Halfedge_Mesh::Index> Flat_Halfedge_Mesh::flip_edge(Index e) {
+
+    if (e >= edge_capacity() || !edge_alive(e) || edge_on_boundary(e))
+        return std::nullopt;
+
+    Index h0 = 2 * e, h1 = 2 * e + 1;
+    Index v0 = vertex[h0], v1 = vertex[h1];
+    Index f0 = face[h0], f1 = face[h1];
+    if (f0 == f1 || vertex_degree(v0) <= 2 || vertex_degree(v1) <= 2)
+        return std::nullopt;
+
+    // Rotate the edge counterclockwise: afterwards it runs between the ends of the
+    // halfedges that followed it, a and b
+    Index a = next[h0], b = next[h1];
+    Index pa = prev(h0), pb = prev(h1);
+    Index an = next[a], bn = next[b];
+    if (vertex[an] == vertex[bn])
+        return std::nullopt;
+    // Nor if they are already connected, which would double the edge
+    bool adjacent = false;
+    for_each_outgoing(vertex[bn],
+                      [&](Index h) { adjacent = adjacent || vertex[twin(h)] == vertex[an]; });
+    if (adjacent)
+        return std::nullopt;
+
+    record_vertices({v0, v1});
+    record_halfedges({h0, pa, b, h1, pb, a});
+    record_faces({f0, f1});
+    if (vertex_halfedge[v0] == h0)
+        vertex_halfedge[v0] = b;
+    if (vertex_halfedge[v1] == h1)
+        vertex_halfedge[v1] = a;
+
+    next[h0] = an;
+    next[pa] = b;
+    next[b] = h0;
+    next[h1] = bn;
+    next[pb] = a;
+    next[a] = h1;
+    vertex[h0] = vertex[bn];
+    vertex[h1] = vertex[an];
+    face[b] = f0;
+    face[a] = f1;
+    face_halfedge[f0] = h0;
+    face_halfedge[f1] = h1;
+    return e;
+}
+
+std::optional<Flat_Halfedge_Mesh::Index> Flat_Halfedge_Mesh::split_edge(Index e) {
+
+    if (e >= edge_capacity() || !edge_alive(e))
+        return std::nullopt;
+
+    Index edges[3] = {new_edge(), null, null}, faces[2] = {null, null};
+    for (Index i = 0; i < 2; i++) {
+        Index f = face[2 * e + i];
+        if (!boundary[f] && face_degree(f) == 3) {
+            edges[1 + i] = new_edge();
+            faces[i] = new_face(false);
+        }
+    }
+    return split_edge(e, new_vertex(Vec3{}), edges, faces);
+}
+
+std::optional<Flat_Halfedge_Mesh::Index>
+Flat_Halfedge_Mesh::split_edge(Index e, Index m, const Index edges[3], const Index faces[2]) {
+
+    if (e >= edge_capacity() || !edge_alive(e))
+        return std::nullopt;
+
+    Index h0 = 2 * e, h1 = 2 * e + 1;
+    Index v1 = vertex[h1];
+    Index f0 = face[h0], f1 = face[h1];
+    bool tri0 = !boundary[f0] && face_degree(f0) == 3;
+    bool tri1 = !boundary[f1] && face_degree(f1) == 3;
+    Index pb = prev(h1);
+
+    // h0 now ends at m and g0 continues to v1; on the other side g1 runs from v1 to
+    // m and h1 continues from m, so h0 / h1 and g0 / g1 remain twins
+    Index g0 = 2 * edges[0], g1 = 2 * edges[0] + 1;
+    record_vertices({m, v1});
+    record_halfedges({g0, g1, h0, h1, pb});
+    pos[m] = edge_center(e);
+
+    vertex[g0] = m;
+    face[g0] = f0;
+    next[g0] = next[h0];
+    next[h0] = g0;
+
+    vertex[g1] = v1;
+    face[g1] = f1;
+    next[g1] = h1;
+    next[pb] = g1;
+    vertex[h1] = m;
+
+    if (vertex_halfedge[v1] == h1)
+        vertex_halfedge[v1] = g1;
+    vertex_halfedge[m] = g0;
+
+    // Split the triangles by connecting m to their opposite corners
+    if (tri0)
+        connect(g0, prev(h0), edges[1], faces[0]);
+    if (tri1)
+        connect(h1, pb, edges[2], faces[1]);
+    return m;
+}
+
+void Flat_Halfedge_Mesh::add_slots(Index vertices, Index edges, Index faces) {
+    vertex_halfedge.resize(vertex_halfedge.size() + vertices, null);
+    pos.resize(pos.size() + vertices);
+    next.resize(next.size() + 2 * (size_t)edges, null);
+    vertex.resize(vertex.size() + 2 * (size_t)edges, null);
+    face.resize(face.size() + 2 * (size_t)edges, null);
+    face_halfedge.resize(face_halfedge.size() + faces, null);
+    boundary.resize(boundary.size() + faces, 0);
+}
+
+void Flat_Halfedge_Mesh::defer_free_lists(bool defer) {
+
+    if (deferred_free && !defer) {
+        free_vertices.clear();
+        free_edges.clear();
+        free_faces.clear();
+        for (Index v = 0; v < vertex_capacity(); v++)
+            if (!vertex_alive(v))
+                free_vertices.push_back(v);
+        for (Index e = 0; e < edge_capacity(); e++)
+            if (!edge_alive(e))
+                free_edges.push_back(e);
+        for (Index f = 0; f < face_capacity(); f++)
+            if (!face_alive(f))
+                free_faces.push_back(f);
+    }
+    deferred_free = defer;
+}
+
+bool Flat_Halfedge_Mesh::needs_compaction() const {
+    auto sparse = [](size_t dead, size_t capacity) { return dead > 1024 && 4 * dead > capacity; };
+    return sparse(free_vertices.size(), vertex_capacity()) ||
+           sparse(free_edges.size(), edge_capacity()) ||
+           sparse(free_faces.size(), face_capacity());
+}
+
+void Flat_Halfedge_Mesh::compact() {
+
+    auto renumber = [](Index capacity, auto alive) {
+        std::vector<Index> map(capacity, null);
+        Index n = 0;
+        for (Index i = 0; i < capacity; i++)
+            if (alive(i))
+                map[i] = n++;
+        return map;
+    };
+    std::vector<Index> vmap = renumber(vertex_capacity(), [&](Index v) { return vertex_alive(v); });
+    std::vector<Index> emap = renumber(edge_capacity(), [&](Index e) { return edge_alive(e); });
+    std::vector<Index> fmap = renumber(face_capacity(), [&](Index f) { return face_alive(f); });
+    auto hmap = [&](Index h) { return 2 * emap[edge(h)] + (h & 1); };
+
+    Index nv = n_vertices(), ne = n_edges(), nf = n_faces();
+
+    std::vector<Index> new_next(2 * ne), new_vertex(2 * ne), new_face(2 * ne);
+    for (Index h = 0; h < halfedge_capacity(); h++) {
+        if (!edge_alive(edge(h)))
+            continue;
+        Index g = hmap(h);
+        new_next[g] = hmap(next[h]);
+        new_vertex[g] = vmap[vertex[h]];
+        new_face[g] = fmap[face[h]];
+    }
+
+    std::vector<Index> new_vertex_halfedge(nv);
+    std::vector<Vec3> new_pos(nv);
+    for (Index v = 0; v < vertex_capacity(); v++) {
+        if (vmap[v] == null)
+            continue;
+        new_vertex_halfedge[vmap[v]] = hmap(vertex_halfedge[v]);
+        new_pos[vmap[v]] = pos[v];
+    }
+
+    std::vector<Index> new_face_halfedge(nf);
+    std::vector<uint8_t> new_boundary(nf);
+    for (Index f = 0; f < face_capacity(); f++) {
+        if (fmap[f] == null)
+            continue;
+        new_face_halfedge[fmap[f]] = hmap(face_halfedge[f]);
+        new_boundary[fmap[f]] = boundary[f];
+    }
+
+    next = std::move(new_next);
+    vertex = std::move(new_vertex);
+    face = std::move(new_face);
+    vertex_halfedge = std::move(new_vertex_halfedge);
+    pos = std::move(new_pos);
+    face_halfedge = std::move(new_face_halfedge);
+    boundary = std::move(new_boundary);
+    free_vertices.clear();
+    free_edges.clear();
+    free_faces.clear();
+}
+
+std::string Flat_Halfedge_Mesh::validate() const {
+
+    auto id = [](Index i) { return std::to_string(i); };
+    std::vector<uint8_t> reached(halfedge_capacity(), 0);
+
+    for (Index h = 0; h < halfedge_capacity(); h++) {
+        if (!edge_alive(edge(h)))
+            continue;
+        if (next[h] >= halfedge_capacity() || !edge_alive(edge(next[h])))
+            return "Halfedge " + id(h) + " has a dead next.";
+        if (vertex[h] >= vertex_capacity() || !vertex_alive(vertex[h]))
+            return "Halfedge " + id(h) + " has a dead vertex.";
+        if (face[h] >= face_capacity() || !face_alive(face[h]))
+            return "Halfedge " + id(h) + " has a dead face.";
+        if (face[next[h]] != face[h])
+            return "Halfedge " + id(h) + " and its next are in different faces.";
+        if (vertex[next[h]] != vertex[twin(h)])
+            return "Halfedge " + id(h) + " does not end where its twin starts.";
+        if (reached[next[h]]++)
+            return "Halfedge " + id(next[h]) + " is the next of two halfedges.";
+    }
+    for (Index v = 0; v < vertex_capacity(); v++)
+        if (vertex_alive(v) && vertex[vertex_halfedge[v]] != v)
+            return "Vertex " + id(v) + " has a halfedge that does not start at it.";
+    for (Index f = 0; f < face_capacity(); f++) {
+        if (!face_alive(f))
+            continue;
+        if (face[face_halfedge[f]] != f)
+            return "Face " + id(f) + " has a halfedge that is not in it.";
+        if (face_degree(f) < (boundary[f] ? 1u : 3u))
+            return "Face " + id(f) + " has fewer than three sides.";
+    }
+    return {};
+}
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "../geometry/halfedge.h"
+#include "../lib/mathlib.h"
+
+/* Flat halfedge storage:
+
+    Halfedge_Mesh keeps its elements in std::lists and links them with list
+    iterators, so every h->twin()->next() walk chases pointers through nodes
+    scattered over the heap. Flat_Halfedge_Mesh stores the same connectivity in
+    contiguous arrays of 32-bit indices, one array per attribute:
+
+        next[h], vertex[h], face[h]      for halfedges
+        vertex_halfedge[v], pos[v]       for vertices
+        face_halfedge[f], boundary[f]    for faces
+
+    Halfedges are allocated in pairs: edge e owns halfedges 2e and 2e + 1, so
+    twin(h) = h ^ 1 and edge(h) = h / 2 need no storage at all.
+
+    Erased elements are marked dead (their halfedge, or for edges their first
+    halfedge's vertex, is set to null) and their indices are pushed onto a free
+    list, so later allocations reuse them and indices of live elements stay valid
+    across local operations (defer_free_lists() holds the pushes back while local
+    operations run on several threads). Once enough of the arrays are dead,
+    compact() renumbers the live elements densely; this invalidates outstanding
+    indices, so it is only done when asked for (needs_compaction() suggests when).
+
+    The local operations mirror Halfedge_Mesh's, taking and returning indices
+    instead of Refs. Meshes move between the two representations with the
+    Flat_Halfedge_Mesh(const Halfedge_Mesh&) constructor and to_halfedge_mesh(),
+    both of which go through the polygon lists used by from_poly.
+
+    While an Edit_Log transaction is open (see edit_log.h), the local operations
+    report every element they are about to change and every slot they take off a
+    free list, so the log can keep the old and new states of just those elements.
+*/
+
+class Edit_Log;
+
+class Flat_Halfedge_Mesh {
+public:
+    using Index = uint32_t;
+    static constexpr Index null = 0xffffffffu;
+
+    Flat_Halfedge_Mesh() = default;
+    explicit Flat_Halfedge_Mesh(const Halfedge_Mesh &mesh);
+
+    // Same contract as Halfedge_Mesh::from_poly: returns an error message, or an
+    // empty string on success
+    std::string from_poly(const std::vector<std::vector<Index>> &polygons,
+                          const std::vector<Vec3> &verts);
+    // Polygons of the non-boundary faces, indexing the returned vertex list
+    void to_poly(std::vector<std::vector<Index>> &polygons, std::vector<Vec3> &verts) const;
+    std::string to_halfedge_mesh(Halfedge_Mesh &mesh) const;
+
+    void clear();
+
+    // Counts of live elements
+    Index n_vertices() const {
+        return (Index)(vertex_halfedge.size() - free_vertices.size());
+    }
+    Index n_edges() const {
+        return (Index)(next.size() / 2 - free_edges.size());
+    }
+    Index n_faces() const {
+        return (Index)(face_halfedge.size() - free_faces.size());
+    }
+    Index n_halfedges() const {
+        return 2 * n_edges();
+    }
+
+    // Upper bounds on the indices in use; loop to these and skip dead elements
+    Index vertex_capacity() const {
+        return (Index)vertex_halfedge.size();
+    }
+    Index edge_capacity() const {
+        return (Index)(next.size() / 2);
+    }
+    Index face_capacity() const {
+        return (Index)face_halfedge.size();
+    }
+    Index halfedge_capacity() const {
+        return (Index)next.size();
+    }
+
+    bool vertex_alive(Index v) const {
+        return vertex_halfedge[v] != null;
+    }
+    bool edge_alive(Index e) const {
+        return vertex[2 * e] != null;
+    }
+    bool face_alive(Index f) const {
+        return face_halfedge[f] != null;
+    }
+
+    // Connectivity
+    static Index twin(Index h) {
+        return h ^ 1u;
+    }
+    static Index edge(Index h) {
+        return h >> 1;
+    }
+    static Index edge_halfedge(Index e) {
+        return 2 * e;
+    }
+    Index prev(Index h) const;
+
+    // Geometry and degree queries, as on Halfedge_Mesh's elements
+    unsigned int vertex_degree(Index v) const;
+    unsigned int face_degree(Index f) const;
+    bool vertex_on_boundary(Index v) const;
+    bool edge_on_boundary(Index e) const;
+    Vec3 vertex_neighborhood_center(Index v) const;
+    Vec3 edge_center(Index e) const;
+    float edge_length(Index e) const;
+    Vec3 face_center(Index f) const;
+    Vec3 face_normal(Index f) const;
+
+    // Calls fn(h) for each halfedge leaving v
+    template<typename F> void for_each_outgoing(Index v, F &&fn) const {
+        Index h = vertex_halfedge[v];
+        do {
+            fn(h);
+            h = next[twin(h)];
+        } while (h != vertex_halfedge[v]);
+    }
+    // Calls fn(h) for each halfedge of f
+    template<typename F> void for_each_halfedge(Index f, F &&fn) const {
+        Index h = face_halfedge[f];
+        do {
+            fn(h);
+            h = next[h];
+        } while (h != face_halfedge[f]);
+    }
+
+    // Local operations, as on Halfedge_Mesh
+    std::optional<Index> erase_edge(Index e);    // returns the merged face
+    std::optional<Index> collapse_edge(Index e); // returns the remaining vertex
+    std::optional<Index> flip_edge(Index e);
+    std::optional<Index> split_edge(Index e);    // returns the new vertex
+
+    // split_edge into given slots rather than ones from the free lists: the new
+    // vertex m, edges[0] for the far half of e, and edges[1 + i] and faces[i] to cut
+    // the triangle on side i (unused if that side is not a triangle). With the free
+    // lists deferred, splits into disjoint slots of disjoint faces may run on several
+    // threads at once.
+    std::optional<Index> split_edge(Index e, Index m, const Index edges[3], const Index faces[2]);
+    // Appends dead slots to hand to split_edge; unused ones are freed when the
+    // deferral ends
+    void add_slots(Index vertices, Index edges, Index faces);
+
+    // While deferred, erased elements are marked dead but not pushed onto the free
+    // lists, so erase_edge and collapse_edge (which allocate nothing) may run on
+    // several threads at once on disjoint neighborhoods. The counts of live elements
+    // are stale until the deferral ends, which rebuilds the free lists.
+    void defer_free_lists(bool defer);
+
+    // Whether enough elements are dead that compact() is worth its cost
+    bool needs_compaction() const;
+    // Renumbers live elements densely, preserving their order, and empties the free
+    // lists. Invalidates all indices held outside the mesh.
+    void compact();
+
+    // Checks that the connectivity is consistent; returns an error message, or an
+    // empty string if the mesh is valid
+    std::string validate() const;
+
+    // Halfedge attributes
+    std::vector<Index> next, vertex, face;
+    // Vertex attributes
+    std::vector<Index> vertex_halfedge;
+    std::vector<Vec3> pos;
+    // Face attributes
+    std::vector<Index> face_halfedge;
+    std::vector<uint8_t> boundary;
+
+private:
+    friend class Edit_Log;
+
+    // Hands the current state of elements about to change to the open transaction,
+    // if any
+    void record_halfedges(std::initializer_list<Index> hs) {
+        if (log)
+            log_halfedges(hs);
+    }
+    void record_vertices(std::initializer_list<Index> vs) {
+        if (log)
+            log_vertices(vs);
+    }
+    void record_faces(std::initializer_list<Index> fs) {
+        if (log)
+            log_faces(fs);
+    }
+    void log_halfedges(std::initializer_list<Index> hs);
+    void log_vertices(std::initializer_list<Index> vs);
+    void log_faces(std::initializer_list<Index> fs);
+    // Removes and returns the last index on a free list
+    Index pop_free(std::vector<Index> &list);
+
+    Index new_vertex(Vec3 p);
+    Index new_edge(); // returns the edge; its halfedges are 2e and 2e + 1
+    Index new_face(bool is_boundary);
+    void erase_vertex_slot(Index v);
+    void erase_edge_slot(Index e);
+    void erase_face_slot(Index f);
+
+    // Splits the face of ha and hb with the new edge e from the start of ha to the
+    // start of hb; hb's side becomes the new face g
+    void connect(Index ha, Index hb, Index e, Index g);
+    // Removes the two-sided face containing h, merging its edges into one
+    void remove_digon(Index h);
+
+    std::vector<Index> free_vertices, free_edges, free_faces;
+    bool deferred_free = false;
+    Edit_Log *log = nullptr;
+};
@@ -0,0 +1,315 @@
+#include "../util/rand.h"
+#include "guiding.h"
+#include "render_shared.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace PT {
+
+// Quadrants receiving more than this fraction of a cell's flux are subdivided
+static constexpr float subdivide_fraction = 0.01f;
+static constexpr size_t max_tree_depth = 20;
+static constexpr size_t default_nodes_per_tree = 256;
+
+// Bytes used per quadtree node: sampling and training structure plus training sums
+static constexpr size_t node_bytes =
+    2 * sizeof(uint32_t[4]) + 2 * sizeof(float[4]);
+
+Vec2 guide_dir_to_square(Vec3 dir) {
+    float u = std::clamp(0.5f * (dir.y + 1.0f), 0.0f, 1.0f);
+    float v = std::atan2(dir.z, dir.x) / (2.0f * PI_F);
+    if (v < 0.0f)
+        v += 1.0f;
+    return Vec2(u, std::clamp(v, 0.0f, 1.0f));
+}
+
+Vec3 guide_square_to_dir(Vec2 p) {
+    float cos_t = 2.0f * p.x - 1.0f;
+    float sin_t = std::sqrt(std::max(0.0f, 1.0f - cos_t * cos_t));
+    float phi = 2.0f * PI_F * p.y;
+    return Vec3(sin_t * std::cos(phi), cos_t, sin_t * std::sin(phi));
+}
+
+// Moves p into the coordinates of the quadrant containing it, and returns that quadrant
+static int descend(Vec2 &p) {
+    int qx = p.x >= 0.5f ? 1 : 0;
+    int qy = p.y >= 0.5f ? 1 : 0;
+    p.x = std::min(2.0f * p.x - qx, 1.0f);
+    p.y = std::min(2.0f * p.y - qy, 1.0f);
+    return qx + 2 * qy;
+}
+
+Vec3 Guide_Field::Distribution::sample(float &pdf) const {
+
+    // The projection is equal-area, so the solid angle density is the density over
+    // the square divided by the area of the sphere
+    float pdf_square = 1.0f;
+    Vec2 lo(0.0f, 0.0f);
+    float size = 1.0f;
+
+    uint32_t n = 0;
+    for (;;) {
+        const Node &node = nodes[n];
+        float sum = node.flux[0] + node.flux[1] + node.flux[2] + node.flux[3];
+        if (sum <= 0.0f) {
+            pdf = 0.0f;
+            return Vec3();
+        }
+
+        float u = RNG::unit() * sum;
+        int q = 0;
+        while (q < 3 && u >= node.flux[q]) {
+            u -= node.flux[q];
+            q++;
+        }
+
+        pdf_square *= 4.0f * node.flux[q] / sum;
+        size *= 0.5f;
+        lo += Vec2((float)(q & 1), (float)(q >> 1)) * size;
+        if (!node.child[q])
+            break;
+        n = node.child[q];
+    }
+
+    pdf = pdf_square / (4.0f * PI_F);
+    return guide_square_to_dir(lo + Vec2(RNG::unit(), RNG::unit()) * size);
+}
+
+float Guide_Field::Distribution::pdf(Vec3 dir) const {
+
+    Vec2 p = guide_dir_to_square(dir);
+    float pdf_square = 1.0f;
+
+    uint32_t n = 0;
+    for (;;) {
+        const Node &node = nodes[n];
+        float sum = node.flux[0] + node.flux[1] + node.flux[2] + node.flux[3];
+        if (sum <= 0.0f)
+            return 0.0f;
+        int q = descend(p);
+        pdf_square *= 4.0f * node.flux[q] / sum;
+        if (!node.child[q])
+            break;
+        n = node.child[q];
+    }
+    return pdf_square / (4.0f * PI_F);
+}
+
+static std::atomic<uint64_t> next_field_id{1};
+
+Guide_Field::Guide_Field(BBox bounds, size_t budget)
+    : id(next_field_id.fetch_add(1, std::memory_order_relaxed)), box(bounds),
+      budget_bytes(budget) {
+
+    // Split the budget into cells of default_nodes_per_tree nodes, with roughly cubical
+    // cells over the scene bounds, then let each tree use whatever the grid leaves over
+    size_t cell_bytes = default_nodes_per_tree * node_bytes + sizeof(Cell);
+    size_t target = std::max(budget / cell_bytes, size_t(1));
+
+    Vec3 extent = box.max - box.min;
+    float longest = std::max(std::max(extent.x, extent.y), std::max(extent.z, EPS_F));
+    for (int i = 0; i < 3; i++)
+        extent[i] = std::max(extent[i], longest * 1e-3f);
+    float side = std::cbrt(extent.x * extent.y * extent.z / target);
+    for (int i = 0; i < 3; i++)
+        res[i] = std::clamp((size_t)(extent[i] / side), size_t(1), size_t(256));
+    while (res[0] * res[1] * res[2] > target) {
+        int axis = (int)(std::max_element(res, res + 3) - res);
+        if (res[axis] == 1)
+            break;
+        res[axis]--;
+    }
+
+    n_cells = res[0] * res[1] * res[2];
+    max_nodes = budget / n_cells > sizeof(Cell) ? (budget / n_cells - sizeof(Cell)) / node_bytes : 1;
+    max_nodes = std::clamp(max_nodes, size_t(1), size_t(1) << 16);
+
+    cells = std::make_unique<Cell[]>(n_cells);
+    for (size_t i = 0; i < n_cells; i++) {
+        auto tree = std::make_shared<Tree>();
+        tree->nodes.push_back({{0, 0, 0, 0}, {0.0f, 0.0f, 0.0f, 0.0f}});
+        tree->train = std::make_unique<std::atomic<float>[]>(4);
+        for (size_t j = 0; j < 4; j++)
+            tree->train[j].store(0.0f, std::memory_order_relaxed);
+        cells[i].training = std::move(tree);
+    }
+}
+
+size_t Guide_Field::cell_index(Vec3 pos) const {
+    Vec3 extent = box.max - box.min;
+    size_t idx[3];
+    for (int i = 0; i < 3; i++) {
+        float t = extent[i] > 0.0f ? (pos[i] - box.min[i]) / extent[i] : 0.0f;
+        idx[i] = std::min((size_t)std::max(t * res[i], 0.0f), res[i] - 1);
+    }
+    return (idx[2] * res[1] + idx[1]) * res[0] + idx[0];
+}
+
+const Guide_Field::Cell_Handle &Guide_Field::handle(size_t i) const {
+
+    // One set of handles per thread, for the field it used last
+    struct Thread_Handles {
+        uint64_t field = 0;
+        std::vector<Cell_Handle> cells;
+    };
+    static thread_local Thread_Handles handles;
+    if (handles.field != id) {
+        handles.field = id;
+        handles.cells.clear();
+        handles.cells.resize(n_cells);
+    }
+
+    Cell_Handle &h = handles.cells[i];
+    const Cell &cell = cells[i];
+    if (h.generation != cell.generation.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> guard(cell.publish);
+        h.sampling = cell.sampling;
+        h.training = cell.training;
+        h.generation = cell.generation.load(std::memory_order_relaxed);
+    }
+    return h;
+}
+
+std::shared_ptr<const Guide_Field::Distribution> Guide_Field::lookup(Vec3 pos) const {
+    return handle(cell_index(pos)).sampling;
+}
+
+size_t Guide_Field::trained_cells() const {
+    size_t count = 0;
+    for (size_t i = 0; i < n_cells; i++) {
+        std::lock_guard<std::mutex> guard(cells[i].publish);
+        if (cells[i].sampling)
+            count++;
+    }
+    return count;
+}
+
+void Guide_Field::record(Vec3 pos, Vec3 dir, float value) {
+
+    if (!(value > 0.0f) || !std::isfinite(value))
+        return;
+
+    size_t i = cell_index(pos);
+    Cell &cell = cells[i];
+    Tree *tree = handle(i).training.get();
+
+    Vec2 p = guide_dir_to_square(dir);
+    uint32_t n = 0;
+    for (;;) {
+        int q = descend(p);
+        uint32_t child = tree->nodes[n].child[q];
+        if (!child) {
+            std::atomic<float> &sum = tree->train[4 * n + q];
+            float old = sum.load(std::memory_order_relaxed);
+            while (!sum.compare_exchange_weak(old, old + value, std::memory_order_relaxed)) {
+            }
+            break;
+        }
+        n = child;
+    }
+
+    uint32_t count = cell.samples.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (count >= cell.next_update.load(std::memory_order_relaxed)) {
+        std::unique_lock<std::mutex> lock(cell.lock, std::try_to_lock);
+        if (lock.owns_lock() && count >= cell.next_update.load(std::memory_order_relaxed))
+            update(cell);
+    }
+}
+
+void Guide_Field::update(Cell &cell) {
+
+    // Only update() replaces the training tree, and it runs under cell.lock
+    std::shared_ptr<Tree> old;
+    {
+        std::lock_guard<std::mutex> guard(cell.publish);
+        old = cell.training;
+    }
+
+    // Publish what was recorded as the new sampling distribution. Nodes are stored in
+    // pre-order, so children always come after their parents and the flux sums can be
+    // accumulated in one backwards pass.
+    auto dist = std::make_shared<Distribution>();
+    dist->nodes = old->nodes;
+    for (size_t n = dist->nodes.size(); n-- > 0;) {
+        Distribution::Node &node = dist->nodes[n];
+        for (int q = 0; q < 4; q++) {
+            if (node.child[q]) {
+                const Distribution::Node &c = dist->nodes[node.child[q]];
+                node.flux[q] = c.flux[0] + c.flux[1] + c.flux[2] + c.flux[3];
+            } else {
+                node.flux[q] = old->train[4 * n + q].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    const Distribution::Node &root = dist->nodes[0];
+    float total = root.flux[0] + root.flux[1] + root.flux[2] + root.flux[3];
+    if (total > 0.0f) {
+        std::lock_guard<std::mutex> guard(cell.publish);
+        cell.sampling = dist;
+        cell.generation.fetch_add(1, std::memory_order_release);
+    }
+
+    // Refine the structure for the next round of training: subdivide bright
+    // quadrants, collapse dim ones, never exceeding max_nodes
+    auto next = std::make_shared<Tree>();
+    std::vector<Distribution::Node> &out = next->nodes;
+
+    auto refine = [&](auto &&refine, int src, const float flux[4], size_t depth) -> uint32_t {
+        uint32_t idx = (uint32_t)out.size();
+        out.push_back({{0, 0, 0, 0}, {0.0f, 0.0f, 0.0f, 0.0f}});
+        for (int q = 0; q < 4; q++) {
+            if (total <= 0.0f || flux[q] <= subdivide_fraction * total)
+                continue;
+            if (depth + 1 >= max_tree_depth || out.size() >= max_nodes)
+                continue;
+            int child_src = -1;
+            float child_flux[4];
+            if (src >= 0 && dist->nodes[src].child[q]) {
+                child_src = (int)dist->nodes[src].child[q];
+                std::copy(dist->nodes[child_src].flux, dist->nodes[child_src].flux + 4, child_flux);
+            } else {
+                std::fill(child_flux, child_flux + 4, 0.25f * flux[q]);
+            }
+            uint32_t c = refine(refine, child_src, child_flux, depth + 1);
+            out[idx].child[q] = c;
+        }
+        return idx;
+    };
+    refine(refine, 0, root.flux, 0);
+
+    next->train = std::make_unique<std::atomic<float>[]>(4 * out.size());
+    for (size_t j = 0; j < 4 * out.size(); j++)
+        next->train[j].store(0.0f, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> guard(cell.publish);
+        cell.training = next;
+        cell.generation.fetch_add(1, std::memory_order_release);
+    }
+
+    uint32_t n = cell.next_update.load(std::memory_order_relaxed);
+    cell.next_update.store(n < (1u << 30) ? 2 * n : n, std::memory_order_relaxed);
+}
+
+static Render_Shared<Guide_Field> field;
+
+Guide_Field *guide_field(BBox bounds, size_t budget_mb) {
+
+    auto same = [](Vec3 a, Vec3 b) { return a.x == b.x && a.y == b.y && a.z == b.z; };
+
+    static thread_local Render_Shared<Guide_Field>::Handle handle;
+    size_t bytes = std::max(budget_mb, size_t(1)) << 20;
+    return field.get(
+        handle,
+        [&](const Guide_Field &f) {
+            return f.budget() == bytes && same(f.bounds().min, bounds.min) &&
+                   same(f.bounds().max, bounds.max);
+        },
+        [&]() { return std::make_shared<Guide_Field>(bounds, bytes); });
+}
+
+void guide_reset() {
+    field.reset();
+}
+
+} // namespace PT
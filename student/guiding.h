@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "../lib/mathlib.h"
+
+/* Path guiding:
+
+    Guide_Field learns, while rendering, where indirect light comes from. The scene
+    bounds are split into a uniform grid of cells, and each cell holds a directional
+    quadtree over the sphere of directions (mapped to the unit square with an
+    equal-area cylindrical projection). Every leaf quadrant stores the flux that
+    arrived through its directions, so sampling proportionally to the tree sends
+    bounce rays towards bright openings instead of over the whole hemisphere.
+
+    Each cell keeps two trees. Paths record into the training tree; once a cell has
+    seen twice as many samples as at its last update, the training tree becomes the
+    cell's sampling tree, and a new training tree is built by subdividing quadrants
+    that received more than a small fraction of the flux and merging the rest. This
+    way, the learned distributions sharpen as the image converges over its passes.
+
+    Rendering threads sample, evaluate and record concurrently. A cell's trees are
+    replaced under a short lock that also bumps the cell's generation; each thread
+    keeps its own handles to the trees of every cell, as with Render_Shared, and only
+    takes the lock to refresh a handle whose cell has changed since.
+
+    The total size of all trees is bounded by the memory budget: it determines both
+    the grid resolution and the maximum number of nodes per tree.
+*/
+
+namespace PT {
+
+class Guide_Field {
+public:
+    // Learned distribution of one cell; immutable once published
+    class Distribution {
+    public:
+        Vec3 sample(float &pdf) const;
+        float pdf(Vec3 dir) const;
+
+    private:
+        friend class Guide_Field;
+        struct Node {
+            uint32_t child[4]; // 0 for leaf quadrants
+            float flux[4];
+        };
+        std::vector<Node> nodes;
+    };
+
+    Guide_Field(BBox bounds, size_t budget_bytes);
+
+    const BBox &bounds() const {
+        return box;
+    }
+    size_t budget() const {
+        return budget_bytes;
+    }
+
+    // The sampling distribution at pos, or null while that cell is still untrained.
+    // Hold on to the returned pointer to sample and evaluate consistently. Takes no
+    // lock unless the cell changed since this thread last looked at it.
+    std::shared_ptr<const Distribution> lookup(Vec3 pos) const;
+
+    // Records that radiance with luminance value / pdf arrived at pos from dir
+    void record(Vec3 pos, Vec3 dir, float value);
+
+    // Number of cells that have published a sampling distribution
+    size_t trained_cells() const;
+
+private:
+    struct Tree {
+        std::vector<Distribution::Node> nodes;     // structure (flux unused)
+        std::unique_ptr<std::atomic<float>[]> train; // 4 per node
+    };
+    struct Cell {
+        // Replaced under publish, which bumps generation
+        std::shared_ptr<const Distribution> sampling;
+        std::shared_ptr<Tree> training;
+        std::atomic<uint64_t> generation{1};
+        mutable std::mutex publish;
+
+        std::atomic<uint32_t> samples{0};
+        std::atomic<uint32_t> next_update{64};
+        std::mutex lock; // held while updating
+    };
+    // A thread's view of one cell's trees, as of generation
+    struct Cell_Handle {
+        std::shared_ptr<const Distribution> sampling;
+        std::shared_ptr<Tree> training;
+        uint64_t generation = 0;
+    };
+
+    size_t cell_index(Vec3 pos) const;
+    const Cell_Handle &handle(size_t cell) const;
+    void update(Cell &cell);
+
+    uint64_t id; // tells apart the fields the threads' handles refer to
+    BBox box;
+    size_t budget_bytes;
+    size_t res[3];
+    size_t max_nodes;
+    size_t n_cells;
+    std::unique_ptr<Cell[]> cells;
+};
+
+// Equal-area mapping between directions and the unit square, as used by the quadtrees
+Vec2 guide_dir_to_square(Vec3 dir);
+Vec3 guide_square_to_dir(Vec2 p);
+
+// The field used for the current scene: rebuilt when the scene bounds or the budget
+// (in megabytes) change, otherwise shared across renders so training carries over
+// between progressive passes. Fetching it takes no lock once it is built (see
+// render_shared.h), and it stays valid until the calling thread asks again.
+Guide_Field *guide_field(BBox bounds, size_t budget_mb);
+void guide_reset();
+
+} // namespace PT
@@ -1,13 +1,35 @@
 ﻿
 #include <queue>
-#include <set>
 #include <unordered_map>
 
 #include "../geometry/halfedge.h"
+#include "../lib/log.h"
 #include "debug.h"
+#include "edit_log.h"
+#include "flat_halfedge.h"
+#include "parallel.h"
+#include "remesh.h"
+#include "simplify.h"
+#include "subdivision.h"
+#include <chrono>
 #include <iostream>
 #include <vector>
 
+// The Halfedge_Edit_Log recording this mesh, if any. The log undoes and redoes steps
+// with new_*, erase and do_erase, which only members can call, so the operations
+// hand them over as lambdas written in member scope.
+#define EDIT_LOG                                                                           \
+    Halfedge_Edit_Log::recording(                                                          \
+        *this, {[](Halfedge_Mesh &m) { return m.new_halfedge(); },                         \
+                [](Halfedge_Mesh &m) { return m.new_vertex(); },                           \
+                [](Halfedge_Mesh &m) { return m.new_edge(); },                             \
+                [](Halfedge_Mesh &m, bool boundary) { return m.new_face(boundary); },      \
+                [](Halfedge_Mesh &m, HalfedgeRef h) { m.erase(h); },                       \
+                [](Halfedge_Mesh &m, VertexRef v) { m.erase(v); },                         \
+                [](Halfedge_Mesh &m, EdgeRef e) { m.erase(e); },                           \
+                [](Halfedge_Mesh &m, FaceRef f) { m.erase(f); },                           \
+                [](Halfedge_Mesh &m) { m.do_erase(); }})
+
 /* Note on local operation return types:
 
         The local operations all return a std::optional<T> type. This is used so that your
@@ -56,6 +78,9 @@ std::optional<Halfedge_Mesh::FaceRef> Halfedge_Mesh::erase_edge(Halfedge_Mesh::E
     if(e==edges.end()){
         return std::nullopt;
     }
+    Halfedge_Edit_Log *log = EDIT_LOG;
+    if (log)
+        log->save_around(e);
     //if it's a single line
 
   //  if ((e->halfedge()->next() == e->halfedge()->twin()) || 
@@ -115,6 +140,8 @@ std::optional<Halfedge_Mesh::FaceRef> Halfedge_Mesh::erase_edge(Halfedge_Mesh::E
     left_prev->next()= right_next;
     right_prev->next()= left_next;
 
+    if (log)
+        log->erased(e, left_he, right_he, f_right);
     Halfedge_Mesh::erase(e);
     Halfedge_Mesh::erase(left_he);
     Halfedge_Mesh::erase(right_he);
@@ -130,6 +157,9 @@ std::optional<Halfedge_Mesh::FaceRef> Halfedge_Mesh::erase_edge(Halfedge_Mesh::E
 std::optional<Halfedge_Mesh::VertexRef> Halfedge_Mesh::collapse_edge(Halfedge_Mesh::EdgeRef e) {
 
     (void)e;
+    Halfedge_Edit_Log *log = EDIT_LOG;
+    if (log)
+        log->save_around(e);
     Halfedge_Mesh::HalfedgeRef h0= e->halfedge();
     Halfedge_Mesh::HalfedgeRef a0= h0->twin();
     Halfedge_Mesh::VertexRef leftVtx= h0->vertex();
@@ -177,6 +207,8 @@ std::optional<Halfedge_Mesh::VertexRef> Halfedge_Mesh::collapse_edge(Halfedge_Me
     	h0->face() = f_inner;
     	h3->face() = f_inner;
 
+        if (log)
+            log->erased(e1, f1, h2, h1);
         Halfedge_Mesh::erase(e1);
         Halfedge_Mesh::erase(f1);
         Halfedge_Mesh::erase(h2);
@@ -207,6 +239,8 @@ std::optional<Halfedge_Mesh::VertexRef> Halfedge_Mesh::collapse_edge(Halfedge_Me
     	a3->face() = f_inner;
 
     	// delete
+        if (log)
+            log->erased(e2, f2, a2, a1);
     	Halfedge_Mesh::erase(e2);
     	Halfedge_Mesh::erase(f2);
     	Halfedge_Mesh::erase(a2);
@@ -232,6 +266,8 @@ std::optional<Halfedge_Mesh::VertexRef> Halfedge_Mesh::collapse_edge(Halfedge_Me
     f1->halfedge() = h3;
     f2->halfedge() = a3;
 
+    if (log)
+        log->erased(rightVtx, e, h0, a0);
     Halfedge_Mesh::erase(rightVtx);
     Halfedge_Mesh::erase(e);
     Halfedge_Mesh::erase(h0);
@@ -262,6 +298,8 @@ std::optional<Halfedge_Mesh::VertexRef> Halfedge_Mesh::collapse_face(Halfedge_Me
 std::optional<Halfedge_Mesh::EdgeRef> Halfedge_Mesh::flip_edge(Halfedge_Mesh::EdgeRef e) {
 
     (void)e;
+    if (Halfedge_Edit_Log *log = EDIT_LOG)
+        log->save_around(e);
     Halfedge_Mesh::HalfedgeRef left_he = e->halfedge();
     Halfedge_Mesh::HalfedgeRef right_he = left_he->twin();
 
@@ -341,7 +379,10 @@ std::optional<Halfedge_Mesh::VertexRef> Halfedge_Mesh::split_edge(Halfedge_Mesh:
 
         if(b1->next()==h1 && b3->next()==h1_twin){
             std::cout<<"Both side of this edge are triangle"<<std::endl;
-            
+            Halfedge_Edit_Log *log = EDIT_LOG;
+            if (log)
+                log->save_around(e);
+
             // set the new vertice
             Halfedge_Mesh::VertexRef v = new_vertex();
             v->pos = e->center();
@@ -359,6 +400,8 @@ std::optional<Halfedge_Mesh::VertexRef> Halfedge_Mesh::split_edge(Halfedge_Mesh:
             Halfedge_Mesh::HalfedgeRef h3_twin = new_halfedge();
             Halfedge_Mesh::HalfedgeRef h4 = new_halfedge();
             Halfedge_Mesh::HalfedgeRef h4_twin = new_halfedge();
+            if (log)
+                log->created(v, e2, e3, e4, f2, f3, h2, h2_twin, h3, h3_twin, h4, h4_twin);
 
             // f1 and its related edge
             f1->halfedge()=h1;
@@ -507,6 +550,9 @@ std::optional<Halfedge_Mesh::FaceRef> Halfedge_Mesh::bevel_face(Halfedge_Mesh::F
 
     if(!f->is_boundary())
     {
+        Halfedge_Edit_Log *log = EDIT_LOG;
+        if (log)
+            log->save_face(f);
         Halfedge_Mesh::HalfedgeRef h = f->halfedge();
 		std::vector<Halfedge_Mesh::HalfedgeRef> he;
 		std::vector<Halfedge_Mesh::HalfedgeRef> newhefc;
@@ -536,6 +582,9 @@ std::optional<Halfedge_Mesh::FaceRef> Halfedge_Mesh::bevel_face(Halfedge_Mesh::F
 		}while(h != f->halfedge());
 
         size_t N = he.size();
+        for (size_t i = 0; log && i < N; i++)
+            log->created(newedg_hrz[i], newedg_vtc[i], newvtx[i], newfc[i], newhefc[i],
+                         newhefc_t[i], newhe[i], newhe_t[i]);
 	
 		for(size_t i = 0; i < he.size(); i++)
 		{
@@ -727,88 +776,205 @@ void Halfedge_Mesh::bevel_face_positions(const std::vector<Vec3> &start_position
     
 }
 
+/*
+        Orders the corners of the polygon p[0..n) (in order around its face) for
+        clipping as ears: each clipped corner leaves the polygon through the diagonal
+        between its current neighbors, until three corners are left. Fanning clips
+        corners 1, 2, ..., n - 3 in turn, which fans triangles out of corner 0.
+        Ear clipping clips the best-shaped valid ear each time: a convex corner
+        whose triangle holds no other corner, judged in the plane of the polygon's
+        Newell normal, scored by area over the sum of its squared sides. Removing a
+        corner changes the ears of its two neighbors only, so the other scores are
+        kept, and all are recomputed only if no kept one is valid. The buffers are
+        the caller's, so that no face allocates.
+*/
+static void ear_order(const Vec3 *p, unsigned int n, bool clip_ears,
+                      std::vector<unsigned int> &prev, std::vector<unsigned int> &next,
+                      std::vector<float> &score, std::vector<unsigned int> &ears) {
+
+    ears.clear();
+    if (!clip_ears) {
+        for (unsigned int i = 1; i + 2 < n; i++)
+            ears.push_back(i);
+        return;
+    }
+
+    Vec3 normal;
+    for (unsigned int i = 0; i < n; i++)
+        normal += cross(p[i], p[(i + 1) % n]);
+    prev.resize(n);
+    next.resize(n);
+    score.resize(n);
+    for (unsigned int i = 0; i < n; i++) {
+        prev[i] = (i + n - 1) % n;
+        next[i] = (i + 1) % n;
+    }
+
+    // -1 for corners that are not ears
+    auto ear_score = [&](unsigned int i) {
+        unsigned int a = prev[i], c = next[i];
+        Vec3 pa = p[a], pb = p[i], pc = p[c];
+        float area = dot(cross(pb - pa, pc - pb), normal);
+        if (area <= 0.0f)
+            return -1.0f;
+        auto inside = [&](Vec3 q) {
+            return dot(cross(pb - pa, q - pa), normal) >= 0.0f &&
+                   dot(cross(pc - pb, q - pb), normal) >= 0.0f &&
+                   dot(cross(pa - pc, q - pc), normal) >= 0.0f;
+        };
+        for (unsigned int j = next[c]; j != a; j = next[j])
+            if (inside(p[j]))
+                return -1.0f;
+        float sides = (pb - pa).norm_squared() + (pc - pb).norm_squared() +
+                      (pa - pc).norm_squared();
+        return area / (normal.norm() * sides);
+    };
+    for (unsigned int i = 0; i < n; i++)
+        score[i] = ear_score(i);
+
+    unsigned int first = 0;
+    for (unsigned int left = n; left > 3; left--) {
+        auto best_ear = [&]() {
+            unsigned int best = first;
+            unsigned int i = first;
+            do {
+                if (score[i] > score[best])
+                    best = i;
+                i = next[i];
+            } while (i != first);
+            return best;
+        };
+        unsigned int best = best_ear();
+        if (score[best] < 0.0f) {
+            unsigned int i = first;
+            do {
+                score[i] = ear_score(i);
+                i = next[i];
+            } while (i != first);
+            // A polygon too warped or degenerate to have any ear left is fanned
+            best = best_ear();
+        }
+
+        ears.push_back(best);
+        unsigned int a = prev[best], c = next[best];
+        next[a] = c;
+        prev[c] = a;
+        first = a;
+        score[a] = ear_score(a);
+        score[c] = ear_score(c);
+    }
+}
+
 /*
         Splits all non-triangular faces into triangles.
+
+        A face of degree n becomes n - 2 triangles with n - 3 new edges, so a
+        first pass counts the non-boundary faces to split and the new elements
+        each needs, and all of them are allocated up front, in the order of the
+        faces. The faces are then rewired in parallel chunks: each one clips its
+        ears in the order given by ear_order (fanning, or ear clipping if
+        debug_data.ear_clip_triangulation is set) out of its own slice of the new
+        elements, and touches no element of any other face, so no locking is
+        needed. The last three corners keep the original face.
 */
 void Halfedge_Mesh::triangulate() {
-    
-    // For each face...
-    for(auto& f : faces)
-    {
-      //if it's not a triangle
-      if (f.degree()!=3)
-      {
-          std::cout<<"This is not a triangle, lets add edge to it"<<std::endl; 
-          // create a new halfedge and vertice list
-          // hes = [he1, he2, he3, ...]
-          // vtxs = [vtx1, vtx2, vtx3, ...]
-          std::vector<HalfedgeRef> hes;
-          std::vector<VertexRef> vtxs;
-
-          Halfedge_Mesh::HalfedgeRef ori_h=f.halfedge();
-          Halfedge_Mesh::HalfedgeRef he=f.halfedge();
-          
-          int i=0;
-          do{
-              i++;
-              hes.push_back(he);
-              vtxs.push_back(he->vertex());
-              he=he->next();
-              std::cout<<"add " << i << "th vertex/halfedge to the list"<<std::endl;
-          }while(he!=ori_h);
-          
-          // if its a square , we need to add 4-3=1 edge
-          // if its a pentagon, we need to add 5-3=2 edge
-          Size n_vtx = f.degree();
-          std::cout<<"It has " << n_vtx << " edges, we need to add " 
-              << n_vtx-3 << " more" << std::endl;
-
-          for(int idx=0; idx<n_vtx-3; idx++)
-          {
-              std::cout << "Start drawing the " << idx <<"th new edge" << std::endl;
-              Halfedge_Mesh::HalfedgeRef h = new_halfedge();
-              Halfedge_Mesh::HalfedgeRef h_t = new_halfedge();
-
-              Halfedge_Mesh::FaceRef f_n = new_face();
-              f_n->halfedge()=h;
-              ori_h->face()->halfedge()=h_t;
-
-              Halfedge_Mesh::EdgeRef e_n = new_edge();
-
-              Size left_he_idx = n_vtx-2-idx;
-              std::cout << "The left half edge idx is " << left_he_idx << std::endl;
-              Size right_he_idx = n_vtx-3-idx;
-              std::cout << "The right half edge idx is " << right_he_idx << std::endl;
-
-              h->twin() = h_t;
-              h->vertex() = vtxs.front();
-              h->next() = hes[left_he_idx];
-              hes[left_he_idx]->next()->next() = h;
-              
-
-              h_t->twin() = h;
-              h_t->vertex() = vtxs[left_he_idx];
-              h_t->face() = ori_h->face();
-              h_t->next() = hes.front();
-              hes[right_he_idx]->next() = h_t;
-
-              //edge
-              e_n->halfedge()=h;
-              h->edge()=e_n;
-              h_t->edge()=e_n;
-
-              //face 
-              hes[left_he_idx]->face() = f_n;
-              hes[left_he_idx]->next()->face() = f_n;
-              h->face() = f_n;
-
-              f_n->halfedge() = h;
-              ori_h->face()->halfedge()=h_t;
-          }
-     
-      }
 
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point start = Clock::now();
+
+    std::vector<FaceRef> split;
+    std::vector<size_t> first_new{0};
+    for (FaceRef f = faces_begin(); f != faces_end(); f++) {
+        if (f->is_boundary())
+            continue;
+        unsigned int n = f->degree();
+        if (n <= 3)
+            continue;
+        split.push_back(f);
+        first_new.push_back(first_new.back() + n - 3);
     }
+    double count_ms = ms_since(start);
+
+    start = Clock::now();
+    size_t total = first_new.back();
+    std::vector<EdgeRef> new_edges(total);
+    std::vector<FaceRef> new_faces(total);
+    std::vector<HalfedgeRef> new_halfedges(2 * total);
+    for (size_t i = 0; i < total; i++) {
+        new_edges[i] = new_edge();
+        new_faces[i] = new_face();
+        new_halfedges[2 * i] = new_halfedge();
+        new_halfedges[2 * i + 1] = new_halfedge();
+    }
+    double allocate_ms = ms_since(start);
+
+    start = Clock::now();
+    bool clip_ears = debug_data.ear_clip_triangulation;
+    parallel_for(split.size(), debug_data.mesh_threads, [&](size_t begin, size_t end) {
+        std::vector<HalfedgeRef> ring, leaving;
+        std::vector<Vec3> corners;
+        std::vector<unsigned int> prev, next, ears;
+        std::vector<float> score;
+
+        auto triangle = [](HalfedgeRef x, HalfedgeRef y, HalfedgeRef z, FaceRef g) {
+            x->next() = y;
+            y->next() = z;
+            z->next() = x;
+            x->face() = y->face() = z->face() = g;
+            g->halfedge() = x;
+        };
+
+        for (size_t k = begin; k < end; k++) {
+            FaceRef f = split[k];
+            ring.clear();
+            corners.clear();
+            HalfedgeRef h = f->halfedge();
+            do {
+                ring.push_back(h);
+                corners.push_back(h->vertex()->pos);
+                h = h->next();
+            } while (h != f->halfedge());
+            unsigned int n = (unsigned int)ring.size();
+            ear_order(corners.data(), n, clip_ears, prev, next, score, ears);
+
+            // leaving[i] runs from corner i to its neighbor in what is left of the
+            // polygon; clipping corner i between a and c makes triangle a, i, c with
+            // the new edge's halfedge c -> a, and its twin a -> c leaves a after it
+            leaving.assign(ring.begin(), ring.end());
+            prev.resize(n);
+            next.resize(n);
+            for (unsigned int i = 0; i < n; i++) {
+                prev[i] = (i + n - 1) % n;
+                next[i] = (i + 1) % n;
+            }
+            size_t base = first_new[k];
+            for (size_t t = 0; t < ears.size(); t++) {
+                unsigned int i = ears[t], a = prev[i], c = next[i];
+                HalfedgeRef back = new_halfedges[2 * (base + t)];
+                HalfedgeRef across = new_halfedges[2 * (base + t) + 1];
+                EdgeRef e = new_edges[base + t];
+                back->vertex() = ring[c]->vertex();
+                across->vertex() = ring[a]->vertex();
+                back->twin() = across;
+                across->twin() = back;
+                back->edge() = across->edge() = e;
+                e->halfedge() = back;
+                triangle(leaving[a], leaving[i], back, new_faces[base + t]);
+                leaving[a] = across;
+                next[a] = c;
+                prev[c] = a;
+            }
+            unsigned int a = ears.empty() ? 0 : prev[ears.back()];
+            triangle(leaving[a], leaving[next[a]], leaving[next[next[a]]], f);
+        }
+    }, 1024);
+    double wire_ms = ms_since(start);
+
+    if (debug_data.mesh_timing)
+        info("Triangulation (%s): %zu faces -> %zu more triangles, count %.2f ms, "
+             "allocate %.2f ms, wire %.2f ms",
+             clip_ears ? "ear clipping" : "fan", split.size(), total, count_ms, allocate_ms,
+             wire_ms);
 }
 
 /* Note on the quad subdivision process:
@@ -858,6 +1024,147 @@ void Halfedge_Mesh::triangulate() {
         scratch, using the two lists.
 */
 
+/*
+        Numbers the mesh's vertices and non-boundary faces in list order, and lists
+        the faces as polygons over those numbers, as taken by from_poly.
+*/
+struct Mesh_Polygons {
+    std::unordered_map<const Halfedge_Mesh::Vertex *, Subdivision_Level::Index> vertex_index;
+    std::vector<Halfedge_Mesh::VertexRef> verts;
+    std::vector<Halfedge_Mesh::FaceRef> faces;
+    std::vector<std::vector<Subdivision_Level::Index>> polygons;
+
+    explicit Mesh_Polygons(Halfedge_Mesh &mesh) {
+        vertex_index.reserve(mesh.n_vertices());
+        verts.reserve(mesh.n_vertices());
+        for (auto v = mesh.vertices_begin(); v != mesh.vertices_end(); v++) {
+            vertex_index[&*v] = (Subdivision_Level::Index)verts.size();
+            verts.push_back(v);
+        }
+        faces.reserve(mesh.n_faces());
+        polygons.reserve(mesh.n_faces());
+        for (auto f = mesh.faces_begin(); f != mesh.faces_end(); f++) {
+            if (f->is_boundary())
+                continue;
+            std::vector<Subdivision_Level::Index> poly;
+            auto h = f->halfedge();
+            do {
+                poly.push_back(vertex_index[&*h->vertex()]);
+                h = h->next();
+            } while (h != f->halfedge());
+            faces.push_back(f);
+            polygons.push_back(std::move(poly));
+        }
+    }
+};
+
+/*
+        The tables of the last cage subdivided. Subdividing a cage with the same
+        faces again (e.g. after undoing a subdivision and moving some vertices)
+        skips building the level, and computes the new points with a one-level
+        Stencil_Table (see subdivision.h), factored on that second use.
+*/
+struct Subdivision_Cache {
+    bool valid = false;
+    std::vector<std::vector<Subdivision_Level::Index>> polygons;
+    Subdivision_Level::Index n_vertices = 0;
+    Subdivision_Level level;
+
+    bool factored = false;
+    Subdivision_Scheme scheme = Subdivision_Scheme::linear;
+    Stencil_Table table;
+};
+static Subdivision_Cache subdivision_cache;
+
+/*
+        Both subdivision rules run on the flat tables of a Subdivision_Level (see
+        subdivision.h): the mesh's vertices and faces are numbered in list order,
+        the new points are computed in parallel passes (or by the cached stencils),
+        and then copied back into the new_pos members. If the mesh can't be
+        subdivided, every element's new_pos is set to where it is now, so the rebuilt
+        mesh keeps its shape rather than picking up stale positions, and the error is
+        returned.
+*/
+static std::string subdivide_positions(Halfedge_Mesh &mesh, Subdivision_Scheme scheme) {
+
+    using Index = Subdivision_Level::Index;
+    auto start = std::chrono::steady_clock::now();
+
+    Mesh_Polygons numbered(mesh);
+    auto &vertex_index = numbered.vertex_index;
+    auto &verts = numbered.verts;
+    auto &faces = numbered.faces;
+    auto &polygons = numbered.polygons;
+
+    Subdivision_Cache &cache = subdivision_cache;
+    bool same_cage =
+        cache.valid && cache.n_vertices == verts.size() && cache.polygons == polygons;
+    if (!same_cage) {
+        cache.valid = cache.factored = false;
+        std::string err = cache.level.build(polygons, (Index)verts.size());
+        if (!err.empty()) {
+            for (auto v = mesh.vertices_begin(); v != mesh.vertices_end(); v++)
+                v->new_pos = v->pos;
+            for (auto e = mesh.edges_begin(); e != mesh.edges_end(); e++)
+                e->new_pos = e->center();
+            for (auto f = mesh.faces_begin(); f != mesh.faces_end(); f++)
+                f->new_pos = f->center();
+            return err;
+        }
+        cache.valid = true;
+        cache.polygons = std::move(polygons);
+        cache.n_vertices = (Index)verts.size();
+    } else if (!cache.factored || cache.scheme != scheme) {
+        cache.table.threads = (size_t)std::max(debug_data.mesh_threads, 0);
+        cache.factored =
+            cache.table.build(cache.polygons, cache.n_vertices, scheme, 1).empty();
+        cache.scheme = scheme;
+    }
+    const Subdivision_Level &level = cache.level;
+    bool stencils = same_cage && cache.factored;
+
+    Subdivision_Timing timing;
+    timing.topology_ms = ms_since(start);
+
+    std::vector<Vec3> points;
+    if (stencils) {
+        std::vector<Vec3> cage(verts.size());
+        for (size_t i = 0; i < verts.size(); i++)
+            cage[i] = verts[i]->pos;
+        cache.table.evaluate(cage, points);
+    } else {
+        std::vector<Subd_Point> in(verts.size()), out(level.n_refined());
+        for (size_t i = 0; i < verts.size(); i++)
+            in[i] = {verts[i]->pos.x, verts[i]->pos.y, verts[i]->pos.z, 0.0f};
+        level.refine(in.data(), out.data(), scheme, debug_data.mesh_threads, &timing);
+        points.resize(out.size());
+        for (size_t i = 0; i < out.size(); i++)
+            points[i] = Vec3(out[i].x, out[i].y, out[i].z);
+    }
+
+    auto point = [&](Index i) { return points[i]; };
+    Index V = level.n_vertices(), E = level.n_edges();
+    for (Index i = 0; i < V; i++)
+        verts[i]->new_pos = point(i);
+    for (size_t i = 0; i < faces.size(); i++)
+        faces[i]->new_pos = point(V + E + (Index)i);
+    for (auto e = mesh.edges_begin(); e != mesh.edges_end(); e++) {
+        Index a = vertex_index[&*e->halfedge()->vertex()];
+        Index b = vertex_index[&*e->halfedge()->twin()->vertex()];
+        e->new_pos = point(V + level.edge_between(a, b));
+    }
+
+    if (debug_data.mesh_timing && stencils)
+        info("Subdivision positions: %zu faces, cached tables, stencils factored in %.2f ms, "
+             "evaluated in %.2f ms",
+             faces.size(), cache.table.build_ms(), cache.table.evaluate_ms());
+    else if (debug_data.mesh_timing)
+        info("Subdivision positions: %zu faces, tables %.2f ms, faces %.2f ms, edges %.2f ms, "
+             "vertices %.2f ms",
+             faces.size(), timing.topology_ms, timing.face_ms, timing.edge_ms, timing.vertex_ms);
+    return {};
+}
+
 /*
         Compute new vertex positions for a mesh that splits each polygon
         into quads (by inserting a vertex at the face midpoint and each
@@ -868,24 +1175,9 @@ void Halfedge_Mesh::triangulate() {
         centroids.
 */
 void Halfedge_Mesh::linear_subdivide_positions() {
-
-    // For each vertex, assign Vertex::new_pos to
-    // its original position, Vertex::pos.
-    for (auto v = vertices.begin(); v!=vertices.end(); ++v){
-        v->new_pos = v->pos;
-    }
-
-    // For each edge, assign the midpoint of the two original
-    // positions to Edge::new_pos.
-    for (auto e = edges.begin(); e!=edges.end(); ++e){
-        e->new_pos = e->center();
-    }
-    // For each face, assign the centroid (i.e., arithmetic mean)
-    // of the original vertex positions to Face::new_pos. Note
-    // that in general, NOT all faces will be triangles!
-    for (auto f=faces.begin(); f!=faces.end(); ++f){
-        f->new_pos = f->center();
-    }
+    std::string err = subdivide_positions(*this, Subdivision_Scheme::linear);
+    if (!err.empty())
+        warn("Linear subdivision: %s", err.c_str());
 }
 
 /*
@@ -899,45 +1191,9 @@ void Halfedge_Mesh::linear_subdivide_positions() {
         Note: this will only be called on meshes without boundary
 */
 void Halfedge_Mesh::catmullclark_subdivide_positions() {
-
-    // The implementation for this routine should be
-    // a lot like Halfedge_Mesh:linear_subdivide_positions:(),
-    // except that the calculation of the positions themsevles is
-    // slightly more involved, using the Catmull-Clark subdivision
-    // rules. (These rules are outlined in the Developer Manual.)
-
-    // Faces
-    for (auto f=faces.begin(); f!=faces.end(); ++f){
-        f->new_pos = f->center();
-    }
-    // Edges
-    for (auto e = edges.begin(); e!=edges.end(); ++e){
-        e->new_pos = e->center();
-        Vec3 v1 = e->center();
-        Vec3 f1 =(e->halfedge()->face()->center()+e->halfedge()->twin()->face()->center())/2;
-        e->new_pos = (v1+f1)/2;
-    }
-    // Vertices
-    for (auto v = vertices.begin(); v!=vertices.end(); ++v){
-        Vec3 Q;
-        Vec3 R;
-        Vec3 S = v->pos;
-        
-        Halfedge_Mesh::HalfedgeRef h = v->halfedge();
-
-        do{
-            Q = Q + h->face()->new_pos;
-            R = R + h->edge()->new_pos;
-            h = h->twin()->next();
-        }while(h!=v->halfedge());
-
-        float n = 1.0f*(v->degree());
-
-        Q /= n;
-        R /= n;
-
-        v->new_pos = (Q+2*R+(n-3)*S)/n;
-    }
+    std::string err = subdivide_positions(*this, Subdivision_Scheme::catmull_clark);
+    if (!err.empty())
+        warn("Catmull-Clark subdivision: %s", err.c_str());
 }
 
 /*
@@ -946,48 +1202,38 @@ void Halfedge_Mesh::catmullclark_subdivide_positions() {
 */
 void Halfedge_Mesh::loop_subdivide() {
 
-    // Compute new positions for all the vertices in the input mesh, using
-    // the Loop subdivision rule, and store them in Vertex::new_pos.
-    // -> At this point, we also want to mark each vertex as being a vertex of the
-    //    original mesh. Use Vertex::is_new for this.
-    // -> Next, compute the updated vertex positions associated with edges, and
-    //    store it in Edge::new_pos.
-    // -> Next, we're going to split every edge in the mesh, in any order.  For
-    //    future reference, we're also going to store some information about which
-    //    subdivided edges come from splitting an edge in the original mesh, and
-    //    which edges are new, by setting the flat Edge::is_new. Note that in this
-    //    loop, we only want to iterate over edges of the original mesh.
-    //    Otherwise, we'll end up splitting edges that we just split (and the
-    //    loop will never end!)
-    // -> Now flip any new edge that connects an old and new vertex.
-    // -> Finally, copy the new vertex positions into final Vertex::pos.
-
-    // Each vertex and edge of the original surface can be associated with a
-    // vertex in the new (subdivided) surface.
-    // Therefore, our strategy for computing the subdivided vertex locations is to
-    // *first* compute the new positions
-    // using the connectivity of the original (coarse) mesh; navigating this mesh
-    // will be much easier than navigating
-    // the new subdivided (fine) mesh, which has more elements to traverse.  We
-    // will then assign vertex positions in
-    // the new mesh based on the values we computed for the original mesh.
-
-    // Compute updated positions for all the vertices in the original mesh, using
-    // the Loop subdivision rule.
-
-    // Next, compute the updated vertex positions associated with edges.
-
-    // Next, we're going to split every edge in the mesh, in any order. For
-    // future reference, we're also going to store some information about which
-    // subdivided edges come from splitting an edge in the original mesh, and
-    // which edges are new.
-    // In this loop, we only want to iterate over edges of the original
-    // mesh---otherwise, we'll end up splitting edges that we just split (and
-    // the loop will never end!)
-
-    // Finally, flip any new edge that connects an old and new vertex.
-
-    // Copy the updated vertex positions to the subdivided mesh.
+    // Rather than splitting and flipping edges one at a time, the new positions and
+    // the 4x refined triangles are computed in bulk from flat tables of the coarse
+    // mesh (see loop_subdivide in subdivision.h), and the mesh is rebuilt from them.
+    Mesh_Polygons numbered(*this);
+    std::vector<Vec3> positions(numbered.verts.size());
+    for (size_t i = 0; i < positions.size(); i++)
+        positions[i] = numbered.verts[i]->pos;
+
+    std::vector<Index> triangles;
+    std::vector<Vec3> refined;
+    Subdivision_Timing timing;
+    std::string err = ::loop_subdivide(numbered.polygons, positions, triangles, refined,
+                                       debug_data.mesh_threads, &timing);
+    if (!err.empty()) {
+        warn("Loop subdivision: %s", err.c_str());
+        return;
+    }
+
+    std::vector<std::vector<Index>> polygons(triangles.size() / 3);
+    for (size_t i = 0; i < polygons.size(); i++)
+        polygons[i] = {triangles[3 * i], triangles[3 * i + 1], triangles[3 * i + 2]};
+    err = from_poly(polygons, refined);
+    if (!err.empty()) {
+        warn("Loop subdivision: %s", err.c_str());
+        return;
+    }
+
+    if (debug_data.mesh_timing)
+        info("Loop subdivision: %zu -> %zu triangles, tables %.2f ms, edges %.2f ms, "
+             "vertices %.2f ms, triangles %.2f ms",
+             numbered.polygons.size(), polygons.size(), timing.topology_ms, timing.edge_ms,
+             timing.vertex_ms, timing.connect_ms);
 }
 
 /*
@@ -997,143 +1243,30 @@ void Halfedge_Mesh::loop_subdivide() {
 */
 bool Halfedge_Mesh::isotropic_remesh() {
 
-    // Compute the mean edge length.
-    // Repeat the four main steps for 5 or 6 iterations
-    // -> Split edges much longer than the target length (being careful about
-    //    how the loop is written!)
-    // -> Collapse edges much shorter than the target length.  Here we need to
-    //    be EXTRA careful about advancing the loop, because many edges may have
-    //    been destroyed by a collapse (which ones?)
-    // -> Now flip each edge if it improves vertex degree
-    // -> Finally, apply some tangential smoothing to the vertex positions
-
-    return false;
-}
-
-/* Helper type for quadric simplification */
-struct Edge_Record {
-
-    Edge_Record() {}
-    Edge_Record(std::unordered_map<Halfedge_Mesh::VertexRef, Mat4> &vertex_quadrics,
-                Halfedge_Mesh::EdgeRef e)
-        : edge(e) {
-
-        // Compute the combined quadric from the edge endpoints.
-        // -> Build the 3x3 linear system whose solution minimizes the quadric error
-        Mat4 K = Mat4::Zero;
-        K = K + vertex_quadrics[e->halfedge()->vertex()];
-        K = K + vertex_quadrics[e->halfedge()->twin()->vertex()];
-
-        Mat4 A = Mat4::I;
-        A [0][0] = K[0][0];
-        A [0][1] = K[0][1];
-        A [0][2] = K[0][2];
-        A [1][0] = K[1][0];
-        A [1][1] = K[1][1];
-        A [1][2] = K[1][2];
-        A [2][0] = K[2][0];
-        A [2][1] = K[2][1];
-        A [2][2] = K[2][2];
-        
-        Vec3 b(K[0][3], K[1][3], K[2][3]);
+    // All four phases run on a flat copy of the mesh (see remesh.h), written back
+    // once at the end
+    Flat_Halfedge_Mesh flat(*this);
 
-        optimal = A.inverse() * b;  
+    Remesh_Stats stats;
+    if (!::isotropic_remesh(flat, 6, debug_data.mesh_threads, &stats))
+        return false;
 
-        Vec4 homoX(optimal[0],optimal[1],optimal[2],1.0f);
-        cost = dot(K*homoX,homoX);
-
-        //    associated with these two endpoints.
-        // -> Use this system to solve for the optimal position, and store it in
-        //    Edge_Record::optimal.
-        // -> Also store the cost associated with collapsing this edge in
-        //    Edge_Record::cost.
+    std::string err = flat.to_halfedge_mesh(*this);
+    if (!err.empty()) {
+        warn("Remeshing: %s", err.c_str());
+        return false;
     }
-    
-    Halfedge_Mesh::EdgeRef edge;
-    Vec3 optimal;
-    float cost;
-};
 
-bool operator<(const Edge_Record &r1, const Edge_Record &r2) {
-    if (r1.cost != r2.cost) {
-        return r1.cost < r2.cost;
-    }
-    Halfedge_Mesh::EdgeRef e1 = r1.edge;
-    Halfedge_Mesh::EdgeRef e2 = r2.edge;
-    return &*e1 < &*e2;
+    if (debug_data.mesh_timing)
+        info("Remeshing: %zu -> %zu triangles, bvh %.2f ms, splits %.2f ms, collapses %.2f ms, "
+             "flips %.2f ms, smoothing %.2f ms (%zu splits, %zu collapses, %zu flips, "
+             "%zu rounds)",
+             stats.faces_before, stats.faces_after, stats.bvh_ms, stats.split_ms,
+             stats.collapse_ms, stats.flip_ms, stats.smooth_ms, stats.splits, stats.collapses,
+             stats.flips, stats.rounds);
+    return true;
 }
 
-/** Helper type for quadric simplification
- *
- * A PQueue is a minimum-priority queue that
- * allows elements to be both inserted and removed from the
- * queue.  Together, one can easily change the priority of
- * an item by removing it, and re-inserting the same item
- * but with a different priority.  A priority queue, for
- * those who don't remember or haven't seen it before, is a
- * data structure that always keeps track of the item with
- * the smallest priority or "score," even as new elements
- * are inserted and removed.  Priority queues are often an
- * essential component of greedy algorithms, where one wants
- * to iteratively operate on the current "best" element.
- *
- * PQueue is templated on the type T of the object
- * being queued.  For this reason, T must define a comparison
- * operator of the form
- *
- *    bool operator<( const T& t1, const T& t2 )
- *
- * which returns true if and only if t1 is considered to have a
- * lower priority than t2.
- *
- * Basic use of a PQueue might look
- * something like this:
- *
- *    // initialize an empty queue
- *    PQueue<myItemType> queue;
- *
- *    // add some items (which we assume have been created
- *    // elsewhere, each of which has its priority stored as
- *    // some kind of internal member variable)
- *    queue.insert( item1 );
- *    queue.insert( item2 );
- *    queue.insert( item3 );
- *
- *    // get the highest priority item currently in the queue
- *    myItemType highestPriorityItem = queue.top();
- *
- *    // remove the highest priority item, automatically
- *    // promoting the next-highest priority item to the top
- *    queue.pop();
- *
- *    myItemType nextHighestPriorityItem = queue.top();
- *
- *    // Etc.
- *
- *    // We can also remove an item, making sure it is no
- *    // longer in the queue (note that this item may already
- *    // have been removed, if it was the 1st or 2nd-highest
- *    // priority item!)
- *    queue.remove( item2 );
- *
- */
-template <class T> struct PQueue {
-    void insert(const T &item) { queue.insert(item); }
-    void remove(const T &item) {
-        if (queue.find(item) != queue.end()) {
-            queue.erase(item);
-        }
-    }
-    //bool operator<( const T& t1, const T& t2 ){
-    //    return t1.cost < t2.cost;
-    //}
-    const T &top(void) const { return *(queue.begin()); }
-    void pop(void) { queue.erase(queue.begin()); }
-    size_t size() { return queue.size(); }
-
-    std::set<T> queue;
-};
-
 /*
         Mesh simplification. Note that this function returns success in a similar
         manner to the local operations, except with only a boolean value.
@@ -1142,193 +1275,30 @@ template <class T> struct PQueue {
 */
 bool Halfedge_Mesh::simplify() {
 
-    std::unordered_map<VertexRef, Mat4> vertex_quadrics;
-    std::unordered_map<FaceRef, Mat4> face_quadrics;
-    std::unordered_map<EdgeRef, Edge_Record> edge_records;
-    PQueue<Edge_Record> edge_queue;
-
-    // Compute initial quadrics for each face by simply writing the plane equation
-    // for the face in homogeneous coordinates. These quadrics should be stored
-    // in face_quadrics 
-    for (auto f = faces.begin(); f!=faces.end();f++)
-    {
-        // is the d the position of the surface or vertices?
-        //float d = 1.0f * dot(f->normal(), f->halfedge()->vertex()->pos);
-        float d = 1.0f * dot(f->normal(), f->center());
-        Vec4 v(f->normal(), d);
-        Mat4 m_face = Mat4::Zero;
-        m_face = outer(v,v);
-        face_quadrics.insert({f,m_face});
-    }
-
-    // -> Compute an initial quadric for each vertex as the sum of the quadrics
-    //    associated with the incident faces, storing it in vertex_quadrics
-    for (auto vtx = vertices.begin(); vtx!=vertices.end(); vtx++){
-        Halfedge_Mesh::HalfedgeRef h = vtx->halfedge();
-        Mat4 m_quadric = Mat4::Zero;
-
-        do{
-            m_quadric = m_quadric + face_quadrics[h->face()];
-            h = h->twin()->next();
-        }while(h!=vtx->halfedge());
-
-        vertex_quadrics.insert({vtx,m_quadric});
+    // Quadrics, costs and collapses all run on a flat copy of the mesh indexed by
+    // element (see simplify.h), which is written back once at the end
+    Flat_Halfedge_Mesh flat(*this);
+    size_t triangles = 0;
+    for (Index f = 0; f < flat.face_capacity(); f++)
+        triangles += flat.face_alive(f) && !flat.boundary[f];
+
+    Simplify_Stats stats;
+    bool simplified = debug_data.batched_simplify
+                          ? simplify_batched(flat, triangles / 4, debug_data.mesh_threads, &stats)
+                          : ::simplify(flat, triangles / 4, debug_data.mesh_threads, &stats);
+    if (!simplified)
+        return false;
+
+    std::string err = flat.to_halfedge_mesh(*this);
+    if (!err.empty()) {
+        warn("Simplification: %s", err.c_str());
+        return false;
     }
-    
-    // -> Build a priority queue of edges according to their quadric error cost,
-    //    i.e., by building an Edge_Record for each edge and sticking it in the
-    //    queue. You may want to use the above PQueue<Edge_Record> for this.
-    for (auto e = edges.begin(); e!=edges.end(); e++){
-        Edge_Record record(vertex_quadrics,e->halfedge()->edge());
-        edge_records.insert({e->halfedge()->edge(),record});
-        edge_queue.insert(record);
-    }
-
-    // -> Until we reach the target edge budget, collapse the best edge. Remember
-    //    to remove from the queue any edge that touches the collapsing edge
-    //    BEFORE it gets collapsed, and add back into the queue any edge touching
-    //    the collapsed vertex AFTER it's been collapsed. Also remember to assign
-    //    a quadric to the collapsed vertex, and to pop the collapsed edge off the
-    //    top of the queue.
-    auto targetnum_triangle = faces.size();
-    targetnum_triangle/=4;
-
-    for (int i=0; i<=targetnum_triangle; i++){
-
-        //std::cout<<"total edge"<< faces.size() <<std::endl;
-        std::cout<<" "<<std::endl;
-        std::cout<<"Start"<<std::endl;
-        std::cout<<""<< "vertex_quadrics length " <<vertex_quadrics.size()<<std::endl;
-        std::cout<<""<< "face_quadrics length " <<face_quadrics.size()<<std::endl;
-        std::cout<<""<< "edge_records length " <<edge_records.size()<<std::endl;
-        std::cout<<""<< "edge_queue length " <<edge_queue.size()<<std::endl;
-
-        // 获得cost最小的点
-        Edge_Record be = edge_queue.top();
-
-        // 从顶点-矩阵哈希表中删除两个和edge相关的顶点
-        vertex_quadrics.erase(vertex_quadrics.find(be.edge->halfedge()->vertex()));
-        vertex_quadrics.erase(vertex_quadrics.find(be.edge->halfedge()->twin()->vertex()));
-        
-        // 从 边-矩阵 哈希表中把边删掉
-        edge_records.erase(edge_records.find(be.edge));
-
-        // 把这个点的struct 从edge queue里面删掉
-        edge_queue.pop();
-
-
-        HalfedgeRef h1 = be.edge->halfedge()->next();
-		HalfedgeRef h2 = be.edge->halfedge()->twin()->next();
-
-        int count = 0;
-        do
-		{
-            count ++;
-            //std::cout<<"remove edge left " << h1->edge()->id() << " from Edge_Record "<< std::endl;
-            // 从 分数表 中把边删掉
-			edge_queue.remove(edge_records[h1->edge()]);
-            // 从 面-矩阵 哈希表中把所有和两个顶点相接的面都删掉
-			face_quadrics.erase(face_quadrics.find(h1->face()));
-            // 从 边-矩阵 哈希表中把所有相关的边都删掉
-            edge_records.erase(edge_records.find(h1->edge()));
-
-			h1 = h1->twin()->next();
-		}while(h1 != be.edge->halfedge()->twin());
-		//std::cout<<"remove " << count << "edges connected to the left vertex"<< std::endl;
-  
-        count = 0;
-
-		do
-		{
-            count ++;
-            // 从 分数表 中把边删掉
-			edge_queue.remove(edge_records[h2->edge()]);
-            // 从 面-矩阵 哈希表中把所有和两个顶点相接的面都删掉
-            face_quadrics.erase(face_quadrics.find(h2->face()));	
-            // 从 边-矩阵 哈希表中把所有相关的边都删掉
-            edge_records.erase(edge_records.find(h2->edge()));
-
-			h2 = h2->twin()->next();
-		}while(h2 != be.edge->halfedge());
-        //std::cout<<"remove " << count << "edges connected to the right vertex"<< std::endl;
-
-        std::optional<VertexRef> cv = collapse_edge(be.edge);
-        VertexRef newV = cv.value();
-        newV->pos = be.optimal;
-
-        // 重新计算每个面的quadric
-        HalfedgeRef new_he = newV->halfedge();
-        count = 0;
-        Mat4 newV_quadric = Mat4::Zero;
-        do
-		{
-            count ++;
-            FaceRef  f = new_he->face();
-			float d = 1.0f * dot(f->normal(), f->center());
-            Vec4 v(f->normal(), d);
-            Mat4 m_face = Mat4::Zero;
-            m_face = outer(v,v);
-            
-            // 把周围一圈面 加入 面-矩阵 哈希表中
-            face_quadrics.insert({f,m_face});
-
-            // 把这个面累加到这个点的quadric中
-            newV_quadric = newV_quadric + face_quadrics[f];
-
-            new_he = new_he ->twin()->next();
-		}while(new_he != newV->halfedge());
-
-        //增加一个新的点到 顶点-矩阵 哈希表中
-        vertex_quadrics.insert({newV,newV_quadric});
-        //std::cout<<"add " << count << "edges connected to the new vertex"<< std::endl;
-
-        count = 0;
-        new_he = newV->halfedge();
-        //更新其他和删除边缘相接的点的 顶点-矩阵 哈希表
-        do
-		{
-            count ++;
-            // 对每一顶点，创建一个空矩阵
-            Mat4 current_V_qua = Mat4::Zero;
-            // 获取顶点
-            VertexRef twinV = new_he->twin()->vertex();
-            // 获取顶点的halfedge
-            HalfedgeRef twinVhe = twinV->halfedge();
-            //遍历与这些点相接的所有面
-            do{
-                current_V_qua = current_V_qua + face_quadrics[twinVhe->face()];
-                twinVhe = twinVhe->twin()->next();
-            }while(twinVhe != twinV->halfedge());
-            //跟新这个顶点的 顶点-矩阵哈希表
-            vertex_quadrics[twinV] = current_V_qua;
-
-            new_he = new_he->twin()->next();
-		}while(new_he != newV->halfedge());
-
-        std::cout<<"update "<< count <<"vertexs' quadric"<<std::endl;
-        
-        count = 0;
-        new_he = newV->halfedge();
-        do{
-            count ++;
-            Edge_Record record(vertex_quadrics,new_he->edge());
-            // 把新的边加入到 边-矩阵 哈希表中
-            edge_records.insert({new_he->edge(), record});
-            // 把新的边加入Queue中
-            edge_queue.insert(record);
-	    	new_he = new_he->twin()->next();
-		}while(new_he != newV->halfedge());
-        //std::cout<<"add " << count << "edges to edge record"<< std::endl;
-
-        
-        std::cout<<""<< "vertex_quadrics length " <<vertex_quadrics.size()<<std::endl;
-        std::cout<<""<< "face_quadrics length " <<face_quadrics.size()<<std::endl;
-        std::cout<<""<< "edge_records length " <<edge_records.size()<<std::endl;
-        std::cout<<""<< "edge_queue length " <<edge_queue.size()<<std::endl;
-        std::cout<<"End"<<std::endl;
-    }
-
-    
 
+    if (debug_data.mesh_timing)
+        info("Simplification: %zu -> %zu triangles, quadrics %.2f ms, costs %.2f ms, "
+             "select %.2f ms, collapses %.2f ms, updates %.2f ms (%zu rounds, %zu rejected)",
+             stats.faces_before, stats.faces_after, stats.quadric_ms, stats.cost_ms,
+             stats.select_ms, stats.collapse_ms, stats.update_ms, stats.rounds, stats.rejected);
     return true;
 }
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "../rays/bsdf.h"
+
+/* Rough microfacet BSDFs:
+
+    Both BSDFs use the GGX (Trowbridge-Reitz) normal distribution with the
+    height-correlated Smith masking-shadowing term, and sample microfacet normals
+    from the distribution of normals visible from out_dir (VNDF, Heitz 2018), which
+    never produces directions below the surface and keeps the sample weights close
+    to constant. As everywhere in the pathtracer, directions are in the local frame
+    where the surface normal is (0,1,0).
+
+    They have the same interface as the other BSDF_* types, plus pdf(out_dir, in_dir),
+    which returns exactly the density sample() draws in_dir with. They are not yet
+    alternatives of the BSDF variant (rays/bsdf.h), and scene materials can't select
+    them, so the pathtracer does not render them; only the GGX sampling check in the
+    debug menu runs them.
+
+    roughness is the GGX alpha parameter (0 = smooth, 1 = very rough); values below
+    min_roughness are clamped to keep the distribution finite.
+*/
+
+namespace PT {
+
+namespace GGX {
+
+constexpr float min_roughness = 1e-3f;
+
+// Normal distribution D(h)
+float D(Vec3 h, float alpha);
+// Smith masking of a single direction G1(v), and height-correlated G2(o, i)
+float G1(Vec3 v, float alpha);
+float G2(Vec3 o, Vec3 i, float alpha);
+// Samples a microfacet normal visible from v (v.y > 0) given two uniform numbers
+Vec3 sample_visible_normal(Vec3 v, float alpha, float u1, float u2);
+// Density of sample_visible_normal, with respect to solid angle of h
+float visible_normal_pdf(Vec3 v, Vec3 h, float alpha);
+
+// Unpolarized Fresnel reflectance of a dielectric interface; cos_i is the cosine on
+// the incident side with eta_i / eta_t the indices of refraction on either side
+float fresnel_dielectric(float cos_i, float eta_i, float eta_t);
+
+} // namespace GGX
+
+// Rough metal: reflectance is the color at normal incidence (Schlick Fresnel)
+struct BSDF_GGX_Conductor {
+
+    BSDF_GGX_Conductor(Spectrum reflectance, float roughness)
+        : reflectance(reflectance), roughness(roughness) {}
+
+    BSDF_Sample sample(Vec3 out_dir) const;
+    Spectrum evaluate(Vec3 out_dir, Vec3 in_dir) const;
+    float pdf(Vec3 out_dir, Vec3 in_dir) const;
+
+    Spectrum reflectance;
+    float roughness;
+};
+
+// Rough glass: reflects or transmits according to the exact dielectric Fresnel term
+struct BSDF_GGX_Dielectric {
+
+    BSDF_GGX_Dielectric(Spectrum transmittance, Spectrum reflectance, float roughness, float ior)
+        : transmittance(transmittance), reflectance(reflectance), roughness(roughness),
+          index_of_refraction(ior) {}
+
+    BSDF_Sample sample(Vec3 out_dir) const;
+    Spectrum evaluate(Vec3 out_dir, Vec3 in_dir) const;
+    float pdf(Vec3 out_dir, Vec3 in_dir) const;
+
+    Spectrum transmittance;
+    Spectrum reflectance;
+    float roughness;
+    float index_of_refraction;
+};
+
+// Samples both BSDFs at several roughnesses and angles, checks that sample() agrees with
+// pdf() and evaluate() and that the pdf integrates to what sample() draws, and logs the
+// result
+void ggx_consistency_check();
+
+} // namespace PT
@@ -0,0 +1,50 @@
+
+#include "motion_bvh.h"
+#include "debug.h"
+#include "render_shared.h"
+#include "scene_probe.h"
+
+namespace PT {
+
+struct Motion_Scene {
+    uint64_t revision = 0;
+    int object = 0;
+    Vec3 offset;
+    Motion_BVH<Moving<Object_Ref>> bvh;
+};
+static Render_Shared<Motion_Scene> scenes;
+
+const Motion_BVH<Moving<Object_Ref>> *motion_scene() {
+
+    if (!debug_data.motion_blur)
+        return nullptr;
+
+    uint64_t revision = scene_revision();
+    Vec3 offset(debug_data.motion_offset[0], debug_data.motion_offset[1],
+                debug_data.motion_offset[2]);
+
+    static thread_local Render_Shared<Motion_Scene>::Handle handle;
+    const Motion_Scene *current = scenes.get(
+        handle,
+        [&](const Motion_Scene &s) {
+            return s.revision == revision && s.object == debug_data.motion_object &&
+                   s.offset == offset;
+        },
+        [&]() {
+            auto s = std::make_shared<Motion_Scene>();
+            s->revision = revision;
+            s->object = debug_data.motion_object;
+            s->offset = offset;
+            std::vector<Moving<Object_Ref>> prims;
+            prims.reserve(scene_objects());
+            for (size_t i = 0; i < scene_objects(); i++) {
+                Mat4 end = (int)i == s->object ? Mat4::translate(offset) : Mat4::I;
+                prims.emplace_back(Object_Ref{scene_object(i)}, Mat4::I, end);
+            }
+            s->bvh.build(std::move(prims));
+            return s;
+        });
+    return &current->bvh;
+}
+
+} // namespace PT
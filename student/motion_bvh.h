@@ -0,0 +1,232 @@
+#pragma once
+
+#include <algorithm>
+#include <stack>
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../rays/trace.h"
+#include "scene_probe.h"
+
+/* Motion blur:
+
+    A Motion_BVH is built over primitives that move linearly during the shutter
+    interval [0, 1]. Every node stores its bounds at both ends of the interval, and
+    traversal tests a ray with shutter time t against the bounds interpolated to t.
+    Because each point of a linearly moving primitive stays within the interpolation
+    of its start and end boxes, the interpolated node bounds stay conservative, and a
+    blurred frame costs one traversal per ray instead of one render per sub-frame.
+
+    The Primitive interface is the same as for BVH, with an added shutter time:
+        BBox bbox(float time) const;      // time is 0 or 1
+        Trace hit(const Ray& ray, float time) const;
+
+    Moving<Primitive> adapts any static BVH primitive (e.g. an Object) whose transform
+    changes from start to end of the shutter.
+
+    Ray has no time of its own, so the time is that of the camera ray a path started
+    from (see Camera_Ray::time). With debug_data.motion_blur set, trace_pixel gets
+    motion_scene(): every scene object, with debug_data.motion_object moving by
+    debug_data.motion_offset while the shutter is open, and traces it in place of the
+    static scene. Area lights, the emissive lights (emissive.h) and caustic photons
+    still see the scene as it is when the shutter opens.
+*/
+
+namespace PT {
+
+template <typename Primitive> class Motion_BVH {
+public:
+    Motion_BVH() = default;
+    Motion_BVH(std::vector<Primitive> &&prims, size_t max_leaf_size = 4) {
+        build(std::move(prims), max_leaf_size);
+    }
+
+    void build(std::vector<Primitive> &&prims, size_t max_leaf_size = 4);
+    Trace hit(const Ray &ray, float time) const;
+    BBox bbox() const;
+
+private:
+    struct Node {
+        BBox bbox0, bbox1; // bounds at shutter open / close
+        size_t start, size, l, r;
+        bool is_leaf() const { return l == 0 && r == 0; }
+    };
+
+    static BBox lerp(const BBox &a, const BBox &b, float t) {
+        return BBox(a.min * (1.0f - t) + b.min * t, a.max * (1.0f - t) + b.max * t);
+    }
+
+    std::vector<Node> nodes;
+    std::vector<Primitive> primitives;
+};
+
+template <typename Primitive>
+void Motion_BVH<Primitive>::build(std::vector<Primitive> &&prims, size_t max_leaf_size) {
+
+    nodes.clear();
+    primitives = std::move(prims);
+    if (primitives.empty())
+        return;
+
+    // Partition on the centroid of the box swept over the whole shutter interval
+    struct Build_Prim {
+        BBox b0, b1;
+        Vec3 centroid;
+    };
+    std::vector<Build_Prim> info(primitives.size());
+    for (size_t i = 0; i < primitives.size(); i++) {
+        info[i].b0 = primitives[i].bbox(0.0f);
+        info[i].b1 = primitives[i].bbox(1.0f);
+        BBox swept = info[i].b0;
+        swept.enclose(info[i].b1);
+        info[i].centroid = swept.center();
+    }
+    std::vector<size_t> order(primitives.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+
+    auto make_node = [&](size_t start, size_t size) {
+        Node n;
+        for (size_t i = start; i < start + size; i++) {
+            n.bbox0.enclose(info[order[i]].b0);
+            n.bbox1.enclose(info[order[i]].b1);
+        }
+        n.start = start;
+        n.size = size;
+        n.l = n.r = 0;
+        nodes.push_back(n);
+        return nodes.size() - 1;
+    };
+
+    std::stack<size_t> todo;
+    todo.push(make_node(0, primitives.size()));
+    while (!todo.empty()) {
+        size_t idx = todo.top();
+        todo.pop();
+        Node node = nodes[idx];
+        if (node.size <= max_leaf_size)
+            continue;
+
+        // Median split along the widest axis of the centroid bounds
+        BBox cbox;
+        for (size_t i = node.start; i < node.start + node.size; i++)
+            cbox.enclose(info[order[i]].centroid);
+        Vec3 extent = cbox.max - cbox.min;
+        int axis = 0;
+        if (extent.y > extent[axis])
+            axis = 1;
+        if (extent.z > extent[axis])
+            axis = 2;
+        if (extent[axis] <= 0.0f)
+            continue;
+
+        auto first = order.begin() + node.start;
+        auto mid = first + node.size / 2;
+        std::nth_element(first, mid, first + node.size, [&](size_t a, size_t b) {
+            return info[a].centroid[axis] < info[b].centroid[axis];
+        });
+
+        size_t half = node.size / 2;
+        size_t l = make_node(node.start, half);
+        size_t r = make_node(node.start + half, node.size - half);
+        nodes[idx].l = l;
+        nodes[idx].r = r;
+        todo.push(l);
+        todo.push(r);
+    }
+
+    std::vector<Primitive> sorted;
+    sorted.reserve(primitives.size());
+    for (size_t i : order)
+        sorted.push_back(std::move(primitives[i]));
+    primitives = std::move(sorted);
+}
+
+template <typename Primitive> Trace Motion_BVH<Primitive>::hit(const Ray &ray, float time) const {
+
+    Trace ret;
+    if (nodes.empty())
+        return ret;
+
+    // Reused between calls, so tracing a ray does not allocate
+    static thread_local std::vector<size_t> todo;
+    todo.clear();
+    todo.push_back(0);
+    while (!todo.empty()) {
+        const Node &node = nodes[todo.back()];
+        todo.pop_back();
+
+        Vec2 times(ray.time_bounds[0], ray.time_bounds[1]);
+        if (!lerp(node.bbox0, node.bbox1, time).hit(ray, times))
+            continue;
+        if (ret.hit && times.x > ret.time)
+            continue;
+
+        if (node.is_leaf()) {
+            for (size_t i = node.start; i < node.start + node.size; i++)
+                ret = Trace::min(ret, primitives[i].hit(ray, time));
+        } else {
+            todo.push_back(node.l);
+            todo.push_back(node.r);
+        }
+    }
+    return ret;
+}
+
+template <typename Primitive> BBox Motion_BVH<Primitive>::bbox() const {
+    if (nodes.empty())
+        return BBox();
+    BBox box = nodes[0].bbox0;
+    box.enclose(nodes[0].bbox1);
+    return box;
+}
+
+// A primitive whose object-to-world transform is interpolated linearly between
+// start and end over the shutter interval
+template <typename Primitive> class Moving {
+public:
+    Moving(Primitive &&prim, const Mat4 &start, const Mat4 &end)
+        : prim(std::move(prim)), start(start), end(end), still(start == end && start == Mat4::I) {
+    }
+
+    BBox bbox(float time) const {
+        BBox box = prim.bbox();
+        if (!still)
+            box.transform(at(time));
+        return box;
+    }
+
+    Trace hit(const Ray &ray, float time) const {
+        if (still)
+            return prim.hit(ray);
+        Mat4 T = at(time);
+        Mat4 iT = T.inverse();
+        Ray local = ray;
+        local.transform(iT);
+        Trace ret = prim.hit(local);
+        ret.transform(T, iT.T());
+        return ret;
+    }
+
+private:
+    // Interpolating the matrices moves every point on a straight line, which keeps
+    // the interpolated bounds in Motion_BVH conservative
+    Mat4 at(float time) const {
+        Mat4 m;
+        for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 4; j++)
+                m[i][j] = start[i][j] * (1.0f - time) + end[i][j] * time;
+        return m;
+    }
+
+    Primitive prim;
+    Mat4 start, end;
+    bool still; // start and end are the identity
+};
+
+// The scene's objects, with debug_data.motion_object moving by debug_data.motion_offset
+// over the shutter; null unless debug_data.motion_blur is set. Rebuilt when the scene or
+// the motion changes, and valid until the calling thread's next call.
+const Motion_BVH<Moving<Object_Ref>> *motion_scene();
+
+} // namespace PT
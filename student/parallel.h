@@ -0,0 +1,59 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+/* Data-parallel loops for the mesh passes:
+
+    parallel_for(n, threads, f) calls f(begin, end) on disjoint ranges covering [0, n),
+    one range per thread, with the calling thread taking the first. threads = 0 uses
+    every hardware thread. Ranges smaller than min_per_thread are not worth a thread,
+    so small meshes run serially on the caller.
+
+    The passes also share a few small helpers: their timers, the lock-free minimum
+    they use to claim vertices, and the bit mixer that scatters their batch keys.
+*/
+
+template<typename F>
+void parallel_for(size_t n, size_t threads, F &&f, size_t min_per_thread = 4096) {
+
+    if (!threads)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    threads = std::min(threads, std::max(n / std::max(min_per_thread, size_t(1)), size_t(1)));
+
+    size_t per = (n + threads - 1) / threads;
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; t++) {
+        size_t begin = std::min(t * per, n), end = std::min(begin + per, n);
+        if (begin < end)
+            workers.emplace_back([&f, begin, end]() { f(begin, end); });
+    }
+    f(0, std::min(per, n));
+    for (std::thread &w : workers)
+        w.join();
+}
+
+// Milliseconds since start, for the passes' timing stats
+inline double ms_since(std::chrono::steady_clock::time_point start) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+// Lowers slot to key if key is smaller
+inline void atomic_min(std::atomic<uint64_t> &slot, uint64_t key) {
+    uint64_t current = slot.load(std::memory_order_relaxed);
+    while (key < current && !slot.compare_exchange_weak(current, key, std::memory_order_relaxed)) {
+    }
+}
+
+// Mixes the bits of x (the MurmurHash3 finalizer), so keys ordered by it scatter
+// over the mesh
+inline uint32_t mix_bits(uint32_t x) {
+    x = (x ^ (x >> 16)) * 0x85ebca6bu;
+    x = (x ^ (x >> 13)) * 0xc2b2ae35u;
+    return x ^ (x >> 16);
+}
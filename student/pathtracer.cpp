@@ -2,11 +2,133 @@
 #include "../rays/pathtracer.h"
 #include "../rays/samplers.h"
 #include "../util/rand.h"
+#include "camera_rays.h"
+#include "chunked_mesh.h"
 #include "debug.h"
+#include "denoise.h"
+#include "emissive.h"
+#include "guiding.h"
+#include "motion_bvh.h"
+#include "photon_map.h"
+#include "profiler.h"
+#include "radiance_cache.h"
+#include "shade_batch.h"
+#include "sphere_packet.h"
+#include "spectrum4.h"
+#include "stats.h"
+#include <algorithm>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
 
 namespace PT {
 
+// Guiding field used by the paths of the pixel currently traced on this thread; null
+// when path guiding is disabled
+static thread_local Guide_Field *pixel_guide = nullptr;
+
+// Radiance cache used by the current pixel, or null when caching is disabled; and
+// whether the path being traced has already bounced off a diffuse surface
+static thread_local Radiance_Cache *pixel_cache = nullptr;
+static thread_local bool bounced_diffuse = false;
+
+// Caustic photons for the current pixel, when the caustic integrator is selected
+static thread_local const Photon_Map *pixel_photons = nullptr;
+
+// Emissive geometry sampled as lights for the current pixel, or null when there is none;
+// and the density with which the ray being traced was sampled at the surface it left,
+// negative when that surface did not sample lights (camera rays, discrete bounces), so
+// the emission the ray finds counts in full
+static thread_local const Emissive_Lights *pixel_emitters = nullptr;
+static thread_local float bounce_pdf = -1.0f;
+
+// The out-of-core mesh rendered along with the scene, if any (see chunked_mesh.h)
+static thread_local const Chunked_Mesh *pixel_chunked = nullptr;
+
+// The scene in motion, traced instead of the static scene while motion blur is on, and
+// the shutter time of the camera ray being traced (see motion_bvh.h)
+static thread_local const Motion_BVH<Moving<Object_Ref>> *pixel_motion = nullptr;
+static thread_local float ray_time = 0.0f;
+
+// The scene with its spheres in packets, if enabled (see sphere_packet.h)
+static thread_local const Packed_Scene *pixel_packed = nullptr;
+
+static Trace hit_scene(const BVH<Object> &scene, const Ray &ray) {
+    if (pixel_motion)
+        return pixel_motion->hit(ray, ray_time);
+    if (pixel_packed)
+        return pixel_packed->hit(ray);
+    return scene.hit(ray);
+}
+
+// What a ray hits in the scene and the chunked mesh, and whether the chunked mesh was
+// the closer
+struct Scene_Hit {
+    Trace hit;
+    bool chunked = false;
+};
+static Scene_Hit intersect(const BVH<Object> &scene, const Ray &ray, size_t n_materials) {
+    TRAVERSAL_STAT(rays, 1);
+    PROFILE_SCOPE(traversal);
+    Scene_Hit result;
+    result.hit = hit_scene(scene, ray);
+    result.chunked = hit_chunked(pixel_chunked, ray, result.hit, n_materials);
+    return result;
+}
+
+// The first hit of the camera ray trace_ray is about to trace, when trace_pixel has
+// already found it; trace_ray uses and clears it
+static thread_local const Scene_Hit *known_hit = nullptr;
+
+// Power heuristic weight of a strategy with density a against one with density b; a
+// direction only one of them can produce gets weight 1 from it
+static float power_heuristic(float a, float b) {
+    if (b <= 0.0f)
+        return 1.0f;
+    float a2 = a * a, b2 = b * b;
+    return a2 / (a2 + b2);
+}
+
+// Where trace_ray stores what the current camera ray hit first, while AOVs are recorded
+struct First_Hit {
+    Spectrum albedo = Spectrum(1.0f);
+    Vec3 normal;
+    float depth = 0.0f;
+};
+static thread_local First_Hit *first_hit = nullptr;
+
+// Set by trace_ray when its ray leaves the scene, so the caller can tell whether the
+// radiance it got back came from the environment
+static thread_local bool ray_escaped = false;
+
+// Holds one of debug_data.render_threads slots while a pixel is traced. The render's
+// thread pool is sized by the pathtracer, so with a limit set, the workers beyond it
+// sleep until a pixel finishes rather than spinning on a core the limit left free.
+static std::mutex slots_lock;
+static std::condition_variable slot_freed;
+static int tracing_threads = 0;
+struct Render_Slot {
+    bool held = false;
+    Render_Slot() {
+        int limit = debug_data.render_threads;
+        if (limit <= 0)
+            return;
+        std::unique_lock<std::mutex> lock(slots_lock);
+        slot_freed.wait(lock, [limit] { return tracing_threads < limit; });
+        tracing_threads++;
+        held = true;
+    }
+    ~Render_Slot() {
+        if (!held)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(slots_lock);
+            tracing_threads--;
+        }
+        slot_freed.notify_one();
+    }
+};
+
 Spectrum Pathtracer::trace_pixel(size_t x, size_t y) {
 
     Vec2 xy((float)x, (float)y);
@@ -20,34 +142,118 @@ Spectrum Pathtracer::trace_pixel(size_t x, size_t y) {
     // Tip: Samplers::Rect::Uniform
     // Tip: you may want to use log_ray for debugging
 
-    // This currently generates a ray at the bottom left of the pixel every time.
-    Spectrum s;
-
-    float pdf = 1.0f;
-    Samplers::Rect::Uniform myUni = Samplers::Rect::Uniform();
-    
+    Render_Slot slot;
 
-    for (int i=0; i<n_samples; i++){
-        auto sample = myUni.sample(pdf); 
+    // The pixel's own scope closes before its timings are flushed below
+    Spectrum pixel;
+    {
+        PROFILE_SCOPE(pixel);
+        Spectrum4 s;
+        Traversal_Stats stats_before = traversal_stats;
+
+        pixel_guide = nullptr;
+        if (debug_data.path_guiding)
+            pixel_guide =
+                guide_field(scene.bbox(), (size_t)std::max(debug_data.guide_budget_mb, 1));
+
+        pixel_cache = nullptr;
+        if (debug_data.radiance_cache)
+            pixel_cache = radiance_cache(scene.bbox(), materials, lights,
+                                         (size_t)std::max(debug_data.cache_budget_mb, 1),
+                                         debug_data.cache_resolution);
+
+        pixel_photons = nullptr;
+        if (debug_data.integrator == 1) {
+            Photon_Settings settings;
+            settings.photons = (size_t)std::max(debug_data.photon_count, 1);
+            settings.radius = debug_data.photon_radius;
+            pixel_photons = photon_map(scene, materials, lights, settings);
+        }
 
-        float x_screen = (x+sample.x)/ out_w;
-        float y_screen = (y+sample.y)/ out_h;
+        pixel_emitters = emissive_lights(materials);
+        if (pixel_emitters->empty())
+            pixel_emitters = nullptr;
+        bounce_pdf = -1.0f;
+        pixel_chunked = render_chunked_mesh();
+        pixel_motion = motion_scene();
+        pixel_packed = pixel_motion ? nullptr : packed_scene();
+
+        // All of the pixel's camera rays are generated in one batch
+        static thread_local std::vector<Camera_Ray> camera_rays;
+        generate_tile(camera, x, y, 1, 1, out_w, out_h, n_samples, camera_rays);
+
+        bool aovs = debug_data.output_aovs;
+        if (aovs)
+            aov_prepare(out_w, out_h);
+        First_Hit aov_sum;
+        aov_sum.albedo = {};
+
+        // Find every camera ray's first hit, then shade the samples grouped by the
+        // material they hit (see shade_batch.h)
+        static thread_local std::vector<Scene_Hit> scene_hits;
+        static thread_local std::vector<Trace> camera_hits;
+        static thread_local std::vector<uint32_t> order;
+        scene_hits.resize(camera_rays.size());
+        camera_hits.resize(camera_rays.size());
+        for (size_t k = 0; k < camera_rays.size(); k++) {
+            ray_time = camera_rays[k].time;
+            scene_hits[k] = intersect(scene, camera_rays[k].ray, materials.size());
+            camera_hits[k] = scene_hits[k].hit;
+        }
+        sort_by_material(materials, camera_hits, order);
+
+        for (uint32_t k : order) {
+            Camera_Ray &sample = camera_rays[k];
+            Ray &out = sample.ray;
+            out.depth = max_depth;
+            ray_time = sample.time;
+            First_Hit first;
+            first_hit = aovs ? &first : nullptr;
+            known_hit = &scene_hits[k];
+            s += trace_ray(out);
+            log_ray(out, 10.0f);
+            if (aovs) {
+                aov_sum.albedo += first.albedo;
+                aov_sum.normal += first.normal;
+                aov_sum.depth += first.depth;
+            }
+        }
+        first_hit = nullptr;
+    
+        pixel = (s * (1.0f / n_samples)).spectrum();
+
+        if (aovs) {
+            AOV_Buffers &buffers = aov_buffers();
+            size_t i = y * out_w + x;
+            buffers.albedo[i] = aov_sum.albedo * (1.0f / n_samples);
+            buffers.normal[i] =
+                aov_sum.normal.norm_squared() > 0.0f ? aov_sum.normal.unit() : Vec3();
+            buffers.depth[i] = aov_sum.depth / n_samples;
+        }
 
-        Ray out = camera.generate_ray(Vec2(x_screen, y_screen));
-        out.depth = max_depth;
-        s += trace_ray(out);
-        log_ray(out, 10.0f);
+        // BVH heatmap debug mode: show the average traversal work per sample instead of radiance
+        if (debug_data.bvh_heatmap) {
+            Traversal_Stats work = traversal_stats - stats_before;
+            uint64_t counts[] = {work.nodes_visited, work.boxes_tested, work.tris_tested};
+            float value = (float)counts[std::clamp(debug_data.heatmap_metric, 0, 2)] / n_samples;
+            pixel = heatmap_color(value, debug_data.heatmap_max);
+        }
     }
-    
-    s *= (float)(1.0f / n_samples);
-    return s;
+    flush_traversal_stats();
+    profiler_flush();
+    return pixel;
 }
 
 Spectrum Pathtracer::trace_ray(const Ray &ray) {
     // Trace ray into scene. If nothing is hit, sample the environment
-    Trace hit = scene.hit(ray);
+    Scene_Hit found = known_hit ? *known_hit : intersect(scene, ray, materials.size());
+    known_hit = nullptr;
+    Trace hit = found.hit;
+    bool chunked_hit = found.chunked;
+    ray_escaped = !hit.hit;
     if (!hit.hit) {
         if (env_light.has_value()) {
+            PROFILE_SCOPE(env_lookup);
             return env_light.value().sample_direction(ray.dir);
         }
         return {};
@@ -61,6 +267,12 @@ Spectrum Pathtracer::trace_ray(const Ray &ray) {
     Vec3 out_dir = world_to_object.rotate(ray.point - hit.position).unit();
     const BSDF &bsdf = materials[hit.material];
 
+    if (first_hit && ray.depth == max_depth) {
+        first_hit->albedo = bsdf_albedo(bsdf);
+        first_hit->normal = hit.normal;
+        first_hit->depth = hit.time;
+    }
+
     // Now we can compute the rendering equation at this point.
     // We split it into two stages: sampling lighting (i.e. directly connecting
     // the current path to each light in the scene), then sampling the BSDF
@@ -71,27 +283,90 @@ Spectrum Pathtracer::trace_ray(const Ray &ray) {
     // indirect lighting components calculated in the code below. The starter
     // code sets radiance_out to (0.5,0.5,0.5) so that you can test your geometry
     // queries before you implement path tracing.
-    Spectrum radiance_out =
-        debug_data.normal_colors ? Spectrum(0.1f) : Spectrum::direction(hit.normal);
+    if (!debug_data.normal_colors)
+        return Spectrum::direction(hit.normal);
+
+    // Once the path has bounced off a diffuse surface, a diffuse hit may end it with
+    // the cached outgoing radiance (see radiance_cache.h)
+    const BSDF_Lambertian *lambertian = std::get_if<BSDF_Lambertian>(&bsdf.underlying);
+    bool cacheable = pixel_cache && lambertian;
+    if (cacheable && bounced_diffuse) {
+        Spectrum cached;
+        if (pixel_cache->lookup(hit.position, hit.normal,
+                                (uint32_t)std::max(debug_data.cache_min_samples, 1), cached))
+            return cached;
+    }
+
+    // With path guiding, diffuse surfaces pick their bounce direction from a mixture of
+    // the BSDF and the distribution learned at the hit point (see below)
+    std::shared_ptr<const Guide_Field::Distribution> guide;
+    if (pixel_guide && lambertian)
+        guide = pixel_guide->lookup(hit.position);
+    float fraction = guide ? std::clamp(debug_data.guide_fraction, 0.0f, 0.99f) : 0.0f;
+
+    // Density with which the bounce below picks the object-space direction in_dir
+    auto scatter_pdf = [&](Vec3 in_dir) {
+        float pdf = 0.0f;
+        if (lambertian)
+            pdf = std::max(in_dir.y, 0.0f) / PI_F;
+        else if (std::holds_alternative<BSDF_Diffuse>(bsdf.underlying))
+            pdf = in_dir.y > 0.0f ? 1.0f / (2.0f * PI_F) : 0.0f;
+        if (guide)
+            pdf = fraction * guide->pdf(object_to_world.rotate(in_dir)) + (1.0f - fraction) * pdf;
+        return pdf;
+    };
+
+    // The BSDF sample also carries the surface's emission. Emission that the surface
+    // the ray left could also have sampled as a light is weighted against that
+    // strategy (multiple importance sampling, see emissive.h)
+    BSDF_Sample f = bsdf.sample(out_dir);
+    Spectrum radiance_out = f.emissive;
+    if (bounce_pdf >= 0.0f && pixel_emitters && !chunked_hit &&
+        pixel_emitters->samples_material(hit.material)) {
+        float light_pdf =
+            pixel_emitters->pdf(ray.point, hit.position, hit.normal, hit.material);
+        radiance_out *= power_heuristic(bounce_pdf, n_area_samples * light_pdf);
+    }
+    Spectrum4 direct;
     {
-        auto sample_light = [&](const auto &light) {
+        // Samples the light; with mis, its samples are weighted against the bounce
+        auto sample_light = [&](const auto &light, bool mis) {
             // If the light is discrete (e.g. a point light), then we only need
             // one sample, as all samples will be equivalent
             int samples = light.is_discrete() ? 1 : (int)n_area_samples;
+
+            // Draw all of the light's samples first, so the BSDF is evaluated for
+            // them in one batch that dispatches on the material type only once
+            static thread_local std::vector<Light_Sample> light_samples;
+            static thread_local std::vector<Vec3> in_dirs;
+            static thread_local std::vector<Spectrum> absorbsions;
+            light_samples.resize(samples);
+            in_dirs.resize(samples);
+            absorbsions.resize(samples);
+            for (int i = 0; i < samples; i++) {
+                light_samples[i] = light.sample(hit.position);
+                in_dirs[i] = world_to_object.rotate(light_samples[i].direction);
+            }
+            {
+                PROFILE_SCOPE(bsdf);
+                evaluate_batch(bsdf, out_dir, in_dirs.data(), samples, absorbsions.data());
+            }
+
             for (int i = 0; i < samples; i++) {
 
-                Light_Sample sample = light.sample(hit.position);
-                Vec3 in_dir = world_to_object.rotate(sample.direction);
+                const Light_Sample &sample = light_samples[i];
+                if (sample.pdf <= 0.0f)
+                    continue;
 
                 // If the light is below the horizon, ignore it
-                float cos_theta = in_dir.y;
+                float cos_theta = in_dirs[i].y;
                 if (cos_theta <= 0.0f)
                     continue;
 
                 // If the BSDF has 0 throughput in this direction, ignore it
                 // This is another oppritunity to do Russian roulette on low-throughput rays,
                 // which would allow us to skip the shadow ray cast, increasing efficiency.
-                Spectrum absorbsion = bsdf.evaluate(out_dir, in_dir);
+                const Spectrum &absorbsion = absorbsions[i];
                 if (absorbsion.luma() == 0.0f)
                     continue;
 
@@ -108,8 +383,19 @@ Spectrum Pathtracer::trace_ray(const Ray &ray) {
                 // area lights.
                 Ray shadowRay(hit.position + EPS_F * sample.direction, sample.direction);
 				shadowRay.time_bounds[1] = sample.distance / sample.direction.norm() - EPS_F;
-				if (!scene.hit(shadowRay).hit){
-                    radiance_out += (cos_theta / (samples * sample.pdf)) * sample.radiance * absorbsion;
+				TRAVERSAL_STAT(rays, 1);
+				bool occluded;
+				{
+				    PROFILE_SCOPE(shadow_rays);
+				    occluded = hit_scene(scene, shadowRay).hit ||
+				               (pixel_chunked && pixel_chunked->hit(shadowRay).hit);
+				}
+				if (!occluded){
+                    float weight = 1.0f;
+                    if (mis)
+                        weight = power_heuristic(samples * sample.pdf, scatter_pdf(in_dirs[i]));
+                    direct.fma(sample.radiance, absorbsion,
+                               weight * cos_theta / (samples * sample.pdf));
                 }
                     
             }
@@ -119,50 +405,83 @@ Spectrum Pathtracer::trace_ray(const Ray &ray) {
         // going to hit the exact right direction by sampling lights, so ignore them.
         if (!bsdf.is_discrete()) {
             for (const auto &light : lights)
-                sample_light(light);
+                sample_light(light, false);
             if (env_light.has_value())
-                sample_light(env_light.value());
+                sample_light(env_light.value(), false);
+            if (pixel_emitters)
+                sample_light(*pixel_emitters, true);
         }
     }
+    radiance_out += direct.spectrum();
 
+    // Light focused onto diffuse surfaces by glass and mirrors (see photon_map.h)
+    if (pixel_photons && lambertian)
+        radiance_out += pixel_photons->estimate(hit.position, hit.normal, lambertian->albedo);
 
-    return radiance_out;
-    //// TODO (PathTracer): Task 5
-    //// Compute an indirect lighting estimate using pathtracing with Monte Carlo.
-
-   
-    //// (1) Ray objects have a depth field; you should use this to avoid
-    //// traveling down one path forever.
-    //if (ray.depth > max_depth){
-    //    return radiance_out;
-    //}
-
-    //// (2) randomly select a new ray direction (it may be reflection or transmittence
-    //// ray depending on surface type) using bsdf.sample()
-    //
-    //BSDF_Sample f = bsdf.sample(out_dir);
-
-
-    //// (3) potentially terminate path (using Russian roulette). You can make this
-    //// a function of the bsdf attenuation or track overall ray throughput
-    //float termProb = 1.0f - f.attenuation.luma();
-
-    //if ((double)rand() / RAND_MAX < termProb){
-    //    return radiance_out;
-    //}
-
-    //// (4) create new scene-space ray and cast it to get incoming light
-    //Vec3 newray_dir = object_to_world * f.direction;
-    //newray_dir.normalize();
-    //Ray newRay(hit.position + EPS_F * newray_dir, newray_dir);
-    //double cos_theta = f.direction.z;
-
-    //// (5) add contribution due to incoming light with proper weighting
-
-    //float pdf_term = 1/(f.pdf * (1-termProb));
+    // TODO (PathTracer): Task 5
+    // Compute an indirect lighting estimate using pathtracing with Monte Carlo.
+
+    // (1) Ray objects have a depth field; you should use this to avoid
+    // traveling down one path forever.
+    if (ray.depth == 0)
+        return radiance_out;
+
+    // (2) randomly select a new ray direction (it may be reflection or transmittence
+    // ray depending on surface type) using bsdf.sample()
+
+    // With path guiding, diffuse surfaces instead pick between the BSDF sample and one
+    // from the distribution learned at the hit point, and weight the result by the
+    // density of the mixture (one-sample MIS), which keeps the estimate unbiased
+    // wherever either strategy can produce the direction.
+    if (guide) {
+        if (RNG::coin_flip(fraction)) {
+            float guide_pdf;
+            f.direction = world_to_object.rotate(guide->sample(guide_pdf));
+        }
+        f.pdf = scatter_pdf(f.direction);
+        f.attenuation =
+            f.direction.y > 0.0f ? lambertian->evaluate(out_dir, f.direction) : Spectrum();
+    }
+    if (f.pdf <= 0.0f)
+        return radiance_out;
+
+    // (3) potentially terminate path (using Russian roulette). You can make this
+    // a function of the bsdf attenuation or track overall ray throughput
+
+    // A bounce that carries nothing back (e.g. a guided direction below a diffuse
+    // surface) is not traced
+    Spectrum weight = f.attenuation * (std::abs(f.direction.y) / f.pdf);
+    if (weight.luma() == 0.0f) {
+        if (cacheable)
+            pixel_cache->update(hit.position, hit.normal, radiance_out);
+        return radiance_out;
+    }
 
-    //return radiance_out+ f.attenuation * trace_ray(newRay) * (float)abs(cos_theta) * pdf_term;
-    
+    // (4) create new scene-space ray and cast it to get incoming light
+    Vec3 world_dir = object_to_world.rotate(f.direction).unit();
+    Ray bounce(hit.position + EPS_F * world_dir, world_dir);
+    bounce.depth = ray.depth - 1;
+    bool was_diffuse = bounced_diffuse;
+    float was_pdf = bounce_pdf;
+    bounced_diffuse = lambertian != nullptr;
+    bounce_pdf = bsdf.is_discrete() ? -1.0f : scatter_pdf(f.direction);
+    Spectrum incoming = trace_ray(bounce);
+    bounced_diffuse = was_diffuse;
+    bounce_pdf = was_pdf;
+
+    // Light from the environment was already counted by sampling it directly
+    if (ray_escaped && !bsdf.is_discrete())
+        incoming = {};
+
+    if (pixel_guide && !bsdf.is_discrete())
+        pixel_guide->record(hit.position, world_dir, incoming.luma() / f.pdf);
+
+    // (5) add contribution due to incoming light with proper weighting
+    ray_escaped = false;
+    radiance_out += weight * incoming;
+    if (cacheable)
+        pixel_cache->update(hit.position, hit.normal, radiance_out);
+    return radiance_out;
 }
 
 } // namespace PT
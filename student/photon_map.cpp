@@ -0,0 +1,218 @@
+
+#include "photon_map.h"
+#include "../util/rand.h"
+#include "render_shared.h"
+#include "scene_probe.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+namespace PT {
+
+Photon_Map::Photon_Map(const BVH<Object> &scene, const std::vector<BSDF> &materials,
+                       const std::vector<Light> &lights, const Photon_Settings &settings)
+    : config(settings), box(scene.bbox()), n_lights(lights.size()) {
+
+    radius = std::max((box.max - box.min).norm(), EPS_F) * std::max(settings.radius, 1e-6f);
+
+    // Only point and spot lights have a single position to emit photons from; directional
+    // lights are discrete too, but sampling one gives no position
+    struct Emitter {
+        const Light *light;
+        Vec3 position;
+    };
+    std::vector<Emitter> emitters;
+    Vec3 center = box.center();
+    for (const Light &light : lights) {
+        if (!std::holds_alternative<Point_Light>(light.underlying) &&
+            !std::holds_alternative<Spot_Light>(light.underlying))
+            continue;
+        Light_Sample s = light.sample(center);
+        emitters.push_back({&light, center + s.direction * s.distance});
+    }
+    if (emitters.empty() || !settings.photons) {
+        build_grid();
+        return;
+    }
+
+    size_t n_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    n_threads = std::min(n_threads, settings.photons);
+    std::vector<std::vector<Photon>> found(n_threads);
+    float emitted_scale = 4.0f * PI_F * emitters.size() / settings.photons;
+
+    auto trace = [&](size_t thread, size_t begin, size_t end) {
+        std::vector<Photon> &out = found[thread];
+        for (size_t i = begin; i < end; i++) {
+
+            const Emitter &emitter = emitters[i % emitters.size()];
+
+            // Uniform direction on the sphere
+            float z = 1.0f - 2.0f * RNG::unit();
+            float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+            float phi = 2.0f * PI_F * RNG::unit();
+            Vec3 dir(r * std::cos(phi), r * std::sin(phi), z);
+
+            // Intensity towards dir: the radiance one unit away, undoing the falloff
+            Light_Sample s = emitter.light->sample(emitter.position + dir);
+            Spectrum power = s.radiance * (s.distance * s.distance * emitted_scale);
+            if (power.luma() <= 0.0f)
+                continue;
+
+            Ray ray(emitter.position, dir);
+            bool specular = false;
+            for (size_t bounce = 0; bounce < settings.max_bounces; bounce++) {
+
+                Trace hit = scene.hit(ray);
+                if (!hit.hit)
+                    break;
+
+                const BSDF &bsdf = materials[hit.material];
+                if (!bsdf.is_discrete()) {
+                    // Direct illumination is sampled by trace_ray; only keep caustics
+                    if (specular && std::holds_alternative<BSDF_Lambertian>(bsdf.underlying))
+                        out.push_back({hit.position, -ray.dir, power});
+                    break;
+                }
+
+                Mat4 object_to_world = Mat4::rotate_to(hit.normal);
+                Mat4 world_to_object = object_to_world.T();
+                BSDF_Sample f = bsdf.sample(world_to_object.rotate(-ray.dir).unit());
+                if (f.pdf <= 0.0f)
+                    break;
+                power = power * f.attenuation * (std::abs(f.direction.y) / f.pdf);
+                if (power.luma() <= 0.0f)
+                    break;
+
+                Vec3 next = object_to_world.rotate(f.direction).unit();
+                ray = Ray(hit.position + EPS_F * next, next);
+                specular = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    size_t per = (settings.photons + n_threads - 1) / n_threads;
+    for (size_t t = 1; t < n_threads; t++) {
+        size_t begin = std::min(t * per, settings.photons);
+        size_t end = std::min(begin + per, settings.photons);
+        workers.emplace_back(trace, t, begin, end);
+    }
+    trace(0, 0, std::min(per, settings.photons));
+    for (std::thread &w : workers)
+        w.join();
+
+    size_t total = 0;
+    for (const auto &f : found)
+        total += f.size();
+    photons.reserve(total);
+    for (auto &f : found)
+        photons.insert(photons.end(), f.begin(), f.end());
+
+    build_grid();
+}
+
+uint64_t Photon_Map::cell_hash(int64_t x, int64_t y, int64_t z) const {
+    uint64_t h = (uint64_t)x * 73856093ull ^ (uint64_t)y * 19349663ull ^ (uint64_t)z * 83492791ull;
+    return h & (cell_start.size() - 2);
+}
+
+void Photon_Map::build_grid() {
+
+    // One hash slot per photon (rounded up to a power of two), plus the end sentinel
+    size_t slots = 1;
+    while (slots < photons.size())
+        slots *= 2;
+    cell_start.assign(slots + 1, 0);
+
+    auto slot_of = [&](Vec3 p) {
+        Vec3 c = (p - box.min) * (1.0f / radius);
+        return cell_hash((int64_t)std::floor(c.x), (int64_t)std::floor(c.y),
+                         (int64_t)std::floor(c.z));
+    };
+
+    // Counting sort by slot
+    std::vector<uint32_t> slot(photons.size());
+    for (size_t i = 0; i < photons.size(); i++) {
+        slot[i] = (uint32_t)slot_of(photons[i].position);
+        cell_start[slot[i] + 1]++;
+    }
+    for (size_t i = 1; i <= slots; i++)
+        cell_start[i] += cell_start[i - 1];
+
+    std::vector<uint32_t> next(cell_start.begin(), cell_start.end() - 1);
+    std::vector<Photon> sorted(photons.size());
+    for (size_t i = 0; i < photons.size(); i++)
+        sorted[next[slot[i]]++] = photons[i];
+    photons = std::move(sorted);
+}
+
+Spectrum Photon_Map::estimate(Vec3 pos, Vec3 normal, Spectrum albedo) const {
+
+    if (photons.empty())
+        return {};
+
+    Vec3 c = (pos - box.min) * (1.0f / radius);
+    int64_t cx = (int64_t)std::floor(c.x), cy = (int64_t)std::floor(c.y),
+            cz = (int64_t)std::floor(c.z);
+
+    // Neighboring cells may share a hash slot; visit each slot once
+    uint64_t slots[27];
+    size_t n = 0;
+    for (int64_t z = -1; z <= 1; z++)
+        for (int64_t y = -1; y <= 1; y++)
+            for (int64_t x = -1; x <= 1; x++)
+                slots[n++] = cell_hash(cx + x, cy + y, cz + z);
+    std::sort(slots, slots + n);
+    n = std::unique(slots, slots + n) - slots;
+
+    float r2 = radius * radius;
+    Spectrum power;
+    for (size_t i = 0; i < n; i++) {
+        for (uint32_t p = cell_start[slots[i]]; p < cell_start[slots[i] + 1]; p++) {
+            const Photon &photon = photons[p];
+            if ((photon.position - pos).norm_squared() > r2)
+                continue;
+            if (dot(photon.direction, normal) <= 0.0f)
+                continue;
+            power += photon.power;
+        }
+    }
+    return power * albedo * (1.0f / (PI_F * PI_F * r2));
+}
+
+static Render_Shared<Photon_Map> map;
+
+const Photon_Map *photon_map(const BVH<Object> &scene, const std::vector<BSDF> &materials,
+                             const std::vector<Light> &lights, const Photon_Settings &settings) {
+
+    auto same = [](Vec3 a, Vec3 b) { return a.x == b.x && a.y == b.y && a.z == b.z; };
+
+    static thread_local Render_Shared<Photon_Map>::Handle handle;
+    BBox bounds = scene.bbox();
+    uint64_t revision = scene_revision(), materials_id = materials_key(materials);
+    uint64_t lights_id = lights_key(lights);
+    return map.get(
+        handle,
+        [&](const Photon_Map &m) {
+            return m.revision == revision && m.materials == materials_id &&
+                   m.lights_key == lights_id && m.lights() == lights.size() &&
+                   m.settings().photons == settings.photons &&
+                   m.settings().radius == settings.radius &&
+                   m.settings().max_bounces == settings.max_bounces &&
+                   same(m.bounds().min, bounds.min) && same(m.bounds().max, bounds.max);
+        },
+        [&]() {
+            auto m = std::make_shared<Photon_Map>(scene, materials, lights, settings);
+            m->revision = revision;
+            m->materials = materials_id;
+            m->lights_key = lights_id;
+            return m;
+        });
+}
+
+void photon_map_reset() {
+    map.reset();
+}
+
+} // namespace PT
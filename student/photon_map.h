@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../lib/spectrum.h"
+#include "../rays/bsdf.h"
+#include "../rays/bvh.h"
+#include "../rays/light.h"
+#include "../rays/object.h"
+
+/* Caustic photon mapping:
+
+    Light that reaches a diffuse surface through glass or mirrors (a caustic) can't
+    be rendered by trace_ray alone: light sampling is skipped at discrete BSDFs, and
+    a path bouncing off them almost never hits a point light. Instead, the caustic
+    integrator traces photons from the lights through the scene, keeps those that
+    land on a diffuse surface after at least one discrete bounce, and trace_ray adds
+    their density around each diffuse hit:
+
+        L_caustic(x) = sum over photons p within r of x:  f(x) * power_p / (pi r^2)
+
+    Photons are emitted from point and spot lights. A light's position is
+    recovered by sampling it from the center of the scene, and its intensity towards
+    a direction by sampling it from one unit away in that direction, so spot light
+    falloff is respected. Photons are traced on all hardware threads and then stored
+    in a hash grid with cells of size r, so a lookup visits 27 cells.
+*/
+
+namespace PT {
+
+struct Photon_Settings {
+    size_t photons = 1000000; // photons emitted in total
+    float radius = 0.005f;    // gather radius, as a fraction of the scene's diagonal
+    size_t max_bounces = 8;
+};
+
+class Photon_Map {
+public:
+    Photon_Map(const BVH<Object> &scene, const std::vector<BSDF> &materials,
+               const std::vector<Light> &lights, const Photon_Settings &settings);
+
+    // Caustic radiance leaving a Lambertian surface with the given albedo
+    Spectrum estimate(Vec3 pos, Vec3 normal, Spectrum albedo) const;
+
+    size_t size() const {
+        return photons.size();
+    }
+    const Photon_Settings &settings() const {
+        return config;
+    }
+    const BBox &bounds() const {
+        return box;
+    }
+    size_t lights() const {
+        return n_lights;
+    }
+
+    // The scene revision, materials and lights the photons were traced through (see
+    // scene_probe.h)
+    uint64_t revision = 0;
+    uint64_t materials = 0;
+    uint64_t lights_key = 0;
+
+private:
+    struct Photon {
+        Vec3 position;
+        Vec3 direction; // towards where the photon came from
+        Spectrum power;
+    };
+
+    uint64_t cell_hash(int64_t x, int64_t y, int64_t z) const;
+    void build_grid();
+
+    Photon_Settings config;
+    BBox box;
+    size_t n_lights = 0;
+    float radius = 0.0f;
+    std::vector<Photon> photons;      // sorted by cell
+    std::vector<uint32_t> cell_start; // photons of hash slot i are [start[i], start[i + 1])
+};
+
+// The map used for the current render, built by the first pixel that asks for it and
+// rebuilt when the scene, its materials or lights, or the settings change (see
+// render_shared.h).
+// The map stays valid until the calling thread asks again.
+const Photon_Map *photon_map(const BVH<Object> &scene, const std::vector<BSDF> &materials,
+                             const std::vector<Light> &lights, const Photon_Settings &settings);
+void photon_map_reset();
+
+} // namespace PT
@@ -0,0 +1,162 @@
+
+#include "profiler.h"
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+
+namespace PT {
+
+const char *Prof_Stage_Names[(int)Prof_Stage::count] = {
+    "BVH Build", "Env Map Build", "Pixel", "Camera Rays",
+    "Traversal", "Shadow Rays",   "BSDF",  "Env Lookup"};
+
+static const size_t max_events_per_thread = 1 << 16;
+
+struct Prof_Totals {
+    uint64_t calls[(int)Prof_Stage::count] = {};
+    int64_t ns[(int)Prof_Stage::count] = {};
+};
+
+struct Prof_Thread_Buffer {
+    uint32_t id = 0;
+    size_t n_events = 0; // events recorded by this thread since the last reset
+    uint64_t epoch = 0;  // reset generation the buffer belongs to
+    std::vector<Prof_Event> events;
+    Prof_Totals totals;
+};
+
+static std::atomic<bool> enabled{false};
+static std::atomic<uint64_t> reset_epoch{0};
+static std::atomic<uint32_t> next_thread_id{0};
+static std::atomic<int64_t> clock_origin{0};
+
+static std::mutex profile_lock;
+static std::vector<Prof_Event> profile_events;
+static Prof_Totals profile_totals;
+
+static thread_local Prof_Thread_Buffer thread_buffer;
+
+static int64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void profiler_enable(bool enable) {
+    if (enable && !enabled)
+        profiler_reset();
+    enabled = enable;
+}
+
+bool profiler_enabled() {
+    return enabled.load(std::memory_order_relaxed);
+}
+
+int64_t profiler_now() {
+    return steady_ns() - clock_origin.load(std::memory_order_relaxed);
+}
+
+void profiler_reset() {
+    std::lock_guard<std::mutex> lock(profile_lock);
+    profile_events.clear();
+    profile_totals = Prof_Totals();
+    clock_origin = steady_ns();
+    reset_epoch++;
+}
+
+void profiler_record(Prof_Stage stage, int64_t start_ns, int64_t end_ns) {
+
+    Prof_Thread_Buffer &buf = thread_buffer;
+    uint64_t epoch = reset_epoch.load(std::memory_order_relaxed);
+    if (buf.epoch != epoch) {
+        // Drop anything buffered before the last reset
+        buf.events.clear();
+        buf.totals = Prof_Totals();
+        buf.n_events = 0;
+        buf.epoch = epoch;
+    }
+    if (buf.id == 0)
+        buf.id = ++next_thread_id;
+
+    buf.totals.calls[(int)stage]++;
+    buf.totals.ns[(int)stage] += end_ns - start_ns;
+    if (buf.n_events < max_events_per_thread) {
+        buf.events.push_back({stage, buf.id, start_ns, end_ns - start_ns});
+        buf.n_events++;
+    }
+}
+
+void profiler_flush() {
+
+    Prof_Thread_Buffer &buf = thread_buffer;
+    bool any = false;
+    for (int i = 0; i < (int)Prof_Stage::count; i++)
+        any = any || buf.totals.calls[i];
+    if (!any)
+        return;
+
+    std::lock_guard<std::mutex> lock(profile_lock);
+    if (buf.epoch == reset_epoch) {
+        profile_events.insert(profile_events.end(), buf.events.begin(), buf.events.end());
+        for (int i = 0; i < (int)Prof_Stage::count; i++) {
+            profile_totals.calls[i] += buf.totals.calls[i];
+            profile_totals.ns[i] += buf.totals.ns[i];
+        }
+    }
+    buf.events.clear();
+    buf.totals = Prof_Totals();
+}
+
+std::vector<Prof_Row> profiler_summary() {
+
+    profiler_flush();
+
+    std::lock_guard<std::mutex> lock(profile_lock);
+    std::vector<Prof_Row> rows;
+    for (int i = 0; i < (int)Prof_Stage::count; i++) {
+        Prof_Row row;
+        row.stage = (Prof_Stage)i;
+        row.calls = profile_totals.calls[i];
+        row.total_ms = profile_totals.ns[i] * 1e-6;
+        row.mean_us = row.calls ? profile_totals.ns[i] * 1e-3 / row.calls : 0.0;
+        rows.push_back(row);
+    }
+    return rows;
+}
+
+bool profiler_write_trace(const std::string &path) {
+
+    profiler_flush();
+
+    std::ofstream out(path);
+    if (!out.is_open())
+        return false;
+
+    std::lock_guard<std::mutex> lock(profile_lock);
+
+    // Chrome trace event format: complete ("X") events with microsecond timestamps
+    out << std::fixed;
+    out.precision(3);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    for (const Prof_Event &e : profile_events) {
+        if (!first)
+            out << ",\n";
+        first = false;
+        out << "{\"name\":\"" << Prof_Stage_Names[(int)e.stage] << "\",\"ph\":\"X\",\"pid\":0,"
+            << "\"tid\":" << e.thread << ",\"ts\":" << e.start_ns * 1e-3
+            << ",\"dur\":" << e.duration_ns * 1e-3 << "}";
+    }
+    out << "\n],\"summary\":{";
+    for (int i = 0; i < (int)Prof_Stage::count; i++) {
+        if (i)
+            out << ",";
+        out << "\"" << Prof_Stage_Names[i] << "\":{\"calls\":" << profile_totals.calls[i]
+            << ",\"total_ms\":" << profile_totals.ns[i] * 1e-6 << "}";
+    }
+    out << "}}\n";
+    return out.good();
+}
+
+} // namespace PT
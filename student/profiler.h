@@ -0,0 +1,102 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Render profiling:
+
+    PROFILE_SCOPE(stage) times the enclosing block and attributes it to one of the
+    render stages below. Each thread appends its timings to a thread-local buffer,
+    which is merged into the global profile by profiler_flush() (Pathtracer::trace_pixel
+    calls it once per pixel), so the hot path never takes a lock.
+
+    The profile is cleared whenever a render starts (when begin_render builds the
+    scene BVH), so the timeline and the summary cover the latest render only.
+
+    Timelines are kept for at most max_events_per_thread scopes per thread; past that
+    only the per-stage totals are updated. The merged profile can be written as a
+    Chrome trace (chrome://tracing or ui.perfetto.dev) and is summarized in the debug UI.
+
+    Profiling is off until enabled at runtime, and define SCOTTY3D_NO_PROFILE to compile
+    all of the scopes out.
+*/
+
+namespace PT {
+
+enum class Prof_Stage : int {
+    bvh_build,
+    env_build,
+    pixel,
+    camera_rays,
+    traversal,
+    shadow_rays,
+    bsdf,
+    env_lookup,
+    count
+};
+
+extern const char *Prof_Stage_Names[(int)Prof_Stage::count];
+
+struct Prof_Event {
+    Prof_Stage stage;
+    uint32_t thread;
+    int64_t start_ns;
+    int64_t duration_ns;
+};
+
+struct Prof_Row {
+    Prof_Stage stage;
+    uint64_t calls = 0;
+    double total_ms = 0.0;
+    double mean_us = 0.0;
+};
+
+void profiler_enable(bool enable);
+bool profiler_enabled();
+
+// Clears all timings and restarts the timeline clock
+void profiler_reset();
+
+// Merges the calling thread's buffered timings into the global profile
+void profiler_flush();
+
+// Per-stage totals over all flushed timings
+std::vector<Prof_Row> profiler_summary();
+
+// Writes the merged timeline as a Chrome trace event JSON file
+bool profiler_write_trace(const std::string &path);
+
+// Internal: called by Prof_Scope
+int64_t profiler_now();
+void profiler_record(Prof_Stage stage, int64_t start_ns, int64_t end_ns);
+
+class Prof_Scope {
+public:
+    explicit Prof_Scope(Prof_Stage stage) : stage(stage) {
+        if (profiler_enabled())
+            start = profiler_now();
+    }
+    ~Prof_Scope() {
+        if (start >= 0)
+            profiler_record(stage, start, profiler_now());
+    }
+    Prof_Scope(const Prof_Scope &) = delete;
+    Prof_Scope &operator=(const Prof_Scope &) = delete;
+
+private:
+    Prof_Stage stage;
+    int64_t start = -1;
+};
+
+} // namespace PT
+
+#ifdef SCOTTY3D_NO_PROFILE
+#define PROFILE_SCOPE(stage) ((void)0)
+#else
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(stage)                                                                       \
+    PT::Prof_Scope PROFILE_CONCAT(prof_scope_, __LINE__)(PT::Prof_Stage::stage)
+#endif
@@ -0,0 +1,434 @@
+
+#include "progressive.h"
+#include "../lib/log.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+using Index = Progressive_Mesh::Index;
+using Clock = std::chrono::steady_clock;
+
+const char progressive_magic[8] = {'S', '3', 'D', 'P', 'M', 'E', 'S', '1'};
+
+// Indices are written seven bits per byte, low bits first, the top bit marking
+// that more bytes follow, so the many indices below 2^21 take at most three bytes
+void put_varint(std::vector<char> &out, Index x) {
+    while (x >= 0x80) {
+        out.push_back((char)(x | 0x80));
+        x >>= 7;
+    }
+    out.push_back((char)x);
+}
+
+bool get_varint(std::istream &in, Index &x) {
+    x = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int c = in.get();
+        if (c == EOF)
+            return false;
+        x |= (Index)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+void put_floats(std::vector<char> &out, const Vec3 &v) {
+    const char *p = (const char *)v.data;
+    out.insert(out.end(), p, p + 3 * sizeof(float));
+}
+
+bool get_floats(std::istream &in, Vec3 &v) {
+    float f[3];
+    in.read((char *)f, sizeof(f));
+    v = Vec3(f[0], f[1], f[2]);
+    return in.good();
+}
+
+// One vertex split as stored in a file
+struct Split {
+    Index vertex = 0;
+    Vec3 pos[2];
+    std::vector<Index> triangles, corners;
+};
+
+bool read_split(std::istream &in, Split &split) {
+    Index n = 0;
+    if (!get_varint(in, split.vertex) || !get_floats(in, split.pos[0]) ||
+        !get_floats(in, split.pos[1]) || !get_varint(in, n))
+        return false;
+    split.triangles.resize(3 * (size_t)n);
+    for (Index &i : split.triangles)
+        if (!get_varint(in, i))
+            return false;
+    if (!get_varint(in, n))
+        return false;
+    split.corners.resize(n);
+    for (Index &c : split.corners)
+        if (!get_varint(in, c))
+            return false;
+    return true;
+}
+
+// Applies a split to a mesh of verts.size() vertices, checking that its indices are
+// in range so a corrupt file cannot write out of bounds
+bool apply_split(const Split &split, std::vector<Vec3> &verts, std::vector<Index> &triangles) {
+    Index v = (Index)verts.size();
+    if (split.vertex >= v)
+        return false;
+    for (Index i : split.triangles)
+        if (i > v)
+            return false;
+    for (Index c : split.corners)
+        if (c >= triangles.size())
+            return false;
+    verts[split.vertex] = split.pos[0];
+    verts.push_back(split.pos[1]);
+    triangles.insert(triangles.end(), split.triangles.begin(), split.triangles.end());
+    for (Index c : split.corners)
+        triangles[c] = v;
+    return true;
+}
+
+} // namespace
+
+void Progressive_Mesh::clear() {
+    base_verts.clear();
+    base_triangles.clear();
+    split_vertex.clear();
+    split_pos.clear();
+    triangle_start.assign(1, 0);
+    triangles.clear();
+    corner_start.assign(1, 0);
+    corners.clear();
+}
+
+std::string Progressive_Mesh::build(const Flat_Halfedge_Mesh &mesh, size_t base_faces,
+                                    size_t threads, bool batched) {
+
+    clear();
+    for (Index f = 0; f < mesh.face_capacity(); f++)
+        if (mesh.face_alive(f) && !mesh.boundary[f] && mesh.face_degree(f) != 3)
+            return "Progressive meshes need a triangle mesh";
+
+    // simplify() leaves the mesh alone when it is already coarse enough, which
+    // leaves an empty history and a progressive mesh with no splits
+    Flat_Halfedge_Mesh coarse = mesh;
+    Collapse_History history;
+    if (batched)
+        simplify_batched(coarse, base_faces, threads, nullptr, &history);
+    else
+        simplify(coarse, base_faces, threads, nullptr, &history);
+
+    return from_history(mesh, history);
+}
+
+std::string Progressive_Mesh::from_history(const Flat_Halfedge_Mesh &mesh,
+                                           const Collapse_History &history) {
+
+    const Index null = Flat_Halfedge_Mesh::null;
+    Index nv = mesh.vertex_capacity(), nf = mesh.face_capacity();
+    size_t n = history.size();
+
+    // Replay the collapses on a triangle soup, recording what each one changed:
+    // the positions it overwrote, the corners of the triangles it dropped, and which
+    // corner of each moved triangle held the removed vertex
+    std::vector<Index> corner(3 * (size_t)nf, null);
+    for (Index f = 0; f < nf; f++) {
+        if (!mesh.face_alive(f) || mesh.boundary[f])
+            continue;
+        Index k = 0;
+        mesh.for_each_halfedge(f, [&](Index h) { corner[3 * f + k++] = mesh.vertex[h]; });
+    }
+    std::vector<Vec3> pos = mesh.pos;
+    std::vector<Vec3> before(2 * n);
+    std::vector<Index> dropped_corners(3 * history.dropped.size());
+    std::vector<uint8_t> moved_slot(history.moved.size());
+    std::vector<uint8_t> vertex_gone(nv, 0), face_gone(nf, 0);
+
+    for (size_t i = 0; i < n; i++) {
+        Index a = history.kept[i], b = history.removed[i];
+        before[2 * i] = pos[a];
+        before[2 * i + 1] = pos[b];
+        for (Index d = history.dropped_start[i]; d < history.dropped_start[i + 1]; d++) {
+            Index f = history.dropped[d];
+            std::copy_n(&corner[3 * f], 3, &dropped_corners[3 * d]);
+            face_gone[f] = 1;
+        }
+        for (Index m = history.moved_start[i]; m < history.moved_start[i + 1]; m++) {
+            Index *c = &corner[3 * history.moved[m]];
+            uint8_t k = 0;
+            while (k < 3 && c[k] != b)
+                k++;
+            if (k == 3)
+                return "Collapse history does not match the mesh";
+            c[k] = a;
+            moved_slot[m] = k;
+        }
+        pos[a] = history.merged_pos[i];
+        vertex_gone[b] = 1;
+    }
+
+    // Number the base mesh first and then what each split adds, undoing the last
+    // collapse first
+    std::vector<Index> vmap(nv, null), fmap(nf, null);
+    for (Index v = 0; v < nv; v++) {
+        if (mesh.vertex_alive(v) && !vertex_gone[v]) {
+            vmap[v] = (Index)base_verts.size();
+            base_verts.push_back(pos[v]);
+        }
+    }
+    for (Index f = 0; f < nf; f++) {
+        if (corner[3 * f] == null || face_gone[f])
+            continue;
+        fmap[f] = (Index)(base_triangles.size() / 3);
+        for (Index k = 0; k < 3; k++)
+            base_triangles.push_back(vmap[corner[3 * f + k]]);
+    }
+    Index next_vertex = (Index)base_verts.size(), next_face = (Index)(base_triangles.size() / 3);
+    for (size_t i = n; i-- > 0;) {
+        vmap[history.removed[i]] = next_vertex++;
+        for (Index d = history.dropped_start[i]; d < history.dropped_start[i + 1]; d++)
+            fmap[history.dropped[d]] = next_face++;
+    }
+
+    split_vertex.reserve(n);
+    split_pos.reserve(2 * n);
+    triangle_start.reserve(n + 1);
+    corner_start.reserve(n + 1);
+    triangles.reserve(dropped_corners.size());
+    corners.reserve(history.moved.size());
+    for (size_t i = n; i-- > 0;) {
+        split_vertex.push_back(vmap[history.kept[i]]);
+        split_pos.push_back(before[2 * i]);
+        split_pos.push_back(before[2 * i + 1]);
+        for (Index d = history.dropped_start[i]; d < history.dropped_start[i + 1]; d++)
+            for (Index k = 0; k < 3; k++)
+                triangles.push_back(vmap[dropped_corners[3 * d + k]]);
+        triangle_start.push_back((Index)(triangles.size() / 3));
+        for (Index m = history.moved_start[i]; m < history.moved_start[i + 1]; m++)
+            corners.push_back(3 * fmap[history.moved[m]] + moved_slot[m]);
+        corner_start.push_back((Index)corners.size());
+    }
+    return {};
+}
+
+void Progressive_Mesh::extract(size_t splits, std::vector<Vec3> &verts,
+                               std::vector<Index> &tris) const {
+    verts.assign(base_verts.begin(), base_verts.end());
+    tris.assign(base_triangles.begin(), base_triangles.end());
+    refine(0, splits, verts, tris);
+}
+
+void Progressive_Mesh::refine(size_t from, size_t to, std::vector<Vec3> &verts,
+                              std::vector<Index> &tris) const {
+
+    to = std::min(to, n_splits());
+    if (from >= to)
+        return;
+    Index base = (Index)base_verts.size();
+    verts.resize(n_vertices(to));
+    tris.reserve(3 * n_triangles(to));
+    for (size_t s = from; s < to; s++) {
+        Index v = base + (Index)s;
+        verts[split_vertex[s]] = split_pos[2 * s];
+        verts[v] = split_pos[2 * s + 1];
+        tris.insert(tris.end(), triangles.begin() + 3 * triangle_start[s],
+                    triangles.begin() + 3 * triangle_start[s + 1]);
+        for (Index c = corner_start[s]; c < corner_start[s + 1]; c++)
+            tris[corners[c]] = v;
+    }
+}
+
+size_t Progressive_Mesh::splits_for_triangles(size_t n) const {
+    size_t base = base_triangles.size() / 3;
+    if (n <= base)
+        return 0;
+    auto it = std::lower_bound(triangle_start.begin(), triangle_start.end(), n - base);
+    return std::min((size_t)(it - triangle_start.begin()), n_splits());
+}
+
+bool Progressive_Mesh::write(const std::string &path) const {
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out.is_open())
+        return false;
+
+    uint32_t counts[3] = {(uint32_t)base_verts.size(), (uint32_t)(base_triangles.size() / 3),
+                          (uint32_t)n_splits()};
+    out.write(progressive_magic, sizeof(progressive_magic));
+    out.write((const char *)counts, sizeof(counts));
+
+    // Base mesh, then splits, buffered a megabyte at a time
+    std::vector<char> buffer;
+    buffer.reserve(1 << 20);
+    auto flush = [&](size_t at_least) {
+        if (buffer.size() >= at_least) {
+            out.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    };
+    for (const Vec3 &p : base_verts) {
+        put_floats(buffer, p);
+        flush(1 << 20);
+    }
+    for (Index i : base_triangles) {
+        put_varint(buffer, i);
+        flush(1 << 20);
+    }
+    for (size_t s = 0; s < n_splits(); s++) {
+        put_varint(buffer, split_vertex[s]);
+        put_floats(buffer, split_pos[2 * s]);
+        put_floats(buffer, split_pos[2 * s + 1]);
+        put_varint(buffer, triangle_start[s + 1] - triangle_start[s]);
+        for (Index i = 3 * triangle_start[s]; i < 3 * triangle_start[s + 1]; i++)
+            put_varint(buffer, triangles[i]);
+        put_varint(buffer, corner_start[s + 1] - corner_start[s]);
+        for (Index c = corner_start[s]; c < corner_start[s + 1]; c++)
+            put_varint(buffer, corners[c]);
+        flush(1 << 20);
+    }
+    flush(0);
+    return out.good();
+}
+
+bool Progressive_Mesh::read(const std::string &path) {
+
+    clear();
+    Progressive_Reader reader;
+    std::vector<Vec3> verts;
+    std::vector<Index> tris;
+    if (!reader.open(path, base_verts, base_triangles))
+        return false;
+
+    // Keep the splits instead of applying them, checking them against a mesh
+    // refined alongside
+    verts = base_verts;
+    tris = base_triangles;
+    Split split;
+    for (size_t s = 0; s < reader.total; s++) {
+        if (!read_split(reader.in, split) || !apply_split(split, verts, tris)) {
+            clear();
+            return false;
+        }
+        split_vertex.push_back(split.vertex);
+        split_pos.push_back(split.pos[0]);
+        split_pos.push_back(split.pos[1]);
+        triangles.insert(triangles.end(), split.triangles.begin(), split.triangles.end());
+        triangle_start.push_back((Index)(triangles.size() / 3));
+        corners.insert(corners.end(), split.corners.begin(), split.corners.end());
+        corner_start.push_back((Index)corners.size());
+    }
+    return true;
+}
+
+bool Progressive_Reader::open(const std::string &path, std::vector<Vec3> &verts,
+                              std::vector<Index> &triangles) {
+
+    in = std::ifstream(path, std::ios::binary);
+    done = total = 0;
+    if (!in.is_open())
+        return false;
+
+    char magic[sizeof(progressive_magic)];
+    uint32_t counts[3] = {};
+    in.read(magic, sizeof(magic));
+    in.read((char *)counts, sizeof(counts));
+    if (!in.good() || std::memcmp(magic, progressive_magic, sizeof(magic)) != 0)
+        return false;
+
+    verts.resize(counts[0]);
+    for (Vec3 &v : verts)
+        if (!get_floats(in, v))
+            return false;
+    triangles.resize(3 * (size_t)counts[1]);
+    for (Index &i : triangles)
+        if (!get_varint(in, i) || i >= counts[0])
+            return false;
+    if (!in.good())
+        return false;
+    total = counts[2];
+    return true;
+}
+
+size_t Progressive_Reader::refine(size_t count, std::vector<Vec3> &verts,
+                                  std::vector<Index> &triangles) {
+    Split split;
+    size_t applied = 0;
+    while (applied < count && done < total) {
+        if (!read_split(in, split) || !apply_split(split, verts, triangles)) {
+            total = done;
+            break;
+        }
+        applied++;
+        done++;
+    }
+    return applied;
+}
+
+void progressive_benchmark(const std::vector<std::vector<Index>> &triangles,
+                           const std::vector<Vec3> &verts, size_t threads) {
+
+    Flat_Halfedge_Mesh mesh;
+    std::string err = mesh.from_poly(triangles, verts);
+    if (!err.empty()) {
+        warn("Progressive mesh benchmark: %s", err.c_str());
+        return;
+    }
+
+    Progressive_Mesh pm;
+    Clock::time_point start = Clock::now();
+    err = pm.build(mesh, triangles.size() / 100, threads);
+    double build_ms = ms_since(start);
+    if (!err.empty()) {
+        warn("Progressive mesh benchmark: %s", err.c_str());
+        return;
+    }
+    info("Progressive mesh: %zu -> %zu triangles, %zu splits, built in %.0f ms",
+         pm.n_triangles(pm.n_splits()), pm.n_triangles(0), pm.n_splits(), build_ms);
+
+    std::vector<Vec3> lod_verts;
+    std::vector<Index> lod_tris;
+    for (size_t percent : {1, 5, 25, 100}) {
+        size_t splits = pm.splits_for_triangles(triangles.size() * percent / 100);
+        start = Clock::now();
+        pm.extract(splits, lod_verts, lod_tris);
+        double ms = ms_since(start);
+        info("Progressive mesh: extracted %zu triangles in %.1f ms (%.1f M triangles/s)",
+             lod_tris.size() / 3, ms, lod_tris.size() / 3 / (ms * 1e3));
+    }
+
+    const char *path = "progressive_benchmark.pm";
+    start = Clock::now();
+    if (!pm.write(path)) {
+        warn("Progressive mesh benchmark: failed to write %s", path);
+        return;
+    }
+    double write_ms = ms_since(start);
+    std::ifstream size_of(path, std::ios::binary | std::ios::ate);
+    double mb = size_of.tellg() / (1024.0 * 1024.0);
+
+    // Stream the file back in steps of 64k splits, as a viewer refining over time
+    Progressive_Reader reader;
+    std::vector<Vec3> stream_verts;
+    std::vector<Index> stream_tris;
+    start = Clock::now();
+    bool ok = reader.open(path, stream_verts, stream_tris);
+    double base_ms = ms_since(start);
+    while (ok && reader.refine(1 << 16, stream_verts, stream_tris))
+        ;
+    double stream_ms = ms_since(start);
+    ok = ok && reader.splits_read() == pm.n_splits() && stream_verts == lod_verts &&
+         stream_tris == lod_tris;
+    std::remove(path);
+
+    info("Progressive mesh: wrote %.1f MB in %.0f ms (%.1f bytes/triangle); streamed base "
+         "in %.1f ms and all splits in %.0f ms%s",
+         mb, write_ms, mb * 1024 * 1024 / (lod_tris.size() / 3), base_ms, stream_ms,
+         ok ? "" : " (MISMATCH)");
+}
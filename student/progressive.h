@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "flat_halfedge.h"
+#include "simplify.h"
+
+/* Progressive meshes:
+
+    Simplifying once to the coarsest level and keeping the collapses (see
+    Collapse_History) yields every level of detail in between: undoing the
+    collapses from last to first is a sequence of vertex splits, each of which adds
+    one vertex and the (at most two) triangles its collapse dropped, and moves some
+    corners of the surrounding triangles from the split vertex to the new one.
+
+    A Progressive_Mesh numbers vertices and triangles in the order the splits
+    create them: the base mesh's first, then one vertex and its triangles per
+    split. The mesh after s splits is therefore a prefix of both arrays, and
+    extract() builds it in time proportional to its size by copying the base and
+    replaying s splits, each of which only touches the corners it moves.
+
+    Splits are kept in flat CSR arrays:
+
+        split_vertex[s]          the vertex split s splits
+        split_pos[2s], [2s + 1]  its position after the split, and the new vertex's
+        triangles                corners of the new triangles of split s, three each,
+                                 from triangle_start[s] to triangle_start[s + 1]
+        corners                  3 * triangle + corner of each corner switching to
+                                 the new vertex, from corner_start[s] to
+                                 corner_start[s + 1]
+
+    write() stores the base mesh first and the splits after it in order, with
+    indices as variable-length integers, so a Progressive_Reader can show the
+    base as soon as it has been read and refine it as more splits arrive.
+*/
+
+class Progressive_Mesh {
+public:
+    using Index = uint32_t;
+
+    // Simplifies a copy of mesh down to base_faces triangles, keeping the collapses.
+    // Returns an error message, or an empty string on success.
+    std::string build(const Flat_Halfedge_Mesh &mesh, size_t base_faces, size_t threads = 0,
+                      bool batched = false);
+
+    // The mesh after the first splits vertex splits: O(output)
+    void extract(size_t splits, std::vector<Vec3> &verts, std::vector<Index> &triangles) const;
+    // Applies splits [from, to) to the mesh extracted for from splits
+    void refine(size_t from, size_t to, std::vector<Vec3> &verts,
+                std::vector<Index> &triangles) const;
+    // The fewest splits giving at least the given number of triangles
+    size_t splits_for_triangles(size_t n) const;
+
+    size_t n_splits() const {
+        return split_vertex.size();
+    }
+    size_t n_vertices(size_t splits) const {
+        return base_verts.size() + splits;
+    }
+    size_t n_triangles(size_t splits) const {
+        return base_triangles.size() / 3 + triangle_start[splits];
+    }
+
+    // Returns false if the file could not be written or read
+    bool write(const std::string &path) const;
+    bool read(const std::string &path);
+
+private:
+    friend class Progressive_Reader;
+
+    void clear();
+    std::string from_history(const Flat_Halfedge_Mesh &mesh, const Collapse_History &history);
+
+    std::vector<Vec3> base_verts;
+    std::vector<Index> base_triangles;
+    std::vector<Index> split_vertex;
+    std::vector<Vec3> split_pos;
+    std::vector<Index> triangle_start{0}, triangles;
+    std::vector<Index> corner_start{0}, corners;
+};
+
+// Reads a file written by Progressive_Mesh::write front to back: the base mesh
+// first, then vertex splits in batches of any size, refining the caller's mesh
+class Progressive_Reader {
+public:
+    using Index = Progressive_Mesh::Index;
+
+    // Opens path and reads the base mesh into verts and triangles
+    bool open(const std::string &path, std::vector<Vec3> &verts, std::vector<Index> &triangles);
+
+    // Reads and applies up to count more splits; returns how many were applied,
+    // fewer at the end of the file or if it is truncated
+    size_t refine(size_t count, std::vector<Vec3> &verts, std::vector<Index> &triangles);
+
+    size_t splits_read() const {
+        return done;
+    }
+    size_t splits_total() const {
+        return total;
+    }
+
+private:
+    friend class Progressive_Mesh;
+
+    std::ifstream in;
+    size_t done = 0, total = 0;
+};
+
+// Builds the progressive mesh of the given triangle mesh down to 1% of its faces,
+// extracts several levels, round-trips it through a file and logs the timings
+void progressive_benchmark(const std::vector<std::vector<Progressive_Mesh::Index>> &triangles,
+                           const std::vector<Vec3> &verts, size_t threads = 0);
@@ -0,0 +1,158 @@
+
+#include "radiance_cache.h"
+#include "render_shared.h"
+#include "scene_probe.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace PT {
+
+// Slots examined per lookup or insertion
+static constexpr size_t max_probes = 8;
+
+static void atomic_add(std::atomic<float> &a, float v) {
+    float old = a.load(std::memory_order_relaxed);
+    while (!a.compare_exchange_weak(old, old + v, std::memory_order_relaxed)) {
+    }
+}
+
+// 64-bit finalizer from MurmurHash3
+static uint64_t mix(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return k;
+}
+
+Radiance_Cache::Radiance_Cache(BBox bounds, size_t budget, float resolution)
+    : box(bounds), budget_bytes(budget), res(resolution) {
+
+    float diag = (box.max - box.min).norm();
+    cell_size = std::max(diag, EPS_F) / std::max(res, 1.0f);
+
+    n_entries = 1;
+    while (n_entries * 2 * sizeof(Entry) <= budget)
+        n_entries *= 2;
+
+    entries = std::make_unique<Entry[]>(n_entries);
+    for (size_t i = 0; i < n_entries; i++)
+        for (int c = 0; c < 3; c++)
+            entries[i].sum[c].store(0.0f, std::memory_order_relaxed);
+}
+
+uint64_t Radiance_Cache::key(Vec3 pos, Vec3 normal) const {
+
+    // 19 bits per position axis, plus the normal quantized to a 4x4 grid over each
+    // face of the octahedron (8 * 16 bins, 7 bits)
+    uint64_t k = 0;
+    for (int i = 0; i < 3; i++) {
+        int64_t c = (int64_t)std::floor((pos[i] - box.min[i]) / cell_size);
+        k = (k << 19) | ((uint64_t)c & 0x7ffff);
+    }
+
+    float l1 = std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+    float u = l1 > 0.0f ? std::abs(normal.x) / l1 : 0.0f;
+    float v = l1 > 0.0f ? std::abs(normal.z) / l1 : 0.0f;
+    uint64_t octant = (normal.x < 0.0f) | ((normal.y < 0.0f) << 1) | ((normal.z < 0.0f) << 2);
+    uint64_t bu = std::min((uint64_t)(u * 4.0f), uint64_t(3));
+    uint64_t bv = std::min((uint64_t)(v * 4.0f), uint64_t(3));
+    k = (k << 7) | (octant << 4) | (bu << 2) | bv;
+
+    // Reserve 0 for empty slots
+    return k + 1;
+}
+
+bool Radiance_Cache::lookup(Vec3 pos, Vec3 normal, uint32_t min_samples,
+                            Spectrum &radiance) const {
+
+    uint64_t k = key(pos, normal);
+    size_t mask = n_entries - 1;
+    size_t slot = mix(k) & mask;
+    for (size_t i = 0; i < max_probes; i++) {
+        const Entry &e = entries[(slot + i) & mask];
+        uint64_t ek = e.key.load(std::memory_order_acquire);
+        if (ek == 0)
+            return false;
+        if (ek != k)
+            continue;
+        uint32_t count = e.count.load(std::memory_order_relaxed);
+        if (count < std::max(min_samples, 1u))
+            return false;
+        float inv = 1.0f / count;
+        radiance = Spectrum(e.sum[0].load(std::memory_order_relaxed) * inv,
+                            e.sum[1].load(std::memory_order_relaxed) * inv,
+                            e.sum[2].load(std::memory_order_relaxed) * inv);
+        return true;
+    }
+    return false;
+}
+
+void Radiance_Cache::update(Vec3 pos, Vec3 normal, Spectrum radiance) {
+
+    if (!std::isfinite(radiance.r) || !std::isfinite(radiance.g) || !std::isfinite(radiance.b))
+        return;
+
+    uint64_t k = key(pos, normal);
+    size_t mask = n_entries - 1;
+    size_t slot = mix(k) & mask;
+    for (size_t i = 0; i < max_probes; i++) {
+        Entry &e = entries[(slot + i) & mask];
+        uint64_t ek = e.key.load(std::memory_order_acquire);
+        if (ek == 0 && e.key.compare_exchange_strong(ek, k, std::memory_order_acq_rel))
+            ek = k;
+        if (ek != k)
+            continue;
+        atomic_add(e.sum[0], radiance.r);
+        atomic_add(e.sum[1], radiance.g);
+        atomic_add(e.sum[2], radiance.b);
+        e.count.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    // The neighborhood is full; dropping the sample keeps insertion cost bounded
+}
+
+size_t Radiance_Cache::used_entries() const {
+    size_t used = 0;
+    for (size_t i = 0; i < n_entries; i++)
+        if (entries[i].key.load(std::memory_order_relaxed))
+            used++;
+    return used;
+}
+
+static Render_Shared<Radiance_Cache> cache;
+
+Radiance_Cache *radiance_cache(BBox bounds, const std::vector<BSDF> &materials,
+                               const std::vector<Light> &lights, size_t budget_mb,
+                               float resolution) {
+
+    auto same = [](Vec3 a, Vec3 b) { return a.x == b.x && a.y == b.y && a.z == b.z; };
+
+    static thread_local Render_Shared<Radiance_Cache>::Handle handle;
+    size_t bytes = std::max(budget_mb, size_t(1)) << 20;
+    uint64_t revision = scene_revision(), materials_id = materials_key(materials);
+    uint64_t lights_id = lights_key(lights);
+    return cache.get(
+        handle,
+        [&](const Radiance_Cache &c) {
+            return c.revision == revision && c.materials == materials_id &&
+                   c.lights_key == lights_id && c.budget() == bytes &&
+                   c.resolution() == resolution && same(c.bounds().min, bounds.min) &&
+                   same(c.bounds().max, bounds.max);
+        },
+        [&]() {
+            auto c = std::make_shared<Radiance_Cache>(bounds, bytes, resolution);
+            c->revision = revision;
+            c->materials = materials_id;
+            c->lights_key = lights_id;
+            return c;
+        });
+}
+
+void radiance_cache_reset() {
+    cache.reset();
+}
+
+} // namespace PT
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../lib/spectrum.h"
+#include "../rays/bsdf.h"
+#include "../rays/light.h"
+
+/* Radiance caching:
+
+    Radiance_Cache stores the outgoing radiance of diffuse surfaces in a fixed-size
+    hash table keyed on the quantized hit position and normal. Once a path has
+    bounced off a diffuse surface, the next diffuse hit can return the cached value
+    instead of tracing the rest of the path, and every path that does get traced
+    adds its result to the entry it passed, so the cache keeps refining as the
+    render progresses.
+
+    The table never grows: its size comes from the memory budget, and an insertion
+    probes a fixed number of slots before giving up, so both memory and lookup cost
+    are bounded. Entries are only trusted after min_samples updates. Since cells
+    have a finite size, cached lighting is blurred over roughly cell_size, which is a
+    fraction of the scene's bounding box diagonal.
+*/
+
+namespace PT {
+
+class Radiance_Cache {
+public:
+    Radiance_Cache(BBox bounds, size_t budget_bytes, float resolution);
+
+    const BBox &bounds() const {
+        return box;
+    }
+    size_t budget() const {
+        return budget_bytes;
+    }
+    float resolution() const {
+        return res;
+    }
+
+    // Returns whether the cell of (pos, normal) has at least min_samples updates, and
+    // if so, sets radiance to their average
+    bool lookup(Vec3 pos, Vec3 normal, uint32_t min_samples, Spectrum &radiance) const;
+
+    // Adds one radiance estimate to the cell of (pos, normal)
+    void update(Vec3 pos, Vec3 normal, Spectrum radiance);
+
+    size_t used_entries() const;
+    size_t capacity() const {
+        return n_entries;
+    }
+
+    // The scene revision, materials and lights the cached radiance was traced with (see
+    // scene_probe.h)
+    uint64_t revision = 0;
+    uint64_t materials = 0;
+    uint64_t lights_key = 0;
+
+private:
+    struct Entry {
+        std::atomic<uint64_t> key{0}; // 0 = empty
+        std::atomic<float> sum[3];
+        std::atomic<uint32_t> count{0};
+    };
+
+    uint64_t key(Vec3 pos, Vec3 normal) const;
+
+    BBox box;
+    size_t budget_bytes;
+    float res;
+    float cell_size;
+    size_t n_entries; // power of two
+    std::unique_ptr<Entry[]> entries;
+};
+
+// The cache used for the current scene; rebuilt when the scene, its materials or lights,
+// the budget (in megabytes) or the resolution change. Fetching it takes no lock once it
+// is built (see render_shared.h), and it stays valid until the calling thread asks again.
+Radiance_Cache *radiance_cache(BBox bounds, const std::vector<BSDF> &materials,
+                               const std::vector<Light> &lights, size_t budget_mb,
+                               float resolution);
+void radiance_cache_reset();
+
+} // namespace PT
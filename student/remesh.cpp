@@ -0,0 +1,704 @@
+
+#include "remesh.h"
+#include "../lib/log.h"
+#include "../rays/bvh.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define REMESH_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace {
+
+using Index = Flat_Halfedge_Mesh::Index;
+using Clock = std::chrono::steady_clock;
+
+const Index null = Flat_Halfedge_Mesh::null;
+const uint64_t unclaimed = ~uint64_t(0);
+// Tangential smoothing moves each vertex this fraction of the way to its centroid
+const float smoothing_weight = 0.2f;
+
+// The key of edge e in a batch (see Vertex_Claims::pick): smaller priorities go
+// first, and ties go by a hash of the edge that changes every round. Ties broken
+// by index or by exact length let only the local minima of a regular or smoothly
+// graded mesh win, a few per round.
+uint64_t batch_key(uint32_t priority, Index e, size_t round) {
+    uint32_t h = mix_bits(e + (uint32_t)round * 0x9e3779b9u);
+    return (uint64_t(priority) << 48) | (uint64_t(h >> 16) << 32) | e;
+}
+
+float length2(const Flat_Halfedge_Mesh &mesh, Index e) {
+    return (mesh.pos[mesh.vertex[2 * e]] - mesh.pos[mesh.vertex[2 * e + 1]]).norm_squared();
+}
+
+// A triangle of the input surface, as a BVH primitive
+struct Surface_Triangle {
+    const Vec3 *pos;
+    Index v[3];
+
+    BBox bbox() const {
+        BBox box;
+        for (Index i : v)
+            box.enclose(pos[i]);
+        return box;
+    }
+
+    PT::Trace hit(const Ray &ray) const {
+        PT::Trace ret;
+        ret.origin = ray.point;
+        Vec3 a = pos[v[0]], e1 = pos[v[1]] - a, e2 = pos[v[2]] - a;
+        Vec3 p = cross(ray.dir, e2);
+        float det = dot(e1, p);
+        if (std::abs(det) < 1e-20f)
+            return ret;
+        float inv = 1.0f / det;
+        Vec3 s = ray.point - a;
+        float u = dot(s, p) * inv;
+        if (u < 0.0f || u > 1.0f)
+            return ret;
+        Vec3 q = cross(s, e1);
+        float w = dot(ray.dir, q) * inv;
+        if (w < 0.0f || u + w > 1.0f)
+            return ret;
+        float t = dot(e2, q) * inv;
+        if (t < ray.time_bounds[0] || t > ray.time_bounds[1])
+            return ret;
+        ret.hit = true;
+        ret.time = t;
+        ret.position = ray.point + t * ray.dir;
+        ret.normal = cross(e1, e2).unit();
+        return ret;
+    }
+};
+
+// Raises slot to value if value is larger
+void atomic_max(std::atomic<uint8_t> &slot, uint8_t value) {
+    uint8_t current = slot.load(std::memory_order_relaxed);
+    while (value > current &&
+           !slot.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+// Per-vertex claims for picking conflict-free batches of local operations
+class Vertex_Claims {
+public:
+    // Makes room for vertices [0, n)
+    void grow(size_t n, size_t threads) {
+        if (n <= touch.size())
+            return;
+        touch = std::vector<std::atomic<uint64_t>>(n + n / 2);
+        sole = std::vector<std::atomic<uint64_t>>(touch.size());
+        taken = std::vector<std::atomic<uint8_t>>(touch.size());
+        parallel_for(touch.size(), threads, [&](size_t begin, size_t end) {
+            for (size_t v = begin; v < end; v++) {
+                touch[v].store(unclaimed, std::memory_order_relaxed);
+                sole[v].store(unclaimed, std::memory_order_relaxed);
+                taken[v].store(0, std::memory_order_relaxed);
+            }
+        });
+    }
+
+    // Returns the candidates, in order, picked so that none of them writes a vertex
+    // another one reads or writes: claims(e, fn) calls fn(v, shared) for each vertex
+    // the operation on e touches, with shared set if it only reads the vertex's own
+    // position and neighbors. Two candidates may share such a vertex, and otherwise
+    // the smallest key(e) takes it. Distinct candidates need distinct keys.
+    // Candidates clear of everything picked so far try again in later passes,
+    // growing the batch toward a maximal one.
+    template<typename C, typename K>
+    std::vector<Index> pick(const std::vector<Index> &candidates, size_t threads, C &&claims,
+                            K &&key) {
+
+        // Claims are gathered once into CSR arrays, with shared ones flagged
+        size_t n = candidates.size();
+        std::vector<uint64_t> keys(n);
+        claim_start.assign(n + 1, 0);
+        parallel_for(n, threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                keys[i] = key(candidates[i]);
+                claims(candidates[i], [&](Index, bool) { claim_start[i + 1]++; });
+            }
+        }, 256);
+        for (size_t i = 0; i < n; i++)
+            claim_start[i + 1] += claim_start[i];
+        claimed.resize(claim_start[n]);
+        parallel_for(n, threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                Index k = claim_start[i];
+                claims(candidates[i],
+                       [&](Index v, bool shared) { claimed[k++] = shared ? v | shared_bit : v; });
+            }
+        }, 256);
+
+        // Every claim lowers touch to its key, and sole claims lower sole too. A
+        // candidate wins if it is the smallest to touch each of its sole vertices and
+        // no smaller candidate holds any of its shared ones alone.
+        std::vector<uint8_t> state(n, 0); // 0 waiting, 1 picked, 2 blocked
+        std::vector<size_t> waiting(n);
+        for (size_t i = 0; i < n; i++)
+            waiting[i] = i;
+        auto each_claim = [&](size_t i, auto &&fn) {
+            for (Index k = claim_start[i]; k < claim_start[i + 1]; k++)
+                fn(claimed[k] & ~shared_bit, (claimed[k] & shared_bit) != 0);
+        };
+        for (int pass = 0; pass < 3 && !waiting.empty(); pass++) {
+            parallel_for(waiting.size(), threads, [&](size_t begin, size_t end) {
+                for (size_t w = begin; w < end; w++) {
+                    size_t i = waiting[w];
+                    each_claim(i, [&](Index v, bool shared) {
+                        if (taken[v].load(std::memory_order_relaxed) > (shared ? 1 : 0))
+                            state[i] = 2;
+                    });
+                    if (state[i])
+                        continue;
+                    each_claim(i, [&](Index v, bool shared) {
+                        atomic_min(touch[v], keys[i]);
+                        if (!shared)
+                            atomic_min(sole[v], keys[i]);
+                    });
+                }
+            }, 256);
+            parallel_for(waiting.size(), threads, [&](size_t begin, size_t end) {
+                for (size_t w = begin; w < end; w++) {
+                    size_t i = waiting[w];
+                    if (state[i])
+                        continue;
+                    bool won = true;
+                    each_claim(i, [&](Index v, bool shared) {
+                        won = won && (shared ? sole[v].load(std::memory_order_relaxed) >= keys[i]
+                                             : touch[v].load(std::memory_order_relaxed) == keys[i]);
+                    });
+                    state[i] = won ? 1 : 0;
+                }
+            }, 256);
+            parallel_for(waiting.size(), threads, [&](size_t begin, size_t end) {
+                for (size_t w = begin; w < end; w++) {
+                    size_t i = waiting[w];
+                    each_claim(i, [&](Index v, bool shared) {
+                        touch[v].store(unclaimed, std::memory_order_relaxed);
+                        sole[v].store(unclaimed, std::memory_order_relaxed);
+                        if (state[i] == 1)
+                            atomic_max(taken[v], shared ? 1 : 2);
+                    });
+                }
+            }, 256);
+            waiting.erase(std::remove_if(waiting.begin(), waiting.end(),
+                                         [&](size_t i) { return state[i] != 0; }),
+                          waiting.end());
+        }
+
+        std::vector<Index> picked;
+        for (size_t i = 0; i < n; i++) {
+            if (state[i] == 1) {
+                picked.push_back(candidates[i]);
+                each_claim(i, [&](Index v, bool) { taken[v].store(0, std::memory_order_relaxed); });
+            }
+        }
+        return picked;
+    }
+
+private:
+    static constexpr Index shared_bit = Index(1) << 31;
+
+    // The smallest key of any claim and of any sole claim on each vertex, and 2 for
+    // vertices held alone by a picked candidate or 1 for vertices it shares
+    std::vector<std::atomic<uint64_t>> touch, sole;
+    std::vector<std::atomic<uint8_t>> taken;
+    std::vector<Index> claim_start, claimed;
+};
+
+// Calls visit(i, push) for i in [0, n) on several threads; returns the edges it
+// pushed, sorted and without repeats
+template<typename F> std::vector<Index> gather(size_t n, size_t threads, F &&visit) {
+    std::mutex lock;
+    std::vector<Index> out;
+    parallel_for(n, threads, [&](size_t begin, size_t end) {
+        std::vector<Index> mine;
+        auto push = [&](Index e) { mine.push_back(e); };
+        for (size_t i = begin; i < end; i++)
+            visit(i, push);
+        std::lock_guard<std::mutex> guard(lock);
+        out.insert(out.end(), mine.begin(), mine.end());
+    }, 1024);
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out;
+}
+
+// The candidates not picked, both lists being sorted
+std::vector<Index> losers(const std::vector<Index> &candidates, const std::vector<Index> &picked) {
+    std::vector<Index> rest;
+    std::set_difference(candidates.begin(), candidates.end(), picked.begin(), picked.end(),
+                        std::back_inserter(rest));
+    return rest;
+}
+
+void split_long_edges(Flat_Halfedge_Mesh &mesh, float high2, size_t threads,
+                      Vertex_Claims &claims, Remesh_Stats &s) {
+
+    auto is_long = [&](Index e) { return mesh.edge_alive(e) && length2(mesh, e) > high2; };
+    std::vector<Index> candidates =
+        gather(mesh.edge_capacity(), threads, [&](size_t e, auto &&push) {
+            if (is_long((Index)e))
+                push((Index)e);
+        });
+
+    while (!candidates.empty()) {
+        s.rounds++;
+
+        // Longest first, in steps of half the threshold; a split only touches the
+        // faces on either side of its edge, and any two edges of one triangle share
+        // an endpoint
+        claims.grow(mesh.vertex_capacity(), threads);
+        std::vector<Index> picked = claims.pick(
+            candidates, threads,
+            [&](Index e, auto &&fn) {
+                fn(mesh.vertex[2 * e], false);
+                fn(mesh.vertex[2 * e + 1], false);
+            },
+            [&](Index e) {
+                float steps = std::min(2.0f * length2(mesh, e) / high2, 15.0f);
+                return batch_key(15 - (uint32_t)steps, e, s.rounds);
+            });
+
+        std::vector<Index> inner, border;
+        for (Index e : picked)
+            (mesh.edge_on_boundary(e) ? border : inner).push_back(e);
+
+        // Every interior split cuts two triangles, so it takes one vertex, three edges
+        // and two faces from slots allocated for the whole batch
+        Index n = (Index)inner.size();
+        Index v_base = mesh.vertex_capacity(), e_base = mesh.edge_capacity();
+        Index f_base = mesh.face_capacity();
+        mesh.add_slots(n, 3 * n, 2 * n);
+        std::vector<Index> split_at(picked.size(), null);
+        parallel_for(n, threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                Index edges[3] = {e_base + 3 * (Index)i, e_base + 3 * (Index)i + 1,
+                                  e_base + 3 * (Index)i + 2};
+                Index faces[2] = {f_base + 2 * (Index)i, f_base + 2 * (Index)i + 1};
+                split_at[i] = mesh.split_edge(inner[i], v_base + (Index)i, edges, faces)
+                                  .value_or(null);
+            }
+        }, 256);
+        for (size_t i = 0; i < border.size(); i++)
+            split_at[n + i] = mesh.split_edge(border[i]).value_or(null);
+        s.splits += picked.size();
+
+        // Splits move no vertices, so the losers are still long; new long edges can
+        // only be around the new vertices
+        std::vector<Index> rest = losers(candidates, picked);
+        candidates = gather(rest.size() + split_at.size(), threads, [&](size_t i, auto &&push) {
+            if (i < rest.size()) {
+                push(rest[i]);
+                return;
+            }
+            Index m = split_at[i - rest.size()];
+            if (m != null)
+                mesh.for_each_outgoing(m, [&](Index h) {
+                    Index g = Flat_Halfedge_Mesh::edge(h);
+                    if (is_long(g))
+                        push(g);
+                });
+        });
+    }
+}
+
+// Where collapsing e leaves the merged vertex: on the boundary if either endpoint
+// is, so borders keep their shape, and otherwise at the midpoint
+Vec3 collapse_point(const Flat_Halfedge_Mesh &mesh, Index e) {
+    Index v0 = mesh.vertex[2 * e], v1 = mesh.vertex[2 * e + 1];
+    bool b0 = mesh.vertex_on_boundary(v0), b1 = mesh.vertex_on_boundary(v1);
+    if (b0 && !b1)
+        return mesh.pos[v0];
+    if (b1 && !b0)
+        return mesh.pos[v1];
+    return mesh.edge_center(e);
+}
+
+// Calls fn(v, shared) on every vertex a collapse of e touches (with repeats). It
+// rewires the rings of both endpoints and of the corners opposite e, but only reads
+// the positions of the other neighbors, which nearby collapses may share.
+template<typename F> void for_each_claimed(const Flat_Halfedge_Mesh &mesh, Index e, F &&fn) {
+    for (Index h : {2 * e, 2 * e + 1}) {
+        Index v = mesh.vertex[h];
+        fn(v, false);
+        if (!mesh.boundary[mesh.face[h]])
+            fn(mesh.vertex[mesh.next[mesh.next[h]]], false);
+        mesh.for_each_outgoing(
+            v, [&](Index g) { fn(mesh.vertex[Flat_Halfedge_Mesh::twin(g)], true); });
+    }
+}
+
+void collapse_short_edges(Flat_Halfedge_Mesh &mesh, float low2, float high2, size_t threads,
+                          Vertex_Claims &claims, Remesh_Stats &s) {
+
+    // Short, and no edge of the merged vertex would come out long
+    auto worth = [&](Index e) {
+        if (!mesh.edge_alive(e) || length2(mesh, e) >= low2)
+            return false;
+        Index v0 = mesh.vertex[2 * e], v1 = mesh.vertex[2 * e + 1];
+        Vec3 x = collapse_point(mesh, e);
+        bool ok = true;
+        for (Index v : {v0, v1})
+            mesh.for_each_outgoing(v, [&](Index h) {
+                Index w = mesh.vertex[Flat_Halfedge_Mesh::twin(h)];
+                if (w != v0 && w != v1 && (mesh.pos[w] - x).norm_squared() > high2)
+                    ok = false;
+            });
+        return ok;
+    };
+    std::vector<Index> candidates =
+        gather(mesh.edge_capacity(), threads, [&](size_t e, auto &&push) {
+            if (worth((Index)e))
+                push((Index)e);
+        });
+
+    while (!candidates.empty()) {
+        s.rounds++;
+
+        // Shortest first, in eighths of the threshold
+        claims.grow(mesh.vertex_capacity(), threads);
+        std::vector<Index> picked = claims.pick(
+            candidates, threads,
+            [&](Index e, auto &&fn) { for_each_claimed(mesh, e, fn); },
+            [&](Index e) {
+                return batch_key((uint32_t)(8.0f * length2(mesh, e) / low2), e, s.rounds);
+            });
+
+        // Collapses next to the boundary edit the boundary face, which runs along the
+        // whole border, so they run serially after the rest
+        std::vector<uint8_t> on_border(picked.size());
+        parallel_for(picked.size(), threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                on_border[i] = mesh.vertex_on_boundary(mesh.vertex[2 * picked[i]]) ||
+                               mesh.vertex_on_boundary(mesh.vertex[2 * picked[i] + 1]);
+        }, 256);
+        std::vector<Index> merged(picked.size(), null);
+        auto collapse = [&](size_t i) {
+            if (!worth(picked[i]))
+                return;
+            Vec3 x = collapse_point(mesh, picked[i]);
+            std::optional<Index> v = mesh.collapse_edge(picked[i]);
+            if (v) {
+                mesh.pos[*v] = x;
+                merged[i] = *v;
+            }
+        };
+        parallel_for(picked.size(), threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                if (!on_border[i])
+                    collapse(i);
+        }, 256);
+        for (size_t i = 0; i < picked.size(); i++)
+            if (on_border[i])
+                collapse(i);
+        s.collapses += picked.size() - std::count(merged.begin(), merged.end(), null);
+
+        // Rejected collapses are dropped until a neighbor's collapse brings them back.
+        // Collapses nearby may have made a loser unfit, but that is checked again
+        // only if it is picked, as most losers are far from any collapse.
+        std::vector<Index> rest = losers(candidates, picked);
+        candidates = gather(rest.size() + merged.size(), threads, [&](size_t i, auto &&push) {
+            if (i < rest.size()) {
+                if (mesh.edge_alive(rest[i]) && length2(mesh, rest[i]) < low2)
+                    push(rest[i]);
+                return;
+            }
+            Index v = merged[i - rest.size()];
+            if (v != null)
+                mesh.for_each_outgoing(v, [&](Index h) {
+                    Index g = Flat_Halfedge_Mesh::edge(h);
+                    if (worth(g))
+                        push(g);
+                });
+        });
+    }
+}
+
+// How much flipping e lowers the total distance of the valences of its triangles'
+// corners from six (four on the boundary); 0 if e cannot or should not flip
+int flip_gain(const Flat_Halfedge_Mesh &mesh, Index e) {
+
+    Index h0 = 2 * e, h1 = 2 * e + 1;
+    if (!mesh.edge_alive(e) || mesh.boundary[mesh.face[h0]] || mesh.boundary[mesh.face[h1]])
+        return 0;
+    Index v0 = mesh.vertex[h0], v1 = mesh.vertex[h1];
+    Index a = mesh.vertex[mesh.next[mesh.next[h0]]], b = mesh.vertex[mesh.next[mesh.next[h1]]];
+
+    auto deviation = [&](Index v, int change) {
+        int target = mesh.vertex_on_boundary(v) ? 4 : 6;
+        return std::abs((int)mesh.vertex_degree(v) + change - target);
+    };
+    int before = deviation(v0, 0) + deviation(v1, 0) + deviation(a, 0) + deviation(b, 0);
+    int after = deviation(v0, -1) + deviation(v1, -1) + deviation(a, 1) + deviation(b, 1);
+    if (after >= before)
+        return 0;
+
+    // Nor if either new triangle would face away from the pair it replaces
+    Vec3 p0 = mesh.pos[v0], p1 = mesh.pos[v1], pa = mesh.pos[a], pb = mesh.pos[b];
+    Vec3 n = cross(p1 - p0, pa - p0) + cross(p0 - p1, pb - p1);
+    if (dot(cross(p0 - pa, pb - pa), n) <= 0.0f || dot(cross(p1 - pb, pa - pb), n) <= 0.0f)
+        return 0;
+    return before - after;
+}
+
+// Calls fn on the corners of both triangles of e, which a flip reads or writes
+template<typename F> void for_each_corner(const Flat_Halfedge_Mesh &mesh, Index e, F &&fn) {
+    for (Index h : {2 * e, 2 * e + 1}) {
+        fn(mesh.vertex[h], false);
+        fn(mesh.vertex[mesh.next[mesh.next[h]]], false);
+    }
+}
+
+void flip_toward_valence(Flat_Halfedge_Mesh &mesh, size_t threads, Vertex_Claims &claims,
+                         Remesh_Stats &s) {
+
+    std::vector<Index> candidates =
+        gather(mesh.edge_capacity(), threads, [&](size_t e, auto &&push) {
+            if (flip_gain(mesh, (Index)e) > 0)
+                push((Index)e);
+        });
+
+    // Every flip lowers the total deviation, so this ends
+    while (!candidates.empty()) {
+        s.rounds++;
+
+        // Largest gain first
+        claims.grow(mesh.vertex_capacity(), threads);
+        std::vector<Index> picked = claims.pick(
+            candidates, threads, [&](Index e, auto &&fn) { for_each_corner(mesh, e, fn); },
+            [&](Index e) { return batch_key(8 - flip_gain(mesh, e), e, s.rounds); });
+        std::vector<uint8_t> flipped(picked.size(), 0);
+        parallel_for(picked.size(), threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                flipped[i] = mesh.flip_edge(picked[i]).has_value();
+        }, 256);
+        s.flips += std::count(flipped.begin(), flipped.end(), 1);
+
+        // A flip changes the valences of the same four corners, which changes the
+        // gain of every edge around them
+        std::vector<Index> rest = losers(candidates, picked);
+        candidates = gather(rest.size() + picked.size(), threads, [&](size_t i, auto &&push) {
+            if (i < rest.size()) {
+                if (flip_gain(mesh, rest[i]) > 0)
+                    push(rest[i]);
+                return;
+            }
+            if (!flipped[i - rest.size()])
+                return;
+            for_each_corner(mesh, picked[i - rest.size()], [&](Index v, bool) {
+                mesh.for_each_outgoing(v, [&](Index h) {
+                    Index g = Flat_Halfedge_Mesh::edge(h);
+                    if (flip_gain(mesh, g) > 0)
+                        push(g);
+                });
+            });
+        });
+    }
+}
+
+void smooth_tangentially(Flat_Halfedge_Mesh &mesh, const PT::BVH<Surface_Triangle> &surface,
+                         float reach, size_t threads) {
+
+    // Positions, neighbor centroids and unit normals in structure-of-arrays form,
+    // padded to a multiple of four; weight is 0 for vertices that stay put
+    size_t nv = mesh.vertex_capacity(), padded = (nv + 3) & ~size_t(3);
+    std::vector<float> buffer(10 * padded, 0.0f);
+    float *px = &buffer[0], *py = &buffer[padded], *pz = &buffer[2 * padded];
+    float *cx = &buffer[3 * padded], *cy = &buffer[4 * padded], *cz = &buffer[5 * padded];
+    float *nx = &buffer[6 * padded], *ny = &buffer[7 * padded], *nz = &buffer[8 * padded];
+    float *weight = &buffer[9 * padded];
+
+    parallel_for(nv, threads, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++) {
+            if (!mesh.vertex_alive((Index)v))
+                continue;
+            Vec3 p = mesh.pos[v];
+            px[v] = p.x;
+            py[v] = p.y;
+            pz[v] = p.z;
+            Vec3 sum, normal;
+            unsigned int k = 0;
+            bool border = false;
+            mesh.for_each_outgoing((Index)v, [&](Index h) {
+                sum += mesh.pos[mesh.vertex[Flat_Halfedge_Mesh::twin(h)]];
+                k++;
+                if (mesh.boundary[mesh.face[h]]) {
+                    border = true;
+                    return;
+                }
+                Vec3 a = mesh.pos[mesh.vertex[mesh.next[h]]];
+                Vec3 b = mesh.pos[mesh.vertex[mesh.next[mesh.next[h]]]];
+                normal += cross(a - p, b - p);
+            });
+            float len = normal.norm();
+            if (border || !k || len <= 0.0f)
+                continue;
+            Vec3 c = sum * (1.0f / k), n = normal * (1.0f / len);
+            cx[v] = c.x;
+            cy[v] = c.y;
+            cz[v] = c.z;
+            nx[v] = n.x;
+            ny[v] = n.y;
+            nz[v] = n.z;
+            weight[v] = smoothing_weight;
+        }
+    });
+
+    // p += weight * (d - (d . n) n) with d = c - p, the step toward the centroid with
+    // its normal part removed
+    parallel_for(padded / 4, threads, [&](size_t begin, size_t end) {
+        for (size_t i = 4 * begin; i < 4 * end; i += 4) {
+#ifdef REMESH_SSE
+            __m128 x = _mm_loadu_ps(px + i), y = _mm_loadu_ps(py + i), z = _mm_loadu_ps(pz + i);
+            __m128 dx = _mm_sub_ps(_mm_loadu_ps(cx + i), x);
+            __m128 dy = _mm_sub_ps(_mm_loadu_ps(cy + i), y);
+            __m128 dz = _mm_sub_ps(_mm_loadu_ps(cz + i), z);
+            __m128 mx = _mm_loadu_ps(nx + i), my = _mm_loadu_ps(ny + i), mz = _mm_loadu_ps(nz + i);
+            __m128 t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, mx), _mm_mul_ps(dy, my)),
+                                  _mm_mul_ps(dz, mz));
+            __m128 w = _mm_loadu_ps(weight + i);
+            x = _mm_add_ps(x, _mm_mul_ps(w, _mm_sub_ps(dx, _mm_mul_ps(t, mx))));
+            y = _mm_add_ps(y, _mm_mul_ps(w, _mm_sub_ps(dy, _mm_mul_ps(t, my))));
+            z = _mm_add_ps(z, _mm_mul_ps(w, _mm_sub_ps(dz, _mm_mul_ps(t, mz))));
+            _mm_storeu_ps(px + i, x);
+            _mm_storeu_ps(py + i, y);
+            _mm_storeu_ps(pz + i, z);
+#else
+            for (size_t j = i; j < i + 4; j++) {
+                float dx = cx[j] - px[j], dy = cy[j] - py[j], dz = cz[j] - pz[j];
+                float t = dx * nx[j] + dy * ny[j] + dz * nz[j];
+                px[j] += weight[j] * (dx - t * nx[j]);
+                py[j] += weight[j] * (dy - t * ny[j]);
+                pz[j] += weight[j] * (dz - t * nz[j]);
+            }
+#endif
+        }
+    });
+
+    // Back onto the input surface, along the normal either way
+    parallel_for(nv, threads, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++) {
+            if (weight[v] == 0.0f)
+                continue;
+            Vec3 p(px[v], py[v], pz[v]), n(nx[v], ny[v], nz[v]);
+            Ray up(p, n), down(p, -n);
+            up.time_bounds = down.time_bounds = Vec2(0.0f, reach);
+            PT::Trace a = surface.hit(up), b = surface.hit(down);
+            if (a.hit && (!b.hit || a.time <= b.time))
+                p = a.position;
+            else if (b.hit)
+                p = b.position;
+            mesh.pos[v] = p;
+        }
+    }, 1024);
+}
+
+} // namespace
+
+bool isotropic_remesh(Flat_Halfedge_Mesh &mesh, size_t iterations, size_t threads,
+                      Remesh_Stats *stats) {
+
+    Remesh_Stats local;
+    Remesh_Stats &s = stats ? *stats : local;
+    s = {};
+
+    // The input surface, kept for reprojection
+    std::vector<Vec3> surface_pos = mesh.pos;
+    std::vector<Surface_Triangle> triangles;
+    for (Index f = 0; f < mesh.face_capacity(); f++) {
+        if (!mesh.face_alive(f) || mesh.boundary[f])
+            continue;
+        if (mesh.face_degree(f) != 3)
+            return false;
+        Surface_Triangle t{surface_pos.data(), {}};
+        Index k = 0;
+        mesh.for_each_halfedge(f, [&](Index h) { t.v[k++] = mesh.vertex[h]; });
+        triangles.push_back(t);
+    }
+    s.faces_before = s.faces_after = triangles.size();
+    if (triangles.empty())
+        return false;
+
+    double total = 0.0;
+    size_t n_edges = 0;
+    for (Index e = 0; e < mesh.edge_capacity(); e++) {
+        if (mesh.edge_alive(e)) {
+            total += mesh.edge_length(e);
+            n_edges++;
+        }
+    }
+    float target = (float)(total / n_edges);
+    float high = 4.0f / 3.0f * target, low = 4.0f / 5.0f * target;
+
+    Clock::time_point start = Clock::now();
+    PT::BVH<Surface_Triangle> surface(std::move(triangles), 4);
+    s.bvh_ms = ms_since(start);
+
+    Vertex_Claims claims;
+    for (size_t i = 0; i < iterations; i++) {
+        mesh.defer_free_lists(true);
+
+        start = Clock::now();
+        split_long_edges(mesh, high * high, threads, claims, s);
+        s.split_ms += ms_since(start);
+
+        start = Clock::now();
+        collapse_short_edges(mesh, low * low, high * high, threads, claims, s);
+        s.collapse_ms += ms_since(start);
+
+        start = Clock::now();
+        flip_toward_valence(mesh, threads, claims, s);
+        s.flip_ms += ms_since(start);
+
+        start = Clock::now();
+        smooth_tangentially(mesh, surface, target, threads);
+        s.smooth_ms += ms_since(start);
+
+        mesh.defer_free_lists(false);
+        if (mesh.needs_compaction())
+            mesh.compact();
+    }
+    mesh.compact();
+
+    s.faces_after = 0;
+    for (Index f = 0; f < mesh.face_capacity(); f++)
+        s.faces_after += !mesh.boundary[f];
+    return true;
+}
+
+void remesh_benchmark(const std::vector<std::vector<Index>> &triangles,
+                      const std::vector<Vec3> &verts, size_t threads) {
+
+    auto run = [&](const char *name, size_t run_threads) {
+        Flat_Halfedge_Mesh mesh;
+        std::string err = mesh.from_poly(triangles, verts);
+        if (!err.empty()) {
+            warn("Remeshing benchmark: %s", err.c_str());
+            return;
+        }
+        Remesh_Stats stats;
+        Clock::time_point start = Clock::now();
+        isotropic_remesh(mesh, 6, run_threads, &stats);
+        double ms = ms_since(start);
+
+        info("%s: %zu -> %zu triangles in %.0f ms (BVH %.0f ms, splits %.0f ms, collapses "
+             "%.0f ms, flips %.0f ms, smoothing %.0f ms; %zu splits, %zu collapses, %zu flips "
+             "in %zu rounds)",
+             name, stats.faces_before, stats.faces_after, ms, stats.bvh_ms, stats.split_ms,
+             stats.collapse_ms, stats.flip_ms, stats.smooth_ms, stats.splits, stats.collapses,
+             stats.flips, stats.rounds);
+    };
+    run("Remeshing (1 thread)", 1);
+    run("Remeshing", threads);
+}
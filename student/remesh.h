@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "flat_halfedge.h"
+
+/* Isotropic remeshing:
+
+    Each iteration moves the mesh toward edges of one target length L (the mean
+    edge length of the input) and vertices of valence six, in four phases:
+
+        split     edges longer than 4/3 L at their midpoints
+        collapse  edges shorter than 4/5 L, unless that makes an edge longer than 4/3 L
+        flip      edges whose flip brings the valences of the four vertices of its
+                  triangles closer to six (four on the boundary)
+        smooth    vertices tangentially toward the centroid of their neighbors, then
+                  back onto the input surface
+
+    The topological phases run in rounds of conflict-free batches. Every candidate
+    claims the vertices its operation rewires (the endpoints for a split, the
+    endpoints and opposite corners for a collapse, and the corners of both triangles
+    for a flip) and, shared, those whose positions it only reads (the rest of a
+    collapse's one-rings). Each vertex keeps the smallest claim by an atomic min over
+    keys ordered longest first for splits and shortest first for collapses, and
+    candidates holding all of their claims run concurrently. The losers and the edges around
+    whatever changed are the next round's candidates, until none are left. Splits
+    take their new elements from slots allocated for the whole batch up front;
+    operations on boundary edges, whose boundary face is shared along the whole
+    border, run on the calling thread.
+
+    Smoothing is a Jacobi step: neighbor centroids and vertex normals are gathered
+    from the current positions into structure-of-arrays buffers, and one
+    branch-free pass (four vertices per SSE instruction) applies the tangential
+    update. Each moved vertex is then reprojected onto the input surface by casting
+    rays both ways along its normal into a BVH over the input triangles, so repeated
+    iterations do not shrink the mesh.
+*/
+
+struct Remesh_Stats {
+    size_t faces_before = 0, faces_after = 0;
+    size_t splits = 0, collapses = 0, flips = 0, rounds = 0;
+    double bvh_ms = 0.0, split_ms = 0.0, collapse_ms = 0.0, flip_ms = 0.0, smooth_ms = 0.0;
+};
+
+// Remeshes a triangle mesh in place for the given number of iterations, then
+// compacts it. Returns false if the mesh is not made of triangles.
+bool isotropic_remesh(Flat_Halfedge_Mesh &mesh, size_t iterations = 6, size_t threads = 0,
+                      Remesh_Stats *stats = nullptr);
+
+// Remeshes the given triangle mesh on one thread and on the given number, and logs
+// the timings of each phase
+void remesh_benchmark(const std::vector<std::vector<Flat_Halfedge_Mesh::Index>> &triangles,
+                      const std::vector<Vec3> &verts, size_t threads = 0);
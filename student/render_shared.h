@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+/* Render-wide structures:
+
+    The photon map, the guiding field and the radiance cache are each built for the
+    scene being rendered and then used by every pixel. The render's worker threads
+    reach student code first through trace_pixel, so the structure is built by the
+    first pixel that finds it missing or built for other inputs, while the other
+    workers wait for it.
+
+    Render_Shared<T> holds the current instance. Each thread keeps a Handle to it,
+    which it only refreshes when the instance changes, so after the build every pixel
+    gets the structure with one atomic load and a comparison of its inputs, without
+    locking or touching the reference count. Replaced instances live on until the
+    last thread holding them refreshes its handle.
+*/
+
+namespace PT {
+
+template <typename T> class Render_Shared {
+public:
+    struct Handle {
+        std::shared_ptr<T> held;
+        uint64_t generation = 0;
+    };
+
+    // Returns the current instance, first replacing it with build() (which returns a
+    // std::shared_ptr<T>) if there is none or matches(instance) is false. The result
+    // stays valid until the next call with the same handle.
+    template <typename Matches, typename Build>
+    T *get(Handle &handle, Matches &&matches, Build &&build) {
+        if (handle.held && handle.generation == generation.load(std::memory_order_acquire) &&
+            matches(*handle.held))
+            return handle.held.get();
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (!current || !matches(*current)) {
+            current = build();
+            generation.fetch_add(1, std::memory_order_release);
+        }
+        handle.held = current;
+        handle.generation = generation.load(std::memory_order_relaxed);
+        return handle.held.get();
+    }
+
+    // Drops the current instance, so the next get() builds a new one
+    void reset() {
+        std::lock_guard<std::mutex> guard(lock);
+        current = nullptr;
+        generation.fetch_add(1, std::memory_order_release);
+    }
+
+private:
+    std::mutex lock;
+    std::shared_ptr<T> current;
+    std::atomic<uint64_t> generation{1};
+};
+
+} // namespace PT
@@ -2,6 +2,7 @@
 #include "../rays/samplers.h"
 #include "../util/rand.h"
 #include "debug.h"
+#include "profiler.h"
 
 namespace Samplers {
 
@@ -11,9 +12,9 @@ Vec2 Rect::Uniform::sample(float &pdf) const {
     // Generate a uniformly random point on a rectangle of size size.x * size.y
     // Tip: RNG::unit() 
     
-    float x = (float)rand() / (float)(RAND_MAX);
-    float y = 1.0f-x;
-    pdf = x+y; // the PDF should integrate to 1 over the whole rectangle
+    float x = RNG::unit() * size.x;
+    float y = RNG::unit() * size.y;
+    pdf = 1.0f / (size.x * size.y); // the PDF should integrate to 1 over the whole rectangle
     return Vec2(x,y);
 }
 
@@ -21,7 +22,15 @@ Vec3 Hemisphere::Cosine::sample(float &pdf) const {
 
     // TODO (PathTracer): Task 6
     // You may implement this, but don't have to.
-    return Vec3();
+
+    // Uniform point on the disk, projected up onto the hemisphere
+    float Xi1 = RNG::unit();
+    float Xi2 = RNG::unit();
+    float r = std::sqrt(Xi1);
+    float phi = 2.0f * PI_F * Xi2;
+    float y = std::sqrt(std::max(0.0f, 1.0f - Xi1));
+    pdf = y / PI_F;
+    return Vec3(r * std::cos(phi), y, r * std::sin(phi));
 }
 
 Vec3 Sphere::Uniform::sample(float &pdf) const {
@@ -38,6 +47,7 @@ Sphere::Image::Image(const HDR_Image &image) {
 
     // TODO (PathTracer): Task 7
     // Set up importance sampling for a spherical environment map image.
+    PROFILE_SCOPE(env_build);
 
     // You may make use of the pdf, cdf, and total members, or create your own
     // representation.
@@ -0,0 +1,204 @@
+
+#include "scene_probe.h"
+#include "../rays/object.h"
+
+#include <atomic>
+#include <cmath>
+
+namespace PT {
+
+static const Object *objects = nullptr;
+static size_t n_objects = 0;
+static std::atomic<uint64_t> revision{0};
+
+Probe_Record &probe_record() {
+    static thread_local Probe_Record record;
+    return record;
+}
+
+void scene_built(const Object *list, size_t n) {
+    objects = list;
+    n_objects = n;
+    revision.fetch_add(1, std::memory_order_release);
+}
+
+uint64_t scene_revision() {
+    return revision.load(std::memory_order_acquire);
+}
+
+size_t scene_objects() {
+    return n_objects;
+}
+
+const Object *scene_object(size_t i) {
+    return i < n_objects ? &objects[i] : nullptr;
+}
+
+BBox Object_Ref::bbox() const {
+    return object->bbox();
+}
+
+Trace Object_Ref::hit(const Ray &ray) const {
+    return object->hit(ray);
+}
+
+// Sends a probe ray from origin and returns what the object reported
+static Probe_Record &probe(const Object &object, Vec3 origin, size_t max_triangles) {
+    Probe_Record &record = probe_record();
+    record.reached = false;
+    record.max_triangles = max_triangles;
+    record.triangles.clear();
+    record.sphere = false;
+    Ray ray(origin, Vec3(0.0f, 0.0f, 1.0f));
+    ray.depth = probe_depth;
+    object.hit(ray);
+    return record;
+}
+
+bool probe_material(size_t i, Object_Shape &shape) {
+
+    shape = Object_Shape();
+    if (i >= n_objects)
+        return false;
+    const Object &object = objects[i];
+
+    // The object-space images of the world origin and the unit axis points give the
+    // columns of the inverse transform; its inverse takes the object back to world space
+    Vec3 world[] = {Vec3(), Vec3(1.0f, 0.0f, 0.0f), Vec3(0.0f, 1.0f, 0.0f),
+                    Vec3(0.0f, 0.0f, 1.0f)};
+    Vec3 local[4];
+    for (int k = 0; k < 4; k++) {
+        Probe_Record &record = probe(object, world[k], 0);
+        if (!record.reached)
+            return false;
+        local[k] = record.origin;
+    }
+    Vec3 a = local[1] - local[0], b = local[2] - local[0], c = local[3] - local[0];
+    float det = dot(a, cross(b, c));
+    if (!(std::abs(det) > 0.0f) || !std::isfinite(det))
+        return false;
+    shape.rows[0] = cross(b, c) / det;
+    shape.rows[1] = cross(c, a) / det;
+    shape.rows[2] = cross(a, b) / det;
+    shape.offset = local[0];
+
+    // Aim an ordinary ray at one triangle (or the sphere) to learn the material
+    Probe_Record &record = probe(object, Vec3(), 1);
+    BBox box = object.bbox();
+    float reach = (box.max - box.min).norm() + 1.0f;
+    Vec3 target, normal;
+    if (record.sphere) {
+        target = shape.to_world(Vec3());
+        normal = Vec3(0.0f, 1.0f, 0.0f);
+    } else if (record.triangles.size() == 3) {
+        Vec3 v0 = shape.to_world(record.triangles[0]);
+        Vec3 v1 = shape.to_world(record.triangles[1]);
+        Vec3 v2 = shape.to_world(record.triangles[2]);
+        target = (v0 + v1 + v2) / 3.0f;
+        normal = cross(v1 - v0, v2 - v0);
+        if (!(normal.norm_squared() > 0.0f))
+            return false;
+        normal = normal.unit();
+    } else {
+        return false;
+    }
+    Ray ray(target + normal * reach, -normal);
+    bool sphere = record.sphere;
+    Trace hit = object.hit(ray);
+    if (!hit.hit)
+        return false;
+    shape.material = (int)hit.material;
+    shape.sphere = sphere;
+    return true;
+}
+
+bool probe_geometry(size_t i, Object_Shape &shape) {
+
+    if (i >= n_objects)
+        return false;
+    Probe_Record &record = probe(objects[i], Vec3(), std::numeric_limits<size_t>::max() / 3);
+    if (!record.reached)
+        return false;
+
+    shape.triangles.clear();
+    shape.sphere = record.sphere;
+    if (record.sphere) {
+        shape.center = shape.to_world(Vec3());
+        Vec3 axis(shape.rows[0].x, shape.rows[1].x, shape.rows[2].x);
+        shape.radius = record.radius * axis.norm();
+        return true;
+    }
+    shape.triangles.reserve(record.triangles.size());
+    for (Vec3 v : record.triangles)
+        shape.triangles.push_back(shape.to_world(v));
+    return !shape.triangles.empty();
+}
+
+// FNV-1a
+static void fnv_add(uint64_t &key, const void *data, size_t bytes) {
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < bytes; i++)
+        key = (key ^ p[i]) * 1099511628211ull;
+}
+static constexpr uint64_t fnv_basis = 14695981039346656037ull;
+
+uint64_t materials_key(const std::vector<BSDF> &materials) {
+
+    // Hashes each material's type and parameters
+    uint64_t key = fnv_basis;
+    auto add = [&key](const void *data, size_t bytes) { fnv_add(key, data, bytes); };
+    auto add_spectrum = [&add](Spectrum s) {
+        float c[] = {s.r, s.g, s.b};
+        add(c, sizeof(c));
+    };
+    for (const BSDF &bsdf : materials) {
+        size_t type = bsdf.underlying.index();
+        add(&type, sizeof(type));
+        std::visit(
+            [&](const auto &b) {
+                using T = std::decay_t<decltype(b)>;
+                if constexpr (std::is_same_v<T, BSDF_Lambertian>) {
+                    add_spectrum(b.albedo);
+                } else if constexpr (std::is_same_v<T, BSDF_Mirror>) {
+                    add_spectrum(b.reflectance);
+                } else if constexpr (std::is_same_v<T, BSDF_Glass>) {
+                    add_spectrum(b.transmittance);
+                    add_spectrum(b.reflectance);
+                    add(&b.index_of_refraction, sizeof(float));
+                } else if constexpr (std::is_same_v<T, BSDF_Diffuse>) {
+                    add_spectrum(b.radiance);
+                } else if constexpr (std::is_same_v<T, BSDF_Refract>) {
+                    add_spectrum(b.transmittance);
+                    add(&b.index_of_refraction, sizeof(float));
+                }
+            },
+            bsdf.underlying);
+    }
+    return key;
+}
+
+uint64_t lights_key(const std::vector<Light> &lights) {
+
+    // A spot light's cone may miss some of the points, but not all of them
+    const Vec3 probes[] = {Vec3(), Vec3(1.0f, 0.0f, 0.0f), Vec3(0.0f, 1.0f, 0.0f),
+                           Vec3(0.0f, 0.0f, 1.0f), Vec3(-1.0f, -1.0f, -1.0f)};
+    uint64_t key = fnv_basis;
+    for (const Light &light : lights) {
+        if (!std::holds_alternative<Point_Light>(light.underlying) &&
+            !std::holds_alternative<Spot_Light>(light.underlying))
+            continue;
+        for (Vec3 from : probes) {
+            Light_Sample s = light.sample(from);
+            float values[] = {from.x + s.direction.x * s.distance,
+                              from.y + s.direction.y * s.distance,
+                              from.z + s.direction.z * s.distance,
+                              s.radiance.r,
+                              s.radiance.g,
+                              s.radiance.b};
+            fnv_add(key, values, sizeof(values));
+        }
+    }
+    return key;
+}
+
+} // namespace PT
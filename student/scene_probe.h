@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../rays/bsdf.h"
+#include "../rays/light.h"
+#include "../rays/trace.h"
+
+/* Reading the scene back from its objects:
+
+    Objects keep their geometry, transform and material private; all student code can
+    do with one is call bbox() and hit(). Some render-wide structures (e.g. the
+    emissive lights) still need the scene's world-space surfaces, so they are read
+    back through Object::hit:
+
+    - BVH<Object>::build registers its primitives with scene_built(), which also
+      bumps scene_revision(), so structures built from the scene know when to rebuild.
+
+    - A ray whose depth is probe_depth puts Tri_Mesh::hit and Sphere::hit in probe
+      mode: instead of intersecting, they report the ray's origin (in object space,
+      after Object::hit has applied its inverse transform) and, when asked for, their
+      triangles or radius, then return a miss.
+
+    Probing from four origins gives the object's inverse transform, which maps the
+    reported object-space triangles back to world space. The material comes from an
+    ordinary hit() aimed at one of them. Spheres are assumed to be scaled uniformly.
+*/
+
+namespace PT {
+
+class Object;
+
+// Ray depth that puts Tri_Mesh::hit and Sphere::hit in probe mode
+constexpr size_t probe_depth = std::numeric_limits<size_t>::max();
+
+// What the probed object reported on this thread
+struct Probe_Record {
+    Vec3 origin;
+    bool reached = false;
+    // Triangles are only collected up to this many, and only by Tri_Mesh::hit
+    size_t max_triangles = 0;
+    std::vector<Vec3> triangles;
+    bool sphere = false;
+    float radius = 0.0f;
+
+    void add_triangle(Vec3 v0, Vec3 v1, Vec3 v2) {
+        if (triangles.size() < 3 * max_triangles) {
+            triangles.push_back(v0);
+            triangles.push_back(v1);
+            triangles.push_back(v2);
+        }
+    }
+};
+Probe_Record &probe_record();
+
+// Called by BVH<Object>::build with its primitives, which stay at this address until
+// the BVH is rebuilt or cleared (clear passes n = 0)
+void scene_built(const Object *objects, size_t n);
+uint64_t scene_revision();
+
+// An object of the current scene, in world space
+struct Object_Shape {
+    int material = -1;
+    std::vector<Vec3> triangles; // every three are one triangle
+    bool sphere = false;
+    Vec3 center;
+    float radius = 0.0f;
+
+    // Object to world: world = rows * (object - offset), found by probe_material
+    Vec3 rows[3];
+    Vec3 offset;
+    Vec3 to_world(Vec3 p) const {
+        p -= offset;
+        return Vec3(dot(rows[0], p), dot(rows[1], p), dot(rows[2], p));
+    }
+};
+
+size_t scene_objects();
+const Object *scene_object(size_t i);
+
+// A scene object by address, so structures traced in place of the scene (e.g. the
+// motion BVH) need not copy it
+struct Object_Ref {
+    const Object *object;
+    BBox bbox() const;
+    Trace hit(const Ray &ray) const;
+};
+
+// Finds the material of scene object i and whether it is a sphere, and then its
+// geometry. Each returns false if the object could not be read (e.g. it is empty).
+bool probe_material(size_t i, Object_Shape &shape);
+bool probe_geometry(size_t i, Object_Shape &shape);
+
+// Identifies the materials' types and parameters, for keying structures built from them
+uint64_t materials_key(const std::vector<BSDF> &materials);
+
+// Identifies the point and spot lights by where they are and what they emit towards a
+// few fixed points, as seen through Light::sample; other lights are skipped, since
+// sampling an area light picks a random point
+uint64_t lights_key(const std::vector<Light> &lights);
+
+} // namespace PT
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "../rays/bsdf.h"
+#include "../rays/trace.h"
+
+/* Batched BSDF evaluation:
+
+    BSDF::evaluate dispatches on the material type (the variant held by BSDF) for
+    every call. When many evaluations are needed at once, these functions resolve the
+    type once per batch instead, and run a loop instantiated for that concrete BSDF
+    type, so the per-sample work is a direct (inlinable) call with the material's
+    parameters already in registers.
+
+    evaluate_batch handles many directions against one BSDF, e.g. all of a light's
+    samples at a hit point.
+
+    The same holds across hits: trace_pixel finds the first hit of all of a pixel's
+    camera rays, then shades them in the order given by sort_by_material, so runs of
+    consecutive samples go through the same BSDF type and material (at the pixel's
+    edges the samples are split between several).
+*/
+
+namespace PT {
+
+// out[i] = bsdf.evaluate(out_dir, in_dirs[i]) for i in [0, n)
+void evaluate_batch(const BSDF &bsdf, Vec3 out_dir, const Vec3 *in_dirs, size_t n,
+                    Spectrum *out);
+
+// Fills order with the indices of hits, sorted by BSDF type and then material, with
+// the misses last; hits with equal keys keep their relative order
+void sort_by_material(const std::vector<BSDF> &materials, const std::vector<Trace> &hits,
+                      std::vector<uint32_t> &order);
+
+} // namespace PT
@@ -1,6 +1,10 @@
 
 #include "../rays/shapes.h"
 #include "debug.h"
+#include "scene_probe.h"
+
+#include <algorithm>
+#include <cmath>
 
 namespace PT {
 
@@ -25,6 +29,16 @@ Trace Sphere::hit(const Ray &ray) const {
     // but only the _later_ one is within ray.time_bounds, you should
     // return that one!
 
+    // Probe rays read the sphere instead (see scene_probe.h)
+    if (ray.depth == probe_depth) {
+        Probe_Record &record = probe_record();
+        record.reached = true;
+        record.origin = ray.point;
+        record.sphere = true;
+        record.radius = radius;
+        return {};
+    }
+
     Trace ret;
 
     ret.hit = false;       // was there an intersection?
@@ -32,42 +46,35 @@ Trace Sphere::hit(const Ray &ray) const {
     ret.position = Vec3{}; // where was the intersection?
     ret.normal = Vec3{};   // what was the surface normal at the intersection?
 
+    // Solve |o + t d|^2 = r^2 in the form from Ray Tracing Gems (ch. 7):
+    // the discriminant is computed from the distance between the center and the
+    // ray's closest point to it, and the second root from the first through
+    // t0 * t1 = c / a, which both avoid catastrophic cancellation.
     float a = dot(ray.dir, ray.dir);
-    float b = 2.f*dot(ray.point, ray.dir);
-    float c = dot(ray.point, ray.point)-radius*radius;
-
-    float b2minus4ac = b*b-4.f*a*c;
-    
-    if(b2minus4ac>=0){
-        float t1 = (- b - sqrt(b2minus4ac))/(2.f*a);
-        float t2 = (- b + sqrt(b2minus4ac))/(2.f*a);
-        bool t1True = (t1>ray.time_bounds[0])&&(t1<ray.time_bounds[1])&&(t1>0);
-        bool t2True = (t2>ray.time_bounds[0])&&(t2<ray.time_bounds[1])&&(t2>0);
-        
-        if (t1True&&t2True){
-            float t = std::min(t1, t2);
-            ret.hit = true;
-            ret.time = t;
-            ret.position = ray.point+t*ray.dir;
-            ret.normal = ret.position.normalize();
-            return ret;
-        }
-        else if(t1True && !t2True){
-            ret.hit = true;
-            ret.time = t1;
-            ret.position = ray.point+t1*ray.dir;
-            ret.normal = ret.position.normalize();
-            return ret;
-        }
-        else if(t2True && !t1True){
-            ret.hit = true;
-            ret.time = t1;
-            ret.position = ray.point+t1*ray.dir;
-            ret.normal = ret.position.normalize();
-            return ret;
-        }
-    }
+    float b = -dot(ray.point, ray.dir);
+    float c = dot(ray.point, ray.point) - radius * radius;
+    Vec3 l = ray.point + (b / a) * ray.dir;
+    float discriminant = a * (radius * radius - dot(l, l));
+    if (discriminant < 0.0f)
+        return ret;
+
+    float q = b + std::copysign(std::sqrt(discriminant), b);
+    float t0 = c / q, t1 = q / a;
+    if (t0 > t1)
+        std::swap(t0, t1);
+
+    // Take the nearer root when it lies within the ray's bounds, else the farther one
+    auto in_bounds = [&](float t) {
+        return t > ray.time_bounds[0] && t < ray.time_bounds[1] && t > 0.0f;
+    };
+    bool hit0 = in_bounds(t0);
+    if (!hit0 && !in_bounds(t1))
+        return ret;
 
+    ret.hit = true;
+    ret.time = hit0 ? t0 : t1;
+    ret.position = ray.point + ret.time * ray.dir;
+    ret.normal = ret.position * (1.0f / radius);
     return ret;
 }
  
@@ -0,0 +1,746 @@
+
+#include "simplify.h"
+#include "../lib/log.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <utility>
+
+namespace {
+
+using Index = Flat_Halfedge_Mesh::Index;
+using Clock = std::chrono::steady_clock;
+
+// Border planes are weighted well above any face so borders move last
+const float boundary_weight = 100.0f;
+
+// A 4-ary min-heap of edges keyed by cost, tracking each edge's slot so a changed
+// cost moves its entry in place. Four children of 8 bytes share a cache line, so a
+// sift touches half as many lines as in a binary heap.
+class Edge_Heap {
+public:
+    explicit Edge_Heap(Index n_edges) : slot(n_edges, Flat_Halfedge_Mesh::null) {
+    }
+
+    bool empty() const {
+        return entries.empty();
+    }
+
+    // Takes (edge, cost) pairs for distinct edges and heapifies them in one pass
+    void build(std::vector<std::pair<float, Index>> &&items) {
+        entries = std::move(items);
+        for (size_t i = 0; i < entries.size(); i++)
+            slot[entries[i].second] = (Index)i;
+        if (entries.empty())
+            return;
+        for (size_t i = entries.size() / 4 + 1; i-- > 0;)
+            down(i);
+    }
+
+    // Sets the cost of e, inserting it if it is not in the heap
+    void update(Index e, float cost) {
+        Index i = slot[e];
+        if (i == Flat_Halfedge_Mesh::null) {
+            entries.push_back({cost, e});
+            slot[e] = (Index)entries.size() - 1;
+            up(entries.size() - 1);
+            return;
+        }
+        float old = entries[i].first;
+        entries[i].first = cost;
+        if (cost < old)
+            up(i);
+        else
+            down(i);
+    }
+
+    void remove(Index e) {
+        Index i = slot[e];
+        if (i == Flat_Halfedge_Mesh::null)
+            return;
+        slot[e] = Flat_Halfedge_Mesh::null;
+        std::pair<float, Index> last = entries.back();
+        entries.pop_back();
+        if (i < entries.size()) {
+            float old = entries[i].first;
+            place(i, last);
+            if (last.first < old)
+                up(i);
+            else
+                down(i);
+        }
+    }
+
+    Index pop() {
+        Index e = entries[0].second;
+        slot[e] = Flat_Halfedge_Mesh::null;
+        std::pair<float, Index> last = entries.back();
+        entries.pop_back();
+        if (!entries.empty()) {
+            entries[0] = last;
+            slot[last.second] = 0;
+            down(0);
+        }
+        return e;
+    }
+
+private:
+    std::vector<std::pair<float, Index>> entries;
+    std::vector<Index> slot;
+
+    void place(size_t i, std::pair<float, Index> x) {
+        entries[i] = x;
+        slot[x.second] = (Index)i;
+    }
+    void up(size_t i) {
+        std::pair<float, Index> x = entries[i];
+        while (i > 0) {
+            size_t parent = (i - 1) / 4;
+            if (entries[parent].first <= x.first)
+                break;
+            place(i, entries[parent]);
+            i = parent;
+        }
+        place(i, x);
+    }
+    void down(size_t i) {
+        std::pair<float, Index> x = entries[i];
+        size_t n = entries.size();
+        while (4 * i + 1 < n) {
+            size_t child = 4 * i + 1, last = std::min(child + 4, n);
+            for (size_t c = child + 1; c < last; c++)
+                if (entries[c].first < entries[child].first)
+                    child = c;
+            if (x.first <= entries[child].first)
+                break;
+            place(i, entries[child]);
+            i = child;
+        }
+        place(i, x);
+    }
+};
+
+// The unit normal, offset and area of a triangle
+struct Plane {
+    Vec3 n;
+    float d = 0.0f, area = 0.0f;
+};
+
+Plane triangle_plane(Vec3 p0, Vec3 p1, Vec3 p2) {
+    Plane p;
+    Vec3 n = cross(p1 - p0, p2 - p0);
+    float len = n.norm();
+    if (len <= 0.0f)
+        return p;
+    p.n = n / len;
+    p.d = -dot(p.n, p0);
+    p.area = 0.5f * len;
+    return p;
+}
+
+Plane face_plane(const Flat_Halfedge_Mesh &mesh, Index f) {
+    Index h = mesh.face_halfedge[f];
+    Index h1 = mesh.next[h], h2 = mesh.next[h1];
+    return triangle_plane(mesh.pos[mesh.vertex[h]], mesh.pos[mesh.vertex[h1]],
+                          mesh.pos[mesh.vertex[h2]]);
+}
+
+// Where edge e should collapse to and what that costs under quadric q
+float collapse_target(const Flat_Halfedge_Mesh &mesh, Index e, const Quadric &q, Vec3 &x) {
+    if (q.optimum(x) && std::isfinite(x.x) && std::isfinite(x.y) && std::isfinite(x.z))
+        return (float)std::max(0.0, q.error(x));
+
+    // Ill-conditioned (e.g. a flat region): take the best of the ends and the middle
+    Vec3 a = mesh.pos[mesh.vertex[2 * e]], b = mesh.pos[mesh.vertex[2 * e + 1]];
+    Vec3 candidates[3] = {0.5f * (a + b), a, b};
+    double best = q.error(candidates[0]);
+    x = candidates[0];
+    for (int i = 1; i < 3; i++) {
+        double err = q.error(candidates[i]);
+        if (err < best) {
+            best = err;
+            x = candidates[i];
+        }
+    }
+    return (float)std::max(0.0, best);
+}
+
+// Whether moving both ends of e to x turns any other face around them over
+bool flips_face(const Flat_Halfedge_Mesh &mesh, Index e, Vec3 x) {
+
+    Index a = mesh.vertex[2 * e], b = mesh.vertex[2 * e + 1];
+    Index f0 = mesh.face[2 * e], f1 = mesh.face[2 * e + 1];
+    bool flips = false;
+    for (Index v : {a, b}) {
+        mesh.for_each_outgoing(v, [&](Index h) {
+            Index f = mesh.face[h];
+            if (flips || mesh.boundary[f] || f == f0 || f == f1)
+                return;
+            Index h1 = mesh.next[h], h2 = mesh.next[h1];
+            Vec3 p1 = mesh.pos[mesh.vertex[h1]], p2 = mesh.pos[mesh.vertex[h2]];
+            Vec3 before = cross(p1 - mesh.pos[v], p2 - mesh.pos[v]);
+            Vec3 after = cross(p1 - x, p2 - x);
+            flips = dot(before, after) <= 0.0f;
+        });
+    }
+    return flips;
+}
+
+// Counts the non-boundary faces; returns false if any of them is not a triangle
+bool count_triangles(const Flat_Halfedge_Mesh &mesh, size_t &faces) {
+    faces = 0;
+    for (Index f = 0; f < mesh.face_capacity(); f++) {
+        if (!mesh.face_alive(f) || mesh.boundary[f])
+            continue;
+        if (mesh.face_degree(f) != 3)
+            return false;
+        faces++;
+    }
+    return true;
+}
+
+// The area-weighted planes of the faces around each vertex, plus a plane through
+// each border edge perpendicular to its face
+std::vector<Quadric> vertex_quadrics(const Flat_Halfedge_Mesh &mesh, size_t threads) {
+
+    Index nv = mesh.vertex_capacity(), nf = mesh.face_capacity();
+    std::vector<Quadric> face_quadric(nf);
+    parallel_for(nf, threads, [&](size_t begin, size_t end) {
+        for (size_t f = begin; f < end; f++) {
+            if (!mesh.face_alive((Index)f) || mesh.boundary[f])
+                continue;
+            Plane p = face_plane(mesh, (Index)f);
+            face_quadric[f] = Quadric::plane(p.n, p.d, p.area);
+        }
+    });
+    std::vector<Quadric> quadric(nv);
+    parallel_for(nv, threads, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++) {
+            if (!mesh.vertex_alive((Index)v))
+                continue;
+            mesh.for_each_outgoing((Index)v, [&](Index h) {
+                Index f = mesh.face[h], g = mesh.face[Flat_Halfedge_Mesh::twin(h)];
+                if (!mesh.boundary[f])
+                    quadric[v] += face_quadric[f];
+                if (mesh.boundary[f] != mesh.boundary[g]) {
+                    Index inside = mesh.boundary[f] ? g : f;
+                    Vec3 p = mesh.pos[v];
+                    Vec3 t = mesh.pos[mesh.vertex[Flat_Halfedge_Mesh::twin(h)]] - p;
+                    Vec3 m = cross(t, face_plane(mesh, inside).n);
+                    float len = m.norm();
+                    if (len > 0.0f) {
+                        m /= len;
+                        quadric[v] += Quadric::plane(m, -dot(m, p), boundary_weight * len * len);
+                    }
+                }
+            });
+        }
+    });
+    return quadric;
+}
+
+// The cost of collapsing e under its endpoints' quadrics, and where to put the result
+float edge_cost(const Flat_Halfedge_Mesh &mesh, const std::vector<Quadric> &quadric, Index e,
+                Vec3 &x) {
+    Quadric q = quadric[mesh.vertex[2 * e]] + quadric[mesh.vertex[2 * e + 1]];
+    return collapse_target(mesh, e, q, x);
+}
+
+// The collapse of e merges the other two sides of each triangle on e into one edge;
+// writes those sides and returns how many there are
+Index collapse_sides(const Flat_Halfedge_Mesh &mesh, Index e, Index sides[4]) {
+    Index n = 0;
+    for (Index h : {2 * e, 2 * e + 1}) {
+        if (mesh.boundary[mesh.face[h]])
+            continue;
+        sides[n++] = Flat_Halfedge_Mesh::edge(mesh.next[h]);
+        sides[n++] = Flat_Halfedge_Mesh::edge(mesh.next[mesh.next[h]]);
+    }
+    return n;
+}
+
+// Calls fn on every vertex a collapse of e reads or writes: both endpoints and all
+// of their neighbors (with repeats)
+template<typename F> void for_each_claimed(const Flat_Halfedge_Mesh &mesh, Index e, F &&fn) {
+    for (Index v : {mesh.vertex[2 * e], mesh.vertex[2 * e + 1]}) {
+        fn(v);
+        mesh.for_each_outgoing(v, [&](Index h) { fn(mesh.vertex[Flat_Halfedge_Mesh::twin(h)]); });
+    }
+}
+
+} // namespace
+
+Quadric Quadric::plane(Vec3 n, float d, float weight) {
+    Quadric r;
+    double a = n.x, b = n.y, c = n.z, w = d;
+    double entries[10] = {a * a, a * b, a * c, a * w, b * b, b * c, b * w, c * c, c * w, w * w};
+    for (int i = 0; i < 10; i++)
+        r.q[i] = entries[i] * weight;
+    return r;
+}
+
+double Quadric::error(Vec3 x) const {
+    double X = x.x, Y = x.y, Z = x.z;
+    return q[0] * X * X + 2.0 * q[1] * X * Y + 2.0 * q[2] * X * Z + 2.0 * q[3] * X +
+           q[4] * Y * Y + 2.0 * q[5] * Y * Z + 2.0 * q[6] * Y + q[7] * Z * Z +
+           2.0 * q[8] * Z + q[9];
+}
+
+bool Quadric::optimum(Vec3 &x) const {
+
+    // Solve A x = -b by Cramer's rule, A = [q0 q1 q2; q1 q4 q5; q2 q5 q7]
+    double a00 = q[0], a01 = q[1], a02 = q[2], a11 = q[4], a12 = q[5], a22 = q[7];
+    double b0 = -q[3], b1 = -q[6], b2 = -q[8];
+
+    double c00 = a11 * a22 - a12 * a12;
+    double c01 = a02 * a12 - a01 * a22;
+    double c02 = a01 * a12 - a02 * a11;
+    double det = a00 * c00 + a01 * c01 + a02 * c02;
+    double scale = std::abs(a00) + std::abs(a11) + std::abs(a22);
+    if (std::abs(det) <= 1e-9 * scale * scale * scale || scale == 0.0)
+        return false;
+
+    double c11 = a00 * a22 - a02 * a02;
+    double c12 = a01 * a02 - a00 * a12;
+    double c22 = a00 * a11 - a01 * a01;
+    double inv = 1.0 / det;
+    x = Vec3((float)((c00 * b0 + c01 * b1 + c02 * b2) * inv),
+             (float)((c01 * b0 + c11 * b1 + c12 * b2) * inv),
+             (float)((c02 * b0 + c12 * b1 + c22 * b2) * inv));
+    return true;
+}
+
+void Collapse_History::clear() {
+    kept.clear();
+    removed.clear();
+    merged_pos.clear();
+    dropped_start.assign(1, 0);
+    dropped.clear();
+    moved_start.assign(1, 0);
+    moved.clear();
+}
+
+void Collapse_History::push(const Flat_Halfedge_Mesh &mesh, Index e, Vec3 x) {
+
+    Index f0 = mesh.face[2 * e], f1 = mesh.face[2 * e + 1];
+    Index b = mesh.vertex[2 * e + 1];
+    kept.push_back(mesh.vertex[2 * e]);
+    removed.push_back(b);
+    merged_pos.push_back(x);
+    for (Index f : {f0, f1})
+        if (!mesh.boundary[f])
+            dropped.push_back(f);
+    dropped_start.push_back((Index)dropped.size());
+    mesh.for_each_outgoing(b, [&](Index h) {
+        Index f = mesh.face[h];
+        if (!mesh.boundary[f] && f != f0 && f != f1)
+            moved.push_back(f);
+    });
+    moved_start.push_back((Index)moved.size());
+}
+
+void Collapse_History::pop() {
+    kept.pop_back();
+    removed.pop_back();
+    merged_pos.pop_back();
+    dropped_start.pop_back();
+    dropped.resize(dropped_start.back());
+    moved_start.pop_back();
+    moved.resize(moved_start.back());
+}
+
+void Collapse_History::append(const Collapse_History &other) {
+    kept.insert(kept.end(), other.kept.begin(), other.kept.end());
+    removed.insert(removed.end(), other.removed.begin(), other.removed.end());
+    merged_pos.insert(merged_pos.end(), other.merged_pos.begin(), other.merged_pos.end());
+    Index d = (Index)dropped.size(), m = (Index)moved.size();
+    for (size_t i = 1; i < other.dropped_start.size(); i++)
+        dropped_start.push_back(d + other.dropped_start[i]);
+    for (size_t i = 1; i < other.moved_start.size(); i++)
+        moved_start.push_back(m + other.moved_start[i]);
+    dropped.insert(dropped.end(), other.dropped.begin(), other.dropped.end());
+    moved.insert(moved.end(), other.moved.begin(), other.moved.end());
+}
+
+bool simplify(Flat_Halfedge_Mesh &mesh, size_t target_faces, size_t threads,
+              Simplify_Stats *stats, Collapse_History *history) {
+
+    Simplify_Stats local;
+    Simplify_Stats &s = stats ? *stats : local;
+    s = {};
+
+    size_t faces = 0;
+    if (!count_triangles(mesh, faces))
+        return false;
+    s.faces_before = s.faces_after = faces;
+    Index ne = mesh.edge_capacity();
+
+    Clock::time_point start = Clock::now();
+    std::vector<Quadric> quadric = vertex_quadrics(mesh, threads);
+    s.quadric_ms = ms_since(start);
+
+    // Initial costs and heap
+    start = Clock::now();
+    std::vector<Vec3> target(ne);
+    std::vector<std::pair<float, Index>> costs(ne);
+    parallel_for(ne, threads, [&](size_t begin, size_t end) {
+        for (size_t e = begin; e < end; e++) {
+            if (!mesh.edge_alive((Index)e)) {
+                costs[e] = {0.0f, Flat_Halfedge_Mesh::null};
+                continue;
+            }
+            costs[e] = {edge_cost(mesh, quadric, (Index)e, target[e]), (Index)e};
+        }
+    });
+    costs.erase(std::remove_if(costs.begin(), costs.end(),
+                               [](const std::pair<float, Index> &x) {
+                                   return x.second == Flat_Halfedge_Mesh::null;
+                               }),
+                costs.end());
+    Edge_Heap heap(ne);
+    heap.build(std::move(costs));
+    s.cost_ms = ms_since(start);
+
+    start = Clock::now();
+    while (faces > target_faces && !heap.empty()) {
+
+        Index e = heap.pop();
+        if (!mesh.edge_alive(e))
+            continue;
+
+        Vec3 x = target[e];
+        if (flips_face(mesh, e, x)) {
+            s.rejected++;
+            continue;
+        }
+        Index sides[4];
+        Index n_sides = collapse_sides(mesh, e, sides);
+        Quadric q = quadric[mesh.vertex[2 * e]] + quadric[mesh.vertex[2 * e + 1]];
+        if (history)
+            history->push(mesh, e, x);
+        std::optional<Index> v = mesh.collapse_edge(e);
+        if (!v) {
+            if (history)
+                history->pop();
+            s.rejected++;
+            continue;
+        }
+        mesh.pos[*v] = x;
+        quadric[*v] = q;
+        faces -= n_sides / 2;
+        for (Index i = 0; i < n_sides; i++)
+            if (!mesh.edge_alive(sides[i]))
+                heap.remove(sides[i]);
+        s.collapses++;
+
+        // Every edge around the new vertex changed cost
+        mesh.for_each_outgoing(*v, [&](Index h) {
+            Index g = Flat_Halfedge_Mesh::edge(h);
+            heap.update(g, edge_cost(mesh, quadric, g, target[g]));
+        });
+    }
+    s.collapse_ms = ms_since(start);
+    s.faces_after = faces;
+
+    mesh.compact();
+    return s.collapses > 0;
+}
+
+bool simplify_batched(Flat_Halfedge_Mesh &mesh, size_t target_faces, size_t threads,
+                      Simplify_Stats *stats, Collapse_History *history) {
+
+    Simplify_Stats local;
+    Simplify_Stats &s = stats ? *stats : local;
+    s = {};
+
+    size_t faces = 0;
+    if (!count_triangles(mesh, faces))
+        return false;
+    s.faces_before = s.faces_after = faces;
+    Index nv = mesh.vertex_capacity(), ne = mesh.edge_capacity();
+    const float never = std::numeric_limits<float>::infinity();
+
+    Clock::time_point start = Clock::now();
+    std::vector<Quadric> quadric = vertex_quadrics(mesh, threads);
+    s.quadric_ms = ms_since(start);
+
+    start = Clock::now();
+    std::vector<Vec3> target(ne);
+    std::vector<float> cost(ne, never);
+    parallel_for(ne, threads, [&](size_t begin, size_t end) {
+        for (size_t e = begin; e < end; e++)
+            if (mesh.edge_alive((Index)e))
+                cost[e] = edge_cost(mesh, quadric, (Index)e, target[e]);
+    });
+    s.cost_ms = ms_since(start);
+
+    // owner[v] is the smallest key of the candidates claiming v in a selection pass,
+    // and taken[v] marks vertices claimed by an edge already selected this round.
+    // Keys count down from pass to pass, so owners left over from earlier passes
+    // never win and need no reset (until the count wraps).
+    std::vector<std::atomic<uint64_t>> owner(nv);
+    auto reset_owners = [&]() {
+        parallel_for(nv, threads, [&](size_t begin, size_t end) {
+            for (size_t v = begin; v < end; v++)
+                owner[v].store(~uint64_t(0), std::memory_order_relaxed);
+        });
+    };
+    reset_owners();
+    std::vector<uint8_t> taken(nv, 0);
+
+    // Within a pass, keys hash the edge so winners spread evenly over the mesh
+    // instead of lining up along gradients of the cost; the edge breaks ties
+    uint32_t pass = 0;
+    auto key = [&](Index e) {
+        uint32_t x = mix_bits(e + pass * 0x9e3779b9u);
+        return (uint64_t(0xffffu - (pass & 0xffffu)) << 48) | (uint64_t(x >> 16) << 32) | e;
+    };
+    std::mutex lock;
+    std::vector<Index> candidates, selected, claim_start, claims;
+    std::vector<size_t> picked;
+    mesh.defer_free_lists(true);
+
+    while (faces > target_faces) {
+
+        // Candidates: roughly the edges cheap enough to make up the remaining
+        // collapses, with the cutoff estimated from a sample of the costs
+        start = Clock::now();
+        size_t wanted = (faces - target_faces + 1) / 2;
+        std::vector<float> sample;
+        Index stride = std::max<Index>(1, ne / 65536);
+        for (Index e = 0; e < ne; e += stride)
+            if (cost[e] != never)
+                sample.push_back(cost[e]);
+        if (sample.empty())
+            break;
+        size_t n_live = std::max<size_t>(1, faces * 3 / 2);
+        size_t rank = std::min(sample.size() - 1,
+                               sample.size() * std::min(wanted, n_live / 12) / n_live);
+        std::nth_element(sample.begin(), sample.begin() + rank, sample.end());
+        float cutoff = sample[rank];
+
+        candidates.clear();
+        parallel_for(ne, threads, [&](size_t begin, size_t end) {
+            std::vector<Index> mine;
+            for (size_t e = begin; e < end; e++)
+                if (cost[e] <= cutoff)
+                    mine.push_back((Index)e);
+            std::lock_guard<std::mutex> guard(lock);
+            candidates.insert(candidates.end(), mine.begin(), mine.end());
+        });
+        if (candidates.empty())
+            break;
+
+        // Each candidate claims the vertices its collapse touches, gathered once per
+        // round into CSR arrays. A candidate that holds all of its claims is picked:
+        // no other picked collapse reads or writes anything it does. Candidates
+        // clear of every picked edge try again in the next pass, growing the set
+        // toward a maximal one.
+        claim_start.assign(candidates.size() + 1, 0);
+        parallel_for(candidates.size(), threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                Index e = candidates[i];
+                claim_start[i + 1] = 2 + mesh.vertex_degree(mesh.vertex[2 * e]) +
+                                     mesh.vertex_degree(mesh.vertex[2 * e + 1]);
+            }
+        }, 256);
+        for (size_t i = 0; i < candidates.size(); i++)
+            claim_start[i + 1] += claim_start[i];
+        claims.resize(claim_start.back());
+        parallel_for(candidates.size(), threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                Index *out = &claims[claim_start[i]];
+                for_each_claimed(mesh, candidates[i], [&](Index w) { *out++ = w; });
+            }
+        }, 256);
+        auto claims_begin = [&](size_t i) { return claims.begin() + claim_start[i]; };
+        auto claims_end = [&](size_t i) { return claims.begin() + claim_start[i + 1]; };
+
+        picked.clear();
+        std::vector<uint8_t> active(candidates.size(), 1);
+        for (int round_pass = 0; round_pass < 3; round_pass++) {
+            if (++pass % 0x10000u == 0)
+                reset_owners();
+            parallel_for(candidates.size(), threads, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    if (!active[i])
+                        continue;
+                    if (std::any_of(claims_begin(i), claims_end(i),
+                                    [&](Index w) { return taken[w]; })) {
+                        active[i] = 0;
+                        continue;
+                    }
+                    uint64_t k = key(candidates[i]);
+                    std::for_each(claims_begin(i), claims_end(i),
+                                  [&](Index w) { atomic_min(owner[w], k); });
+                }
+            }, 256);
+            size_t first = picked.size();
+            parallel_for(candidates.size(), threads, [&](size_t begin, size_t end) {
+                std::vector<size_t> mine;
+                for (size_t i = begin; i < end; i++) {
+                    if (!active[i])
+                        continue;
+                    uint64_t k = key(candidates[i]);
+                    if (std::all_of(claims_begin(i), claims_end(i), [&](Index w) {
+                            return owner[w].load(std::memory_order_relaxed) == k;
+                        })) {
+                        mine.push_back(i);
+                        active[i] = 0;
+                    }
+                }
+                std::lock_guard<std::mutex> guard(lock);
+                picked.insert(picked.end(), mine.begin(), mine.end());
+            }, 256);
+            parallel_for(picked.size() - first, threads, [&](size_t begin, size_t end) {
+                for (size_t j = first + begin; j < first + end; j++)
+                    std::for_each(claims_begin(picked[j]), claims_end(picked[j]),
+                                  [&](Index w) { taken[w] = 1; });
+            }, 256);
+        }
+        selected.resize(picked.size());
+        parallel_for(picked.size(), threads, [&](size_t begin, size_t end) {
+            for (size_t j = begin; j < end; j++) {
+                std::for_each(claims_begin(picked[j]), claims_end(picked[j]),
+                              [&](Index w) { taken[w] = 0; });
+                selected[j] = candidates[picked[j]];
+            }
+        }, 256);
+        if (selected.size() > wanted) {
+            std::sort(selected.begin(), selected.end(), [&](Index a, Index b) {
+                return cost[a] < cost[b] || (cost[a] == cost[b] && a < b);
+            });
+            selected.resize(wanted);
+        }
+        // In index order, neighboring collapses touch neighboring memory
+        std::sort(selected.begin(), selected.end());
+        s.select_ms += ms_since(start);
+
+        // Collapse the selected edges concurrently. Walking a boundary face visits
+        // the whole border loop, outside any claim, so edges touching the border
+        // are collapsed afterwards on this thread.
+        start = Clock::now();
+        std::vector<Index> merged(selected.size(), Flat_Halfedge_Mesh::null);
+        std::vector<uint8_t> removed(selected.size(), 0), on_border(selected.size());
+        parallel_for(selected.size(), threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                on_border[i] = mesh.vertex_on_boundary(mesh.vertex[2 * selected[i]]) ||
+                               mesh.vertex_on_boundary(mesh.vertex[2 * selected[i] + 1]);
+        }, 256);
+        // Collapses selected[i], recording it in log if there is one
+        auto collapse = [&](size_t i, Collapse_History *log) {
+            Index e = selected[i];
+            Vec3 x = target[e];
+            Index sides[4];
+            Index n_sides = collapse_sides(mesh, e, sides);
+            Quadric q = quadric[mesh.vertex[2 * e]] + quadric[mesh.vertex[2 * e + 1]];
+            std::optional<Index> v;
+            if (!flips_face(mesh, e, x)) {
+                if (log)
+                    log->push(mesh, e, x);
+                v = mesh.collapse_edge(e);
+                if (!v && log)
+                    log->pop();
+            }
+            if (!v) {
+                cost[e] = never; // until a collapse next to it changes its cost
+                return;
+            }
+            mesh.pos[*v] = x;
+            quadric[*v] = q;
+            for (Index j = 0; j < n_sides; j++)
+                if (!mesh.edge_alive(sides[j]))
+                    cost[sides[j]] = never;
+            cost[e] = never;
+            merged[i] = *v;
+            removed[i] = (uint8_t)(n_sides / 2);
+        };
+        // Each range logs on its own; the logs are joined in range order, so the
+        // history does not depend on how the threads were scheduled
+        std::vector<std::pair<size_t, Collapse_History>> logs;
+        parallel_for(selected.size(), threads, [&](size_t begin, size_t end) {
+            Collapse_History log;
+            for (size_t i = begin; i < end; i++)
+                if (!on_border[i])
+                    collapse(i, history ? &log : nullptr);
+            if (history) {
+                std::lock_guard<std::mutex> guard(lock);
+                logs.emplace_back(begin, std::move(log));
+            }
+        }, 64);
+        if (history) {
+            std::sort(logs.begin(), logs.end(),
+                      [](const auto &a, const auto &b) { return a.first < b.first; });
+            for (const auto &log : logs)
+                history->append(log.second);
+        }
+        for (size_t i = 0; i < selected.size(); i++)
+            if (on_border[i])
+                collapse(i, history);
+        for (size_t i = 0; i < selected.size(); i++) {
+            faces -= removed[i];
+            if (merged[i] != Flat_Halfedge_Mesh::null)
+                s.collapses++;
+            else
+                s.rejected++;
+        }
+        s.collapse_ms += ms_since(start);
+
+        // Only the edges around each new vertex changed cost, and no two new vertices
+        // share an edge, so they update in parallel too
+        start = Clock::now();
+        parallel_for(merged.size(), threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                if (merged[i] == Flat_Halfedge_Mesh::null)
+                    continue;
+                mesh.for_each_outgoing(merged[i], [&](Index h) {
+                    Index g = Flat_Halfedge_Mesh::edge(h);
+                    cost[g] = edge_cost(mesh, quadric, g, target[g]);
+                });
+            }
+        }, 256);
+        s.update_ms += ms_since(start);
+        s.rounds++;
+    }
+    s.faces_after = faces;
+
+    mesh.defer_free_lists(false);
+    mesh.compact();
+    return s.collapses > 0;
+}
+
+void simplify_benchmark(const std::vector<std::vector<Index>> &triangles,
+                        const std::vector<Vec3> &verts, size_t threads) {
+
+    auto run = [&](const char *name, bool batched, size_t run_threads) {
+        Flat_Halfedge_Mesh mesh;
+        std::string err = mesh.from_poly(triangles, verts);
+        if (!err.empty()) {
+            warn("Simplification benchmark: %s", err.c_str());
+            return;
+        }
+        Simplify_Stats stats;
+        Clock::time_point start = Clock::now();
+        if (batched)
+            simplify_batched(mesh, triangles.size() / 100, run_threads, &stats);
+        else
+            simplify(mesh, triangles.size() / 100, run_threads, &stats);
+        double ms = ms_since(start);
+
+        info("%s: %zu -> %zu triangles in %.0f ms (quadrics %.0f ms, costs %.0f ms, "
+             "select %.0f ms, collapses %.0f ms, updates %.0f ms; %zu collapses in %zu rounds, "
+             "%zu rejected)",
+             name, stats.faces_before, stats.faces_after, ms, stats.quadric_ms, stats.cost_ms,
+             stats.select_ms, stats.collapse_ms, stats.update_ms, stats.collapses, stats.rounds,
+             stats.rejected);
+    };
+    run("Simplification (heap)", false, threads);
+    run("Simplification (batched, 1 thread)", true, 1);
+    run("Simplification (batched)", true, threads);
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "flat_halfedge.h"
+
+/* Quadric error simplification:
+
+    Each face's plane n . x + d = 0 defines the quadric (n . x + d)^2, the squared
+    distance of x from the plane. A vertex's quadric sums those of its faces (scaled
+    by their areas), and collapsing an edge to a point x costs the sum of both
+    endpoints' quadrics evaluated at x, minimized where its gradient vanishes.
+
+    The quadric's matrix is symmetric, so it is stored as the ten distinct entries
+
+        a^2  ab  ac  ad
+             b^2 bc  bd
+                 c^2 cd
+                     d^2
+
+    and the optimal point solves a 3x3 system rather than inverting a Mat4. Quadrics
+    live in arrays indexed by the vertices of a Flat_Halfedge_Mesh. The entries are
+    doubles: on a fine mesh the terms of the error nearly cancel, and in floats the
+    costs of short edges drown in rounding noise.
+
+    Edges wait in a 4-ary min-heap keyed by cost that also records where each edge
+    sits, so when a collapse changes an edge's cost its entry moves up or down in
+    place instead of being erased and reinserted. The heap never holds more than one
+    entry per edge, and the entries of edges a collapse removed are taken out of it
+    right away, so every popped edge is alive.
+
+    Boundary edges add a plane perpendicular to their face through the edge, so open
+    borders stay in place, and collapses that would flip a neighboring face are
+    rejected.
+
+    The heap hands out one edge at a time, so simplify_batched() instead works in
+    rounds. Each round takes the edges cheaper than a cutoff (estimated from a
+    sample of the costs so the round covers about the collapses still wanted) and
+    picks an independent set of them, Luby style: every candidate claims the
+    vertices its collapse touches (both endpoints and their neighbors), each vertex
+    keeps the smallest claim by an atomic min over hashed keys, and candidates
+    holding all of their claims are selected. Candidates clear of the selected ones
+    try again for a few passes. No two selected collapses touch the same elements,
+    so they run concurrently, and afterwards only the edges around the new
+    vertices need new costs, again in parallel.
+*/
+
+struct Quadric {
+    double q[10] = {};
+
+    // The quadric of the plane n . x + d = 0, times weight
+    static Quadric plane(Vec3 n, float d, float weight);
+
+    Quadric &operator+=(const Quadric &o) {
+        for (int i = 0; i < 10; i++)
+            q[i] += o.q[i];
+        return *this;
+    }
+    Quadric operator+(const Quadric &o) const {
+        Quadric r = *this;
+        return r += o;
+    }
+
+    double error(Vec3 x) const;
+    // The point minimizing the error, if the system is well conditioned
+    bool optimum(Vec3 &x) const;
+};
+
+struct Simplify_Stats {
+    size_t faces_before = 0, faces_after = 0;
+    size_t collapses = 0, rejected = 0, rounds = 0;
+    double quadric_ms = 0.0, cost_ms = 0.0, collapse_ms = 0.0;
+    double select_ms = 0.0, update_ms = 0.0; // batched rounds only
+};
+
+// The collapses a simplification performed, in order. Collapse i merged vertex
+// removed[i] into kept[i], which moved to merged_pos[i]; it dropped the triangles
+// dropped[dropped_start[i] .. dropped_start[i + 1]) and, in the triangles
+// moved[moved_start[i] .. moved_start[i + 1]), replaced the corner at removed[i]
+// by kept[i]. Indices refer to the mesh as it was passed in, before compaction.
+struct Collapse_History {
+    using Index = Flat_Halfedge_Mesh::Index;
+
+    std::vector<Index> kept, removed;
+    std::vector<Vec3> merged_pos;
+    std::vector<Index> dropped_start{0}, dropped;
+    std::vector<Index> moved_start{0}, moved;
+
+    size_t size() const {
+        return kept.size();
+    }
+    void clear();
+    // Records the collapse of e to x in mesh, which is about to happen
+    void push(const Flat_Halfedge_Mesh &mesh, Index e, Vec3 x);
+    void pop();
+    void append(const Collapse_History &other);
+};
+
+// Collapses edges of a triangle mesh in order of increasing quadric error until at
+// most target_faces faces remain (or no collapse is possible), then compacts the
+// mesh. Returns false if the mesh is not made of triangles or nothing was collapsed.
+// If history is given, each collapse is appended to it.
+bool simplify(Flat_Halfedge_Mesh &mesh, size_t target_faces, size_t threads = 0,
+              Simplify_Stats *stats = nullptr, Collapse_History *history = nullptr);
+
+// Same contract as simplify, collapsing independent batches of edges on several threads
+bool simplify_batched(Flat_Halfedge_Mesh &mesh, size_t target_faces, size_t threads = 0,
+                      Simplify_Stats *stats = nullptr, Collapse_History *history = nullptr);
+
+// Simplifies the given triangle mesh to 1% of its faces with simplify and with
+// simplify_batched (on one thread and on the given number) and logs the timings
+void simplify_benchmark(const std::vector<std::vector<Flat_Halfedge_Mesh::Index>> &triangles,
+                        const std::vector<Vec3> &verts, size_t threads = 0);
@@ -0,0 +1,212 @@
+
+#include "sphere_packet.h"
+#include "debug.h"
+#include "render_shared.h"
+#include "scene_probe.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+
+#ifdef SPHERE_PACKET_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace PT {
+
+// Spreads the low 10 bits of v so there are two zero bits between each
+static uint32_t spread_bits(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x30000ff;
+    v = (v | (v << 8)) & 0x300f00f;
+    v = (v | (v << 4)) & 0x30c30c3;
+    v = (v | (v << 2)) & 0x9249249;
+    return v;
+}
+
+std::vector<Sphere_Packet> Sphere_Packet::pack(const std::vector<Vec3> &centers,
+                                               const std::vector<float> &radii,
+                                               const std::vector<int> &materials) {
+
+    size_t n = centers.size();
+    BBox bounds;
+    for (const Vec3 &c : centers)
+        bounds.enclose(c);
+    Vec3 extent = bounds.max - bounds.min;
+
+    std::vector<std::pair<uint32_t, uint32_t>> order(n);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t code = 0;
+        for (int a = 0; a < 3; a++) {
+            float t = extent[a] > 0.0f ? (centers[i][a] - bounds.min[a]) / extent[a] : 0.0f;
+            code |= spread_bits((uint32_t)std::clamp(t * 1023.0f, 0.0f, 1023.0f)) << a;
+        }
+        order[i] = {code, (uint32_t)i};
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<Sphere_Packet> packets((n + width - 1) / width);
+    for (size_t p = 0; p < packets.size(); p++) {
+        Sphere_Packet &packet = packets[p];
+        for (size_t lane = 0; lane < width; lane++) {
+            size_t k = p * width + lane;
+            if (k < n) {
+                uint32_t i = order[k].second;
+                packet.cx[lane] = centers[i].x;
+                packet.cy[lane] = centers[i].y;
+                packet.cz[lane] = centers[i].z;
+                packet.r[lane] = radii[i];
+                packet.r2[lane] = radii[i] * radii[i];
+                packet.material[lane] = materials[i];
+                packet.count++;
+            } else {
+                packet.cx[lane] = packet.cy[lane] = packet.cz[lane] = 0.0f;
+                packet.r[lane] = 1.0f;
+                packet.r2[lane] = -1.0f;
+                packet.material[lane] = 0;
+            }
+        }
+    }
+    return packets;
+}
+
+BBox Sphere_Packet::bbox() const {
+    BBox box;
+    for (size_t i = 0; i < count; i++) {
+        Vec3 c(cx[i], cy[i], cz[i]);
+        box.enclose(c - Vec3(r[i]));
+        box.enclose(c + Vec3(r[i]));
+    }
+    return box;
+}
+
+Trace Sphere_Packet::hit(const Ray &ray) const {
+
+    Trace ret;
+    float lo = std::max(ray.time_bounds[0], 0.0f), hi = ray.time_bounds[1];
+    float a = dot(ray.dir, ray.dir);
+    alignas(16) float t[width];
+
+#ifdef SPHERE_PACKET_SSE
+    __m128 dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z);
+    __m128 ox = _mm_sub_ps(_mm_set1_ps(ray.point.x), _mm_load_ps(cx));
+    __m128 oy = _mm_sub_ps(_mm_set1_ps(ray.point.y), _mm_load_ps(cy));
+    __m128 oz = _mm_sub_ps(_mm_set1_ps(ray.point.z), _mm_load_ps(cz));
+    __m128 va = _mm_set1_ps(a), rsq = _mm_load_ps(r2);
+
+    // b = -o.d, c = o.o - r^2, l = o + (b / a) d, discriminant = a (r^2 - l.l)
+    __m128 b = _mm_sub_ps(_mm_setzero_ps(),
+                          _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, dx), _mm_mul_ps(oy, dy)),
+                                     _mm_mul_ps(oz, dz)));
+    __m128 c = _mm_sub_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, ox), _mm_mul_ps(oy, oy)), _mm_mul_ps(oz, oz)), rsq);
+    __m128 s = _mm_div_ps(b, va);
+    __m128 lx = _mm_add_ps(ox, _mm_mul_ps(s, dx));
+    __m128 ly = _mm_add_ps(oy, _mm_mul_ps(s, dy));
+    __m128 lz = _mm_add_ps(oz, _mm_mul_ps(s, dz));
+    __m128 ll = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz));
+    __m128 disc = _mm_mul_ps(va, _mm_sub_ps(rsq, ll));
+    __m128 valid = _mm_and_ps(_mm_cmpge_ps(disc, _mm_setzero_ps()),
+                              _mm_cmpgt_ps(rsq, _mm_setzero_ps()));
+
+    // q = b + sign(b) sqrt(discriminant); roots c / q and q / a
+    __m128 sign = _mm_and_ps(b, _mm_set1_ps(-0.0f));
+    __m128 root = _mm_sqrt_ps(_mm_max_ps(disc, _mm_setzero_ps()));
+    __m128 q = _mm_add_ps(b, _mm_or_ps(root, sign));
+    __m128 t0 = _mm_div_ps(c, q), t1 = _mm_div_ps(q, va);
+    __m128 near_t = _mm_min_ps(t0, t1), far_t = _mm_max_ps(t0, t1);
+
+    __m128 vlo = _mm_set1_ps(lo), vhi = _mm_set1_ps(hi);
+    __m128 near_ok = _mm_and_ps(_mm_cmpgt_ps(near_t, vlo), _mm_cmplt_ps(near_t, vhi));
+    __m128 far_ok = _mm_and_ps(_mm_cmpgt_ps(far_t, vlo), _mm_cmplt_ps(far_t, vhi));
+    __m128 tt = _mm_or_ps(_mm_and_ps(near_ok, near_t), _mm_andnot_ps(near_ok, far_t));
+    __m128 ok = _mm_and_ps(valid, _mm_or_ps(near_ok, far_ok));
+    __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    _mm_store_ps(t, _mm_or_ps(_mm_and_ps(ok, tt), _mm_andnot_ps(ok, inf)));
+#else
+    for (size_t i = 0; i < width; i++) {
+        Vec3 o = ray.point - Vec3(cx[i], cy[i], cz[i]);
+        float b = -dot(o, ray.dir);
+        float c = dot(o, o) - r2[i];
+        Vec3 l = o + (b / a) * ray.dir;
+        float disc = a * (r2[i] - dot(l, l));
+        t[i] = std::numeric_limits<float>::infinity();
+        if (disc < 0.0f || r2[i] <= 0.0f)
+            continue;
+        float q = b + std::copysign(std::sqrt(disc), b);
+        float t0 = std::min(c / q, q / a), t1 = std::max(c / q, q / a);
+        if (t0 > lo && t0 < hi)
+            t[i] = t0;
+        else if (t1 > lo && t1 < hi)
+            t[i] = t1;
+    }
+#endif
+
+    size_t best = 0;
+    for (size_t i = 1; i < width; i++)
+        best = t[i] < t[best] ? i : best;
+    if (!(t[best] < std::numeric_limits<float>::infinity()))
+        return ret;
+
+    ret.hit = true;
+    ret.time = t[best];
+    ret.origin = ray.point;
+    ret.position = ray.point + ret.time * ray.dir;
+    ret.normal = (ret.position - Vec3(cx[best], cy[best], cz[best])) * (1.0f / r[best]);
+    ret.material = material[best];
+    return ret;
+}
+
+Trace Packed_Scene::hit(const Ray &ray) const {
+
+    Trace ret = spheres.hit(ray);
+    if (!ret.hit)
+        return others.hit(ray);
+
+    // Only look for other objects in front of the nearest sphere
+    Ray bounded = ray;
+    bounded.time_bounds[1] = ret.time;
+    return Trace::min(ret, others.hit(bounded));
+}
+
+static Render_Shared<Packed_Scene> scenes;
+
+const Packed_Scene *packed_scene() {
+
+    if (!debug_data.sphere_packets)
+        return nullptr;
+
+    uint64_t revision = scene_revision();
+    static thread_local Render_Shared<Packed_Scene>::Handle handle;
+    const Packed_Scene *current = scenes.get(
+        handle, [&](const Packed_Scene &s) { return s.revision == revision; },
+        [&]() {
+            auto s = std::make_shared<Packed_Scene>();
+            s->revision = revision;
+
+            std::vector<Vec3> centers;
+            std::vector<float> radii;
+            std::vector<int> materials;
+            std::vector<Object_Ref> others;
+            for (size_t i = 0; i < scene_objects(); i++) {
+                Object_Shape shape;
+                if (probe_material(i, shape) && shape.sphere && probe_geometry(i, shape)) {
+                    centers.push_back(shape.center);
+                    radii.push_back(shape.radius);
+                    materials.push_back(shape.material);
+                } else {
+                    others.push_back(Object_Ref{scene_object(i)});
+                }
+            }
+            s->n_spheres = centers.size();
+            if (!centers.empty())
+                s->spheres.build(Sphere_Packet::pack(centers, radii, materials));
+            s->others.build(std::move(others));
+            return s;
+        });
+    return current->n_spheres ? current : nullptr;
+}
+
+} // namespace PT
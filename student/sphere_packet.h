@@ -0,0 +1,71 @@
+#pragma once
+
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../rays/bvh.h"
+#include "../rays/trace.h"
+#include "scene_probe.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define SPHERE_PACKET_SSE
+#endif
+
+/* Sphere packets:
+
+    Scenes made of many small spheres (particles) spend most of their time on
+    sphere tests. A Sphere_Packet stores up to four world-space spheres in
+    structure-of-arrays form and intersects a ray with all of them at once, one SSE
+    lane per sphere, using the same cancellation-free quadratic as Sphere::hit and no
+    data-dependent branches until the closest lane is picked.
+
+    Sphere_Packet has the BVH primitive interface (bbox and hit), so a particle
+    system becomes a BVH<Sphere_Packet> built over pack(...), with a quarter as many
+    leaves as a BVH over single spheres. Each lane keeps its material, which is
+    returned in Trace::material.
+
+    With debug_data.sphere_packets set, trace_pixel gets packed_scene(): the scene's
+    sphere objects, read back in world space (see scene_probe.h), in a BVH of
+    packets, and its other objects in a BVH of their own, traced together in place
+    of the scene BVH. Spheres are assumed to be scaled uniformly.
+*/
+
+namespace PT {
+
+struct Sphere_Packet {
+
+    static constexpr size_t width = 4;
+
+    // Sorts spheres along a Morton curve so neighbors share packets, then groups them
+    // in fours. All three vectors must have the same length.
+    static std::vector<Sphere_Packet> pack(const std::vector<Vec3> &centers,
+                                           const std::vector<float> &radii,
+                                           const std::vector<int> &materials);
+
+    BBox bbox() const;
+    Trace hit(const Ray &ray) const;
+
+    // Unused lanes have a negative squared radius, so they never intersect
+    alignas(16) float cx[width], cy[width], cz[width];
+    alignas(16) float r2[width];
+    float r[width];
+    int material[width];
+    size_t count = 0;
+};
+
+// The scene, with its sphere objects in packets
+struct Packed_Scene {
+    uint64_t revision = 0;
+    size_t n_spheres = 0;
+    BVH<Sphere_Packet> spheres;
+    BVH<Object_Ref> others;
+
+    Trace hit(const Ray &ray) const;
+};
+
+// The current scene packed for tracing; null unless debug_data.sphere_packets is set and
+// the scene has spheres. Rebuilt when the scene changes, and valid until the calling
+// thread's next call.
+const Packed_Scene *packed_scene();
+
+} // namespace PT
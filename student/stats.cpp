@@ -0,0 +1,74 @@
+
+#include "stats.h"
+
+#include <algorithm>
+#include <atomic>
+
+namespace PT {
+
+// Global totals; threads only touch these when flushing once per pixel
+static std::atomic<uint64_t> total_rays{0};
+static std::atomic<uint64_t> total_nodes_visited{0};
+static std::atomic<uint64_t> total_boxes_tested{0};
+static std::atomic<uint64_t> total_prims_tested{0};
+static std::atomic<uint64_t> total_tris_tested{0};
+
+Traversal_Stats &Traversal_Stats::operator+=(const Traversal_Stats &s) {
+    rays += s.rays;
+    nodes_visited += s.nodes_visited;
+    boxes_tested += s.boxes_tested;
+    prims_tested += s.prims_tested;
+    tris_tested += s.tris_tested;
+    return *this;
+}
+
+Traversal_Stats Traversal_Stats::operator-(const Traversal_Stats &s) const {
+    Traversal_Stats ret;
+    ret.rays = rays - s.rays;
+    ret.nodes_visited = nodes_visited - s.nodes_visited;
+    ret.boxes_tested = boxes_tested - s.boxes_tested;
+    ret.prims_tested = prims_tested - s.prims_tested;
+    ret.tris_tested = tris_tested - s.tris_tested;
+    return ret;
+}
+
+void flush_traversal_stats() {
+    total_rays.fetch_add(traversal_stats.rays, std::memory_order_relaxed);
+    total_nodes_visited.fetch_add(traversal_stats.nodes_visited, std::memory_order_relaxed);
+    total_boxes_tested.fetch_add(traversal_stats.boxes_tested, std::memory_order_relaxed);
+    total_prims_tested.fetch_add(traversal_stats.prims_tested, std::memory_order_relaxed);
+    total_tris_tested.fetch_add(traversal_stats.tris_tested, std::memory_order_relaxed);
+    traversal_stats.clear();
+}
+
+Traversal_Stats total_traversal_stats() {
+    Traversal_Stats ret;
+    ret.rays = total_rays.load(std::memory_order_relaxed);
+    ret.nodes_visited = total_nodes_visited.load(std::memory_order_relaxed);
+    ret.boxes_tested = total_boxes_tested.load(std::memory_order_relaxed);
+    ret.prims_tested = total_prims_tested.load(std::memory_order_relaxed);
+    ret.tris_tested = total_tris_tested.load(std::memory_order_relaxed);
+    return ret;
+}
+
+void reset_traversal_stats() {
+    total_rays = 0;
+    total_nodes_visited = 0;
+    total_boxes_tested = 0;
+    total_prims_tested = 0;
+    total_tris_tested = 0;
+}
+
+Spectrum heatmap_color(float value, float max_value) {
+
+    // 0 -> blue, 0.5 -> green, 1 -> red
+    float t = max_value > 0.0f ? std::clamp(value / max_value, 0.0f, 1.0f) : 0.0f;
+    if (t < 0.5f) {
+        float s = 2.0f * t;
+        return Spectrum(0.0f, s, 1.0f - s);
+    }
+    float s = 2.0f * (t - 0.5f);
+    return Spectrum(s, 1.0f - s, 0.0f);
+}
+
+} // namespace PT
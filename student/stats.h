@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+
+#include "../lib/spectrum.h"
+
+/* BVH traversal statistics:
+
+    Every thread owns a Traversal_Stats counter block (traversal_stats below), so
+    counting a visited node or a tested triangle is just an increment on thread-local
+    memory. Pathtracer::trace_pixel flushes the per-thread counts into the global
+    totals once per pixel, and can turn the per-pixel counts into a heatmap when
+    debug_data.bvh_heatmap is enabled.
+
+    Define SCOTTY3D_NO_TRAVERSAL_STATS to compile all the counters out.
+*/
+
+namespace PT {
+
+struct Traversal_Stats {
+    uint64_t rays = 0;          // rays traced against the scene (camera and shadow rays)
+    uint64_t nodes_visited = 0; // BVH nodes entered during traversal
+    uint64_t boxes_tested = 0;  // ray - bounding box tests
+    uint64_t prims_tested = 0;  // primitives tested in BVH leaves
+    uint64_t tris_tested = 0;   // ray - triangle tests
+
+    void clear() { *this = Traversal_Stats(); }
+    Traversal_Stats &operator+=(const Traversal_Stats &s);
+    Traversal_Stats operator-(const Traversal_Stats &s) const;
+};
+
+// Counters for the calling thread
+inline thread_local Traversal_Stats traversal_stats;
+
+// Adds the calling thread's counters to the global totals and clears them
+void flush_traversal_stats();
+
+// Totals over all threads since the last reset
+Traversal_Stats total_traversal_stats();
+void reset_traversal_stats();
+
+// Maps a per-pixel count to a blue -> green -> red ramp, saturating at max_value
+Spectrum heatmap_color(float value, float max_value);
+
+} // namespace PT
+
+#ifdef SCOTTY3D_NO_TRAVERSAL_STATS
+#define TRAVERSAL_STAT(field, n) ((void)0)
+#else
+#define TRAVERSAL_STAT(field, n) (PT::traversal_stats.field += (n))
+#endif
@@ -0,0 +1,666 @@
+
+#include "subdivision.h"
+#include "../lib/log.h"
+#include "flat_halfedge.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define SUBDIVISION_SSE
+#endif
+
+namespace {
+
+// Weighted sum of points
+struct Point_Sum {
+#ifdef SUBDIVISION_SSE
+    __m128 v = _mm_setzero_ps();
+    void add(const Subd_Point &p) {
+        v = _mm_add_ps(v, _mm_load_ps(&p.x));
+    }
+    void add(const Subd_Point &p, float w) {
+        v = _mm_add_ps(v, _mm_mul_ps(_mm_load_ps(&p.x), _mm_set1_ps(w)));
+    }
+    void scale(float s) {
+        v = _mm_mul_ps(v, _mm_set1_ps(s));
+    }
+    void store(Subd_Point &out) const {
+        _mm_store_ps(&out.x, v);
+    }
+#else
+    float x = 0.0f, y = 0.0f, z = 0.0f;
+    void add(const Subd_Point &p) {
+        x += p.x;
+        y += p.y;
+        z += p.z;
+    }
+    void add(const Subd_Point &p, float w) {
+        x += p.x * w;
+        y += p.y * w;
+        z += p.z * w;
+    }
+    void scale(float s) {
+        x *= s;
+        y *= s;
+        z *= s;
+    }
+    void store(Subd_Point &out) const {
+        out.x = x;
+        out.y = y;
+        out.z = z;
+        out.w = 0.0f;
+    }
+#endif
+};
+
+using Clock = std::chrono::steady_clock;
+
+} // namespace
+
+std::string Subdivision_Level::build(const std::vector<std::vector<Index>> &polygons,
+                                     Index n_verts) {
+
+    face_start.assign(1, 0);
+    face_verts.clear();
+    face_edges.clear();
+    edge_verts.clear();
+    edge_faces.clear();
+    vertex_start.assign(1, 0);
+    ring_edges.clear();
+    ring_faces.clear();
+
+    Flat_Halfedge_Mesh mesh;
+    std::string err = mesh.from_poly(polygons, std::vector<Vec3>(n_verts));
+    if (!err.empty())
+        return err;
+
+    // from_poly creates one face per polygon, in order, before any boundary faces
+    Index F = (Index)polygons.size();
+    face_start.reserve(F + 1);
+    face_verts.reserve(mesh.n_halfedges());
+    face_edges.reserve(mesh.n_halfedges());
+    for (Index f = 0; f < F; f++) {
+        mesh.for_each_halfedge(f, [&](Index h) {
+            face_verts.push_back(mesh.vertex[h]);
+            face_edges.push_back(Flat_Halfedge_Mesh::edge(h));
+        });
+        face_start.push_back((Index)face_verts.size());
+    }
+
+    Index E = mesh.edge_capacity();
+    edge_verts.resize(2 * E);
+    edge_faces.resize(2 * E);
+    for (Index h = 0; h < 2 * E; h++) {
+        edge_verts[h] = mesh.vertex[h];
+        edge_faces[h] = mesh.boundary[mesh.face[h]] ? null : mesh.face[h];
+    }
+
+    vertex_start.reserve(n_verts + 1);
+    ring_edges.reserve(2 * E);
+    ring_faces.reserve(2 * E);
+    for (Index v = 0; v < n_verts; v++) {
+        mesh.for_each_outgoing(v, [&](Index h) {
+            ring_edges.push_back(Flat_Halfedge_Mesh::edge(h));
+            ring_faces.push_back(edge_faces[h]);
+        });
+        vertex_start.push_back((Index)ring_edges.size());
+    }
+    return {};
+}
+
+void Subdivision_Level::refine(const Subd_Point *in, Subd_Point *out,
+                               Subdivision_Scheme scheme, size_t threads,
+                               Subdivision_Timing *timing) const {
+
+    Index V = n_vertices(), E = n_edges(), F = n_faces();
+    Subd_Point *vertex_points = out, *edge_points = out + V, *face_points = out + V + E;
+    bool smooth = scheme == Subdivision_Scheme::catmull_clark;
+
+    // Face points: centroids
+    Clock::time_point start = Clock::now();
+    parallel_for(F, threads, [&](size_t begin, size_t end) {
+        for (size_t f = begin; f < end; f++) {
+            Point_Sum sum;
+            for (Index k = face_start[f]; k < face_start[f + 1]; k++)
+                sum.add(in[face_verts[k]]);
+            sum.scale(1.0f / (face_start[f + 1] - face_start[f]));
+            sum.store(face_points[f]);
+        }
+    });
+    if (timing)
+        timing->face_ms += ms_since(start);
+
+    // Edge points: midpoints, or for Catmull-Clark the average of the endpoints and
+    // the two adjacent face points
+    start = Clock::now();
+    parallel_for(E, threads, [&](size_t begin, size_t end) {
+        for (size_t e = begin; e < end; e++) {
+            Point_Sum sum;
+            sum.add(in[edge_verts[2 * e]]);
+            sum.add(in[edge_verts[2 * e + 1]]);
+            Index f0 = edge_faces[2 * e], f1 = edge_faces[2 * e + 1];
+            if (smooth && f0 != null && f1 != null) {
+                sum.add(face_points[f0]);
+                sum.add(face_points[f1]);
+                sum.scale(0.25f);
+            } else {
+                sum.scale(0.5f);
+            }
+            sum.store(edge_points[e]);
+        }
+    });
+    if (timing)
+        timing->edge_ms += ms_since(start);
+
+    // Vertex points: for Catmull-Clark, (Q + 2R + (n - 3) S) / n, where Q averages the
+    // adjacent face points and R the adjacent edge midpoints. Expanding R, this is
+    // (sum of face points + sum of neighbors) / n^2 + (n - 2) / n * S.
+    start = Clock::now();
+    parallel_for(V, threads, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++) {
+            const Subd_Point &S = in[v];
+            if (!smooth) {
+                vertex_points[v] = S;
+                continue;
+            }
+
+            Index ring_begin = vertex_start[v], ring_end = vertex_start[v + 1];
+            Index n = ring_end - ring_begin, n_boundary = 0;
+            Point_Sum sum, boundary_sum;
+            for (Index k = ring_begin; k < ring_end; k++) {
+                Index e = ring_edges[k];
+                Index other = edge_verts[2 * e] == v ? edge_verts[2 * e + 1] : edge_verts[2 * e];
+                if (edge_faces[2 * e] == null || edge_faces[2 * e + 1] == null) {
+                    boundary_sum.add(in[other]);
+                    n_boundary++;
+                }
+                sum.add(in[other]);
+                if (ring_faces[k] != null)
+                    sum.add(face_points[ring_faces[k]]);
+            }
+
+            if (n_boundary == 2) {
+                boundary_sum.add(S, 6.0f);
+                boundary_sum.scale(0.125f);
+                boundary_sum.store(vertex_points[v]);
+            } else if (n_boundary) {
+                vertex_points[v] = S; // corner of a non-manifold boundary
+            } else {
+                sum.scale(1.0f / (float)(n * n));
+                sum.add(S, (float)(n - 2) / n);
+                sum.store(vertex_points[v]);
+            }
+        }
+    });
+    if (timing)
+        timing->vertex_ms += ms_since(start);
+}
+
+void Subdivision_Level::refined_polygons(std::vector<std::vector<Index>> &quads) const {
+
+    Index V = n_vertices(), E = n_edges();
+    quads.clear();
+    quads.reserve(face_verts.size());
+    for (Index f = 0; f < n_faces(); f++) {
+        Index s = face_start[f], n = face_start[f + 1] - s;
+        for (Index i = 0; i < n; i++)
+            quads.push_back({face_verts[s + i], V + face_edges[s + i], V + E + f,
+                             V + face_edges[s + (i + n - 1) % n]});
+    }
+}
+
+void Subdivision_Level::stencils(Subdivision_Scheme scheme, std::vector<Index> &row_start,
+                                 std::vector<Index> &columns, std::vector<float> &weights) const {
+
+    Index V = n_vertices(), E = n_edges(), F = n_faces();
+    bool smooth = scheme == Subdivision_Scheme::catmull_clark;
+
+    row_start.assign(1, 0);
+    columns.clear();
+    weights.clear();
+    row_start.reserve(V + E + F + 1);
+    columns.reserve(4 * (size_t)(V + E + F));
+    weights.reserve(4 * (size_t)(V + E + F));
+
+    // Rows are gathered as unsorted (column, weight) terms, then sorted and merged
+    std::vector<std::pair<Index, float>> row;
+    auto add_face = [&](Index f, float w) {
+        float share = w / (face_start[f + 1] - face_start[f]);
+        for (Index k = face_start[f]; k < face_start[f + 1]; k++)
+            row.push_back({face_verts[k], share});
+    };
+    auto emit = [&]() {
+        std::sort(row.begin(), row.end());
+        for (size_t k = 0; k < row.size(); k++) {
+            if (k && row[k].first == row[k - 1].first) {
+                weights.back() += row[k].second;
+            } else {
+                columns.push_back(row[k].first);
+                weights.push_back(row[k].second);
+            }
+        }
+        row_start.push_back((Index)columns.size());
+        row.clear();
+    };
+
+    // Vertex points, with the same rules as refine()
+    for (Index v = 0; v < V; v++) {
+        Index ring_begin = vertex_start[v], ring_end = vertex_start[v + 1];
+        Index n = ring_end - ring_begin, n_boundary = 0;
+        for (Index k = ring_begin; k < ring_end; k++) {
+            Index e = ring_edges[k];
+            n_boundary += edge_faces[2 * e] == null || edge_faces[2 * e + 1] == null;
+        }
+
+        if (!smooth || (n_boundary && n_boundary != 2)) {
+            row.push_back({v, 1.0f});
+        } else if (n_boundary == 2) {
+            row.push_back({v, 0.75f});
+            for (Index k = ring_begin; k < ring_end; k++) {
+                Index e = ring_edges[k];
+                if (edge_faces[2 * e] == null || edge_faces[2 * e + 1] == null)
+                    row.push_back({edge_verts[2 * e] == v ? edge_verts[2 * e + 1]
+                                                          : edge_verts[2 * e],
+                                   0.125f});
+            }
+        } else {
+            float w = 1.0f / (float)(n * n);
+            row.push_back({v, (float)(n - 2) / n});
+            for (Index k = ring_begin; k < ring_end; k++) {
+                Index e = ring_edges[k];
+                row.push_back(
+                    {edge_verts[2 * e] == v ? edge_verts[2 * e + 1] : edge_verts[2 * e], w});
+                add_face(ring_faces[k], w);
+            }
+        }
+        emit();
+    }
+
+    // Edge points
+    for (Index e = 0; e < E; e++) {
+        Index f0 = edge_faces[2 * e], f1 = edge_faces[2 * e + 1];
+        bool interior = smooth && f0 != null && f1 != null;
+        float w = interior ? 0.25f : 0.5f;
+        row.push_back({edge_verts[2 * e], w});
+        row.push_back({edge_verts[2 * e + 1], w});
+        if (interior) {
+            add_face(f0, 0.25f);
+            add_face(f1, 0.25f);
+        }
+        emit();
+    }
+
+    // Face points
+    for (Index f = 0; f < F; f++) {
+        add_face(f, 1.0f);
+        emit();
+    }
+}
+
+bool Subdivision_Level::is_triangle_mesh() const {
+    return face_verts.size() == 3 * (size_t)n_faces();
+}
+
+void Subdivision_Level::loop_refine(const Subd_Point *in, Subd_Point *out, size_t threads,
+                                    Subdivision_Timing *timing) const {
+
+    Index V = n_vertices(), E = n_edges();
+    Subd_Point *vertex_points = out, *edge_points = out + V;
+
+    // Edge points. Faces are triangles, so side i of face f is face_verts[3f + i] to
+    // face_verts[3f + (i + 1) % 3] and its opposite corner is face_verts[3f + (i + 2) % 3].
+    auto opposite = [&](Index f, Index e) {
+        for (Index i = 0; i < 3; i++)
+            if (face_edges[3 * f + i] == e)
+                return face_verts[3 * f + (i + 2) % 3];
+        return null;
+    };
+    Clock::time_point start = Clock::now();
+    parallel_for(E, threads, [&](size_t begin, size_t end) {
+        for (size_t e = begin; e < end; e++) {
+            Index f0 = edge_faces[2 * e], f1 = edge_faces[2 * e + 1];
+            Point_Sum sum;
+            if (f0 != null && f1 != null) {
+                sum.add(in[edge_verts[2 * e]], 0.375f);
+                sum.add(in[edge_verts[2 * e + 1]], 0.375f);
+                sum.add(in[opposite(f0, (Index)e)], 0.125f);
+                sum.add(in[opposite(f1, (Index)e)], 0.125f);
+            } else {
+                sum.add(in[edge_verts[2 * e]], 0.5f);
+                sum.add(in[edge_verts[2 * e + 1]], 0.5f);
+            }
+            sum.store(edge_points[e]);
+        }
+    });
+    if (timing)
+        timing->edge_ms += ms_since(start);
+
+    start = Clock::now();
+    parallel_for(V, threads, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++) {
+            Index ring_begin = vertex_start[v], ring_end = vertex_start[v + 1];
+            Index n = ring_end - ring_begin, n_boundary = 0;
+            Point_Sum sum, boundary_sum;
+            for (Index k = ring_begin; k < ring_end; k++) {
+                Index e = ring_edges[k];
+                Index other = edge_verts[2 * e] == v ? edge_verts[2 * e + 1] : edge_verts[2 * e];
+                if (edge_faces[2 * e] == null || edge_faces[2 * e + 1] == null) {
+                    boundary_sum.add(in[other]);
+                    n_boundary++;
+                }
+                sum.add(in[other]);
+            }
+
+            const Subd_Point &S = in[v];
+            if (n_boundary == 2) {
+                boundary_sum.add(S, 6.0f);
+                boundary_sum.scale(0.125f);
+                boundary_sum.store(vertex_points[v]);
+            } else if (n_boundary) {
+                vertex_points[v] = S;
+            } else {
+                float beta = n == 3 ? 3.0f / 16.0f : 3.0f / (8.0f * n);
+                sum.scale(beta);
+                sum.add(S, 1.0f - n * beta);
+                sum.store(vertex_points[v]);
+            }
+        }
+    });
+    if (timing)
+        timing->vertex_ms += ms_since(start);
+}
+
+void Subdivision_Level::loop_triangles(std::vector<Index> &triangles, size_t threads) const {
+
+    Index V = n_vertices(), F = n_faces();
+    triangles.resize(12 * (size_t)F);
+    parallel_for(F, threads, [&](size_t begin, size_t end) {
+        for (size_t f = begin; f < end; f++) {
+            const Index *c = &face_verts[3 * f];
+            Index m0 = V + face_edges[3 * f], m1 = V + face_edges[3 * f + 1],
+                  m2 = V + face_edges[3 * f + 2];
+            Index *t = &triangles[12 * f];
+            // A triangle at each corner, then the middle one
+            t[0] = c[0], t[1] = m0, t[2] = m2;
+            t[3] = c[1], t[4] = m1, t[5] = m0;
+            t[6] = c[2], t[7] = m2, t[8] = m1;
+            t[9] = m0, t[10] = m1, t[11] = m2;
+        }
+    });
+}
+
+Subdivision_Level::Index Subdivision_Level::edge_between(Index a, Index b) const {
+    for (Index k = vertex_start[a]; k < vertex_start[a + 1]; k++) {
+        Index e = ring_edges[k];
+        if (edge_verts[2 * e] == b || edge_verts[2 * e + 1] == b)
+            return e;
+    }
+    return null;
+}
+
+std::string Subdivider::build(const std::vector<std::vector<Index>> &polygons, Index n_vertices,
+                              Subdivision_Scheme scheme_, unsigned int levels) {
+
+    Clock::time_point start = Clock::now();
+    scheme = scheme_;
+    steps.clear();
+    finest = polygons;
+    last_timing = {};
+
+    Index n = n_vertices;
+    for (unsigned int i = 0; i < levels; i++) {
+        Subdivision_Level level;
+        std::string err = level.build(finest, n);
+        if (!err.empty()) {
+            steps.clear();
+            finest.clear();
+            return err;
+        }
+        level.refined_polygons(finest);
+        n = level.n_refined();
+        steps.push_back(std::move(level));
+    }
+
+    last_timing.topology_ms = ms_since(start);
+    return {};
+}
+
+void Subdivider::evaluate(const std::vector<Vec3> &cage, std::vector<Vec3> &out) const {
+
+    Subdivision_Timing timing;
+    timing.topology_ms = last_timing.topology_ms;
+
+    std::vector<Subd_Point> &in = buffers[0];
+    in.resize(cage.size());
+    for (size_t i = 0; i < cage.size(); i++)
+        in[i] = {cage[i].x, cage[i].y, cage[i].z, 0.0f};
+
+    for (const Subdivision_Level &level : steps) {
+        buffers[1].resize(level.n_refined());
+        level.refine(buffers[0].data(), buffers[1].data(), scheme, threads, &timing);
+        std::swap(buffers[0], buffers[1]);
+    }
+
+    const std::vector<Subd_Point> &result = buffers[0];
+    out.resize(result.size());
+    for (size_t i = 0; i < result.size(); i++)
+        out[i] = Vec3(result[i].x, result[i].y, result[i].z);
+    last_timing = timing;
+}
+
+std::string Stencil_Table::build(const std::vector<std::vector<Index>> &polygons,
+                                 Index n_vertices, Subdivision_Scheme scheme,
+                                 unsigned int levels, float epsilon) {
+
+    Clock::time_point start = Clock::now();
+
+    Subdivider subd;
+    std::string err = subd.build(polygons, n_vertices, scheme, levels);
+    if (!err.empty())
+        return err;
+    finest = subd.polygons();
+    n_controls = n_vertices;
+
+    // Start from the identity: each cage point is its own stencil
+    row_start.resize(n_vertices + 1);
+    columns.resize(n_vertices);
+    weights.assign(n_vertices, 1.0f);
+    for (Index i = 0; i <= n_vertices; i++)
+        row_start[i] = i;
+    for (Index i = 0; i < n_vertices; i++)
+        columns[i] = i;
+
+    // Multiply in one level at a time: a row of the level's matrix combines rows of
+    // the stencils so far. Rows are split into chunks, each composed on one thread into
+    // its own arrays with a dense accumulator over the cage points.
+    struct Chunk {
+        std::vector<Index> lengths, columns;
+        std::vector<float> weights;
+    };
+    std::vector<Index> level_start, level_columns;
+    std::vector<float> level_weights;
+    for (size_t l = 0; l < subd.n_levels(); l++) {
+
+        subd.level(l).stencils(scheme, level_start, level_columns, level_weights);
+        size_t rows = level_start.size() - 1;
+        size_t n_chunks = std::max(size_t(1), std::min(rows / 4096, size_t(256)));
+        size_t per = (rows + n_chunks - 1) / n_chunks;
+        std::vector<Chunk> chunks(n_chunks);
+
+        parallel_for(
+            n_chunks, threads,
+            [&](size_t chunk_begin, size_t chunk_end) {
+                std::vector<float> sum(n_controls, 0.0f);
+                std::vector<uint8_t> used(n_controls, 0);
+                std::vector<Index> touched;
+                for (size_t c = chunk_begin; c < chunk_end; c++) {
+                    Chunk &chunk = chunks[c];
+                    size_t r0 = c * per, r1 = std::min(rows, r0 + per);
+                    chunk.lengths.reserve(r1 - r0);
+                    for (size_t r = r0; r < r1; r++) {
+                        for (Index k = level_start[r]; k < level_start[r + 1]; k++) {
+                            Index j = level_columns[k];
+                            float w = level_weights[k];
+                            for (Index m = row_start[j]; m < row_start[j + 1]; m++) {
+                                Index col = columns[m];
+                                if (!used[col]) {
+                                    used[col] = 1;
+                                    touched.push_back(col);
+                                }
+                                sum[col] += w * weights[m];
+                            }
+                        }
+                        std::sort(touched.begin(), touched.end());
+                        for (Index col : touched) {
+                            chunk.columns.push_back(col);
+                            chunk.weights.push_back(sum[col]);
+                            sum[col] = 0.0f;
+                            used[col] = 0;
+                        }
+                        chunk.lengths.push_back((Index)touched.size());
+                        touched.clear();
+                    }
+                }
+            },
+            1);
+
+        size_t total = 0;
+        for (const Chunk &chunk : chunks)
+            total += chunk.columns.size();
+        row_start.assign(1, 0);
+        row_start.reserve(rows + 1);
+        columns.clear();
+        weights.clear();
+        columns.reserve(total);
+        weights.reserve(total);
+        for (Chunk &chunk : chunks) {
+            for (Index length : chunk.lengths)
+                row_start.push_back(row_start.back() + length);
+            columns.insert(columns.end(), chunk.columns.begin(), chunk.columns.end());
+            weights.insert(weights.end(), chunk.weights.begin(), chunk.weights.end());
+            chunk = {};
+        }
+    }
+
+    // Drop negligible weights, renormalizing what remains of each stencil
+    if (epsilon > 0.0f) {
+        size_t out = 0;
+        Index begin = 0;
+        for (size_t r = 0; r + 1 < row_start.size(); r++) {
+            Index end = row_start[r + 1];
+            size_t first = out;
+            float kept = 0.0f;
+            for (Index k = begin; k < end; k++) {
+                if (std::abs(weights[k]) < epsilon)
+                    continue;
+                columns[out] = columns[k];
+                weights[out] = weights[k];
+                kept += weights[k];
+                out++;
+            }
+            if (kept != 0.0f)
+                for (size_t k = first; k < out; k++)
+                    weights[k] /= kept;
+            begin = end;
+            row_start[r + 1] = (Index)out;
+        }
+        columns.resize(out);
+        weights.resize(out);
+    }
+
+    last_build_ms = ms_since(start);
+    return {};
+}
+
+void Stencil_Table::evaluate(const std::vector<Vec3> &cage, std::vector<Vec3> &out) const {
+
+    Clock::time_point start = Clock::now();
+
+    control.resize(cage.size());
+    for (size_t i = 0; i < cage.size(); i++)
+        control[i] = {cage[i].x, cage[i].y, cage[i].z, 0.0f};
+
+    out.resize(n_stencils());
+    parallel_for(n_stencils(), threads, [&](size_t begin, size_t end) {
+        Subd_Point p;
+        for (size_t i = begin; i < end; i++) {
+            Point_Sum sum;
+            for (Index k = row_start[i]; k < row_start[i + 1]; k++)
+                sum.add(control[columns[k]], weights[k]);
+            sum.store(p);
+            out[i] = Vec3(p.x, p.y, p.z);
+        }
+    });
+
+    last_evaluate_ms = ms_since(start);
+}
+
+std::string loop_subdivide(const std::vector<std::vector<Subdivision_Level::Index>> &triangles,
+                           const std::vector<Vec3> &verts,
+                           std::vector<Subdivision_Level::Index> &out_triangles,
+                           std::vector<Vec3> &out_verts, size_t threads,
+                           Subdivision_Timing *timing) {
+
+    Clock::time_point start = Clock::now();
+    Subdivision_Level level;
+    std::string err = level.build(triangles, (Subdivision_Level::Index)verts.size());
+    if (!err.empty())
+        return err;
+    if (!level.is_triangle_mesh())
+        return "Loop subdivision needs a triangle mesh.";
+    if (timing)
+        timing->topology_ms += ms_since(start);
+
+    std::vector<Subd_Point> in(verts.size()), out(level.n_vertices() + level.n_edges());
+    for (size_t i = 0; i < verts.size(); i++)
+        in[i] = {verts[i].x, verts[i].y, verts[i].z, 0.0f};
+    level.loop_refine(in.data(), out.data(), threads, timing);
+
+    start = Clock::now();
+    level.loop_triangles(out_triangles, threads);
+    out_verts.resize(out.size());
+    parallel_for(out.size(), threads, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            out_verts[i] = Vec3(out[i].x, out[i].y, out[i].z);
+    });
+    if (timing)
+        timing->connect_ms += ms_since(start);
+    return {};
+}
+
+void subdivision_benchmark(const std::vector<std::vector<Subdivision_Level::Index>> &polygons,
+                           const std::vector<Vec3> &verts, Subdivision_Scheme scheme,
+                           size_t threads) {
+
+    const char *name = scheme == Subdivision_Scheme::linear ? "Linear" : "Catmull-Clark";
+    for (unsigned int levels = 1; levels <= 3; levels++) {
+        Subdivider subd;
+        subd.threads = threads;
+        std::string err =
+            subd.build(polygons, (Subdivision_Level::Index)verts.size(), scheme, levels);
+        if (!err.empty()) {
+            warn("%s subdivision benchmark: %s", name, err.c_str());
+            return;
+        }
+        std::vector<Vec3> out;
+        subd.evaluate(verts, out);
+        const Subdivision_Timing &t = subd.timing();
+        info("%s subdivision, %u level(s): %zu -> %zu faces, topology %.1f ms, positions %.1f ms "
+             "(faces %.1f, edges %.1f, vertices %.1f)",
+             name, levels, polygons.size(), subd.polygons().size(), t.topology_ms,
+             t.face_ms + t.edge_ms + t.vertex_ms, t.face_ms, t.edge_ms, t.vertex_ms);
+
+        Stencil_Table table;
+        table.threads = threads;
+        table.build(polygons, (Subdivision_Level::Index)verts.size(), scheme, levels);
+        table.evaluate(verts, out);
+        info("%s stencils, %u level(s): %zu weights (%.1f per point), factored in %.1f ms, "
+             "evaluated in %.1f ms",
+             name, levels, table.n_weights(), (double)table.n_weights() / table.n_stencils(),
+             table.build_ms(), table.evaluate_ms());
+    }
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "../lib/mathlib.h"
+
+/* Subdivision engine:
+
+    Catmull-Clark and linear subdivision split every face into quads, adding one
+    vertex per edge and one per face. Which coarse points each new point averages
+    depends only on the connectivity, so a Subdivision_Level gathers it once into
+    flat index tables:
+
+        faces     corners and side edges of each face (CSR arrays)
+        edges     two endpoints and the two adjacent faces (null on the boundary)
+        vertices  the edge and face across each outgoing halfedge (CSR arrays)
+
+    refine() then computes the refined points in three passes over these tables:
+    face points, edge points (which use the face points) and vertex points (which
+    use both). Each pass reads only the previous passes' output, so it is split
+    over threads, and points are padded to four floats so each sum is one SSE add.
+
+    The refined mesh stores its vertex points first, then its edge points, then its
+    face points, and its quads come from refined_polygons(). A Subdivider chains
+    several levels; its topology is built once, so an animated cage is refined every
+    frame with evaluate() alone.
+
+    Catmull-Clark boundary edges become their midpoints and boundary vertices use the
+    1/8, 6/8, 1/8 curve rule, keeping open meshes' borders attached.
+
+    Loop subdivision runs on the same tables. It splits each triangle into four, so
+    it only adds edge points: 3/8 of each endpoint plus 1/8 of each opposite corner,
+    while vertices move to (1 - n beta) S + beta * (sum of neighbors), with beta =
+    3/16 for n = 3 and 3 / (8n) otherwise. Boundaries use the same curve rules as
+    Catmull-Clark. The refined triangles of face f are written to slots 4f .. 4f + 3,
+    so every face is handled independently.
+
+    Every refined point is a fixed linear combination of the cage's points, so a
+    Stencil_Table goes one step further: it multiplies the levels' weights out once
+    into a sparse matrix with one row (stencil) per point of the finest level, and
+    evaluate() is then a single sparse matrix - vector product, split over threads
+    by rows, with no intermediate levels at all.
+*/
+
+enum class Subdivision_Scheme { linear, catmull_clark };
+
+// A point padded to one SSE register
+struct alignas(16) Subd_Point {
+    float x = 0.0f, y = 0.0f, z = 0.0f, w = 0.0f;
+};
+
+struct Subdivision_Timing {
+    double topology_ms = 0.0;
+    double face_ms = 0.0, edge_ms = 0.0, vertex_ms = 0.0;
+    double connect_ms = 0.0; // writing Loop subdivision's triangles
+};
+
+class Subdivision_Level {
+public:
+    using Index = uint32_t;
+    static constexpr Index null = 0xffffffffu;
+
+    // Builds the tables for one level over the given polygons; returns an error
+    // message, or an empty string on success
+    std::string build(const std::vector<std::vector<Index>> &polygons, Index n_vertices);
+
+    // out receives n_refined() points; threads = 0 uses every hardware thread
+    void refine(const Subd_Point *in, Subd_Point *out, Subdivision_Scheme scheme,
+                size_t threads = 0, Subdivision_Timing *timing = nullptr) const;
+
+    // Quads of the refined mesh, indexing the points written by refine()
+    void refined_polygons(std::vector<std::vector<Index>> &quads) const;
+
+    // The points refine() computes, as rows of weights on its input: refined point i
+    // is the sum of weights[k] * in[columns[k]] for k in [row_start[i], row_start[i + 1])
+    void stencils(Subdivision_Scheme scheme, std::vector<Index> &row_start,
+                  std::vector<Index> &columns, std::vector<float> &weights) const;
+
+    // Loop subdivision of a triangle mesh: out receives n_vertices() + n_edges() points,
+    // vertex points first, and loop_triangles four triangles per face, three indices
+    // each, in the same order as the faces
+    bool is_triangle_mesh() const;
+    void loop_refine(const Subd_Point *in, Subd_Point *out, size_t threads = 0,
+                     Subdivision_Timing *timing = nullptr) const;
+    void loop_triangles(std::vector<Index> &triangles, size_t threads = 0) const;
+
+    // The edge connecting vertices a and b, or null
+    Index edge_between(Index a, Index b) const;
+
+    Index n_vertices() const {
+        return (Index)vertex_start.size() - 1;
+    }
+    Index n_edges() const {
+        return (Index)edge_verts.size() / 2;
+    }
+    Index n_faces() const {
+        return (Index)face_start.size() - 1;
+    }
+    Index n_refined() const {
+        return n_vertices() + n_edges() + n_faces();
+    }
+
+private:
+    std::vector<Index> face_start{0}, face_verts, face_edges;
+    std::vector<Index> edge_verts, edge_faces;
+    std::vector<Index> vertex_start{0}, ring_edges, ring_faces;
+};
+
+class Subdivider {
+public:
+    using Index = Subdivision_Level::Index;
+
+    // Builds the topology of levels refinement steps of the given cage
+    std::string build(const std::vector<std::vector<Index>> &polygons, Index n_vertices,
+                      Subdivision_Scheme scheme, unsigned int levels);
+
+    // Refines cage positions through every level; only the position passes run
+    void evaluate(const std::vector<Vec3> &cage, std::vector<Vec3> &out) const;
+
+    // Polygons of the finest level, indexing the points written by evaluate()
+    const std::vector<std::vector<Index>> &polygons() const {
+        return finest;
+    }
+    size_t n_levels() const {
+        return steps.size();
+    }
+    const Subdivision_Level &level(size_t i) const {
+        return steps[i];
+    }
+
+    // Time spent in the last build and evaluate, summed over levels
+    const Subdivision_Timing &timing() const {
+        return last_timing;
+    }
+
+    size_t threads = 0;
+
+private:
+    Subdivision_Scheme scheme = Subdivision_Scheme::catmull_clark;
+    std::vector<Subdivision_Level> steps;
+    std::vector<std::vector<Index>> finest;
+    mutable std::vector<Subd_Point> buffers[2];
+    mutable Subdivision_Timing last_timing;
+};
+
+class Stencil_Table {
+public:
+    using Index = Subdivision_Level::Index;
+
+    // Builds the topology of levels refinement steps of the given cage and factors it
+    // into one stencil per refined point. Weights below epsilon are dropped and the
+    // rest of their stencil rescaled to sum to one.
+    std::string build(const std::vector<std::vector<Index>> &polygons, Index n_vertices,
+                      Subdivision_Scheme scheme, unsigned int levels, float epsilon = 0.0f);
+
+    // out[i] = sum of weights * cage positions over stencil i
+    void evaluate(const std::vector<Vec3> &cage, std::vector<Vec3> &out) const;
+
+    const std::vector<std::vector<Index>> &polygons() const {
+        return finest;
+    }
+    size_t n_stencils() const {
+        return row_start.size() - 1;
+    }
+    size_t n_weights() const {
+        return weights.size();
+    }
+
+    // Time spent in the last build and evaluate
+    double build_ms() const {
+        return last_build_ms;
+    }
+    double evaluate_ms() const {
+        return last_evaluate_ms;
+    }
+
+    size_t threads = 0;
+
+private:
+    Index n_controls = 0;
+    std::vector<Index> row_start{0}, columns;
+    std::vector<float> weights;
+    std::vector<std::vector<Index>> finest;
+    mutable std::vector<Subd_Point> control;
+    double last_build_ms = 0.0;
+    mutable double last_evaluate_ms = 0.0;
+};
+
+// One level of Loop subdivision: builds the tables, computes the new points and writes
+// the refined triangles (three indices each) straight into preallocated arrays.
+// Returns an error message, or an empty string on success.
+std::string loop_subdivide(const std::vector<std::vector<Subdivision_Level::Index>> &triangles,
+                           const std::vector<Vec3> &verts,
+                           std::vector<Subdivision_Level::Index> &out_triangles,
+                           std::vector<Vec3> &out_verts, size_t threads = 0,
+                           Subdivision_Timing *timing = nullptr);
+
+// Builds and evaluates 1, 2 and 3 levels of the given mesh, both level by level and
+// through a Stencil_Table, and logs their timings
+void subdivision_benchmark(const std::vector<std::vector<Subdivision_Level::Index>> &polygons,
+                           const std::vector<Vec3> &verts, Subdivision_Scheme scheme,
+                           size_t threads = 0);
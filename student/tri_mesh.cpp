@@ -1,6 +1,8 @@
 
 #include "../rays/tri_mesh.h"
 #include "debug.h"
+#include "scene_probe.h"
+#include "stats.h"
 
 namespace PT {
 
@@ -25,10 +27,18 @@ BBox Triangle::bbox() const {
 
 Trace Triangle::hit(const Ray &ray) const {
 
+    TRAVERSAL_STAT(tris_tested, 1);
+
     // Vertices of triangle - has postion and surface normal
     Tri_Mesh_Vert v_0 = vertex_list[v0];
     Tri_Mesh_Vert v_1 = vertex_list[v1];
     Tri_Mesh_Vert v_2 = vertex_list[v2];
+
+    // Probe rays read the triangle instead (see scene_probe.h)
+    if (ray.depth == probe_depth) {
+        probe_record().add_triangle(v_0.position, v_1.position, v_2.position);
+        return {};
+    }
     (void)v_0;
     (void)v_1;
     (void)v_2;
@@ -118,7 +128,18 @@ Tri_Mesh::Tri_Mesh(const GL::Mesh &mesh) { build(mesh); }
 
 BBox Tri_Mesh::bbox() const { return triangles.bbox(); }
 
-Trace Tri_Mesh::hit(const Ray &ray) const { return triangles.hit(ray); }
+Trace Tri_Mesh::hit(const Ray &ray) const {
+    // A probe ray reports its object-space origin, then visits every triangle
+    if (ray.depth == probe_depth) {
+        Probe_Record &record = probe_record();
+        record.reached = true;
+        record.origin = ray.point;
+        if (record.max_triangles)
+            triangles.hit(ray);
+        return {};
+    }
+    return triangles.hit(ray);
+}
 
 size_t Tri_Mesh::visualize(GL::Lines &lines, GL::Lines &active, size_t level,
                            const Mat4 &trans) const {